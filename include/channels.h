@@ -105,6 +105,12 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	std::string setby; /* 128 */
 
+	/** Incremented whenever an entry is added to or removed from a list mode (bans,
+	 * exceptions, ...) of the channel. Ban verdicts cached in a Membership are only
+	 * valid while this and User::identgeneration are unchanged.
+	 */
+	unsigned int listgeneration;
+
 	/** Sets or unsets a custom mode in the channels info
 	 * @param mode The mode character to set or unset
 	 * @param value True if you want to set the mode or false if you want to remove it
@@ -348,7 +354,8 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	bool SetPrefix(User* user, char prefix, bool adding);
 
-	/** Check if a user is banned on this channel
+	/** Check if a user is banned on this channel. The result is cached in the
+	 * membership of the user until the list modes of the channel or the user change.
 	 * @param user A user to check against the banlist
 	 * @returns True if the user given is banned
 	 */
@@ -358,9 +365,14 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	bool CheckBan(User* user, const std::string& banmask);
 
-	/** Get the status of an "action" type extban
+	/** Get the status of an "action" type extban, cached like IsBanned()
 	 */
 	ModResult GetExtBanStatus(User *u, char type);
+
+	/** Throw away the ban verdicts cached for every channel. Must be called when
+	 * the way bans are matched changes, e.g. when a module is loaded or unloaded.
+	 */
+	static void ResetBanVerdicts();
 };
 
 inline bool Channel::HasUser(User* user)
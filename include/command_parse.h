@@ -30,12 +30,51 @@
 class CoreExport CommandParser
 {
  private:
+	/** A line split into its command and parameters. These are kept between
+	 * lines so that the strings and vectors keep their buffers, and splitting
+	 * a line normally does not allocate memory.
+	 */
+	struct ParsedLine
+	{
+		/** The command, in uppercase */
+		std::string command;
+
+		/** The parameters, passed to the command handler */
+		std::vector<std::string> params;
+
+		/** Strings which were removed from params, reused when a later line has more parameters */
+		std::vector<std::string> spare;
+	};
+
+	/** One ParsedLine for each nesting level of ProcessCommand(), command
+	 * handlers may process other lines. A deque, so growing it does not move
+	 * the ParsedLines which are in use.
+	 */
+	std::deque<ParsedLine> parsedlines;
+
+	/** Number of ParsedLines in use */
+	size_t parsedepth;
+
+	/** Split a line into a command and parameters, like irc::tokenstream but without copying the line
+	 * @param line The line to split
+	 * @param out Where to store the command and the parameters
+	 */
+	static void SplitLine(const std::string& line, ParsedLine& out);
+
 	/** Process a command from a user.
 	 * @param user The user to parse the command for
 	 * @param cmd The command string to process
 	 */
 	void ProcessCommand(LocalUser* user, std::string& cmd);
 
+	/** Process a command from a user after it has been split
+	 * @param user The user to parse the command for
+	 * @param cmd The command string to process
+	 * @param command The command, in uppercase
+	 * @param command_p The parameters of the command
+	 */
+	void ProcessCommand(LocalUser* user, std::string& cmd, std::string& command, std::vector<std::string>& command_p);
+
  public:
 	/** Command list, a hash_map of command names to Command*
 	 */
@@ -23,20 +23,61 @@
 
 #include "modules.h"
 
-/* Forward ref for typedefs */
-class WhoWasGroup;
+/** One WHOWAS entry. Entries live back to back in the ring buffer of
+ * CommandWhowas; the nick, ident and GECOS follow the header inline and the
+ * hosts and server name point into a table of interned strings.
+ */
+struct WhoWasEntry
+{
+	/** Signon time
+	 */
+	time_t signon;
+	/** When the user quit
+	 */
+	time_t added;
+	/** Real host, displayed host and server name (interned)
+	 */
+	const std::string* host;
+	const std::string* dhost;
+	const std::string* server;
+	/** Offset of the previous entry for the same nick, only valid while the
+	 * index still counts that entry
+	 */
+	size_t prev;
+	/** Total size of the entry in bytes including padding, 0 marks the end of
+	 * the used part of the buffer before it wraps
+	 */
+	unsigned int size;
+	/** Lengths of the inline strings
+	 */
+	unsigned short nicklen;
+	unsigned short identlen;
+	unsigned short gecoslen;
+	/** Set when the entry was pushed out of its nick's group but is still
+	 * taking up room in the buffer
+	 */
+	bool dead;
 
-/** A group of users related by nickname
+	const char* nick() const { return reinterpret_cast<const char*>(this + 1); }
+	const char* ident() const { return nick() + nicklen; }
+	const char* gecos() const { return ident() + identlen; }
+};
+
+/** The entries of a nick: the newest one and how many are reachable from it
  */
-typedef std::deque<WhoWasGroup*> whowas_set;
+struct WhoWasNick
+{
+	size_t newest;
+	unsigned int count;
+};
 
-/** Sets of users in the whowas system
+/** Index of nicknames in the whowas system
  */
-typedef std::map<irc::string,whowas_set*> whowas_users;
+typedef TR1NS::unordered_map<std::string, WhoWasNick, irc::insensitive, irc::StrHashComp> whowas_users;
 
-/** Sets of time and users in whowas list
+/** Interned strings with their reference counts
  */
-typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
+typedef TR1NS::unordered_map<std::string, unsigned long> whowas_strings;
 
 /** Handle /WHOWAS. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
@@ -46,23 +87,60 @@ typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
 class CommandWhowas : public Command
 {
   private:
-	/** Whowas container, contains a map of vectors of users tracked by WHOWAS
+	/** Ring buffer holding the entries, oldest at tail, next free byte at head
+	 */
+	char* buffer;
+	size_t buffersize;
+	size_t head;
+	size_t tail;
+
+	/** Number of entries in the buffer, including dead ones
+	 */
+	size_t entries;
+
+	/** Index of the newest entry of each nick
 	 */
 	whowas_users whowas;
 
-	/** Whowas container, contains a map of time_t to users tracked by WHOWAS
+	/** Hosts and server names shared by the entries
+	 */
+	whowas_strings strings;
+
+	const std::string* Intern(const std::string& str);
+	void Release(const std::string* str);
+	WhoWasEntry* At(size_t offset) const { return reinterpret_cast<WhoWasEntry*>(buffer + offset); }
+
+	/** Move tail past the end marker if the oldest entry is at the start of the buffer
+	 */
+	void WrapTail();
+
+	/** Remove the oldest entry from the buffer
+	 */
+	void PopOldest();
+
+	/** Make room for an entry of the given size, evicting old entries as needed
+	 * @return The offset to write the entry at
+	 */
+	size_t Reserve(size_t size);
+
+	/** Add a freshly written entry to the index, killing the oldest entry of
+	 * its nick if the group is full
+	 */
+	void Link(size_t offset);
+
+	/** Kill the entries of a nick beyond the group size
 	 */
-	whowas_users_fifo whowas_fifo;
+	void TrimGroup(WhoWasNick& group);
 
   public:
 	/** Max number of WhoWas entries per user.
 	 */
 	int WhoWasGroupSize;
 
-	/** Max number of cumulative user-entries in WhoWas.
+	/** Max number of bytes used by WhoWas entries.
 	 *  When max reached and added to, push out oldest entry FIFO style.
 	 */
-	int WhoWasMaxGroups;
+	int WhoWasMaxSize;
 
 	/** Max seconds a user is kept in WhoWas before being pruned.
 	 */
@@ -78,39 +156,9 @@ class CommandWhowas : public Command
 	CmdResult Handle(const std::vector<std::string>& parameters, User *user);
 	void AddToWhoWas(User* user);
 	std::string GetStats();
+	/** Apply new config values, moving the entries into a buffer of the new size
+	 */
 	void PruneWhoWas(time_t t);
 	void MaintainWhoWas(time_t t);
 	~CommandWhowas();
 };
-
-/** Used to hold WHOWAS information
- */
-class WhoWasGroup
-{
- public:
-	/** Real host
-	 */
-	std::string host;
-	/** Displayed host
-	 */
-	std::string dhost;
-	/** Ident
-	 */
-	std::string ident;
-	/** Server name
-	 */
-	std::string server;
-	/** Fullname (GECOS)
-	 */
-	std::string gecos;
-	/** Signon time
-	 */
-	time_t signon;
-
-	/** Initialize this WhoWasFroup with a user
-	 */
-	WhoWasGroup(User* user);
-	/** Destructor
-	 */
-	~WhoWasGroup();
-};
@@ -146,12 +146,48 @@ struct CommandLineConf
 	char** argv;
 };
 
+/** An oper privilege, resolved to a number once so that checking whether an
+ * oper has it is a bit test instead of a string lookup. Code which checks the
+ * same privilege often should keep one of these and pass it to
+ * User::HasPrivPermission() instead of the name.
+ */
+class CoreExport Privilege
+{
+	/** Number of the privilege, every Privilege with the same name has the same number */
+	unsigned int id;
+
+ public:
+	/** Resolve a privilege name
+	 * @param name Name of the privilege, e.g. "users/auspex"
+	 */
+	explicit Privilege(const std::string& name) : id(Resolve(name)) { }
+
+	/** Get the number of this privilege, this is its bit in OperInfo::PrivBits */
+	unsigned int GetId() const { return id; }
+
+	/** Get the name of this privilege */
+	const std::string& GetName() const;
+
+	/** Get the number of a privilege by name. Names are numbered when they are
+	 * first seen, either in the config or by code checking them, and keep their
+	 * number until the ircd exits. The wildcard "*" is always number 0.
+	 * @param name Name of the privilege
+	 * @return Number of the privilege
+	 */
+	static unsigned int Resolve(const std::string& name);
+};
+
 class CoreExport OperInfo : public refcountbase
 {
  public:
 	std::set<std::string> AllowedOperCommands;
 	std::set<std::string> AllowedPrivs;
 
+	/** Allowed privileges from oper classes, indexed by Privilege::GetId().
+	 * Built by init() from the same config as AllowedPrivs.
+	 */
+	std::vector<bool> PrivBits;
+
 	/** Allowed user modes from oper classes. */
 	std::bitset<64> AllowedUserModes;
 
@@ -170,6 +206,16 @@ class CoreExport OperInfo : public refcountbase
 	/** Get a configuration item, searching in the oper, type, and class blocks (in that order) */
 	std::string getConfig(const std::string& key);
 	void init();
+
+	/** Check whether the oper classes give a privilege, either by name or with "*"
+	 * @param priv The privilege to check
+	 * @return True if the privilege is given
+	 */
+	bool HasPriv(const Privilege& priv) const
+	{
+		// "*" is privilege 0
+		return ((!PrivBits.empty()) && ((PrivBits[0]) || ((priv.GetId() < PrivBits.size()) && (PrivBits[priv.GetId()]))));
+	}
 };
 
 /** This class holds the bulk of the runtime configuration for the ircd.
@@ -368,6 +414,12 @@ class CoreExport ServerConfig
 	 */
 	int NetBufferSize;
 
+	/** The number of threads which read from client
+	 * sockets, 0 if the main thread does all reads.
+	 * Only used on startup.
+	 */
+	unsigned int IOThreads;
+
 	/** The value to be used for listen() backlogs
 	 * as default.
 	 */
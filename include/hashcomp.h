@@ -109,6 +109,10 @@ namespace irc
 		bool operator()(const std::string& s1, const std::string& s2) const;
 	};
 
+	/** Case insensitive hash of a std::string, used by the nick, UID and channel tables.
+	 * This is SipHash-1-3 with a key chosen randomly on startup, so the hash values
+	 * can not be predicted and a table can not be flooded with colliding names.
+	 */
 	struct insensitive
 	{
 		size_t CoreExport operator()(const std::string &s) const;
@@ -426,7 +430,8 @@ namespace irc
 
 	struct hash
 	{
-		/** Hash an irc::string using RFC1459 case sensitivity rules
+		/** Hash an irc::string using RFC1459 case sensitivity rules.
+		 * The hash is the same as irc::insensitive's for the same string.
 		 * @param s A string to hash
 		 * @return The hash value
 		 */
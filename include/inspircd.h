@@ -55,9 +55,10 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "extensible.h"
 #include "numerics.h"
 #include "uid.h"
+#include "timer.h"
+#include "metrics.h"
 #include "users.h"
 #include "channels.h"
-#include "timer.h"
 #include "hashcomp.h"
 #include "logger.h"
 #include "usermanager.h"
@@ -70,6 +71,7 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "filelogger.h"
 #include "modules.h"
 #include "threadengine.h"
+#include "iothread.h"
 #include "configreader.h"
 #include "inspstring.h"
 #include "protocol.h"
@@ -340,6 +342,10 @@ class CoreExport InspIRCd
 	 */
 	ThreadEngine* Threads;
 
+	/** I/O thread manager, hands reading from client sockets over to I/O threads if enabled
+	 */
+	IOThreadManager* IOThreads;
+
 	/** The thread/class used to read config files in REHASH and on startup
 	 */
 	ConfigReaderThread* ConfigThread;
@@ -362,6 +368,10 @@ class CoreExport InspIRCd
 	 */
 	serverstats* stats;
 
+	/** Metrics registry, exported in the OpenMetrics format by m_httpd_stats
+	 */
+	MetricManager* Metrics;
+
 	/**  Server Config class, holds configuration file data
 	 */
 	ServerConfig* Config;
@@ -70,6 +70,40 @@ enum BufferedSocketError
 /* Required forward declarations */
 class BufferedSocket;
 
+/** An immutable, reference counted chunk of outgoing data.
+ * The same buffer may be queued on the sendq of any number of sockets at
+ * once, so a line which goes out to many recipients only needs to be
+ * formatted and stored a single time.
+ */
+class CoreExport SendBuffer : public refcountbase
+{
+	/** The data held by this buffer, never modified after construction */
+	std::string data;
+
+ public:
+	/** Create a buffer holding a copy of the given data
+	 * @param text The data to store
+	 */
+	SendBuffer(const std::string& text) : data(text) { }
+
+	/** Create a buffer holding the given text followed by a terminator,
+	 * e.g. a line and its CR/LF, using a single allocation
+	 * @param text The data to store
+	 * @param terminator The data to append to text
+	 */
+	SendBuffer(const std::string& text, const std::string& terminator)
+	{
+		data.reserve(text.length() + terminator.length());
+		data.append(text).append(terminator);
+	}
+
+	/** Get the data held by this buffer */
+	inline const std::string& str() const { return data; }
+
+	/** Get the length, in bytes, of this buffer */
+	inline size_t length() const { return data.length(); }
+};
+
 /** Used to time out socket connections
  */
 class CoreExport SocketTimeout : public Timer
@@ -97,6 +131,112 @@ class CoreExport SocketTimeout : public Timer
 	virtual bool Tick(time_t now);
 };
 
+/** A receive queue which remembers how much of its data has been consumed
+ * instead of erasing it from the front each time a line is taken out. This
+ * keeps splitting a large read (a netburst or a paste) into lines linear in
+ * its size. The consumed part is only compacted away once it makes up at
+ * least half of the buffer, so the cost of compaction is amortised.
+ */
+class CoreExport RecvQueue
+{
+	/** Buffered data, the first pos bytes of which have been consumed */
+	std::string buf;
+
+	/** Number of bytes at the start of buf which have been consumed */
+	size_t pos;
+
+	/** Throw away the consumed part of the buffer if it is worth doing so */
+	void Compact()
+	{
+		if (pos && pos >= buf.length() / 2)
+		{
+			buf.erase(0, pos);
+			pos = 0;
+		}
+	}
+
+ public:
+	RecvQueue() : pos(0) { }
+
+	/** Get the number of unconsumed bytes in the queue */
+	inline size_t length() const { return buf.length() - pos; }
+
+	/** Check whether there are any unconsumed bytes in the queue */
+	inline bool empty() const { return buf.length() == pos; }
+
+	/** Get a pointer to the first unconsumed byte. It is valid until new data is added. */
+	inline const char* data() const { return buf.data() + pos; }
+
+	/** Get the unconsumed byte at the given offset */
+	inline char operator[](size_t i) const { return buf[pos + i]; }
+
+	/** Find a character in the unconsumed data
+	 * @param c The character to look for
+	 * @param from The offset to start searching at
+	 * @return The offset of the character, or std::string::npos if not found
+	 */
+	size_t find(char c, size_t from = 0) const
+	{
+		size_t i = buf.find(c, pos + from);
+		return (i == std::string::npos ? i : i - pos);
+	}
+
+	/** Mark bytes at the front of the queue as consumed
+	 * @param n The number of bytes to consume, at most length()
+	 */
+	void consume(size_t n)
+	{
+		pos += n;
+		if (pos >= buf.length())
+			clear();
+	}
+
+	/** Append data to the back of the queue */
+	void append(const char* data, size_t n)
+	{
+		Compact();
+		buf.append(data, n);
+	}
+
+	/** Get the underlying string so that new data can be appended to it directly,
+	 * e.g. by an IOHook. Nothing but appending may be done with the string.
+	 */
+	std::string& GetAppendBuffer()
+	{
+		Compact();
+		return buf;
+	}
+
+	/** Get a copy of the unconsumed data */
+	std::string str() const { return buf.substr(pos); }
+
+	/** Discard all data in the queue, keeping the allocated memory for reuse */
+	void clear()
+	{
+		buf.clear();
+		pos = 0;
+	}
+
+	/** Take the next line out of the queue without copying it
+	 * @param line Set to point to the start of the line if one was found. It is
+	 * valid until new data is added to the queue.
+	 * @param len Set to the length of the line, excluding the delimiter
+	 * @param delim The line delimiter
+	 * @return True if a line was found and consumed, false otherwise
+	 */
+	bool GetNextLine(const char*& line, size_t& len, char delim = '\n')
+	{
+		size_t i = find(delim);
+		if (i == std::string::npos)
+			return false;
+		line = data();
+		len = i;
+		// Don't call consume(), it may clear buf and invalidate line
+		pos += i + 1;
+		return true;
+	}
+};
+
 /**
  * StreamSocket is a class that wraps a TCP socket and handles send
  * and receive queues, including passing them to IO hooks
@@ -106,18 +246,29 @@ class CoreExport StreamSocket : public EventHandler
 	/** The IOHook that handles raw I/O for this socket, or NULL */
 	IOHook* iohook;
 
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue. Note that individual buffers may be shared
+	 * with the send queues of other sockets
 	 */
-	std::deque<std::string> sendq;
+	std::deque<reference<SendBuffer> > sendq;
 	/** Length, in bytes, of the sendq */
 	size_t sendq_len;
+	/** Number of bytes at the start of the first sendq buffer which have already been sent */
+	size_t sendq_offset;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
+	/** Attachment id if this socket is read by an I/O thread, 0 if it is read by the main thread */
+	unsigned long iothreadid;
+
+	friend class IOThreadManager;
  protected:
-	std::string recvq;
+	RecvQueue recvq;
  public:
-	StreamSocket() : iohook(NULL), sendq_len(0) {}
+	StreamSocket() : iohook(NULL), sendq_len(0), sendq_offset(0), iothreadid(0) {}
+	~StreamSocket();
 	IOHook* GetIOHook() const;
+	/** Set the IOHook of this socket. If the socket is read by an I/O thread
+	 * it is given back to the main thread first.
+	 */
 	void AddIOHook(IOHook* hook);
 	void DelIOHook();
 	/** Handle event from socket engine.
@@ -137,12 +288,25 @@ class CoreExport StreamSocket : public EventHandler
 
 	/** Called when new data is present in recvq */
 	virtual void OnDataReady() = 0;
+
+	/** Called in the main thread with data that an I/O thread has read from this socket.
+	 * Appends the data to the recvq and calls OnDataReady()
+	 * @param data The data read
+	 */
+	void OnThreadedRead(const std::string& data);
+
+	/** Make the main thread read from this socket again if it is read by an I/O thread */
+	void DetachIOThread();
 	/** Called when the socket gets an error from socket engine or IO hook */
 	virtual void OnError(BufferedSocketError e) = 0;
 
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+	/** Send the given buffer out the socket, either now or when writes unblock.
+	 * The buffer is queued by reference and must not be modified afterwards.
+	 */
+	void WriteData(const reference<SendBuffer>& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
@@ -232,5 +396,4 @@ class CoreExport BufferedSocket : public StreamSocket
 };
 
 inline IOHook* StreamSocket::GetIOHook() const { return iohook; }
-inline void StreamSocket::AddIOHook(IOHook* hook) { iohook = hook; }
 inline void StreamSocket::DelIOHook() { iohook = NULL; }
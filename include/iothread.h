@@ -0,0 +1,88 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+class IOThread;
+class StreamSocket;
+
+/** Manages the optional pool of threads which read from client sockets.
+ *
+ * When enabled with \<performance:iothreads>, each client socket that has no
+ * IOHook is given to one of the threads, chosen by its file descriptor. That
+ * thread waits for the socket to become readable on its own epoll instance,
+ * reads from it and splits what it read into lines. Complete lines are passed
+ * back to the main thread in batches, where they are processed exactly as if
+ * they had been read there.
+ *
+ * Everything else, including command processing, writing and sockets which
+ * have an IOHook (e.g. SSL), stays on the main thread, so modules do not have
+ * to be thread safe.
+ */
+class CoreExport IOThreadManager
+{
+	/** The threads, a socket belongs to threads[fd % threads.size()] */
+	std::vector<IOThread*> threads;
+
+	/** Sockets which are attached to a thread, keyed by their attachment id.
+	 * Only used from the main thread.
+	 */
+	std::map<unsigned long, StreamSocket*> sockets;
+
+	/** The attachment id that will be given to the next attached socket */
+	unsigned long nextid;
+
+ public:
+	IOThreadManager();
+	~IOThreadManager();
+
+	/** Start the I/O threads. Does nothing if threads are already running.
+	 * @param count The number of threads to start, 0 to not use I/O threads
+	 */
+	void Start(unsigned int count);
+
+	/** Stop all I/O threads, giving their sockets back to the main thread */
+	void Stop();
+
+	/** Get the number of running I/O threads */
+	size_t GetThreadCount() const { return threads.size(); }
+
+	/** Hand reading from a socket over to an I/O thread. The socket must be
+	 * registered with the socket engine already, its read events are disabled.
+	 * @param sock The socket to attach
+	 * @return True if the socket is now read by an I/O thread, false if
+	 * the socket is read by the main thread, e.g. because it has an IOHook
+	 */
+	bool Attach(StreamSocket* sock);
+
+	/** Take reading from a socket back from its I/O thread. This must be
+	 * called before the socket is closed. Everything the thread has read but
+	 * the main thread has not processed yet is given back in order: complete
+	 * lines which are still waiting to be delivered, followed by the partial
+	 * line held by the thread. They are removed from the queue, so they are
+	 * not delivered a second time.
+	 * @param sock The socket to detach
+	 * @param leftover Appended to with the undelivered data, if any
+	 */
+	void Detach(StreamSocket* sock, std::string& leftover);
+
+	/** Find an attached socket by its attachment id
+	 * @param id The attachment id
+	 * @return The socket or NULL if no socket is attached with the given id
+	 */
+	StreamSocket* Find(unsigned long id);
+};
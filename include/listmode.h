@@ -35,18 +35,61 @@ class CoreExport ListModeBase : public ModeHandler
 			: setter(Setter), mask(Mask), time(Time) { }
 	};
 
-	/** Items stored in the channel's list
+	/** Items stored in the channel's list, in the order they were added
 	 */
-	typedef std::list<ListItem> ModeList;
+	typedef std::vector<ListItem> ModeList;
 
  private:
+	/** Sequence number of each item by its mask, compared case insensitively
+	 */
+	typedef TR1NS::unordered_map<std::string, unsigned long, irc::insensitive, irc::StrHashComp> MaskIndex;
+
 	class ChanData
 	{
 	public:
 		ModeList list;
 		int maxitems;
 
-		ChanData() : maxitems(-1) { }
+		/** Sequence numbers of the items in list, seqs[i] belongs to list[i].
+		 * They grow with every added item, so this is sorted and the position
+		 * of an item can be found with a binary search.
+		 */
+		std::vector<unsigned long> seqs;
+
+		/** Sequence number of every item by mask */
+		MaskIndex index;
+
+		/** Sequence number the next added item gets */
+		unsigned long nextseq;
+
+		/** Copy of the case mapping the index was built with. m_nationalchars
+		 * changes the mapping in place, so the pointer alone is not enough.
+		 */
+		unsigned char foldmap[256];
+
+		/** Rebuild the index if the case mapping has changed since it was built */
+		void Refresh();
+
+		ChanData() : maxitems(-1), nextseq(0)
+		{
+			memcpy(foldmap, national_case_insensitive_map, sizeof(foldmap));
+		}
+
+		/** Find an item by mask
+		 * @param mask The mask to look for, compared case insensitively
+		 * @return The position of the item in list, or list.size() if not found
+		 */
+		size_t Find(const std::string& mask);
+
+		/** Add an item to the end of the list
+		 * @param item The item to add, its mask must not be on the list yet
+		 */
+		void Add(const ListItem& item);
+
+		/** Remove an item from the list, keeping the order of the others
+		 * @param pos The position of the item in list
+		 */
+		void Remove(size_t pos);
 	};
 
 	/** The number of items a listmode's list may contain
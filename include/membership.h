@@ -19,6 +19,8 @@
 
 #pragma once
 
+struct ModResult;
+
 class CoreExport Membership : public Extensible
 {
  public:
@@ -26,12 +28,32 @@ class CoreExport Membership : public Extensible
 	Channel* const chan;
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	Membership(User* u, Channel* c) : user(u), chan(c), banlistgen(0), banidentgen(0) {}
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
 	}
 	unsigned int getRank();
+
+	/** Get a ban verdict cached by Channel::IsBanned() or Channel::GetExtBanStatus()
+	 * @param type The extban type of the verdict, 0 for the verdict of IsBanned()
+	 * @param result Set to the verdict if there is one
+	 * @return True if a verdict is cached which is still valid
+	 */
+	bool GetBanVerdict(char type, ModResult& result);
+
+	/** Cache a ban verdict, see GetBanVerdict(). Nothing is cached if the ban list
+	 * or the user has changed since GetBanVerdict() was called.
+	 */
+	void SetBanVerdict(char type, ModResult result);
+
+ private:
+	/** Values of Channel::listgeneration and User::identgeneration when the verdicts were made */
+	unsigned int banlistgen;
+	unsigned int banidentgen;
+
+	/** Cached ban verdicts, pairs of extban type and ModResult::res */
+	std::vector<std::pair<char, int> > banverdicts;
 };
 
 class CoreExport InviteBase
@@ -0,0 +1,198 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+class MetricManager;
+
+/** Atomically add to a 64 bit value and return what it was before. Counters
+ * are updated without locks so they can be bumped from any thread.
+ */
+template<typename T>
+inline T MetricAtomicAdd(T& value, T n)
+{
+#ifdef _WIN32
+	return InterlockedExchangeAdd64(reinterpret_cast<LONG64*>(&value), n);
+#else
+	return __sync_fetch_and_add(&value, n);
+#endif
+}
+
+/** One time series (or, for a histogram, a group of them) which is exported
+ * in the OpenMetrics text format. Metrics with the same name form a family
+ * and must only differ in their labels.
+ *
+ * A metric is shown once it was passed to MetricManager::Add() and stops
+ * being shown when it is destroyed or passed to MetricManager::Del(), so
+ * modules can simply keep their metrics as members.
+ */
+class CoreExport Metric
+{
+	/** The manager this metric is registered with, NULL if none */
+	MetricManager* owner;
+	friend class MetricManager;
+
+ public:
+	enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+	/** Name of the family, e.g. "inspircd_loop_iterations" */
+	const std::string name;
+	/** Type of the family */
+	const Type type;
+	/** One line description of the family */
+	const std::string help;
+	/** Labels of this metric, already formatted (key="value",...), may be empty */
+	const std::string labels;
+
+	Metric(const std::string& Name, Type Typ, const std::string& Help, const std::string& Labels = "");
+	virtual ~Metric();
+
+	/** Append the samples of this metric to out */
+	virtual void Render(std::string& out) const = 0;
+
+	/** Format a label, escaping the value as required by OpenMetrics
+	 * @param key Label name
+	 * @param value Label value
+	 * @return The label in key="value" form
+	 */
+	static std::string Label(const std::string& key, const std::string& value);
+};
+
+/** A monotonically increasing count. Get() can be overridden to export a
+ * counter which is kept elsewhere.
+ */
+class CoreExport MetricCounter : public Metric
+{
+	uint64_t value;
+
+ public:
+	MetricCounter(const std::string& Name, const std::string& Help, const std::string& Labels = "")
+		: Metric(Name, COUNTER, Help, Labels), value(0) { }
+
+	void Inc(uint64_t n = 1) { MetricAtomicAdd<uint64_t>(value, n); }
+	virtual uint64_t Get() const { return MetricAtomicAdd<uint64_t>(const_cast<uint64_t&>(value), 0); }
+	void Render(std::string& out) const CXX11_OVERRIDE;
+};
+
+/** A value which goes up and down. Get() can be overridden to export a
+ * value which is kept elsewhere, e.g. the size of a container.
+ */
+class CoreExport MetricGauge : public Metric
+{
+	int64_t value;
+
+ public:
+	MetricGauge(const std::string& Name, const std::string& Help, const std::string& Labels = "")
+		: Metric(Name, GAUGE, Help, Labels), value(0) { }
+
+	void Add(int64_t n) { MetricAtomicAdd<int64_t>(value, n); }
+	virtual int64_t Get() const { return MetricAtomicAdd<int64_t>(const_cast<int64_t&>(value), 0); }
+	void Render(std::string& out) const CXX11_OVERRIDE;
+};
+
+/** Counts observed values in buckets with fixed upper bounds, e.g. the
+ * number of events handled per main loop iteration.
+ */
+class CoreExport MetricHistogram : public Metric
+{
+	/** Inclusive upper bounds of the buckets, ascending */
+	std::vector<uint64_t> bounds;
+	/** Observations per bucket (not cumulative), the last one is +Inf */
+	std::vector<uint64_t> counts;
+	/** Sum of all observed values */
+	uint64_t sum;
+
+ public:
+	/** Create a histogram
+	 * @param Bounds Space separated, ascending upper bounds of the buckets
+	 */
+	MetricHistogram(const std::string& Name, const std::string& Help, const std::string& Bounds, const std::string& Labels = "");
+
+	void Observe(uint64_t v);
+	void Render(std::string& out) const CXX11_OVERRIDE;
+};
+
+/** Bytes and lines sent and received, by a class of sockets or a single link */
+class CoreExport TrafficMetrics
+{
+ public:
+	MetricCounter BytesIn;
+	MetricCounter BytesOut;
+	MetricCounter LinesIn;
+	MetricCounter LinesOut;
+
+	/** Create traffic metrics
+	 * @param prefix Prefix of the family names, e.g. "inspircd_socket"
+	 * @param what What is counted, used in the descriptions
+	 * @param Labels Labels of all four metrics
+	 */
+	TrafficMetrics(const std::string& prefix, const std::string& what, const std::string& Labels);
+
+	/** Count a received line
+	 * @param bytes Length of the line including the line terminator
+	 */
+	void In(size_t bytes) { BytesIn.Inc(bytes); LinesIn.Inc(); }
+
+	/** Count a sent line
+	 * @param bytes Length of the line including the line terminator
+	 */
+	void Out(size_t bytes) { BytesOut.Inc(bytes); LinesOut.Inc(); }
+
+	/** Add all four metrics to ServerInstance->Metrics */
+	void Register();
+};
+
+/** Holds all exported metrics and renders them. Rendering costs O(metrics),
+ * no matter how many users or channels there are; metrics which report the
+ * size of something must be able to get it in constant time.
+ */
+class CoreExport MetricManager
+{
+	/** Registered metrics by family name */
+	typedef std::multimap<std::string, Metric*> MetricMap;
+	MetricMap metrics;
+
+	/** Metrics which read the size of core containers or ServerInstance->stats */
+	std::vector<Metric*> coremetrics;
+
+ public:
+	/** Main loop iterations */
+	MetricCounter LoopIterations;
+	/** Socket events handled per main loop iteration */
+	MetricHistogram LoopEvents;
+	/** Traffic of local clients */
+	TrafficMetrics Clients;
+	/** Total number of bytes waiting in the sendqs of all sockets */
+	MetricGauge SendQ;
+
+	MetricManager();
+	~MetricManager();
+
+	/** Start exporting a metric. Adding a metric twice has no effect. */
+	void Add(Metric* metric);
+
+	/** Stop exporting a metric */
+	void Del(Metric* metric);
+
+	/** Render all metrics in the OpenMetrics text format, including the
+	 * terminating "# EOF" line
+	 * @param out String to append to
+	 */
+	void Render(std::string& out) const;
+};
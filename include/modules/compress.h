@@ -0,0 +1,67 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "modules.h"
+#include <ctime>
+
+/** One direction of a compressed byte stream.
+ * Streams keep their state across calls so a whole link shares one
+ * dictionary; the counters are read by /STATS.
+ */
+class CompressionStream
+{
+ public:
+	/** Bytes handed to Process() */
+	unsigned long bytes_in;
+	/** Bytes produced by Process() and Flush() */
+	unsigned long bytes_out;
+	/** Processor time spent inside the stream */
+	clock_t cpu;
+
+	CompressionStream() : bytes_in(0), bytes_out(0), cpu(0) {}
+	virtual ~CompressionStream() {}
+
+	/** Feed data through the stream, appending any output to out.
+	 * @param data The input
+	 * @param len Length of the input, set to the number of bytes consumed
+	 * @param out String to append the output to
+	 * @param limit Stop once this many bytes were appended to out; the input
+	 * which was not consumed has to be passed again by the caller
+	 * @return False if the input was corrupt; the stream is then unusable
+	 */
+	virtual bool Process(const char* data, size_t& len, std::string& out, size_t limit = std::string::npos) = 0;
+
+	/** Push out everything buffered so far so the peer can decode it
+	 * without waiting for more input. A no-op for decompressors.
+	 */
+	virtual void Flush(std::string& out) { }
+};
+
+/** Provides compression streams, registered as "compress/<name>".
+ */
+class CompressionProvider : public DataProvider
+{
+ public:
+	CompressionProvider(Module* mod, const std::string& Name)
+		: DataProvider(mod, "compress/" + Name) {}
+
+	virtual CompressionStream* CreateCompressor() = 0;
+	virtual CompressionStream* CreateDecompressor() = 0;
+};
@@ -31,6 +31,8 @@ namespace DNS
 		QUERY_A = 1,
 		/* A CNAME lookup */
 		QUERY_CNAME = 5,
+		/* Start of authority, only seen in the authority section of negative answers */
+		QUERY_SOA = 6,
 		/* Reverse DNS lookup */
 		QUERY_PTR = 12,
 		/* IPv6 AAAA lookup */
@@ -115,6 +117,8 @@ namespace DNS
 	{
 		std::vector<Question> questions;
 		std::vector<ResourceRecord> answers;
+		/* Records from the authority section, e.g. the SOA saying how long a negative answer holds */
+		std::vector<ResourceRecord> authorities;
 		Error error;
 		bool cached;
 
@@ -177,6 +177,24 @@ class HTTPRequest : public Event
 	}
 };
 
+/** A response body that is generated a piece at a time as the client reads it,
+ * so that a large document never has to be held in memory as a whole.
+ * m_httpd owns the stream once it is passed in a HTTPDocumentResponse and
+ * deletes it when the document is complete, the connection closes, or the
+ * module that created it is unloaded.
+ */
+class HTTPDocumentStream
+{
+ public:
+	virtual ~HTTPDocumentStream() { }
+
+	/** Append the next part of the document to data.
+	 * Called whenever the client has read most of what was sent so far.
+	 * @return False if the document is complete, true if more follows
+	 */
+	virtual bool Generate(std::string& data) = 0;
+};
+
 /** If you want to reply to HTTP requests, you must return a HTTPDocumentResponse to
  * the httpd module via the HTTPdAPI.
  * When you initialize this class you initialize it with all components required to
@@ -191,6 +209,9 @@ class HTTPDocumentResponse
 	Module* const module;
 
 	std::stringstream* document;
+	/** The document body if it is streamed, or NULL
+	 */
+	HTTPDocumentStream* stream;
 	unsigned int responsecode;
 
 	/** Any extra headers to include with the defaults
@@ -207,7 +228,18 @@ class HTTPDocumentResponse
 	 * based upon the response code.
 	 */
 	HTTPDocumentResponse(Module* mod, HTTPRequest& req, std::stringstream* doc, unsigned int response)
-		: module(mod), document(doc), responsecode(response), src(req)
+		: module(mod), document(doc), stream(NULL), responsecode(response), src(req)
+	{
+	}
+
+	/** Initialize a HTTPDocumentResponse whose body is generated as it is sent.
+	 * @param mod A pointer to the module who responded to the request
+	 * @param req The request you obtained from the HTTPRequest at an earlier time
+	 * @param body The stream producing the document body, m_httpd takes ownership of it
+	 * @param response A valid HTTP/1.0 or HTTP/1.1 response code
+	 */
+	HTTPDocumentResponse(Module* mod, HTTPRequest& req, HTTPDocumentStream* body, unsigned int response)
+		: module(mod), document(NULL), stream(body), responsecode(response), src(req)
 	{
 	}
 };
@@ -143,6 +143,70 @@ class SQLQuery : public classbase
 	virtual void OnError(SQLerror& error) { }
 };
 
+/** Counters kept by an SQL provider for one database and shown in /STATS Q
+ */
+class SQLStats
+{
+ public:
+	/** Number of latency histogram buckets; bucket n counts queries taking under 10^n ms */
+	static const unsigned int LatencyBuckets = 6;
+
+	/** Queries completed, successfully or not */
+	unsigned long queries;
+	/** Queries which failed */
+	unsigned long errors;
+	/** Time from submission to result, the last bucket has no upper bound */
+	unsigned long latency[LatencyBuckets];
+
+	SQLStats() : queries(0), errors(0)
+	{
+		for (unsigned int i = 0; i < LatencyBuckets; i++)
+			latency[i] = 0;
+	}
+
+	/** Get the current time in milliseconds, for passing to Done() later */
+	static unsigned long Now()
+	{
+		return (unsigned long)ServerInstance->Time() * 1000 + ServerInstance->Time_ns() / 1000000;
+	}
+
+	/** Record a finished query
+	 * @param started The value of Now() when the query was submitted
+	 * @param failed True if the query failed
+	 */
+	void Done(unsigned long started, bool failed)
+	{
+		queries++;
+		if (failed)
+			errors++;
+		unsigned long elapsed = Now() - started;
+		unsigned int bucket = 0;
+		for (unsigned long limit = 1; bucket < LatencyBuckets - 1 && elapsed >= limit; limit *= 10)
+			bucket++;
+		latency[bucket]++;
+	}
+
+	/** Add the /STATS Q lines for a database
+	 * @param id The database id
+	 * @param connections The number of connections to the database
+	 * @param queued The number of queries not yet finished, including active ones
+	 * @param active The number of queries currently being run
+	 */
+	void Report(const std::string& id, size_t connections, size_t queued, size_t active, User* user, string_list& results)
+	{
+		std::string prefix = ServerInstance->Config->ServerName + " 249 " + user->nick + " :" + id;
+		results.push_back(prefix + " connections " + ConvToStr(connections) + " queued " + ConvToStr(queued) +
+			" active " + ConvToStr(active) + " queries " + ConvToStr(queries) + " errors " + ConvToStr(errors));
+
+		std::string line = prefix + " latency";
+		unsigned long limit = 1;
+		for (unsigned int i = 0; i < LatencyBuckets - 1; i++, limit *= 10)
+			line.append(" <" + ConvToStr(limit) + "ms:" + ConvToStr(latency[i]));
+		line.append(" >=" + ConvToStr(limit / 10) + "ms:" + ConvToStr(latency[LatencyBuckets - 1]));
+		results.push_back(line);
+	}
+};
+
 /**
  * Provider object for SQL servers
  */
@@ -237,9 +237,18 @@ class CoreExport SocketEngine
 	/** Reference table, contains all current handlers
 	 */
 	EventHandler** ref;
-	/** List of handlers that want a trial read/write
+	/** File descriptors of the handlers that want a trial read/write, in the
+	 * order they asked for it. A handler is added when it gets its first
+	 * FD_TRIAL_NOTE_MASK bit, so it is only listed once; entries of handlers
+	 * which have been removed since are skipped.
 	 */
-	std::set<int> trials;
+	std::vector<int> trials;
+
+	/** The trials being dispatched by DispatchTrialWrites() and their event
+	 * masks from before the dispatch. Kept to reuse their memory.
+	 */
+	std::vector<int> trialswork;
+	std::vector<int> trialmasks;
 
 	int MAX_DESCRIPTORS;
 
@@ -342,6 +351,9 @@ public:
 
 	/** Dispatch trial reads and writes. This causes the actual socket I/O
 	 * to happen when writes have been pre-buffered.
+	 * All trial reads are done before any write, and output queued by them
+	 * is written out in the same call, so every socket is written to at most
+	 * once, with everything that was queued for it, before waiting for events.
 	 */
 	virtual void DispatchTrialWrites();
 
@@ -29,4 +29,14 @@ class TestSuite
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoRecvQueueTests();
+	bool DoTimerTests();
+	bool DoHashTests();
+	bool DoXLineTests();
+	bool DoBanCacheTests();
+	bool DoListModeTests();
+	bool DoPrivilegeTests();
+	bool DoParserTests();
+	bool DoSocketEngineTests();
+	bool DoIOThreadTests();
 };
@@ -23,11 +23,12 @@
 
 class Module;
 
-/** Timer class for one-second resolution timers
+/** Timer class for one-second or millisecond resolution timers
  * Timer provides a facility which allows module
  * developers to create one-shot timers. The timer
  * can be made to trigger at any time up to a one-second
- * resolution. To use Timer, inherit a class from
+ * resolution, or a millisecond resolution after calling
+ * SetIntervalMS(). To use Timer, inherit a class from
  * Timer, then insert your inherited class into the
  * queue using Server::AddTimer(). The Tick() method of
  * your object (which you have to override) will be called
@@ -43,10 +44,34 @@ class CoreExport Timer
 	 */
 	unsigned int secs;
 
+	/** Number of milliseconds between triggers, 0 if this
+	 * timer has one-second resolution
+	 */
+	unsigned long msecs;
+
 	/** True if this is a repeating timer
 	 */
 	bool repeat;
 
+	/** The tick of the TimerManager (in milliseconds) at which this timer is due
+	 */
+	unsigned long expires;
+
+	/** Next timer in the same slot of the timing wheel
+	 */
+	Timer* next;
+
+	/** Pointer to the pointer pointing to this timer in the timing wheel,
+	 * NULL if this timer is not scheduled
+	 */
+	Timer** pprev;
+
+	/** The wheel this timer is in, 0 for the root wheel or n for TimerManager::levels[n - 1]
+	 */
+	unsigned int wheel;
+
+	friend class TimerManager;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -54,10 +79,9 @@ class CoreExport Timer
 	 * @param repeating Repeat this timer every secs_from_now seconds if set to true
 	 */
 	Timer(unsigned int secs_from_now, time_t now, bool repeating = false)
+		: trigger(now + secs_from_now), secs(secs_from_now), msecs(0), repeat(repeating)
+		, expires(0), next(NULL), pprev(NULL), wheel(0)
 	{
-		trigger = now + secs_from_now;
-		secs = secs_from_now;
-		repeat = repeating;
 	}
 
 	/** Default destructor, removes the timer from the timer manager
@@ -84,6 +108,12 @@ class CoreExport Timer
 	 */
 	void SetInterval(time_t interval);
 
+	/** Sets the interval between two ticks in milliseconds and switches the
+	 * timer to millisecond resolution. Like SetInterval(), this (re)schedules
+	 * the timer to trigger the given number of milliseconds from now.
+	 */
+	void SetIntervalMS(unsigned long interval);
+
 	/** Called when the timer ticks.
 	 * You should override this method with some useful code to
 	 * handle the tick event.
@@ -105,6 +135,14 @@ class CoreExport Timer
 		return secs;
 	}
 
+	/** Returns the interval in milliseconds, 0 if this timer
+	 * has one-second resolution.
+	 */
+	unsigned long GetIntervalMS() const
+	{
+		return msecs;
+	}
+
 	/** Cancels the repeat state of a repeating timer.
 	 * If you call this method, then the next time your
 	 * timer ticks, it will be removed immediately after.
@@ -115,19 +153,112 @@ class CoreExport Timer
 	}
 };
 
-typedef std::multimap<time_t, Timer*> TimerMap;
-
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel with a resolution of one
+ * millisecond: a root wheel of 256 slots of one millisecond each, and four
+ * wheels of 64 slots where each slot covers a whole turn of the wheel below
+ * it. Adding and removing a timer is O(1), the timers in a slot of an outer
+ * wheel are moved inwards when the wheel below it has completed a turn.
+ * Timers with one-second resolution are due at the start of their second,
+ * so they trigger together with the rest of the once-per-second work.
  */
 class CoreExport TimerManager
 {
-	/** A list of all pending timers
+ public:
+	/** The cost of triggering timers during one second
+	 */
+	struct TickCost
+	{
+		/** Number of timers which ticked
+		 */
+		unsigned long timers;
+
+		/** Microseconds spent in TickTimers()
+		 */
+		unsigned long usecs;
+
+		TickCost() : timers(0), usecs(0) { }
+	};
+
+ private:
+	static const unsigned int ROOT_BITS = 8;
+	static const unsigned int ROOT_SIZE = 1 << ROOT_BITS;
+	static const unsigned int LEVEL_BITS = 6;
+	static const unsigned int LEVEL_SIZE = 1 << LEVEL_BITS;
+	static const unsigned int LEVELS = 4;
+
+	/** Timers due within the next ROOT_SIZE milliseconds, indexed by their due tick
+	 */
+	Timer* root[ROOT_SIZE];
+
+	/** Timers due later, levels[n] has a granularity of ROOT_SIZE * LEVEL_SIZE^n milliseconds
+	 */
+	Timer* levels[LEVELS][LEVEL_SIZE];
+
+	/** Number of timers in each wheel, indexed like Timer::wheel
+	 */
+	size_t wheelcount[LEVELS + 1];
+
+	/** The next tick to process, all timers due before this tick have been triggered
+	 */
+	unsigned long wheeltime;
+
+	/** Number of scheduled timers
+	 */
+	size_t count;
+
+	/** The cost of the current second so far, the cost of the last whole second and the highest cost of any second
+	 */
+	TickCost current, lastsecond, peak;
+
+	/** The second the current cost is for
+	 */
+	time_t currentsecond;
+
+	/** Insert a timer into the slot for its due tick
+	 */
+	void Link(Timer* t);
+
+	/** Remove a timer from the slot it is in
+	 */
+	void Unlink(Timer* t);
+
+	/** Move all timers from a slot of an outer wheel into the wheels below it
+	 * @return The index of the slot
+	 */
+	unsigned int Cascade(unsigned int level);
+
+	/** Schedule a timer according to its trigger time or millisecond interval,
+	 * rescheduling it if it is already scheduled
+	 * @param t The timer to schedule
+	 * @param now The current tick
 	 */
-	TimerMap Timers;
+	void AddTimer(Timer* t, unsigned long now);
+
+	/** Trigger all timers which are due
+	 * @param now The current tick
+	 * @param TIME The current time, passed to Timer::Tick()
+	 */
+	void Run(unsigned long now, time_t TIME);
+
+	/** Get the number of milliseconds until the next timer is due
+	 * @param now The current tick
+	 * @param max The maximum value to return
+	 */
+	int GetTimeout(unsigned long now, int max) const;
+
+	/** Get the current tick from the server time, in milliseconds
+	 */
+	static unsigned long GetTick();
+
+	friend class TestSuite;
 
  public:
+	TimerManager();
+
 	/** Tick all pending Timers
 	 * @param TIME the current system time
 	 */
@@ -142,4 +273,21 @@ class CoreExport TimerManager
 	 * @param T an Timer derived class to remove
 	 */
 	void DelTimer(Timer* T);
+
+	/** Get the number of milliseconds the socket engine may wait for events
+	 * before a timer becomes due or the next second starts, whichever is sooner.
+	 */
+	int GetTimeout();
+
+	/** Get the number of scheduled timers
+	 */
+	size_t GetTimerCount() const { return count; }
+
+	/** Get the cost of triggering timers during the last whole second
+	 */
+	const TickCost& GetLastSecondCost() const { return lastsecond; }
+
+	/** Get the highest cost of triggering timers during any second
+	 */
+	const TickCost& GetPeakCost() const { return peak; }
 };
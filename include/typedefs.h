@@ -35,6 +35,7 @@ class LocalUser;
 class Membership;
 class Module;
 class OperInfo;
+class Privilege;
 class RemoteUser;
 class ServerConfig;
 class ServerLimits;
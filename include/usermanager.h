@@ -78,9 +78,11 @@ class CoreExport UserManager
      */
 	void GarbageCollect();
 
-	/** Perform background user events such as PING checks
+	/** Perform background user events such as PING checks for a user
+	 * and schedule the next check. Called from the user's UserCheckTimer.
+	 * @param user The user to check
 	 */
-	void DoBackgroundUserStuff();
+	void DoBackgroundUserStuff(LocalUser* user);
 
 	/** Returns true when all modules have done pre-registration checks on a user
 	 * @param user The user to verify
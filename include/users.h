@@ -300,6 +300,14 @@ class CoreExport User : public Extensible
 	 */
 	std::string fullname;
 
+	/** Incremented whenever something that bans can match changes, such as the nick,
+	 * ident, host, IP, gecos, oper status or the channels of the user. Modules whose
+	 * extbans match other properties of users must increment it when those change,
+	 * as Channel::IsBanned() caches its result until either this or the list modes
+	 * of the channel change.
+	 */
+	unsigned int identgeneration;
+
 	/** The user's mode list.
 	 * NOT a null terminated string.
 	 * Also NOT an array.
@@ -476,6 +484,14 @@ class CoreExport User : public Extensible
 	 */
 	virtual bool HasPrivPermission(const std::string &privstr, bool noisy = false);
 
+	/** Returns true if a user has a given permission, see above.
+	 * This is faster than checking the permission by name.
+	 * @param priv The resolved priv to check
+	 * @param noisy If set to true, the user is notified that they do not have the specified permission where applicable. If false, no notification is sent.
+	 * @return True if this user has the permission in question.
+	 */
+	virtual bool HasPrivPermission(const Privilege& priv, bool noisy = false);
+
 	/** Returns true or false if a user can set a privileged user or channel mode.
 	 * This is done by looking up their oper type from User::oper, then referencing
 	 * this to their oper classes, and checking the modes they can set.
@@ -701,9 +717,28 @@ class CoreExport UserIOHandler : public StreamSocket
 	/** Adds to the user's write buffer.
 	 * You may add any amount of text up to this users sendq value, if you exceed the
 	 * sendq value, the user will be removed, and further buffer adds will be dropped.
-	 * @param data The data to add to the write buffer
+	 * @param data The data to add to the write buffer. The buffer is queued by reference,
+	 * so the same data may be added to the write buffer of many users.
+	 */
+	void AddWriteBuf(const reference<SendBuffer>& data);
+};
+
+/** Runs the periodic checks of a local user: ping and registration timeouts,
+ * command flood penalty decay and resuming commands held back by fakelag.
+ * It is only scheduled for when one of these falls due, so an idle user is
+ * checked once per ping interval rather than every second.
+ */
+class CoreExport UserCheckTimer : public Timer
+{
+ public:
+	LocalUser* const user;
+	UserCheckTimer(LocalUser* me);
+	bool Tick(time_t now);
+
+	/** Make sure the checks run no later than the given time
+	 * @param when The time the checks should run at the latest
 	 */
-	void AddWriteBuf(const std::string &data);
+	void ScheduleCheck(time_t when);
 };
 
 typedef unsigned int already_sent_t;
@@ -716,6 +751,10 @@ class CoreExport LocalUser : public User, public InviteBase
 
 	UserIOHandler eh;
 
+	/** Timer which runs the periodic checks of this user
+	 */
+	UserCheckTimer checktimer;
+
 	/** Position in UserManager::local_users
 	 */
 	LocalUserList::iterator localuseriter;
@@ -816,6 +855,20 @@ class CoreExport LocalUser : public User, public InviteBase
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line prepared by PrepareLine() to this user.
+	 * The line is shared rather than copied, so a message sent to many users
+	 * should be prepared once and then written to each of them with this.
+	 * @param line The line to write, already terminated by CR/LF
+	 */
+	void Write(const reference<SendBuffer>& line);
+
+	/** Prepare a line of text for sending to one or more local users. The text is
+	 * cropped to the maximum line length and CR/LF is appended to it.
+	 * @param text The text to prepare, without CR/LF
+	 * @return A buffer that can be passed to Write() for any number of users
+	 */
+	static reference<SendBuffer> PrepareLine(const std::string& text);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
@@ -855,6 +908,14 @@ class CoreExport LocalUser : public User, public InviteBase
 	 */
 	bool HasPrivPermission(const std::string &privstr, bool noisy = false);
 
+	/** Returns true if a user has a given permission, see above.
+	 * This is faster than checking the permission by name.
+	 * @param priv The resolved priv to check
+	 * @param noisy If set to true, the user is notified that they do not have the specified permission where applicable. If false, no notification is sent.
+	 * @return True if this user has the permission in question.
+	 */
+	bool HasPrivPermission(const Privilege& priv, bool noisy = false);
+
 	/** Returns true or false if a user can set a privileged user or channel mode.
 	 * This is done by looking up their oper type from User::oper, then referencing
 	 * this to their oper classes, and checking the modes they can set.
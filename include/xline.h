@@ -115,6 +115,33 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** What the mask returned by GetIndexMask() is compared with
+	 */
+	enum IndexType
+	{
+		/** The line can not be indexed, Matches() is called for every user */
+		INDEX_NONE,
+		/** The host or the IP of the user must match the mask (case insensitive ASCII) */
+		INDEX_HOST,
+		/** The IP of the user must match the mask */
+		INDEX_IP,
+		/** The nick of the user must match the mask */
+		INDEX_NICK
+	};
+
+	/** Get the mask which the XLineManager uses to find this line without calling Matches()
+	 * for every line of the type. The index only narrows down the lines that are checked,
+	 * Matches() always has the final word, so the mask may match more than the line does.
+	 * It must not match less: if Matches() returns true then the mask matches the part
+	 * of the user given by the return value, using InspIRCd::MatchCIDR() semantics
+	 * (InspIRCd::Match() for nicks). For INDEX_IP and INDEX_NICK the same goes for the
+	 * string given to Matches(const std::string&). The mask must not change while the
+	 * line is added.
+	 * @param mask Set to the mask
+	 * @return What the mask is matched against, INDEX_NONE if the line can't be indexed
+	 */
+	virtual IndexType GetIndexMask(std::string& mask) { return INDEX_NONE; }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -178,6 +205,8 @@ class CoreExport KLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexType GetIndexMask(std::string& mask);
+
 	virtual bool IsBurstable();
 
 	/** Ident mask (ident part only)
@@ -224,6 +253,8 @@ class CoreExport GLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexType GetIndexMask(std::string& mask);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -268,6 +299,8 @@ class CoreExport ELine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexType GetIndexMask(std::string& mask);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -309,6 +342,8 @@ class CoreExport ZLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexType GetIndexMask(std::string& mask);
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -344,6 +379,8 @@ class CoreExport QLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexType GetIndexMask(std::string& mask);
+
 	/** Nickname mask
 	 */
 	std::string nick;
@@ -364,10 +401,16 @@ class CoreExport XLineFactory
 
  public:
 
+	/** Number of users and masks which matched a line of this type,
+	 * exported while the factory is registered
+	 */
+	MetricCounter matches;
+
 	/** Create an XLine factory
 	 * @param t Type of XLine this factory generates
 	 */
-	XLineFactory(const std::string &t) : type(t) { }
+	XLineFactory(const std::string &t)
+		: type(t), matches("inspircd_xline_matches", "Users and masks which matched an X-line", Metric::Label("type", t)) { }
 
 	/** Return the type of XLine this factory generates
 	 * @return The type of XLine this factory generates
@@ -391,6 +434,29 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+class XLineIndex;
+
+/** An entry of the expiry queue of the XLineManager. Lines are looked up by their
+ * type and mask when the entry is due, so entries of lines which have been removed
+ * in the meantime are skipped when they are popped. Entries are not removed when
+ * their line is deleted; instead the queue is rebuilt without them once they make
+ * up half of it, see XLineManager::CompactExpiries().
+ */
+struct XLineExpiry
+{
+	/** The expiry time of the line when the entry was queued */
+	time_t expiry;
+	/** The type of the line */
+	std::string type;
+	/** The Displayable() mask of the line */
+	std::string mask;
+
+	XLineExpiry(time_t e, const std::string& t, const std::string& m) : expiry(e), type(t), mask(m) { }
+
+	/** Used with std::greater to keep the entry that is due first on top of the heap */
+	bool operator>(const XLineExpiry& other) const { return expiry > other.expiry; }
+};
+
 /** XLineManager is a class used to manage glines, klines, elines, zlines and qlines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -413,6 +479,38 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Index of the lines of each type, used by MatchesLine() to only check the
+	 * lines which may match instead of all of them
+	 */
+	std::map<std::string, XLineIndex*> line_index;
+
+	/** Heap of the lines which have a duration, ordered by expiry time
+	 */
+	std::vector<XLineExpiry> expiries;
+
+	/** True while ExpireLines() is running
+	 */
+	bool expiring;
+
+	/** Number of entries in expiries whose line has been removed
+	 */
+	size_t staleexpiries;
+
+	/** Rebuild expiries without the entries of removed lines
+	 */
+	void CompactExpiries();
+
+	/** Take a line out of the index, unset it and free it
+	 * @param container Iterator to the first level of entries the map
+	 * @param item Iterator to the second level of entries in the map
+	 */
+	void RemoveLine(ContainerIter container, LookupIter item);
+
+	/** Count a match of a line in the metrics of its factory
+	 * @param line The line which matched
+	 */
+	void CountMatch(XLine* line);
+
  public:
 
 	/** Constructor
@@ -440,6 +538,11 @@ class CoreExport XLineManager
 	 */
 	XLineLookup* GetAll(const std::string &type);
 
+	/** Expire all lines which are past their expiry time. This is called once a second
+	 * and before lines are matched or listed, so expired lines are never matched.
+	 */
+	void ExpireLines();
+
 	/** Remove all lines of a certain type.
 	 */
 	void DelAll(const std::string &type);
@@ -29,6 +29,8 @@
 #include "mode.h"
 
 static ModeReference ban(NULL, "ban");
+static Privilege privhighjoinlimit("channels/high-join-limit");
+static Privilege privchanauspex("channels/auspex");
 
 Channel::Channel(const std::string &cname, time_t ts)
 {
@@ -39,6 +41,7 @@ Channel::Channel(const std::string &cname, time_t ts)
 	this->age = ts ? ts : ServerInstance->Time();
 
 	topicset = 0;
+	listgeneration = 0;
 	modes.reset();
 }
 
@@ -99,6 +102,9 @@ Membership* Channel::AddUser(User* user)
 		return NULL;
 
 	memb = new Membership(user, this);
+
+	// Extbans such as j: match the channels of a user
+	user->identgeneration++;
 	return memb;
 }
 
@@ -134,6 +140,7 @@ void Channel::CheckDestroy()
 void Channel::DelUser(const UserMembIter& membiter)
 {
 	Membership* memb = membiter->second;
+	memb->user->identgeneration++;
 	memb->cull();
 	delete memb;
 	userlist.erase(membiter);
@@ -195,7 +202,7 @@ Channel* Channel::JoinUser(LocalUser* user, std::string cname, bool override, co
 	 */
 	if (!override)
 	{
-		if (user->HasPrivPermission("channels/high-join-limit"))
+		if (user->HasPrivPermission(privhighjoinlimit))
 		{
 			if (user->chans.size() >= ServerInstance->Config->OperMaxChans)
 			{
@@ -388,23 +395,33 @@ void Channel::ForceJoin(User* user, const std::string* privs, bool bursting, boo
 
 bool Channel::IsBanned(User* user)
 {
+	Membership* memb = GetUser(user);
 	ModResult result;
-	FIRST_MOD_RESULT(OnCheckChannelBan, result, (user, this));
-
-	if (result != MOD_RES_PASSTHRU)
+	if ((memb) && (memb->GetBanVerdict(0, result)))
 		return (result == MOD_RES_DENY);
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	FIRST_MOD_RESULT(OnCheckChannelBan, result, (user, this));
+
+	if (result == MOD_RES_PASSTHRU)
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+		ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
+		const ListModeBase::ModeList* bans = banlm->GetList(this);
+		if (bans)
 		{
-			if (CheckBan(user, it->mask))
-				return true;
+			for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+			{
+				if (CheckBan(user, it->mask))
+				{
+					result = MOD_RES_DENY;
+					break;
+				}
+			}
 		}
 	}
-	return false;
+
+	if (memb)
+		memb->SetBanVerdict(0, result);
+	return (result == MOD_RES_DENY);
 }
 
 bool Channel::CheckBan(User* user, const std::string& mask)
@@ -437,23 +454,39 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 
 ModResult Channel::GetExtBanStatus(User *user, char type)
 {
+	Membership* memb = GetUser(user);
 	ModResult rv;
-	FIRST_MOD_RESULT(OnExtBanCheck, rv, (user, this, type));
-	if (rv != MOD_RES_PASSTHRU)
+	if ((memb) && (memb->GetBanVerdict(type, rv)))
 		return rv;
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	FIRST_MOD_RESULT(OnExtBanCheck, rv, (user, this, type));
 
+	if (rv == MOD_RES_PASSTHRU)
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+		ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
+		const ListModeBase::ModeList* bans = banlm->GetList(this);
+		if (bans)
 		{
-			if (CheckBan(user, it->mask))
-				return MOD_RES_DENY;
+			for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+			{
+				if ((it->mask.length() > 2) && (it->mask[0] == type) && (it->mask[1] == ':') && (CheckBan(user, it->mask.substr(2))))
+				{
+					rv = MOD_RES_DENY;
+					break;
+				}
+			}
 		}
 	}
-	return MOD_RES_PASSTHRU;
+
+	if (memb)
+		memb->SetBanVerdict(type, rv);
+	return rv;
+}
+
+void Channel::ResetBanVerdicts()
+{
+	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+		i->second->listgeneration++;
 }
 
 /* Channel::PartUser
@@ -540,12 +573,13 @@ void Channel::WriteChannel(User* user, const char* text, ...)
 
 void Channel::WriteChannel(User* user, const std::string &text)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + text;
+	const reference<SendBuffer> message = LocalUser::PrepareLine(":" + user->GetFullHost() + " " + text);
 
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
+		LocalUser* lu = IS_LOCAL(i->first);
+		if (lu)
+			lu->Write(message);
 	}
 }
 
@@ -558,12 +592,13 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const char* text
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const std::string &text)
 {
-	const std::string message = ":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text;
+	const reference<SendBuffer> message = LocalUser::PrepareLine(":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text);
 
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
+		LocalUser* lu = IS_LOCAL(i->first);
+		if (lu)
+			lu->Write(message);
 	}
 }
 
@@ -599,15 +634,19 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
+
+	// Format the line once, every local recipient shares the same buffer
+	const reference<SendBuffer> line = LocalUser::PrepareLine(out);
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
+		LocalUser* lu = IS_LOCAL(i->first);
+		if (lu && (except_list.find(i->first) == except_list.end()))
 		{
 			/* User doesn't have the status we're after */
 			if (minrank && i->second->getRank() < minrank)
 				continue;
 
-			i->first->Write(out);
+			lu->Write(line);
 		}
 	}
 }
@@ -657,7 +696,7 @@ const char* Channel::ChanModes(bool showkey)
  */
 void Channel::UserList(User *user)
 {
-	if (this->IsModeSet('s') && !this->HasUser(user) && !user->HasPrivPermission("channels/auspex"))
+	if (this->IsModeSet('s') && !this->HasUser(user) && !user->HasPrivPermission(privchanauspex))
 	{
 		user->WriteNumeric(ERR_NOSUCHNICK, "%s %s :No such nick/channel",user->nick.c_str(), this->name.c_str());
 		return;
@@ -765,6 +804,34 @@ unsigned int Membership::getRank()
 	return rv;
 }
 
+bool Membership::GetBanVerdict(char type, ModResult& result)
+{
+	if ((banlistgen != chan->listgeneration) || (banidentgen != user->identgeneration))
+	{
+		banverdicts.clear();
+		banlistgen = chan->listgeneration;
+		banidentgen = user->identgeneration;
+		return false;
+	}
+
+	for (std::vector<std::pair<char, int> >::const_iterator i = banverdicts.begin(); i != banverdicts.end(); ++i)
+	{
+		if (i->first == type)
+		{
+			result = ModResult(i->second);
+			return true;
+		}
+	}
+	return false;
+}
+
+void Membership::SetBanVerdict(char type, ModResult result)
+{
+	// Modules called while checking the bans may have changed the user or the lists
+	if ((banlistgen == chan->listgeneration) && (banidentgen == user->identgeneration))
+		banverdicts.push_back(std::make_pair(type, result.res));
+}
+
 const char* Channel::GetAllPrefixChars(User* user)
 {
 	static char prefix[64];
@@ -812,11 +879,15 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 				m->second->modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				m->second->modes.substr(mchar == prefix ? i+1 : i);
+			user->identgeneration++;
 			return adding != (mchar == prefix);
 		}
 	}
 	if (adding)
+	{
 		m->second->modes += std::string(1, prefix);
+		user->identgeneration++;
+	}
 	return adding;
 }
 
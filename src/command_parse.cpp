@@ -23,6 +23,8 @@
 
 #include "inspircd.h"
 
+static Privilege privnothrottle("users/flood/no-throttle");
+
 int InspIRCd::PassCompare(Extensible* ex, const std::string &data, const std::string &input, const std::string &hashtype)
 {
 	ModResult res;
@@ -158,31 +160,100 @@ CmdResult CommandParser::CallHandler(const std::string &commandname, const std::
 	return CMD_INVALID;
 }
 
-void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
+void CommandParser::SplitLine(const std::string& line, ParsedLine& out)
 {
-	std::vector<std::string> command_p;
-	irc::tokenstream tokens(cmd);
-	std::string command, token;
-	tokens.GetToken(command);
-
-	/* A client sent a nick prefix on their command (ick)
-	 * rhapsody and some braindead bouncers do this --
-	 * the rfc says they shouldnt but also says the ircd should
-	 * discard it if they do.
+	bool havecommand = false;
+	size_t count = 0;
+	unsigned int index = 0;
+	std::string::size_type pos = 0;
+	out.command.clear();
+
+	while ((pos = line.find_first_not_of(' ', pos)) != std::string::npos)
+	{
+		std::string::size_type start = pos;
+		std::string::size_type end;
+		if ((index) && (line[pos] == ':'))
+		{
+			// The last parameter, it is the rest of the line
+			start++;
+			end = pos = line.length();
+		}
+		else
+		{
+			end = pos = std::min(line.find(' ', pos), line.length());
+		}
+
+		/* A client sent a nick prefix on their command (ick)
+		 * rhapsody and some braindead bouncers do this --
+		 * the rfc says they shouldnt but also says the ircd should
+		 * discard it if they do.
+		 */
+		if ((index++ == 0) && (line[start] == ':'))
+			continue;
+
+		if (!havecommand)
+		{
+			out.command.assign(line, start, end - start);
+			havecommand = true;
+			continue;
+		}
+
+		if (count == out.params.size())
+		{
+			out.params.push_back(std::string());
+			if (!out.spare.empty())
+			{
+				out.params.back().swap(out.spare.back());
+				out.spare.pop_back();
+			}
+		}
+		out.params[count++].assign(line, start, end - start);
+	}
+
+	while (out.params.size() > count)
+	{
+		out.spare.push_back(std::string());
+		out.spare.back().swap(out.params.back());
+		out.params.pop_back();
+	}
+
+	std::transform(out.command.begin(), out.command.end(), out.command.begin(), ::toupper);
+}
+
+namespace
+{
+	/** Raises a nesting depth for as long as it exists, so the depth is
+	 * restored even if a command handler throws
 	 */
-	if (command[0] == ':')
-		tokens.GetToken(command);
+	class DepthGuard
+	{
+		size_t& depth;
 
-	while (tokens.GetToken(token))
-		command_p.push_back(token);
+	 public:
+		DepthGuard(size_t& Depth) : depth(Depth) { depth++; }
+		~DepthGuard() { depth--; }
+	};
+}
 
-	std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
+{
+	// Command handlers may process other lines, every nesting level has its own ParsedLine
+	if (parsedepth == parsedlines.size())
+		parsedlines.push_back(ParsedLine());
+	ParsedLine& parsed = parsedlines[parsedepth];
+	DepthGuard guard(parsedepth);
+
+	SplitLine(cmd, parsed);
+	ProcessCommand(user, cmd, parsed.command, parsed.params);
+}
 
+void CommandParser::ProcessCommand(LocalUser* user, std::string& cmd, std::string& command, std::vector<std::string>& command_p)
+{
 	/* find the command, check it exists */
 	Command* handler = GetHandler(command);
 
 	/* Modify the user's penalty regardless of whether or not the command exists */
-	if (!user->HasPrivPermission("users/flood/no-throttle"))
+	if (!user->HasPrivPermission(privnothrottle))
 	{
 		// If it *doesn't* exist, give it a slightly heftier penalty than normal to deter flooding us crap
 		user->CommandFloodPenalty += handler ? handler->Penalty * 1000 : 2000;
@@ -337,8 +408,10 @@ void CommandParser::ProcessBuffer(std::string &buffer,LocalUser *user)
 	if (!user || buffer.empty())
 		return;
 
-	ServerInstance->Logs->Log("USERINPUT", LOG_RAWIO, "C[%s] I :%s %s",
-		user->uuid.c_str(), user->nick.c_str(), buffer.c_str());
+	// Formatting the line is wasted work unless something logs raw I/O
+	if (ServerInstance->Config->RawLog)
+		ServerInstance->Logs->Log("USERINPUT", LOG_RAWIO, "C[%s] I :%s %s",
+			user->uuid.c_str(), user->nick.c_str(), buffer.c_str());
 	ProcessCommand(user,buffer);
 }
 
@@ -354,6 +427,7 @@ bool CommandParser::AddCommand(Command *f)
 }
 
 CommandParser::CommandParser()
+	: parsedepth(0)
 {
 }
 
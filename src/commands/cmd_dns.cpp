@@ -142,9 +142,13 @@ class Packet : public Query
 		record.ttl = (input[pos] << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
 		pos += 4;
 
-		//record.rdlength = input[pos] << 8 | input[pos + 1];
+		unsigned short rdlength = input[pos] << 8 | input[pos + 1];
 		pos += 2;
 
+		if (rdlength > input_size - pos)
+			throw Exception("Unable to unpack resource record");
+		unsigned short rdend = pos + rdlength;
+
 		switch (record.type)
 		{
 			case QUERY_A:
@@ -185,10 +189,28 @@ class Packet : public Query
 				record.rdata = this->UnpackName(input, input_size, pos);
 				break;
 			}
+			case QUERY_SOA:
+			{
+				record.rdata = this->UnpackName(input, input_size, pos);
+				this->UnpackName(input, input_size, pos);
+
+				/* Skip serial, refresh, retry and expire */
+				if (pos + 20 > input_size)
+					throw Exception("Unable to unpack resource record");
+				pos += 16;
+
+				/* Negative answers are cached for the smaller of the TTL and MINIMUM (RFC 2308) */
+				unsigned int minimum = (input[pos] << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
+				record.ttl = std::min(record.ttl, minimum);
+				break;
+			}
 			default:
 				break;
 		}
 
+		/* Skip whatever rdata we did not understand */
+		pos = rdend;
+
 		if (!record.name.empty() && !record.rdata.empty())
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: " + record.name + " -> " + record.rdata);
 
@@ -244,6 +266,17 @@ class Packet : public Query
 
 		for (unsigned i = 0; i < ancount; ++i)
 			this->answers.push_back(this->UnpackResourceRecord(input, len, packet_pos));
+
+		try
+		{
+			for (unsigned i = 0; i < nscount; ++i)
+				this->authorities.push_back(this->UnpackResourceRecord(input, len, packet_pos));
+		}
+		catch (Exception& ex)
+		{
+			/* The authority section is only used for negative caching, the answer is still good */
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, std::string(ex.GetReason()));
+		}
 	}
 
 	unsigned short Pack(unsigned char* output, unsigned short output_size)
@@ -396,15 +429,62 @@ class Packet : public Query
 
 class MyManager : public Manager, public Timer, public EventHandler
 {
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
+	struct CacheEntry
+	{
+		Query query;
+		/* Position in lru */
+		std::list<Question>::iterator lru;
+		/* Position in expiries */
+		std::multimap<time_t, Question>::iterator expiry;
+	};
+
+	typedef TR1NS::unordered_map<Question, CacheEntry, Question::hash> cache_map;
 	cache_map cache;
+	/* Cached questions, most recently used first */
+	std::list<Question> lru;
+	/* Cached questions by the time they expire */
+	std::multimap<time_t, Question> expiries;
+	/* Maximum number of cached answers */
+	size_t cachesize;
+
+	/* A query which has been sent and not answered yet */
+	struct Pending
+	{
+		/* The question as sent, PTR names are already reversed */
+		Question question;
+		/* Requests for the same question waiting on this query besides requests[id] */
+		std::deque<DNS::Request*> waiting;
+	};
+
+	typedef std::map<unsigned short, Pending> pending_map;
+	pending_map pending;
+	/* Request id of the query for each question in pending */
+	typedef TR1NS::unordered_map<Question, unsigned short, Question::hash> inflight_map;
+	inflight_map inflight;
 
 	irc::sockets::sockaddrs myserver;
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	/** Exports the number of cached answers */
+	class CacheGauge : public MetricGauge
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		const cache_map& cache;
+
+	 public:
+		CacheGauge(const cache_map& c)
+			: MetricGauge("inspircd_dns_cache_entries", "Answers in the DNS cache"), cache(c) { }
+
+		int64_t Get() const CXX11_OVERRIDE { return cache.size(); }
+	};
+	CacheGauge entries;
+
+	/** Longest time a negative answer is cached for, whatever the SOA says (RFC 2308 section 5) */
+	static const unsigned int MAX_NEGATIVE_TTL = 10800;
+
+	void RemoveCache(cache_map::iterator it)
+	{
+		this->lru.erase(it->second.lru);
+		this->expiries.erase(it->second.expiry);
+		this->cache.erase(it);
 	}
 
 	/** Check the DNS cache to see if request can be handled by a cached result
@@ -416,55 +496,143 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 		cache_map::iterator it = this->cache.find(question);
 		if (it == this->cache.end())
+		{
+			this->misses.Inc();
 			return false;
+		}
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		if (it->second.expiry->first < ServerInstance->Time())
 		{
-			this->cache.erase(it);
+			this->RemoveCache(it);
+			this->misses.Inc();
 			return false;
 		}
 
 		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached result for " + question.name);
+		this->hits.Inc();
+		this->lru.splice(this->lru.begin(), this->lru, it->second.lru);
+
+		Query& record = it->second.query;
 		record.cached = true;
-		req->OnLookupComplete(&record);
+		if (record.error == ERROR_NONE)
+			req->OnLookupComplete(&record);
+		else
+			req->OnError(&record);
 		return true;
 	}
 
 	/** Add a record to the dns cache
 	 * @param r The record
+	 * @param ttl How long to keep it for
 	 */
-	void AddCache(Query& r)
+	void AddCache(Query& r, unsigned int ttl)
+	{
+		if (r.questions.empty() || !this->cachesize)
+			return;
+
+		const Question& question = r.questions[0];
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added cache for " + question.name + " ttl: " + ConvToStr(ttl));
+
+		cache_map::iterator it = this->cache.find(question);
+		if (it != this->cache.end())
+			this->RemoveCache(it);
+
+		while (this->cache.size() >= this->cachesize)
+			this->RemoveCache(this->cache.find(this->lru.back()));
+
+		CacheEntry& entry = this->cache[question];
+		entry.query = r;
+		this->lru.push_front(question);
+		entry.lru = this->lru.begin();
+		entry.expiry = this->expiries.insert(std::make_pair(ServerInstance->Time() + static_cast<time_t>(ttl), question));
+	}
+
+	/** Cache an answer for as long as its shortest lived record */
+	void AddPositiveCache(Packet& p)
 	{
-		const ResourceRecord& rr = r.answers[0];
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.questions[0]] = r;
+		unsigned int ttl = p.answers[0].ttl;
+		for (unsigned int i = 1; i < p.answers.size(); ++i)
+			ttl = std::min(ttl, p.answers[i].ttl);
+		this->AddCache(p, ttl);
+	}
+
+	/** Cache a negative answer if it came with an SOA record saying for how long */
+	void AddNegativeCache(Packet& p)
+	{
+		for (std::vector<ResourceRecord>::const_iterator i = p.authorities.begin(); i != p.authorities.end(); ++i)
+		{
+			if (i->type == QUERY_SOA)
+			{
+				this->AddCache(p, i->ttl > MAX_NEGATIVE_TTL ? MAX_NEGATIVE_TTL : i->ttl);
+				return;
+			}
+		}
 	}
 
  public:
 	DNS::Request* requests[MAX_REQUEST_ID];
-
-	MyManager(Module* c) : Manager(c), Timer(3600, ServerInstance->Time(), true)
+	/* Cache statistics */
+	MetricCounter hits;
+	MetricCounter misses;
+	MetricCounter coalesced;
+
+	MyManager(Module* c) : Manager(c), Timer(60, ServerInstance->Time(), true), cachesize(0), entries(cache)
+		, hits("inspircd_dns_cache_hits", "Lookups answered from the DNS cache")
+		, misses("inspircd_dns_cache_misses", "Lookups not found in the DNS cache")
+		, coalesced("inspircd_dns_coalesced", "Lookups which waited on an identical outstanding query")
 	{
 		for (int i = 0; i < MAX_REQUEST_ID; ++i)
 			requests[i] = NULL;
 		ServerInstance->Timers->AddTimer(this);
+		ServerInstance->Metrics->Add(&entries);
+		ServerInstance->Metrics->Add(&hits);
+		ServerInstance->Metrics->Add(&misses);
+		ServerInstance->Metrics->Add(&coalesced);
 	}
 
 	~MyManager()
 	{
 		for (int i = 0; i < MAX_REQUEST_ID; ++i)
 		{
-			DNS::Request* request = requests[i];
-			if (!request)
-				continue;
+			/* Deleting a request lets the next one waiting on the same query take its place */
+			while (DNS::Request* request = requests[i])
+			{
+				Query rr(*request);
+				rr.error = ERROR_UNKNOWN;
+				request->OnError(&rr);
+
+				delete request;
+			}
+		}
+	}
 
-			Query rr(*request);
-			rr.error = ERROR_UNKNOWN;
-			request->OnError(&rr);
+	void SetCacheSize(size_t size)
+	{
+		this->cachesize = size;
+		while (this->cache.size() > this->cachesize)
+			this->RemoveCache(this->cache.find(this->lru.back()));
+	}
 
-			delete request;
+	size_t GetCacheCount() const
+	{
+		return this->cache.size();
+	}
+
+	size_t GetCacheSize() const
+	{
+		return this->cachesize;
+	}
+
+	/** Get every request, including those waiting on another request's query */
+	void GetRequests(std::vector<DNS::Request*>& list)
+	{
+		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+		{
+			if (this->requests[i])
+				list.push_back(this->requests[i]);
 		}
+		for (pending_map::const_iterator i = this->pending.begin(); i != this->pending.end(); ++i)
+			list.insert(list.end(), i->second.waiting.begin(), i->second.waiting.end());
 	}
 
 	void Process(DNS::Request* req)
@@ -519,13 +687,59 @@ class MyManager : public Manager, public Timer, public EventHandler
 			return;
 		}
 
+		/* If the same question is already on the wire, wait for its answer instead of asking again */
+		inflight_map::const_iterator it = this->inflight.find(p.questions[0]);
+		if (it != this->inflight.end())
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Waiting on outstanding query " + ConvToStr(it->second));
+			this->requests[req->id] = NULL;
+			req->id = it->second;
+			this->pending[req->id].waiting.push_back(req);
+			this->coalesced.Inc();
+			return;
+		}
+
 		if (ServerInstance->SE->SendTo(this, buffer, len, 0, &this->myserver.sa, this->myserver.sa_size()) != len)
 			throw Exception("DNS: Unable to send query");
+
+		this->pending[req->id].question = p.questions[0];
+		this->inflight[p.questions[0]] = req->id;
 	}
 
 	void RemoveRequest(DNS::Request* req)
 	{
+		pending_map::iterator it = this->pending.find(req->id);
+
+		if (this->requests[req->id] != req)
+		{
+			/* It was waiting on another request's query */
+			if (it != this->pending.end())
+			{
+				std::deque<DNS::Request*>& waiting = it->second.waiting;
+				waiting.erase(std::remove(waiting.begin(), waiting.end(), req), waiting.end());
+			}
+			return;
+		}
+
+		if (it == this->pending.end())
+		{
+			this->requests[req->id] = NULL;
+			return;
+		}
+
+		if (!it->second.waiting.empty())
+		{
+			/* Someone else still wants the answer, hand the query over to them */
+			this->requests[req->id] = it->second.waiting.front();
+			it->second.waiting.pop_front();
+			return;
+		}
+
 		this->requests[req->id] = NULL;
+		inflight_map::iterator question = this->inflight.find(it->second.question);
+		if (question != this->inflight.end() && question->second == req->id)
+			this->inflight.erase(question);
+		this->pending.erase(it);
 	}
 
 	std::string GetErrorStr(Error e)
@@ -605,7 +819,6 @@ class MyManager : public Manager, public Timer, public EventHandler
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received a nonstandard query");
 			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = ERROR_NONSTANDARD_QUERY;
-			request->OnError(&recv_packet);
 		}
 		else if (recv_packet.flags & QUERYFLAGS_RCODE)
 		{
@@ -639,41 +852,53 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = error;
-			request->OnError(&recv_packet);
+			if (error == ERROR_DOMAIN_NOT_FOUND)
+				this->AddNegativeCache(recv_packet);
 		}
 		else if (recv_packet.questions.empty() || recv_packet.answers.empty())
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: No resource records returned");
 			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = ERROR_NO_RECORDS;
-			request->OnError(&recv_packet);
+			this->AddNegativeCache(recv_packet);
 		}
 		else
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Lookup complete for " + request->name);
 			ServerInstance->stats->statsDnsGood++;
-			request->OnLookupComplete(&recv_packet);
-			this->AddCache(recv_packet);
+			this->AddPositiveCache(recv_packet);
 		}
 
 		ServerInstance->stats->statsDns++;
 
-		/* Request's destructor removes it from the request map */
-		delete request;
+		/* Requests made from here on for the same question need a new query */
+		pending_map::iterator it = this->pending.find(recv_packet.id);
+		if (it != this->pending.end())
+		{
+			inflight_map::iterator question = this->inflight.find(it->second.question);
+			if (question != this->inflight.end() && question->second == recv_packet.id)
+				this->inflight.erase(question);
+		}
+
+		/* Give the answer to every request which was waiting on it. Request's destructor
+		 * removes it from the request map and moves the next waiting request into its place.
+		 */
+		while ((request = this->requests[recv_packet.id]))
+		{
+			if (recv_packet.error == ERROR_NONE)
+				request->OnLookupComplete(&recv_packet);
+			else
+				request->OnError(&recv_packet);
+			delete request;
+		}
 	}
 
 	bool Tick(time_t now)
 	{
 		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: purging DNS cache");
 
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
-		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
-				this->cache.erase(it++);
-			else
-				++it;
-		}
+		while (!this->expiries.empty() && this->expiries.begin()->first < now)
+			this->RemoveCache(this->cache.find(this->expiries.begin()->second));
 		return true;
 	}
 
@@ -797,7 +1022,7 @@ class ModuleDNS : public Module
 
 	void init()
 	{
-		Implementation i[] = { I_OnRehash, I_OnUnloadModule };
+		Implementation i[] = { I_OnRehash, I_OnUnloadModule, I_OnStats };
 		ServerInstance->Modules->Attach(i, this, sizeof(i) / sizeof(Implementation));
 
 		ServerInstance->Modules->AddService(this->manager);
@@ -814,16 +1039,17 @@ class ModuleDNS : public Module
 
 		if (oldserver != DNSServer)
 			this->manager.Rehash(DNSServer);
+
+		this->manager.SetCacheSize(ServerInstance->Config->ConfValue("dns")->getInt("cachesize", 10000));
 	}
 
 	void OnUnloadModule(Module* mod)
 	{
-		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+		std::vector<DNS::Request*> reqs;
+		this->manager.GetRequests(reqs);
+		for (std::vector<DNS::Request*>::iterator i = reqs.begin(); i != reqs.end(); ++i)
 		{
-			DNS::Request* req = this->manager.requests[i];
-			if (!req)
-				continue;
-
+			DNS::Request* req = *i;
 			if (req->creator == mod)
 			{
 				Query rr(*req);
@@ -835,6 +1061,17 @@ class ModuleDNS : public Module
 		}
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results)
+	{
+		if (symbol == 'T')
+		{
+			results.push_back(ServerInstance->Config->ServerName + " 249 " + user->nick + " :dns cache entries " + ConvToStr(this->manager.GetCacheCount()) +
+				"/" + ConvToStr(this->manager.GetCacheSize()) + " hits " + ConvToStr(this->manager.hits.Get()) + " misses " + ConvToStr(this->manager.misses.Get()) +
+				" coalesced " + ConvToStr(this->manager.coalesced.Get()));
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
 	Version GetVersion()
 	{
 		return Version("DNS support", VF_CORE|VF_VENDOR);
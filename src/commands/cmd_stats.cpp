@@ -217,6 +217,12 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :Channels: "+ConvToStr(ServerInstance->chanlist->size()));
 			results.push_back(sn+" 249 "+user->nick+" :Commands: "+ConvToStr(ServerInstance->Parser->cmdlist.size()));
 
+			const TimerManager::TickCost& lastsecond = ServerInstance->Timers->GetLastSecondCost();
+			const TimerManager::TickCost& peak = ServerInstance->Timers->GetPeakCost();
+			results.push_back(sn+" 249 "+user->nick+" :Timers: "+ConvToStr(ServerInstance->Timers->GetTimerCount())+" scheduled");
+			results.push_back(sn+" 249 "+user->nick+" :Timer ticks (last second): "+ConvToStr(lastsecond.timers)+" in "+ConvToStr(lastsecond.usecs)+"us");
+			results.push_back(sn+" 249 "+user->nick+" :Timer ticks (peak):        "+ConvToStr(peak.timers)+" in "+ConvToStr(peak.usecs)+"us");
+
 			float kbitpersec_in, kbitpersec_out, kbitpersec_total;
 			char kbitpersec_in_s[30], kbitpersec_out_s[30], kbitpersec_total_s[30];
 
@@ -27,6 +27,10 @@
  */
 class CommandWho : public Command
 {
+	/** Checked for every user who matches, so resolved once */
+	Privilege usersauspex;
+	Privilege serversauspex;
+
 	bool CanView(Channel* chan, User* user);
 	bool opt_viewopersonly;
 	bool opt_showrealhost;
@@ -43,7 +47,7 @@ class CommandWho : public Command
  public:
 	/** Constructor for who.
 	 */
-	CommandWho ( Module* parent) : Command(parent,"WHO", 1) {
+	CommandWho ( Module* parent) : Command(parent,"WHO", 1), usersauspex("users/auspex"), serversauspex("servers/auspex") {
 		syntax = "<server>|<nickname>|<channel>|<realname>|<host>|0 [ohurmMiaplf]";
 	}
 	void SendWhoLine(User* user, const std::vector<std::string>& parms, const std::string &initial, Channel* ch, User* u, std::vector<std::string> &whoresults);
@@ -159,7 +163,7 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 			match = InspIRCd::Match(user->nick, matchtext);
 
 		/* Don't allow server name matches if HideWhoisServer is enabled, unless the command user has the priv */
-		if (!match && (ServerInstance->Config->HideWhoisServer.empty() || cuser->HasPrivPermission("users/auspex")))
+		if (!match && (ServerInstance->Config->HideWhoisServer.empty() || cuser->HasPrivPermission(usersauspex)))
 			match = InspIRCd::Match(user->server, matchtext);
 
 		return match;
@@ -177,7 +181,7 @@ bool CommandWho::CanView(Channel* chan, User* user)
 	if (chan->HasUser(user))
 		return true;
 	/* Opers see all */
-	if (user->HasPrivPermission("users/auspex"))
+	if (user->HasPrivPermission(usersauspex))
 		return true;
 	/* Cant see inside a +s or a +p channel unless we are a member (see above) */
 	else if (!chan->IsModeSet('s') && !chan->IsModeSet('p'))
@@ -193,7 +197,7 @@ void CommandWho::SendWhoLine(User* user, const std::vector<std::string>& parms,
 
 	std::string wholine = initial + (ch ? ch->name : "*") + " " + u->ident + " " +
 		(opt_showrealhost ? u->host : u->dhost) + " ";
-	if (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"))
+	if (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission(serversauspex))
 		wholine.append(ServerInstance->Config->HideWhoisServer);
 	else
 		wholine.append(u->server);
@@ -268,36 +272,36 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 					opt_viewopersonly = true;
 					break;
 				case 'h':
-					if (user->HasPrivPermission("users/auspex"))
+					if (user->HasPrivPermission(usersauspex))
 						opt_showrealhost = true;
 					break;
 				case 'r':
 					opt_realname = true;
 					break;
 				case 'm':
-					if (user->HasPrivPermission("users/auspex"))
+					if (user->HasPrivPermission(usersauspex))
 						opt_mode = true;
 					break;
 				case 'M':
-					if (user->HasPrivPermission("users/auspex"))
+					if (user->HasPrivPermission(usersauspex))
 						opt_metadata = true;
 					break;
 				case 'i':
 					opt_ident = true;
 					break;
 				case 'p':
-					if (user->HasPrivPermission("users/auspex"))
+					if (user->HasPrivPermission(usersauspex))
 						opt_port = true;
 					break;
 				case 'a':
 					opt_away = true;
 					break;
 				case 'l':
-					if (user->HasPrivPermission("users/auspex") || ServerInstance->Config->HideWhoisServer.empty())
+					if (user->HasPrivPermission(usersauspex) || ServerInstance->Config->HideWhoisServer.empty())
 						opt_local = true;
 					break;
 				case 'f':
-					if (user->HasPrivPermission("users/auspex") || ServerInstance->Config->HideWhoisServer.empty())
+					if (user->HasPrivPermission(usersauspex) || ServerInstance->Config->HideWhoisServer.empty())
 						opt_far = true;
 					break;
 				case 't':
@@ -330,7 +334,7 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 						continue;
 
 					/* If we're not inside the channel, hide +i users */
-					if (i->first->IsModeSet('i') && !inside && !user->HasPrivPermission("users/auspex"))
+					if (i->first->IsModeSet('i') && !inside && !user->HasPrivPermission(usersauspex))
 						continue;
 				}
 
@@ -352,7 +356,7 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 				{
 					if (!user->SharesChannelWith(oper))
 					{
-						if (usingwildcards && (!oper->IsModeSet('i')) && (!user->HasPrivPermission("users/auspex")))
+						if (usingwildcards && (!oper->IsModeSet('i')) && (!user->HasPrivPermission(usersauspex)))
 							continue;
 					}
 
@@ -368,7 +372,7 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 				{
 					if (!user->SharesChannelWith(i->second))
 					{
-						if (usingwildcards && (i->second->IsModeSet('i')) && (!user->HasPrivPermission("users/auspex")))
+						if (usingwildcards && (i->second->IsModeSet('i')) && (!user->HasPrivPermission(usersauspex)))
 							continue;
 					}
 
@@ -23,8 +23,17 @@
 #include "inspircd.h"
 #include "commands/cmd_whowas.h"
 
+/* Entries are padded so that the next header is suitably aligned */
+static const size_t WHOWAS_ALIGN = sizeof(time_t);
+
+static inline unsigned short ClampLength(size_t len)
+{
+	return len > USHRT_MAX ? USHRT_MAX : len;
+}
+
 CommandWhowas::CommandWhowas( Module* parent)
-	: Command(parent, "WHOWAS", 1), WhoWasGroupSize(0), WhoWasMaxGroups(0), WhoWasMaxKeep(0)
+	: Command(parent, "WHOWAS", 1), buffer(NULL), buffersize(0), head(0), tail(0), entries(0)
+	, WhoWasGroupSize(0), WhoWasMaxSize(0), WhoWasMaxKeep(0)
 {
 	syntax = "<nick>{,<nick>}";
 	Penalty = 2;
@@ -33,13 +42,13 @@ CommandWhowas::CommandWhowas( Module* parent)
 CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, User* user)
 {
 	/* if whowas disabled in config */
-	if (this->WhoWasGroupSize == 0 || this->WhoWasMaxGroups == 0)
+	if (this->WhoWasGroupSize == 0 || this->WhoWasMaxSize == 0)
 	{
 		user->WriteNumeric(421, "%s %s :This command has been disabled.",user->nick.c_str(),name.c_str());
 		return CMD_FAILURE;
 	}
 
-	whowas_users::iterator i = whowas.find(assign(parameters[0]));
+	whowas_users::iterator i = whowas.find(parameters[0]);
 
 	if (i == whowas.end())
 	{
@@ -47,42 +56,41 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 		user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
 		return CMD_FAILURE;
 	}
-	else
+
+	/* The index links from the newest entry back, show them oldest first */
+	std::vector<const WhoWasEntry*> group;
+	size_t offset = i->second.newest;
+	for (unsigned int n = 0; n < i->second.count; ++n)
 	{
-		whowas_set* grp = i->second;
-		if (grp->size())
-		{
-			for (whowas_set::iterator ux = grp->begin(); ux != grp->end(); ux++)
-			{
-				WhoWasGroup* u = *ux;
-				time_t rawtime = u->signon;
-				tm *timeinfo;
-				char b[25];
+		group.push_back(At(offset));
+		offset = At(offset)->prev;
+	}
+
+	for (std::vector<const WhoWasEntry*>::reverse_iterator ux = group.rbegin(); ux != group.rend(); ++ux)
+	{
+		const WhoWasEntry* u = *ux;
+		time_t rawtime = u->signon;
+		tm *timeinfo;
+		char b[25];
 
-				timeinfo = localtime(&rawtime);
+		timeinfo = localtime(&rawtime);
 
-				strncpy(b,asctime(timeinfo),24);
-				b[24] = 0;
+		strncpy(b,asctime(timeinfo),24);
+		b[24] = 0;
 
-				user->WriteNumeric(314, "%s %s %s %s * :%s",user->nick.c_str(),parameters[0].c_str(),
-					u->ident.c_str(),u->dhost.c_str(),u->gecos.c_str());
+		const std::string ident(u->ident(), u->identlen);
+		const std::string gecos(u->gecos(), u->gecoslen);
+		user->WriteNumeric(314, "%s %s %s %s * :%s",user->nick.c_str(),parameters[0].c_str(),
+			ident.c_str(),u->dhost->c_str(),gecos.c_str());
 
-				if (user->HasPrivPermission("users/auspex"))
-					user->WriteNumeric(379, "%s %s :was connecting from *@%s",
-						user->nick.c_str(), parameters[0].c_str(), u->host.c_str());
+		if (user->HasPrivPermission("users/auspex"))
+			user->WriteNumeric(379, "%s %s :was connecting from *@%s",
+				user->nick.c_str(), parameters[0].c_str(), u->host->c_str());
 
-				if (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"))
-					user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), ServerInstance->Config->HideWhoisServer.c_str(), b);
-				else
-					user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), u->server.c_str(), b);
-			}
-		}
+		if (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"))
+			user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), ServerInstance->Config->HideWhoisServer.c_str(), b);
 		else
-		{
-			user->WriteNumeric(406, "%s %s :There was no such nickname",user->nick.c_str(),parameters[0].c_str());
-			user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
-			return CMD_FAILURE;
-		}
+			user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), u->server->c_str(), b);
 	}
 
 	user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
@@ -91,208 +99,221 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 
 std::string CommandWhowas::GetStats()
 {
-	int whowas_size = 0;
-	int whowas_bytes = 0;
-	whowas_users_fifo::iterator iter;
-	for (iter = whowas_fifo.begin(); iter != whowas_fifo.end(); iter++)
-	{
-		whowas_set* n = (whowas_set*)whowas.find(iter->second)->second;
-		if (n->size())
-		{
-			whowas_size += n->size();
-			whowas_bytes += (sizeof(whowas_set) + ( sizeof(WhoWasGroup) * n->size() ) );
-		}
-	}
-	return "Whowas entries: " +ConvToStr(whowas_size)+" ("+ConvToStr(whowas_bytes)+" bytes)";
+	unsigned long whowas_size = 0;
+	for (whowas_users::const_iterator i = whowas.begin(); i != whowas.end(); ++i)
+		whowas_size += i->second.count;
+
+	size_t whowas_bytes = 0;
+	if (entries)
+		whowas_bytes = (head > tail) ? head - tail : buffersize - tail + head;
+
+	return "Whowas entries: " + ConvToStr(whowas_size) + " (" + ConvToStr(whowas_bytes) + " of " + ConvToStr(buffersize) + " bytes, " +
+		ConvToStr(strings.size()) + " shared hosts)";
 }
 
-void CommandWhowas::AddToWhoWas(User* user)
+const std::string* CommandWhowas::Intern(const std::string& str)
 {
-	/* if whowas disabled */
-	if (this->WhoWasGroupSize == 0 || this->WhoWasMaxGroups == 0)
+	whowas_strings::iterator i = strings.insert(std::make_pair(str, 0)).first;
+	i->second++;
+	return &i->first;
+}
+
+void CommandWhowas::Release(const std::string* str)
+{
+	whowas_strings::iterator i = strings.find(*str);
+	if (!--i->second)
+		strings.erase(i);
+}
+
+void CommandWhowas::WrapTail()
+{
+	/* Only the part of the buffer after an end marker can be reached from tail while head is behind it */
+	if ((entries) && (tail >= head) && ((buffersize - tail < sizeof(WhoWasEntry)) || (!At(tail)->size)))
+		tail = 0;
+}
+
+void CommandWhowas::PopOldest()
+{
+	WhoWasEntry* entry = At(tail);
+	if (!entry->dead)
 	{
-		return;
+		/* The oldest entry is always the last one reachable from its nick */
+		whowas_users::iterator i = whowas.find(std::string(entry->nick(), entry->nicklen));
+		if ((i != whowas.end()) && (!--i->second.count))
+			whowas.erase(i);
 	}
 
-	whowas_users::iterator iter = whowas.find(irc::string(user->nick.c_str()));
+	Release(entry->host);
+	Release(entry->dhost);
+	Release(entry->server);
+
+	tail += entry->size;
+	if (!--entries)
+		head = tail = 0;
+	else
+		WrapTail();
+}
 
-	if (iter == whowas.end())
+size_t CommandWhowas::Reserve(size_t size)
+{
+	for (;;)
 	{
-		whowas_set* n = new whowas_set;
-		WhoWasGroup *a = new WhoWasGroup(user);
-		n->push_back(a);
-		whowas[user->nick.c_str()] = n;
-		whowas_fifo.push_back(std::make_pair(ServerInstance->Time(),user->nick.c_str()));
+		if (!entries)
+		{
+			head = tail = 0;
+			return 0;
+		}
 
-		if ((int)(whowas.size()) > this->WhoWasMaxGroups)
+		if (head > tail)
 		{
-			whowas_users::iterator iter2 = whowas.find(whowas_fifo[0].second);
-			if (iter2 != whowas.end())
+			/* Used space is [tail, head), free space is after head and before tail */
+			if (buffersize - head >= size)
+				return head;
+
+			if (tail >= size)
 			{
-				whowas_set* n2 = (whowas_set*)iter2->second;
-
-				if (n2->size())
-				{
-					while (n2->begin() != n2->end())
-					{
-						WhoWasGroup *a2 = *(n2->begin());
-						delete a2;
-						n2->pop_front();
-					}
-				}
-
-				delete n2;
-				whowas.erase(iter2);
+				if (buffersize - head >= sizeof(WhoWasEntry))
+					At(head)->size = 0;
+				head = 0;
+				return 0;
 			}
-			whowas_fifo.pop_front();
 		}
-	}
-	else
-	{
-		whowas_set* group = (whowas_set*)iter->second;
-		WhoWasGroup *a = new WhoWasGroup(user);
-		group->push_back(a);
-
-		if ((int)(group->size()) > this->WhoWasGroupSize)
+		else if (tail - head >= size)
 		{
-			WhoWasGroup *a2 = (WhoWasGroup*)*(group->begin());
-			delete a2;
-			group->pop_front();
+			/* Wrapped, free space is [head, tail) */
+			return head;
 		}
+
+		PopOldest();
 	}
 }
 
-/* on rehash, refactor maps according to new conf values */
-void CommandWhowas::PruneWhoWas(time_t t)
+void CommandWhowas::TrimGroup(WhoWasNick& group)
 {
-	/* config values */
-	int groupsize = this->WhoWasGroupSize;
-	int maxgroups = this->WhoWasMaxGroups;
-	int maxkeep =   this->WhoWasMaxKeep;
-
-	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
-	whowas_users::iterator iter;
-	int fifosize;
-	while ((fifosize = (int)whowas_fifo.size()) > 0)
-	{
-		if (fifosize > maxgroups || whowas_fifo[0].first < t - maxkeep)
-		{
-			iter = whowas.find(whowas_fifo[0].second);
-
-			/* hopefully redundant integrity check, but added while debugging r6216 */
-			if (iter == whowas.end())
-			{
-				/* this should never happen, if it does maps are corrupt */
-				ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (1)");
-				return;
-			}
-
-			whowas_set* n = (whowas_set*)iter->second;
-
-			if (n->size())
-			{
-				while (n->begin() != n->end())
-				{
-					WhoWasGroup *a = *(n->begin());
-					delete a;
-					n->pop_front();
-				}
-			}
+	unsigned int groupsize = this->WhoWasGroupSize;
+	if (group.count <= groupsize)
+		return;
 
-			delete n;
-			whowas.erase(iter);
-			whowas_fifo.pop_front();
-		}
-		else
-			break;
-	}
+	size_t offset = group.newest;
+	for (unsigned int n = 1; n < groupsize; ++n)
+		offset = At(offset)->prev;
 
-	/* Then cut the whowas sets to new size (groupsize) */
-	fifosize = (int)whowas_fifo.size();
-	for (int i = 0; i < fifosize; i++)
+	/* The rest stay in the buffer until their turn comes to be evicted */
+	for (unsigned int n = groupsize; n < group.count; ++n)
 	{
-		iter = whowas.find(whowas_fifo[0].second);
-		/* hopefully redundant integrity check, but added while debugging r6216 */
-		if (iter == whowas.end())
-		{
-			/* this should never happen, if it does maps are corrupt */
-			ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (2)");
-			return;
-		}
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			int nickcount = n->size();
-			while (n->begin() != n->end() && nickcount > groupsize)
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->pop_front();
-				nickcount--;
-			}
-		}
+		offset = At(offset)->prev;
+		At(offset)->dead = true;
 	}
+	group.count = groupsize;
 }
 
-/* call maintain once an hour to remove expired nicks */
-void CommandWhowas::MaintainWhoWas(time_t t)
+void CommandWhowas::Link(size_t offset)
+{
+	WhoWasEntry* entry = At(offset);
+	WhoWasNick& group = whowas[std::string(entry->nick(), entry->nicklen)];
+	entry->prev = group.newest;
+	group.newest = offset;
+	group.count++;
+	TrimGroup(group);
+}
+
+void CommandWhowas::AddToWhoWas(User* user)
 {
-	for (whowas_users::iterator iter = whowas.begin(); iter != whowas.end(); iter++)
+	/* if whowas disabled */
+	if (this->WhoWasGroupSize == 0 || this->WhoWasMaxSize == 0)
 	{
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			while ((n->begin() != n->end()) && ((*n->begin())->signon < t - this->WhoWasMaxKeep))
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->erase(n->begin());
-			}
-		}
+		return;
 	}
+
+	unsigned short nicklen = ClampLength(user->nick.length());
+	unsigned short identlen = ClampLength(user->ident.length());
+	unsigned short gecoslen = ClampLength(user->fullname.length());
+
+	size_t size = sizeof(WhoWasEntry) + nicklen + identlen + gecoslen;
+	size = (size + WHOWAS_ALIGN - 1) & ~(WHOWAS_ALIGN - 1);
+	if (size > buffersize)
+		return;
+
+	size_t offset = Reserve(size);
+	WhoWasEntry* entry = At(offset);
+	entry->signon = user->signon;
+	entry->added = ServerInstance->Time();
+	entry->host = Intern(user->host);
+	entry->dhost = Intern(user->dhost);
+	entry->server = Intern(user->server);
+	entry->size = size;
+	entry->nicklen = nicklen;
+	entry->identlen = identlen;
+	entry->gecoslen = gecoslen;
+	entry->dead = false;
+
+	char* data = reinterpret_cast<char*>(entry + 1);
+	memcpy(data, user->nick.data(), nicklen);
+	memcpy(data + nicklen, user->ident.data(), identlen);
+	memcpy(data + nicklen + identlen, user->fullname.data(), gecoslen);
+
+	head = offset + size;
+	entries++;
+	Link(offset);
 }
 
-CommandWhowas::~CommandWhowas()
+/* on rehash, move the entries into a buffer of the new size and regroup them according to new conf values */
+void CommandWhowas::PruneWhoWas(time_t t)
 {
-	whowas_users::iterator iter;
-	int fifosize;
-	while ((fifosize = (int)whowas_fifo.size()) > 0)
+	char* oldbuffer = buffer;
+	size_t oldsize = buffersize;
+	size_t pos = tail;
+	size_t count = entries;
+
+	whowas.clear();
+	buffer = NULL;
+	buffersize = 0;
+	head = tail = entries = 0;
+
+	if (this->WhoWasGroupSize != 0 && this->WhoWasMaxSize != 0)
 	{
-		iter = whowas.find(whowas_fifo[0].second);
+		buffersize = this->WhoWasMaxSize;
+		buffer = new char[buffersize];
+	}
 
-		/* hopefully redundant integrity check, but added while debugging r6216 */
-		if (iter == whowas.end())
-		{
-			/* this should never happen, if it does maps are corrupt */
-			ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (3)");
-			return;
-		}
+	/* Copy oldest first so the newest entries survive if the buffer shrunk */
+	for (; count; --count)
+	{
+		if ((oldsize - pos < sizeof(WhoWasEntry)) || (!reinterpret_cast<WhoWasEntry*>(oldbuffer + pos)->size))
+			pos = 0;
 
-		whowas_set* n = (whowas_set*)iter->second;
+		WhoWasEntry* old = reinterpret_cast<WhoWasEntry*>(oldbuffer + pos);
+		pos += old->size;
 
-		if (n->size())
+		if ((!old->dead) && (old->added >= t - this->WhoWasMaxKeep) && (old->size <= buffersize))
 		{
-			while (n->begin() != n->end())
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->pop_front();
-			}
+			size_t offset = Reserve(old->size);
+			memcpy(buffer + offset, old, old->size);
+			head = offset + old->size;
+			entries++;
+			Link(offset);
+			continue;
 		}
 
-		delete n;
-		whowas.erase(iter);
-		whowas_fifo.pop_front();
+		Release(old->host);
+		Release(old->dhost);
+		Release(old->server);
 	}
+
+	delete[] oldbuffer;
 }
 
-WhoWasGroup::WhoWasGroup(User* user) : host(user->host), dhost(user->dhost), ident(user->ident),
-	server(user->server), gecos(user->fullname), signon(user->signon)
+/* call maintain once an hour to remove expired nicks */
+void CommandWhowas::MaintainWhoWas(time_t t)
 {
+	/* Entries are in the order they were added, so only the expired ones are looked at */
+	while ((entries) && (At(tail)->added < t - this->WhoWasMaxKeep))
+		PopOldest();
 }
 
-WhoWasGroup::~WhoWasGroup()
+CommandWhowas::~CommandWhowas()
 {
+	delete[] buffer;
 }
 
 class ModuleWhoWas : public Module
@@ -345,18 +366,19 @@ class ModuleWhoWas : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("whowas");
 		int NewGroupSize = tag->getInt("groupsize");
-		int NewMaxGroups = tag->getInt("maxgroups");
+		// Old configs limit the number of nicks, assume an average entry is 128 bytes
+		int NewMaxSize = tag->getInt("maxsize", tag->getInt("maxgroups") * 128);
 		int NewMaxKeep = InspIRCd::Duration(tag->getString("maxkeep"));
 
 		RangeCheck(NewGroupSize, 0, 10000, 10, "<whowas:groupsize>");
-		RangeCheck(NewMaxGroups, 0, 1000000, 10240, "<whowas:maxgroups>");
+		RangeCheck(NewMaxSize, 0, 1073741824, 1048576, "<whowas:maxsize>");
 		RangeCheck(NewMaxKeep, 3600, INT_MAX, 3600, "<whowas:maxkeep>");
 
-		if ((NewGroupSize == cmd.WhoWasGroupSize) && (NewMaxGroups == cmd.WhoWasMaxGroups) && (NewMaxKeep == cmd.WhoWasMaxKeep))
+		if ((NewGroupSize == cmd.WhoWasGroupSize) && (NewMaxSize == cmd.WhoWasMaxSize) && (NewMaxKeep == cmd.WhoWasMaxKeep))
 			return;
 
 		cmd.WhoWasGroupSize = NewGroupSize;
-		cmd.WhoWasMaxGroups = NewMaxGroups;
+		cmd.WhoWasMaxSize = NewMaxSize;
 		cmd.WhoWasMaxKeep = NewMaxKeep;
 		cmd.PruneWhoWas(ServerInstance->Time());
 	}
@@ -152,12 +152,100 @@ unsigned const char rfc_case_sensitive_map[256] = {
 	250, 251, 252, 253, 254, 255,                     // 250-255
 };
 
+/** Build a 64 bit integer from two 32 bit halves, ISO C++ 1998 has no long long constants */
+#define U64(hi, lo) ((((uint64_t)(hi)) << 32) | (uint64_t)(lo))
+
+/** The random key of the hash functions, chosen on startup so the hash values
+ * of names can not be predicted and flooding a table with colliding names is
+ * not possible.
+ */
+static struct HashKey
+{
+	uint64_t k0;
+	uint64_t k1;
+
+	HashKey()
+	{
+		unsigned char key[16];
+		size_t got = 0;
+#ifndef _WIN32
+		FILE* f = fopen("/dev/urandom", "rb");
+		if (f)
+		{
+			got = fread(key, 1, sizeof(key), f);
+			fclose(f);
+		}
+#endif
+		if (got != sizeof(key))
+		{
+			// No urandom, mix in what little entropy there is. The tables
+			// still work with a weak key, they are just easier to attack.
+			srand((unsigned int)(time(NULL) ^ (size_t)this));
+			for (size_t i = 0; i < sizeof(key); i++)
+				key[i] = rand();
+		}
+
+		k0 = k1 = 0;
+		for (size_t i = 0; i < 8; i++)
+		{
+			k0 |= (uint64_t)key[i] << (8 * i);
+			k1 |= (uint64_t)key[i + 8] << (8 * i);
+		}
+	}
+} hashkey;
+
+static inline uint64_t rotl(uint64_t x, unsigned int b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+static inline void SipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+{
+	v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+	v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+	v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+	v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+/** SipHash-1-3 of a string as if it was folded to lower case using national_case_insensitive_map.
+ * The string is folded while it is being hashed so no copy is made.
+ */
+static size_t SipHashInsensitive(const unsigned char* in, size_t len)
+{
+	const unsigned char* const map = national_case_insensitive_map;
+	uint64_t v0 = hashkey.k0 ^ U64(0x736f6d65, 0x70736575);
+	uint64_t v1 = hashkey.k1 ^ U64(0x646f7261, 0x6e646f6d);
+	uint64_t v2 = hashkey.k0 ^ U64(0x6c796765, 0x6e657261);
+	uint64_t v3 = hashkey.k1 ^ U64(0x74656462, 0x79746573);
+
+	for (const unsigned char* end = in + (len & ~7); in != end; in += 8)
+	{
+		uint64_t m = (uint64_t)map[in[0]] | ((uint64_t)map[in[1]] << 8) | ((uint64_t)map[in[2]] << 16) |
+			((uint64_t)map[in[3]] << 24) | ((uint64_t)map[in[4]] << 32) | ((uint64_t)map[in[5]] << 40) |
+			((uint64_t)map[in[6]] << 48) | ((uint64_t)map[in[7]] << 56);
+		v3 ^= m;
+		SipRound(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	uint64_t b = (uint64_t)len << 56;
+	for (size_t i = 0; i < (len & 7); i++)
+		b |= (uint64_t)map[in[i]] << (8 * i);
+
+	v3 ^= b;
+	SipRound(v0, v1, v2, v3);
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SipRound(v0, v1, v2, v3);
+	SipRound(v0, v1, v2, v3);
+	SipRound(v0, v1, v2, v3);
+	return (size_t)(v0 ^ v1 ^ v2 ^ v3);
+}
+
 size_t CoreExport irc::hash::operator()(const irc::string &s) const
 {
-	register size_t t = 0;
-	for (irc::string::const_iterator x = s.begin(); x != s.end(); ++x) /* ++x not x++, as its faster */
-		t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
-	return t;
+	return SipHashInsensitive((const unsigned char*)s.data(), s.length());
 }
 
 bool irc::StrHashComp::operator()(const std::string& s1, const std::string& s2) const
@@ -173,15 +261,10 @@ bool irc::StrHashComp::operator()(const std::string& s1, const std::string& s2)
 size_t irc::insensitive::operator()(const std::string &s) const
 {
 	/* XXX: NO DATA COPIES! :)
-	 * The hash function here is practically
-	 * a copy of the one in STL's hash_fun.h,
-	 * only with *x replaced with national_case_insensitive_map[*x].
-	 * This avoids a copy to use hash<const char*>
+	 * The string is folded to lower case with national_case_insensitive_map
+	 * while it is being hashed.
 	 */
-	register size_t t = 0;
-	for (std::string::const_iterator x = s.begin(); x != s.end(); ++x) /* ++x not x++, as its faster */
-		t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
-	return t;
+	return SipHashInsensitive((const unsigned char*)s.data(), s.length());
 }
 
 /******************************************************
@@ -122,6 +122,7 @@ void InspIRCd::Cleanup()
 	if (FakeClient)
 		FakeClient->cull();
 	DeleteZero(this->FakeClient);
+	DeleteZero(this->IOThreads);
 	DeleteZero(this->Users);
 	DeleteZero(this->Modes);
 	DeleteZero(this->XLines);
@@ -135,6 +136,7 @@ void InspIRCd::Cleanup()
 	DeleteZero(this->PI);
 	DeleteZero(this->Threads);
 	DeleteZero(this->Timers);
+	DeleteZero(this->Metrics);
 	DeleteZero(this->SE);
 	Logs->CloseLogs();
 	DeleteZero(this->Logs);
@@ -250,6 +252,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	// Initialize so that if we exit before proper initialization they're not deleted
 	this->Logs = 0;
 	this->Threads = 0;
+	this->IOThreads = 0;
 	this->PI = 0;
 	this->Users = 0;
 	this->chanlist = 0;
@@ -258,6 +261,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	this->BanCache = 0;
 	this->Modules = 0;
 	this->stats = 0;
+	this->Metrics = 0;
 	this->Timers = 0;
 	this->Parser = 0;
 	this->XLines = 0;
@@ -274,6 +278,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	SE = CreateSocketEngine();
 
 	this->Threads = new ThreadEngine;
+	this->IOThreads = new IOThreadManager;
 
 	/* Default implementation does nothing */
 	this->PI = new ProtocolInterface;
@@ -289,6 +294,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	this->Modules = new ModuleManager();
 	dynamic_reference_base::reset_all();
 	this->stats = new serverstats();
+	this->Metrics = new MetricManager;
 	this->Timers = new TimerManager;
 	this->Parser = new CommandParser;
 	this->XLines = new XLineManager;
@@ -542,6 +548,8 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	QueryPerformanceFrequency(&stats->QPFrequency);
 #endif
 
+	this->IOThreads->Start(Config->IOThreads);
+
 	Logs->Log("STARTUP", LOG_DEFAULT, "Startup complete as '%s'[%s], %d max open sockets", Config->ServerName.c_str(),Config->GetSID().c_str(), SE->GetMaxFds());
 
 #ifndef _WIN32
@@ -698,15 +706,14 @@ void InspIRCd::Run()
 
 			OLDTIME = TIME.tv_sec;
 
+			XLines->ExpireLines();
+
 			if ((TIME.tv_sec % 3600) == 0)
 			{
 				Users->GarbageCollect();
 				FOREACH_MOD(I_OnGarbageCollect, OnGarbageCollect());
 			}
 
-			Timers->TickTimers(TIME.tv_sec);
-			Users->DoBackgroundUserStuff();
-
 			if ((TIME.tv_sec % 5) == 0)
 			{
 				FOREACH_MOD(I_OnBackgroundTimer,OnBackgroundTimer(TIME.tv_sec));
@@ -714,6 +721,9 @@ void InspIRCd::Run()
 			}
 		}
 
+		/* Timers may have millisecond resolution, check them on every iteration */
+		Timers->TickTimers(TIME.tv_sec);
+
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
 		 * descriptors in its list... dns, modules, users,
@@ -722,7 +732,8 @@ void InspIRCd::Run()
 		 * dispatched to their handlers.
 		 */
 		this->SE->DispatchTrialWrites();
-		this->SE->DispatchEvents();
+		Metrics->LoopEvents.Observe(this->SE->DispatchEvents());
+		Metrics->LoopIterations.Inc();
 
 		/* if any users were quit, take them out */
 		GlobalCulls.Apply();
@@ -117,10 +117,62 @@ BufferedSocketError BufferedSocket::BeginConnect(const irc::sockets::sockaddrs&
 	return I_ERR_NONE;
 }
 
+void StreamSocket::AddIOHook(IOHook* hook)
+{
+	// IOHooks are not thread safe, make sure the main thread does all reads
+	DetachIOThread();
+	iohook = hook;
+}
+
+void StreamSocket::DetachIOThread()
+{
+	if (!iothreadid)
+		return;
+
+	std::string leftover;
+	ServerInstance->IOThreads->Detach(this, leftover);
+	if (!leftover.empty())
+		recvq.append(leftover.data(), leftover.length());
+
+	// There may be more data waiting in the kernel
+	ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+}
+
+void StreamSocket::OnThreadedRead(const std::string& data)
+{
+	if (!error.empty())
+		return;
+
+	recvq.append(data.data(), data.length());
+	try
+	{
+		OnDataReady();
+	}
+	catch (CoreException& ex)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Caught exception in socket processing on FD %d - '%s'",
+			fd, ex.GetReason());
+		SetError(ex.GetReason());
+	}
+
+	if (!error.empty())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Error on FD %d - '%s'", fd, error.c_str());
+		OnError(I_ERR_OTHER);
+	}
+}
+
 void StreamSocket::Close()
 {
 	if (this->fd > -1)
 	{
+		// Make sure no I/O thread touches the fd after it is closed
+		if (iothreadid)
+		{
+			std::string leftover;
+			ServerInstance->IOThreads->Detach(this, leftover);
+		}
+
 		// final chance, dump as much of the sendq as we can
 		DoWrite();
 		if (GetIOHook())
@@ -143,6 +195,12 @@ void StreamSocket::Close()
 	}
 }
 
+StreamSocket::~StreamSocket()
+{
+	// Whatever was never sent is gone now
+	ServerInstance->Metrics->SendQ.Add(-(int64_t)sendq_len);
+}
+
 CullResult StreamSocket::cull()
 {
 	Close();
@@ -151,12 +209,11 @@ CullResult StreamSocket::cull()
 
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
-	if (i == std::string::npos)
+	const char* start;
+	size_t len;
+	if (!recvq.GetNextLine(start, len, delim))
 		return false;
-	line = recvq.substr(0, i);
-	// TODO is this the most efficient way to split?
-	recvq = recvq.substr(i + 1);
+	line.assign(start, len);
 	return true;
 }
 
@@ -167,7 +224,7 @@ void StreamSocket::DoRead()
 		int rv = -1;
 		try
 		{
-			rv = GetIOHook()->OnStreamSocketRead(this, recvq);
+			rv = GetIOHook()->OnStreamSocketRead(this, recvq.GetAppendBuffer());
 		}
 		catch (CoreException& modexcept)
 		{
@@ -220,6 +277,22 @@ void StreamSocket::DoRead()
 /* Don't try to prepare huge blobs of data to send to a blocked socket */
 static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
 
+namespace
+{
+	/** Passes the change of the sendq length during DoWrite() on to the sendq
+	 * total of all sockets, whichever way DoWrite() returns
+	 */
+	class SendQAccounting
+	{
+		const size_t& len;
+		const size_t before;
+
+	 public:
+		SendQAccounting(const size_t& l) : len(l), before(l) { }
+		~SendQAccounting() { ServerInstance->Metrics->SendQ.Add((int64_t)len - (int64_t)before); }
+	};
+}
+
 void StreamSocket::DoWrite()
 {
 	if (sendq.empty())
@@ -230,6 +303,8 @@ void StreamSocket::DoWrite()
 		return;
 	}
 
+	SendQAccounting accounting(sendq_len);
+
 #ifndef DISABLE_WRITEV
 	if (GetIOHook())
 #endif
@@ -239,52 +314,12 @@ void StreamSocket::DoWrite()
 		{
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
-				{
-					// Avoid multiple repeated SSL encryption invocations
-					// This adds a single copy of the queue, but avoids
-					// much more overhead in terms of system calls invoked
-					// by the IOHook.
-					//
-					// The length limit of 1024 is to prevent merging strings
-					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(sendq_len);
-					for(unsigned int i=0; i < sendq.size(); i++)
-						tmp.append(sendq[i]);
-					sendq.clear();
-					sendq.push_back(tmp);
-				}
-				std::string& front = sendq.front();
-				int itemlen = front.length();
-				if (GetIOHook())
-				{
-					rv = GetIOHook()->OnStreamSocketWrite(this, front);
-					if (rv > 0)
-					{
-						// consumed the entire string, and is ready for more
-						sendq_len -= itemlen;
-						sendq.pop_front();
-					}
-					else if (rv == 0)
-					{
-						// socket has blocked. Stop trying to send data.
-						// IOHook has requested unblock notification from the socketengine
-
-						// Since it is possible that a partial write took place, adjust sendq_len
-						sendq_len = sendq_len - itemlen + front.length();
-						return;
-					}
-					else
-					{
-						SetError("Write Error"); // will not overwrite a better error message
-						return;
-					}
-				}
 #ifdef DISABLE_WRITEV
-				else
+				if (!GetIOHook())
 				{
-					rv = ServerInstance->SE->Send(this, front.data(), itemlen, 0);
+					const std::string& front = sendq.front()->str();
+					int itemlen = front.length() - sendq_offset;
+					rv = ServerInstance->SE->Send(this, front.data() + sendq_offset, itemlen, 0);
 					if (rv == 0)
 					{
 						SetError("Connection closed");
@@ -301,19 +336,70 @@ void StreamSocket::DoWrite()
 					else if (rv < itemlen)
 					{
 						ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(rv);
+						sendq_offset += rv;
 						sendq_len -= rv;
 						return;
 					}
 					else
 					{
 						sendq_len -= itemlen;
+						sendq_offset = 0;
 						sendq.pop_front();
 						if (sendq.empty())
 							ServerInstance->SE->ChangeEventMask(this, FD_WANT_EDGE_WRITE);
 					}
+					continue;
 				}
 #endif
+				// IOHooks modify the data they are given, so take a private copy
+				// of what is left of the queue instead of touching shared buffers
+				std::string front;
+				if (sendq.size() > 1 && sendq[0]->length() - sendq_offset < 1024)
+				{
+					// Avoid multiple repeated SSL encryption invocations
+					// This adds a single copy of the queue, but avoids
+					// much more overhead in terms of system calls invoked
+					// by the IOHook.
+					//
+					// The length limit of 1024 is to prevent merging strings
+					// more than once when writes begin to block.
+					front.reserve(sendq_len);
+					front.append(sendq[0]->str(), sendq_offset, std::string::npos);
+					for (unsigned int i = 1; i < sendq.size(); i++)
+						front.append(sendq[i]->str());
+					sendq.clear();
+				}
+				else
+				{
+					front.assign(sendq.front()->str(), sendq_offset, std::string::npos);
+					sendq.pop_front();
+				}
+				sendq_offset = 0;
+
+				int itemlen = front.length();
+				rv = GetIOHook()->OnStreamSocketWrite(this, front);
+				if (rv > 0)
+				{
+					// consumed the entire string, and is ready for more
+					sendq_len -= itemlen;
+				}
+				else if (rv == 0)
+				{
+					// socket has blocked. Stop trying to send data.
+					// IOHook has requested unblock notification from the socketengine
+
+					// Since it is possible that a partial write took place, adjust sendq_len
+					// and put what is left back at the front of the queue
+					sendq_len = sendq_len - itemlen + front.length();
+					if (!front.empty())
+						sendq.push_front(new SendBuffer(front));
+					return;
+				}
+				else
+				{
+					SetError("Write Error"); // will not overwrite a better error message
+					return;
+				}
 			}
 		}
 		catch (CoreException& modexcept)
@@ -332,36 +418,48 @@ void StreamSocket::DoWrite()
 		int eventChange = FD_WANT_EDGE_WRITE;
 		while (error.empty() && sendq_len && eventChange == FD_WANT_EDGE_WRITE)
 		{
-			// Prepare a writev() call to write all buffers efficiently
+			// Prepare a sendmsg() call to write all buffers efficiently
 			int bufcount = sendq.size();
+			int flags = 0;
 
 			// cap the number of buffers at MYIOV_MAX
 			if (bufcount > MYIOV_MAX)
 			{
 				bufcount = MYIOV_MAX;
+#ifdef MSG_MORE
+				// the rest follows right away, don't send a short segment in between
+				flags = MSG_MORE;
+#endif
 			}
 
+			// The iovecs point directly into the (possibly shared) send buffers
 			int rv_max = 0;
-			iovec* iovecs = new iovec[bufcount];
+			iovec iovecs[MYIOV_MAX];
 			for(int i=0; i < bufcount; i++)
 			{
-				iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
-				iovecs[i].iov_len = sendq[i].length();
-				rv_max += sendq[i].length();
+				const std::string& buf = sendq[i]->str();
+				size_t skip = (i == 0 ? sendq_offset : 0);
+				iovecs[i].iov_base = const_cast<char*>(buf.data() + skip);
+				iovecs[i].iov_len = buf.length() - skip;
+				rv_max += iovecs[i].iov_len;
 			}
-			int rv = writev(fd, iovecs, bufcount);
-			delete[] iovecs;
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iovecs;
+			msg.msg_iovlen = bufcount;
+			int rv = sendmsg(fd, &msg, flags);
 
 			if (rv == (int)sendq_len)
 			{
 				// it's our lucky day, everything got written out. Fast cleanup.
 				// This won't ever happen if the number of buffers got capped.
 				sendq_len = 0;
+				sendq_offset = 0;
 				sendq.clear();
 			}
 			else if (rv > 0)
 			{
-				// Partial write. Clean out strings from the sendq
+				// Partial write. Clean out buffers from the sendq
 				if (rv < rv_max)
 				{
 					// it's going to block now
@@ -370,17 +468,18 @@ void StreamSocket::DoWrite()
 				sendq_len -= rv;
 				while (rv > 0 && !sendq.empty())
 				{
-					std::string& front = sendq.front();
-					if (front.length() <= (size_t)rv)
+					size_t left = sendq.front()->length() - sendq_offset;
+					if (left <= (size_t)rv)
 					{
-						// this string got fully written out
-						rv -= front.length();
+						// this buffer got fully written out
+						rv -= left;
+						sendq_offset = 0;
 						sendq.pop_front();
 					}
 					else
 					{
-						// stopped in the middle of this string
-						front = front.substr(rv);
+						// stopped in the middle of this buffer
+						sendq_offset += rv;
 						rv = 0;
 					}
 				}
@@ -425,9 +524,22 @@ void StreamSocket::WriteData(const std::string &data)
 		return;
 	}
 
+	WriteData(new SendBuffer(data));
+}
+
+void StreamSocket::WriteData(const reference<SendBuffer>& data)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
+			data->str().c_str());
+		return;
+	}
+
 	/* Append the data to the back of the queue ready for writing */
 	sendq.push_back(data);
-	sendq_len += data.length();
+	sendq_len += data->length();
+	ServerInstance->Metrics->SendQ.Add(data->length());
 
 	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
@@ -0,0 +1,377 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "threadengine.h"
+#include "iothread.h"
+
+#ifdef HAS_EPOLL
+
+#include <sys/epoll.h>
+
+/** Data read by an I/O thread, waiting to be processed by the main thread */
+struct IOThreadMessage
+{
+	/** Attachment id of the socket the data was read from, 0 if the message was taken back by Detach() */
+	unsigned long id;
+	/** One or more complete lines, or a single chunk which is as long as the read buffer */
+	std::string data;
+	/** True if reading failed after this data; the thread has forgotten the socket */
+	bool failed;
+	/** errno value of the failure, 0 if the connection was closed by the remote end */
+	int error;
+
+	IOThreadMessage(unsigned long sockid) : id(sockid), failed(false), error(0) { }
+};
+
+class IOThread : public SocketThread
+{
+	/** A socket read by this thread */
+	struct Connection
+	{
+		/** Attachment id of the socket */
+		unsigned long id;
+		/** Data read after the last complete line */
+		std::string partial;
+	};
+	typedef std::map<int, Connection> ConnMap;
+
+	/** epoll instance of this thread, only the sockets of this thread are in it */
+	const int epfd;
+
+	/** Protects conns and the epoll registrations. Always taken before the queue lock. */
+	Mutex connlock;
+
+	/** Sockets read by this thread, keyed by file descriptor */
+	ConnMap conns;
+
+	/** Messages waiting for the main thread, protected by the queue lock */
+	std::vector<IOThreadMessage> outgoing;
+
+	/** Batch currently being delivered by OnNotify(), only used from the main thread */
+	std::vector<IOThreadMessage> delivering;
+
+	/** Index in delivering of the message that is being delivered */
+	size_t current;
+
+	/** Size of the buffer used for reading, same as the main thread's read buffer */
+	const size_t bufsize;
+
+	/** Read from a socket and queue what was read
+	 * @param fd File descriptor of the socket, must be in conns
+	 * @param batch Vector to append the new message to
+	 * @return True if the socket is still usable, false if it was removed from this thread
+	 */
+	bool ReadFrom(int fd, char* buffer, std::vector<IOThreadMessage>& batch)
+	{
+		ConnMap::iterator it = conns.find(fd);
+		if (it == conns.end())
+			return true;
+
+		Connection& conn = it->second;
+		ssize_t n = recv(fd, buffer, bufsize, 0);
+		if (n > 0)
+		{
+			conn.partial.append(buffer, n);
+
+			// Pass on complete lines only, unless the data is as long as the buffer
+			// in which case it's up to the main thread to decide what to do with it
+			std::string::size_type last = conn.partial.rfind('\n');
+			if (last == std::string::npos && conn.partial.length() < bufsize)
+				return true;
+
+			batch.push_back(IOThreadMessage(conn.id));
+			if (last == std::string::npos || last == conn.partial.length() - 1)
+			{
+				batch.back().data.swap(conn.partial);
+			}
+			else
+			{
+				batch.back().data.assign(conn.partial, 0, last + 1);
+				conn.partial.erase(0, last + 1);
+			}
+			return true;
+		}
+
+		if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+			return true;
+
+		batch.push_back(IOThreadMessage(conn.id));
+		IOThreadMessage& msg = batch.back();
+		msg.data.swap(conn.partial);
+		msg.failed = true;
+		msg.error = (n < 0 ? errno : 0);
+
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		conns.erase(it);
+		return false;
+	}
+
+ public:
+	IOThread()
+		: epfd(epoll_create(128))
+		, current(0)
+		, bufsize(ServerInstance->Config->NetBufferSize)
+	{
+		if (epfd < 0)
+			throw CoreException("Could not create epoll instance for I/O thread: " + std::string(strerror(errno)));
+	}
+
+	~IOThread()
+	{
+		close(epfd);
+	}
+
+	void Run()
+	{
+		std::vector<char> buffer(bufsize);
+		std::vector<struct epoll_event> events(128);
+		std::vector<IOThreadMessage> batch;
+
+		while (!this->GetExitFlag())
+		{
+			int count = epoll_wait(epfd, &events[0], events.size(), 1000);
+			if (count <= 0)
+				continue;
+
+			connlock.Lock();
+			for (int i = 0; i < count; i++)
+				ReadFrom(events[i].data.fd, &buffer[0], batch);
+
+			if (!batch.empty())
+			{
+				// Queue while still holding connlock so Detach() sees either the
+				// partial data or the queued message, never neither of them
+				this->LockQueue();
+				bool notify = outgoing.empty();
+				if (notify)
+					outgoing.swap(batch);
+				else
+					outgoing.insert(outgoing.end(), batch.begin(), batch.end());
+				this->UnlockQueue();
+				batch.clear();
+
+				if (notify)
+					this->NotifyParent();
+			}
+			connlock.Unlock();
+		}
+	}
+
+	/** Start reading from a socket
+	 * @return True on success, false if the socket could not be added to epoll
+	 */
+	bool Add(int fd, unsigned long id)
+	{
+		connlock.Lock();
+		Connection& conn = conns[fd];
+		conn.id = id;
+		conn.partial.clear();
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		bool ret = (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+		if (!ret)
+			conns.erase(fd);
+		connlock.Unlock();
+		return ret;
+	}
+
+	/** Stop reading from a socket and collect everything read from it
+	 * which has not yet been delivered to the main thread, in order.
+	 */
+	void Remove(int fd, unsigned long id, std::string& leftover)
+	{
+		// Undelivered messages of the batch that is being delivered right now
+		for (size_t i = current + 1; i < delivering.size(); i++)
+		{
+			IOThreadMessage& msg = delivering[i];
+			if (msg.id != id)
+				continue;
+			leftover.append(msg.data);
+			msg.id = 0;
+		}
+
+		connlock.Lock();
+		this->LockQueue();
+		for (std::vector<IOThreadMessage>::iterator i = outgoing.begin(); i != outgoing.end(); ++i)
+		{
+			if (i->id != id)
+				continue;
+			leftover.append(i->data);
+			i->id = 0;
+		}
+		this->UnlockQueue();
+
+		ConnMap::iterator it = conns.find(fd);
+		if ((it != conns.end()) && (it->second.id == id))
+		{
+			leftover.append(it->second.partial);
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+			conns.erase(it);
+		}
+		connlock.Unlock();
+	}
+
+	void OnNotify()
+	{
+		this->LockQueue();
+		delivering.swap(outgoing);
+		this->UnlockQueue();
+
+		for (current = 0; current < delivering.size(); current++)
+		{
+			IOThreadMessage& msg = delivering[current];
+			if (!msg.id)
+				continue;
+
+			StreamSocket* sock = ServerInstance->IOThreads->Find(msg.id);
+			if (!sock)
+				continue;
+
+			if (!msg.data.empty())
+				sock->OnThreadedRead(msg.data);
+
+			// The socket may have been detached by the processing of the data
+			if ((msg.failed) && (ServerInstance->IOThreads->Find(msg.id) == sock))
+				sock->HandleEvent(EVENT_ERROR, msg.error);
+		}
+		delivering.clear();
+		current = 0;
+	}
+};
+
+IOThreadManager::IOThreadManager()
+	: nextid(1)
+{
+}
+
+IOThreadManager::~IOThreadManager()
+{
+	Stop();
+}
+
+void IOThreadManager::Start(unsigned int count)
+{
+	if (!threads.empty())
+		return;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		IOThread* thread = new IOThread;
+		threads.push_back(thread);
+		ServerInstance->Threads->Start(thread);
+	}
+
+	if (count)
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Started %u I/O threads", count);
+}
+
+void IOThreadManager::Stop()
+{
+	// Give the sockets back to the main thread first, nothing is lost this way
+	while (!sockets.empty())
+		sockets.begin()->second->DetachIOThread();
+
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		IOThread* thread = *i;
+		thread->join();
+		delete thread;
+	}
+	threads.clear();
+}
+
+bool IOThreadManager::Attach(StreamSocket* sock)
+{
+	if ((threads.empty()) || (sock->GetIOHook()) || (sock->GetFd() < 0) || (sock->iothreadid))
+		return false;
+
+	IOThread* thread = threads[sock->GetFd() % threads.size()];
+	unsigned long id = nextid++;
+
+	// Stop the main thread from reading before the I/O thread may start doing so
+	ServerInstance->SE->ChangeEventMask(sock, FD_WANT_NO_READ);
+	if (!thread->Add(sock->GetFd(), id))
+	{
+		ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+		return false;
+	}
+
+	sock->iothreadid = id;
+	sockets[id] = sock;
+	return true;
+}
+
+void IOThreadManager::Detach(StreamSocket* sock, std::string& leftover)
+{
+	if (!sock->iothreadid)
+		return;
+
+	IOThread* thread = threads[sock->GetFd() % threads.size()];
+	thread->Remove(sock->GetFd(), sock->iothreadid, leftover);
+
+	sockets.erase(sock->iothreadid);
+	sock->iothreadid = 0;
+}
+
+StreamSocket* IOThreadManager::Find(unsigned long id)
+{
+	std::map<unsigned long, StreamSocket*>::const_iterator it = sockets.find(id);
+	if (it == sockets.end())
+		return NULL;
+	return it->second;
+}
+
+#else
+
+IOThreadManager::IOThreadManager()
+	: nextid(1)
+{
+}
+
+IOThreadManager::~IOThreadManager()
+{
+}
+
+void IOThreadManager::Start(unsigned int count)
+{
+	if (count)
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "I/O threads are not supported on this system, <performance:iothreads> is ignored");
+}
+
+void IOThreadManager::Stop()
+{
+}
+
+bool IOThreadManager::Attach(StreamSocket* sock)
+{
+	return false;
+}
+
+void IOThreadManager::Detach(StreamSocket* sock, std::string& leftover)
+{
+}
+
+StreamSocket* IOThreadManager::Find(unsigned long id)
+{
+	return NULL;
+}
+
+#endif
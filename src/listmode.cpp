@@ -27,6 +27,55 @@ ListModeBase::ListModeBase(Module* Creator, const std::string& Name, char modech
 	list = true;
 }
 
+void ListModeBase::ChanData::Refresh()
+{
+	// The hash of the masks depends on the case mapping, so rebuild the
+	// index if a module such as m_nationalchars has changed it
+	if (!memcmp(foldmap, national_case_insensitive_map, sizeof(foldmap)))
+		return;
+
+	memcpy(foldmap, national_case_insensitive_map, sizeof(foldmap));
+	index.clear();
+	for (size_t i = 0; i < list.size(); i++)
+		index.insert(std::make_pair(list[i].mask, seqs[i]));
+}
+
+size_t ListModeBase::ChanData::Find(const std::string& mask)
+{
+	Refresh();
+	MaskIndex::const_iterator it = index.find(mask);
+	if (it == index.end())
+		return list.size();
+
+	return std::lower_bound(seqs.begin(), seqs.end(), it->second) - seqs.begin();
+}
+
+void ListModeBase::ChanData::Add(const ListItem& item)
+{
+	Refresh();
+	list.push_back(item);
+	seqs.push_back(nextseq);
+	index[item.mask] = nextseq++;
+}
+
+void ListModeBase::ChanData::Remove(size_t pos)
+{
+	Refresh();
+	index.erase(list[pos].mask);
+
+	// The list is ordered and read directly by other modules, so the later
+	// items are shifted down. Swapping moves the strings without copying them.
+	// Lists are bounded by <banlist:limit>, which keeps this cheap.
+	for (size_t i = pos; i + 1 < list.size(); i++)
+	{
+		list[i].mask.swap(list[i+1].mask);
+		list[i].setter.swap(list[i+1].setter);
+		list[i].time = list[i+1].time;
+	}
+	list.pop_back();
+	seqs.erase(seqs.begin() + pos);
+}
+
 void ListModeBase::DisplayList(User* user, Channel* channel)
 {
 	ChanData* cd = extItem.get(channel);
@@ -148,16 +197,13 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		}
 
 		// Check if the item already exists in the list
-		for (ModeList::iterator it = cd->list.begin(); it != cd->list.end(); it++)
+		if (cd->Find(parameter) != cd->list.size())
 		{
-			if (parameter == it->mask)
-			{
-				/* Give a subclass a chance to error about this */
-				TellAlreadyOnList(source, channel, parameter);
+			/* Give a subclass a chance to error about this */
+			TellAlreadyOnList(source, channel, parameter);
 
-				// it does, deny the change
-				return MODEACTION_DENY;
-			}
+			// it does, deny the change
+			return MODEACTION_DENY;
 		}
 
 		if ((IS_LOCAL(source)) && (cd->list.size() >= GetLimitInternal(channel->name, cd)))
@@ -181,7 +227,8 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		if (ValidateParam(source, channel, parameter))
 		{
 			// And now add the mask onto the list...
-			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			cd->Add(ListItem(parameter, source->nick, ServerInstance->Time()));
+			channel->listgeneration++;
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -195,13 +242,14 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		// We're taking the mode off
 		if (cd)
 		{
-			for (ModeList::iterator it = cd->list.begin(); it != cd->list.end(); ++it)
+			size_t pos = cd->Find(parameter);
+			if (pos != cd->list.size())
 			{
-				if (parameter == it->mask)
-				{
-					cd->list.erase(it);
-					return MODEACTION_ALLOW;
-				}
+				// Tell everyone the mask exactly as it was set
+				parameter = cd->list[pos].mask;
+				cd->Remove(pos);
+				channel->listgeneration++;
+				return MODEACTION_ALLOW;
 			}
 		}
 
@@ -218,17 +266,24 @@ void ListModeBase::DoSyncChannel(Channel* chan, Module* proto, void* opaque)
 	if (!cd)
 		return;
 
-	irc::modestacker modestack(true);
+	// Stack the masks straight from the list, with the same limits as irc::modestacker
 	std::vector<std::string> stackresult;
 	std::vector<TranslateType> types;
-	types.push_back(TR_TEXT);
-
-	for (ModeList::iterator it = cd->list.begin(); it != cd->list.end(); it++)
-		modestack.Push(mode, it->mask);
-
-	while (modestack.GetStackedLine(stackresult))
+	ModeList::const_iterator it = cd->list.begin();
+	while (it != cd->list.end())
 	{
+		stackresult.push_back("+");
+		size_t size = 1;
+		while ((it != cd->list.end()) && (stackresult.size() <= ServerInstance->Config->Limits.MaxModes) && ((stackresult.size() == 1) || (size + it->mask.length() + 2 < 360)))
+		{
+			stackresult[0].push_back(mode);
+			stackresult.push_back(it->mask);
+			size += it->mask.length() + 2;
+			++it;
+		}
+
 		types.assign(stackresult.size(), this->GetTranslateType());
+		types[0] = TR_TEXT;
 		proto->ProtoSendMode(opaque, TYPE_CHANNEL, chan, stackresult, types);
 		stackresult.clear();
 	}
@@ -0,0 +1,241 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+Metric::Metric(const std::string& Name, Type Typ, const std::string& Help, const std::string& Labels)
+	: owner(NULL), name(Name), type(Typ), help(Help), labels(Labels)
+{
+}
+
+Metric::~Metric()
+{
+	if (owner)
+		owner->Del(this);
+}
+
+std::string Metric::Label(const std::string& key, const std::string& value)
+{
+	std::string ret = key + "=\"";
+	for (std::string::const_iterator i = value.begin(); i != value.end(); ++i)
+	{
+		if (*i == '\\' || *i == '"')
+			ret.push_back('\\');
+		else if (*i == '\n')
+		{
+			ret.append("\\n");
+			continue;
+		}
+		ret.push_back(*i);
+	}
+	ret.push_back('"');
+	return ret;
+}
+
+/** Append one sample line, e.g. name_total{labels} 42 */
+static void RenderSample(std::string& out, const std::string& name, const char* suffix, const std::string& labels, const std::string& value)
+{
+	out.append(name).append(suffix);
+	if (!labels.empty())
+		out.append("{").append(labels).append("}");
+	out.append(" ").append(value).append("\n");
+}
+
+void MetricCounter::Render(std::string& out) const
+{
+	RenderSample(out, name, "_total", labels, ConvToStr(Get()));
+}
+
+void MetricGauge::Render(std::string& out) const
+{
+	RenderSample(out, name, "", labels, ConvToStr(Get()));
+}
+
+MetricHistogram::MetricHistogram(const std::string& Name, const std::string& Help, const std::string& Bounds, const std::string& Labels)
+	: Metric(Name, HISTOGRAM, Help, Labels), sum(0)
+{
+	irc::spacesepstream ss(Bounds);
+	std::string bound;
+	while (ss.GetToken(bound))
+		bounds.push_back(ConvToInt(bound));
+	counts.resize(bounds.size() + 1);
+}
+
+void MetricHistogram::Observe(uint64_t v)
+{
+	size_t i = 0;
+	while (i < bounds.size() && v > bounds[i])
+		i++;
+	MetricAtomicAdd<uint64_t>(counts[i], 1);
+	MetricAtomicAdd<uint64_t>(sum, v);
+}
+
+void MetricHistogram::Render(std::string& out) const
+{
+	const std::string prefix = labels.empty() ? "" : labels + ",";
+	uint64_t total = 0;
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		total += MetricAtomicAdd<uint64_t>(const_cast<uint64_t&>(counts[i]), 0);
+		const std::string le = (i < bounds.size() ? ConvToStr(bounds[i]) : "+Inf");
+		RenderSample(out, name, "_bucket", prefix + "le=\"" + le + "\"", ConvToStr(total));
+	}
+	RenderSample(out, name, "_count", labels, ConvToStr(total));
+	RenderSample(out, name, "_sum", labels, ConvToStr(MetricAtomicAdd<uint64_t>(const_cast<uint64_t&>(sum), 0)));
+}
+
+TrafficMetrics::TrafficMetrics(const std::string& prefix, const std::string& what, const std::string& Labels)
+	: BytesIn(prefix + "_received_bytes", "Bytes received from " + what, Labels)
+	, BytesOut(prefix + "_sent_bytes", "Bytes sent to " + what, Labels)
+	, LinesIn(prefix + "_received_lines", "Lines received from " + what, Labels)
+	, LinesOut(prefix + "_sent_lines", "Lines sent to " + what, Labels)
+{
+}
+
+void TrafficMetrics::Register()
+{
+	ServerInstance->Metrics->Add(&BytesIn);
+	ServerInstance->Metrics->Add(&BytesOut);
+	ServerInstance->Metrics->Add(&LinesIn);
+	ServerInstance->Metrics->Add(&LinesOut);
+}
+
+namespace
+{
+	/** Exports one of the counters in ServerInstance->stats */
+	class StatsCounter : public MetricCounter
+	{
+		unsigned long serverstats::*field;
+
+	 public:
+		StatsCounter(const std::string& Name, const std::string& Help, unsigned long serverstats::*Field)
+			: MetricCounter(Name, Help), field(Field) { }
+
+		uint64_t Get() const CXX11_OVERRIDE { return ServerInstance->stats->*field; }
+	};
+
+	/** Exports one of the sizes of the user and channel lists, all of them are known in constant time */
+	class SizeGauge : public MetricGauge
+	{
+	 public:
+		enum What { USERS, LOCALUSERS, UNREGISTERED, CHANNELS };
+
+	 private:
+		const What what;
+
+	 public:
+		SizeGauge(const std::string& Name, const std::string& Help, What w)
+			: MetricGauge(Name, Help), what(w) { }
+
+		int64_t Get() const CXX11_OVERRIDE
+		{
+			switch (what)
+			{
+				case USERS:
+					return ServerInstance->Users->clientlist->size();
+				case LOCALUSERS:
+					return ServerInstance->Users->LocalUserCount();
+				case UNREGISTERED:
+					return ServerInstance->Users->UnregisteredUserCount();
+				case CHANNELS:
+					return ServerInstance->chanlist->size();
+			}
+			return 0;
+		}
+	};
+}
+
+MetricManager::MetricManager()
+	: LoopIterations("inspircd_loop_iterations", "Main loop iterations")
+	, LoopEvents("inspircd_loop_events", "Socket events handled per main loop iteration", "0 1 2 4 8 16 32 64 128 256 512 1024")
+	, Clients("inspircd_socket", "sockets", Metric::Label("class", "client"))
+	, SendQ("inspircd_sendq_bytes", "Bytes waiting in the send queues of all sockets")
+{
+	coremetrics.push_back(new StatsCounter("inspircd_connections_accepted", "Accepted connections", &serverstats::statsAccept));
+	coremetrics.push_back(new StatsCounter("inspircd_connections_refused", "Connections refused on accept", &serverstats::statsRefused));
+	coremetrics.push_back(new StatsCounter("inspircd_unknown_commands", "Unknown commands received", &serverstats::statsUnknown));
+	coremetrics.push_back(new StatsCounter("inspircd_nick_collisions", "Nickname collisions handled", &serverstats::statsCollisions));
+	coremetrics.push_back(new StatsCounter("inspircd_dns_queries", "DNS queries sent", &serverstats::statsDns));
+	coremetrics.push_back(new SizeGauge("inspircd_users", "Users on the network", SizeGauge::USERS));
+	coremetrics.push_back(new SizeGauge("inspircd_local_users", "Registered local users", SizeGauge::LOCALUSERS));
+	coremetrics.push_back(new SizeGauge("inspircd_unregistered_users", "Local connections which have not registered yet", SizeGauge::UNREGISTERED));
+	coremetrics.push_back(new SizeGauge("inspircd_channels", "Channels on the network", SizeGauge::CHANNELS));
+	for (std::vector<Metric*>::const_iterator i = coremetrics.begin(); i != coremetrics.end(); ++i)
+		Add(*i);
+
+	Add(&LoopIterations);
+	Add(&LoopEvents);
+	Add(&SendQ);
+	Add(&Clients.BytesIn);
+	Add(&Clients.BytesOut);
+	Add(&Clients.LinesIn);
+	Add(&Clients.LinesOut);
+}
+
+MetricManager::~MetricManager()
+{
+	// Metrics outliving the manager must not try to remove themselves later
+	for (MetricMap::const_iterator i = metrics.begin(); i != metrics.end(); ++i)
+		i->second->owner = NULL;
+	metrics.clear();
+	for (std::vector<Metric*>::const_iterator i = coremetrics.begin(); i != coremetrics.end(); ++i)
+		delete *i;
+}
+
+void MetricManager::Add(Metric* metric)
+{
+	if (metric->owner)
+		return;
+	metric->owner = this;
+	metrics.insert(std::make_pair(metric->name, metric));
+}
+
+void MetricManager::Del(Metric* metric)
+{
+	if (metric->owner != this)
+		return;
+	metric->owner = NULL;
+	std::pair<MetricMap::iterator, MetricMap::iterator> range = metrics.equal_range(metric->name);
+	for (MetricMap::iterator i = range.first; i != range.second; ++i)
+	{
+		if (i->second == metric)
+		{
+			metrics.erase(i);
+			return;
+		}
+	}
+}
+
+void MetricManager::Render(std::string& out) const
+{
+	static const char* const types[] = { "counter", "gauge", "histogram" };
+
+	const std::string* family = NULL;
+	for (MetricMap::const_iterator i = metrics.begin(); i != metrics.end(); ++i)
+	{
+		const Metric* metric = i->second;
+		if (!family || *family != i->first)
+		{
+			// The first metric of a family describes all of them
+			family = &i->first;
+			out.append("# TYPE ").append(metric->name).append(" ").append(types[metric->type]).append("\n");
+			out.append("# HELP ").append(metric->name).append(" ").append(metric->help).append("\n");
+		}
+		metric->Render(out);
+	}
+	out.append("# EOF\n");
+}
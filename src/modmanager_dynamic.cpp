@@ -109,6 +109,7 @@ bool ModuleManager::Load(const std::string& filename, bool defer)
 		return true;
 
 	FOREACH_MOD(I_OnLoadModule,OnLoadModule(newmod));
+	Channel::ResetBanVerdicts();
 	/* We give every module a chance to re-prioritize when we introduce a new one,
 	 * not just the one thats loading, as the new module could affect the preference
 	 * of others
@@ -369,6 +369,7 @@ void ModuleManager::DoSafeUnload(Module* mod)
 	dynamic_reference_base::reset_all();
 
 	DetachAll(mod);
+	Channel::ResetBanVerdicts();
 
 	Modules.erase(modfind);
 	ServerInstance->GlobalCulls.AddItem(mod);
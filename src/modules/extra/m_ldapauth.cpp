@@ -23,10 +23,13 @@
  */
 
 
+
 #include "inspircd.h"
 #include "users.h"
 #include "channels.h"
 #include "modules.h"
+#include "threadengine.h"
+#include "modules/hash.h"
 
 #include <ldap.h>
 
@@ -37,6 +40,15 @@
 
 /* $LinkerFlags: -lldap */
 
+/*
+ * The LDAP operations block until the directory answers, so they are done by a small
+ * pool of worker threads, each with its own connection. A connecting user stays in
+ * registration (OnCheckReady) until a worker has answered. Answers are kept in a
+ * cache for a while, so reconnecting users do not cost a round trip each time.
+ * The cache is keyed on a salted hash of the name and password, so passwords are
+ * not kept around after the check; without m_sha256 nothing is cached.
+ */
+
 struct RAIILDAPString
 {
 	char *str;
@@ -65,6 +77,7 @@ struct RAIILDAPString
 struct RAIILDAPMessage
 {
 	RAIILDAPMessage()
+		: msg(NULL)
 	{
 	}
 
@@ -75,7 +88,9 @@ struct RAIILDAPMessage
 
 	void dealloc()
 	{
-		ldap_msgfree(msg);
+		if (msg)
+			ldap_msgfree(msg);
+		msg = NULL;
 	}
 
 	operator LDAPMessage*()
@@ -91,65 +106,270 @@ struct RAIILDAPMessage
 	LDAPMessage *msg;
 };
 
-class ModuleLDAPAuth : public Module
+/** Settings used by the worker threads, each of them has its own copy
+ */
+struct LDAPAuthConfig
 {
-	LocalIntExt ldapAuthed;
-	LocalStringExt ldapVhost;
 	std::string base;
 	std::string attribute;
 	std::string ldapserver;
-	std::string allowpattern;
-	std::string killreason;
 	std::string username;
 	std::string password;
-	std::string vhost;
-	std::vector<std::string> whitelistedcidrs;
 	std::vector<std::pair<std::string, std::string> > requiredattributes;
 	int searchscope;
+	int timeout;
+};
+
+/** A credential check, created by the main thread and answered by a worker
+ */
+struct LDAPAuthRequest
+{
+	/** UUID of the user being checked */
+	const std::string uuid;
+	/** Salted hash of the name and password, used as the cache key; empty if not cacheable */
+	const std::string key;
+	/** Value of the search attribute, the nick or ident of the user */
+	const std::string name;
+	/** Password sent by the user */
+	std::string password;
+
+	/* Filled in by the worker */
+
+	/** True if the credentials were accepted */
+	bool authed;
+	/** True if the answer came from the directory and may be cached */
+	bool cacheable;
+	/** DN of the user, if authed */
+	std::string dn;
+	/** Why the credentials were not accepted */
+	std::string reason;
+
+	LDAPAuthRequest(const std::string& Uuid, const std::string& Key, const std::string& Name, const std::string& Password)
+		: uuid(Uuid), key(Key), name(Name), password(Password), authed(false), cacheable(false)
+	{
+	}
+};
+
+/** A cached answer of the directory
+ */
+struct LDAPAuthCacheEntry
+{
+	bool authed;
+	std::string dn;
+	time_t expires;
+};
+
+class ModuleLDAPAuth;
+
+class LDAPAuthWorker : public SocketThread
+{
+	ModuleLDAPAuth* const Parent;
+	/** Connection to the directory, worker thread only */
+	LDAP* conn;
+	/** Settings in use, worker thread only */
+	LDAPAuthConfig config;
+	/** Settings to use from the next request on, MUST HOLD MUTEX */
+	LDAPAuthConfig newconfig;
+	/** True if newconfig is to be used, MUST HOLD MUTEX */
+	bool reconfigure;
+
+	bool Connect(std::string& reason);
+	void Check(LDAPAuthRequest* req);
+
+ public:
+	/** Requests to answer, the front one is being worked on. MUST HOLD MUTEX */
+	std::deque<LDAPAuthRequest*> queue;
+	/** Answered requests, MUST HOLD MUTEX */
+	std::deque<LDAPAuthRequest*> results;
+
+	LDAPAuthWorker(ModuleLDAPAuth* Creator)
+		: Parent(Creator), conn(NULL), reconfigure(false)
+	{
+	}
+
+	~LDAPAuthWorker();
+
+	void SetConfig(const LDAPAuthConfig& conf)
+	{
+		this->LockQueue();
+		newconfig = conf;
+		reconfigure = true;
+		this->UnlockQueue();
+	}
+
+	void Submit(LDAPAuthRequest* req)
+	{
+		this->LockQueue();
+		queue.push_back(req);
+		this->UnlockQueueWakeup();
+	}
+
+	size_t GetQueueSize()
+	{
+		this->LockQueue();
+		size_t size = queue.size();
+		this->UnlockQueue();
+		return size;
+	}
+
+	void Run();
+	void OnNotify();
+};
+
+class ModuleLDAPAuth : public Module
+{
+	typedef std::map<std::string, LDAPAuthCacheEntry> LDAPAuthCache;
+
+	LocalIntExt ldapAuthed;
+	LocalStringExt ldapVhost;
+	LDAPAuthConfig config;
+	std::string allowpattern;
+	std::string killreason;
+	std::string vhost;
+	std::vector<std::string> whitelistedcidrs;
+	std::vector<LDAPAuthWorker*> workers;
+	LDAPAuthCache cache;
+	unsigned int cachesize;
+	time_t cachettl;
+	time_t negcachettl;
+	dynamic_reference<HashProvider> sha256;
+	/** Random salt of the cache keys */
+	std::string salt;
 	bool verbose;
 	bool useusername;
-	LDAP *conn;
+
+	void AddCache(const LDAPAuthRequest& req)
+	{
+		time_t ttl = req.authed ? cachettl : negcachettl;
+		if (!req.cacheable || ttl <= 0 || !cachesize || req.key.empty())
+			return;
+
+		if (cache.size() >= cachesize)
+		{
+			// Make room by dropping expired entries, or any if there are none
+			for (LDAPAuthCache::iterator i = cache.begin(); i != cache.end(); )
+			{
+				if (i->second.expires <= ServerInstance->Time())
+					cache.erase(i++);
+				else
+					++i;
+			}
+			if (cache.size() >= cachesize)
+				cache.erase(cache.begin());
+		}
+
+		LDAPAuthCacheEntry& entry = cache[req.key];
+		entry.authed = req.authed;
+		entry.dn = req.dn;
+		entry.expires = ServerInstance->Time() + ttl;
+	}
+
+	void Authenticate(LocalUser* user, const std::string& DN)
+	{
+		if (!vhost.empty())
+		{
+			irc::commasepstream stream(DN);
+
+			// mashed map of key:value parts of the DN
+			std::map<std::string, std::string> dnParts;
+
+			std::string dnPart;
+			while (stream.GetToken(dnPart))
+			{
+				std::string::size_type pos = dnPart.find('=');
+				if (pos == std::string::npos) // malformed
+					continue;
+
+				std::string key = dnPart.substr(0, pos);
+				std::string value = dnPart.substr(pos + 1, dnPart.length() - pos + 1); // +1s to skip the = itself
+				dnParts[key] = value;
+			}
+
+			// change host according to config key
+			ldapVhost.set(user, SafeReplace(vhost, dnParts));
+		}
+
+		ldapAuthed.set(user,1);
+	}
+
+	void Forbid(LocalUser* user, const std::string& reason)
+	{
+		if (verbose)
+			ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (%s)", user->GetFullRealHost().c_str(), reason.c_str());
+		ServerInstance->Users->QuitUser(user, killreason);
+	}
 
 public:
 	ModuleLDAPAuth()
 		: ldapAuthed("ldapauth", this)
 		, ldapVhost("ldapauth_vhost", this)
+		, sha256(this, "hash/sha256")
 	{
-		conn = NULL;
+	}
+
+	/** Get the cache key of a name and password
+	 * @return A salted SHA-256 HMAC of both, or an empty string if no hash provider is loaded
+	 */
+	std::string GetKey(const std::string& name, const std::string& password)
+	{
+		if (!sha256)
+			return "";
+		return sha256->hmac(salt, name + " " + password);
 	}
 
 	void init() CXX11_OVERRIDE
 	{
+		salt = ServerInstance->GenRandomStr(32, false);
 		ServerInstance->Modules->AddService(ldapAuthed);
 		ServerInstance->Modules->AddService(ldapVhost);
 		Implementation eventlist[] = { I_OnCheckReady, I_OnRehash,I_OnUserRegister, I_OnUserConnect };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		OnRehash(NULL);
+
+		// The number of threads can only be changed by reloading the module
+		unsigned int threads = ServerInstance->Config->ConfValue("ldapauth")->getInt("threads", 2);
+		if (threads < 1 || threads > 32)
+			threads = 2;
+		for (unsigned int i = 0; i < threads; i++)
+		{
+			LDAPAuthWorker* worker = new LDAPAuthWorker(this);
+			worker->SetConfig(config);
+			ServerInstance->Threads->Start(worker);
+			workers.push_back(worker);
+		}
 	}
 
 	~ModuleLDAPAuth()
 	{
-		if (conn)
-			ldap_unbind_ext(conn, NULL, NULL);
+		for (std::vector<LDAPAuthWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			// Waits for the request in progress, if any; the rest are dropped
+			(*i)->join();
+			delete *i;
+		}
 	}
 
 	void OnRehash(User* user) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("ldapauth");
 		whitelistedcidrs.clear();
-		requiredattributes.clear();
+		config.requiredattributes.clear();
 
-		base 			= tag->getString("baserdn");
-		attribute		= tag->getString("attribute");
-		ldapserver		= tag->getString("server");
+		config.base		= tag->getString("baserdn");
+		config.attribute	= tag->getString("attribute");
+		config.ldapserver	= tag->getString("server");
 		allowpattern	= tag->getString("allowpattern");
 		killreason		= tag->getString("killreason");
 		std::string scope	= tag->getString("searchscope");
-		username		= tag->getString("binddn");
-		password		= tag->getString("bindauth");
+		config.username		= tag->getString("binddn");
+		config.password		= tag->getString("bindauth");
+		config.timeout		= tag->getInt("timeout", 5);
 		vhost			= tag->getString("host");
 		verbose			= tag->getBool("verbose");		/* Set to true if failed connects should be reported to operators */
 		useusername		= tag->getBool("userfield");
+		cachesize		= tag->getInt("cachesize", 1000);
+		cachettl		= tag->getInt("cachettl", 300);
+		negcachettl		= tag->getInt("negcachettl", 60);
 
 		ConfigTagList whitelisttags = ServerInstance->Config->ConfTags("ldapwhitelist");
 
@@ -169,42 +389,19 @@ public:
 			const std::string val = i->second->getString("value");
 
 			if (!attr.empty() && !val.empty())
-				requiredattributes.push_back(make_pair(attr, val));
+				config.requiredattributes.push_back(make_pair(attr, val));
 		}
 
 		if (scope == "base")
-			searchscope = LDAP_SCOPE_BASE;
+			config.searchscope = LDAP_SCOPE_BASE;
 		else if (scope == "onelevel")
-			searchscope = LDAP_SCOPE_ONELEVEL;
-		else searchscope = LDAP_SCOPE_SUBTREE;
+			config.searchscope = LDAP_SCOPE_ONELEVEL;
+		else config.searchscope = LDAP_SCOPE_SUBTREE;
 
-		Connect();
-	}
-
-	bool Connect()
-	{
-		if (conn != NULL)
-			ldap_unbind_ext(conn, NULL, NULL);
-		int res, v = LDAP_VERSION3;
-		res = ldap_initialize(&conn, ldapserver.c_str());
-		if (res != LDAP_SUCCESS)
-		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "LDAP connection failed: %s", ldap_err2string(res));
-			conn = NULL;
-			return false;
-		}
-
-		res = ldap_set_option(conn, LDAP_OPT_PROTOCOL_VERSION, (void *)&v);
-		if (res != LDAP_SUCCESS)
-		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "LDAP set protocol to v3 failed: %s", ldap_err2string(res));
-			ldap_unbind_ext(conn, NULL, NULL);
-			conn = NULL;
-			return false;
-		}
-		return true;
+		// Answers given under the old settings may no longer be right
+		cache.clear();
+		for (std::vector<LDAPAuthWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+			(*i)->SetConfig(config);
 	}
 
 	std::string SafeReplace(const std::string &text, std::map<std::string,
@@ -260,175 +457,281 @@ public:
 			}
 		}
 
-		if (!CheckCredentials(user))
+		if (user->password.empty())
 		{
-			ServerInstance->Users->QuitUser(user, killreason);
+			Forbid(user, "No password provided");
 			return MOD_RES_DENY;
 		}
+
+		const std::string& name = useusername ? user->ident : user->nick;
+		const std::string key = GetKey(name, user->password);
+		LDAPAuthCache::iterator it = (key.empty() ? cache.end() : cache.find(key));
+		if (it != cache.end())
+		{
+			if (it->second.expires > ServerInstance->Time())
+			{
+				if (!it->second.authed)
+				{
+					Forbid(user, "Rejected by LDAP recently");
+					return MOD_RES_DENY;
+				}
+				Authenticate(user, it->second.dn);
+				return MOD_RES_PASSTHRU;
+			}
+			cache.erase(it);
+		}
+
+		// Hand it to the least busy worker, OnCheckReady holds the user until the answer is in
+		LDAPAuthWorker* worker = workers[0];
+		size_t queued = worker->GetQueueSize();
+		for (size_t i = 1; i < workers.size() && queued; i++)
+		{
+			size_t size = workers[i]->GetQueueSize();
+			if (size < queued)
+			{
+				worker = workers[i];
+				queued = size;
+			}
+		}
+		worker->Submit(new LDAPAuthRequest(user->uuid, key, name, user->password));
 		return MOD_RES_PASSTHRU;
 	}
 
-	bool CheckCredentials(LocalUser* user)
+	/** Called on the main thread when a worker has answered a request */
+	void OnResult(const LDAPAuthRequest& req)
 	{
-		if (conn == NULL)
-			if (!Connect())
-				return false;
+		AddCache(req);
 
-		if (user->password.empty())
+		LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(req.uuid));
+		if (!user || user->quitting || user->registered == REG_ALL)
+			return;
+
+		if (!req.authed)
 		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (No password provided)", user->GetFullRealHost().c_str());
-			return false;
+			Forbid(user, req.reason);
+			return;
 		}
 
-		int res;
-		// bind anonymously if no bind DN and authentication are given in the config
-		struct berval cred;
-		cred.bv_val = const_cast<char*>(password.c_str());
-		cred.bv_len = password.length();
+		Authenticate(user, req.dn);
+		// Let the user finish registering now, not on the next periodic check
+		user->checktimer.ScheduleCheck(ServerInstance->Time());
+	}
+
+	ModResult OnCheckReady(LocalUser* user) CXX11_OVERRIDE
+	{
+		return ldapAuthed.get(user) ? MOD_RES_PASSTHRU : MOD_RES_DENY;
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Allow/Deny connections based upon answer from LDAP server", VF_VENDOR);
+	}
+};
 
-		if ((res = ldap_sasl_bind_s(conn, username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) != LDAP_SUCCESS)
+LDAPAuthWorker::~LDAPAuthWorker()
+{
+	if (conn)
+		ldap_unbind_ext(conn, NULL, NULL);
+	for (std::deque<LDAPAuthRequest*>::iterator i = queue.begin(); i != queue.end(); ++i)
+		delete *i;
+	for (std::deque<LDAPAuthRequest*>::iterator i = results.begin(); i != results.end(); ++i)
+		delete *i;
+}
+
+bool LDAPAuthWorker::Connect(std::string& reason)
+{
+	if (conn != NULL)
+		ldap_unbind_ext(conn, NULL, NULL);
+	int res, v = LDAP_VERSION3;
+	res = ldap_initialize(&conn, config.ldapserver.c_str());
+	if (res != LDAP_SUCCESS)
+	{
+		reason = "LDAP connection failed: " + std::string(ldap_err2string(res));
+		conn = NULL;
+		return false;
+	}
+
+	res = ldap_set_option(conn, LDAP_OPT_PROTOCOL_VERSION, (void *)&v);
+	if (res != LDAP_SUCCESS)
+	{
+		reason = "LDAP set protocol to v3 failed: " + std::string(ldap_err2string(res));
+		ldap_unbind_ext(conn, NULL, NULL);
+		conn = NULL;
+		return false;
+	}
+
+	// Don't let an unresponsive server hold this worker forever
+	struct timeval tv;
+	tv.tv_sec = config.timeout;
+	tv.tv_usec = 0;
+	ldap_set_option(conn, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+	ldap_set_option(conn, LDAP_OPT_TIMEOUT, &tv);
+	return true;
+}
+
+void LDAPAuthWorker::Check(LDAPAuthRequest* req)
+{
+	if (conn == NULL)
+		if (!Connect(req->reason))
+			return;
+
+	int res;
+	// bind anonymously if no bind DN and authentication are given in the config
+	struct berval cred;
+	cred.bv_val = const_cast<char*>(config.password.c_str());
+	cred.bv_len = config.password.length();
+
+	if ((res = ldap_sasl_bind_s(conn, config.username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) != LDAP_SUCCESS)
+	{
+		if (res == LDAP_SERVER_DOWN)
 		{
-			if (res == LDAP_SERVER_DOWN)
-			{
-				// Attempt to reconnect if the connection dropped
-				if (verbose)
-					ServerInstance->SNO->WriteToSnoMask('a', "LDAP server has gone away - reconnecting...");
-				Connect();
-				res = ldap_sasl_bind_s(conn, username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-			}
+			// Attempt to reconnect if the connection dropped
+			if (Connect(req->reason))
+				res = ldap_sasl_bind_s(conn, config.username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+		}
 
-			if (res != LDAP_SUCCESS)
-			{
-				if (verbose)
-					ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (LDAP bind failed: %s)", user->GetFullRealHost().c_str(), ldap_err2string(res));
+		if (res != LDAP_SUCCESS)
+		{
+			if (req->reason.empty())
+				req->reason = "LDAP bind failed: " + std::string(ldap_err2string(res));
+			if (conn)
 				ldap_unbind_ext(conn, NULL, NULL);
-				conn = NULL;
-				return false;
-			}
+			conn = NULL;
+			return;
 		}
+	}
 
-		RAIILDAPMessage msg;
-		std::string what = (attribute + "=" + (useusername ? user->ident : user->nick));
-		if ((res = ldap_search_ext_s(conn, base.c_str(), searchscope, what.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msg)) != LDAP_SUCCESS)
+	RAIILDAPMessage msg;
+	std::string what = (config.attribute + "=" + req->name);
+	if ((res = ldap_search_ext_s(conn, config.base.c_str(), config.searchscope, what.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msg)) != LDAP_SUCCESS)
+	{
+		// Do a second search, based on password, if it contains a :
+		// That is, PASS <user>:<password> will work.
+		size_t pos = req->password.find(":");
+		if (pos != std::string::npos)
 		{
-			// Do a second search, based on password, if it contains a :
-			// That is, PASS <user>:<password> will work.
-			size_t pos = user->password.find(":");
-			if (pos != std::string::npos)
-			{
-				// manpage says we must deallocate regardless of success or failure
-				// since we're about to do another query (and reset msg), first
-				// free the old one.
-				msg.dealloc();
+			// manpage says we must deallocate regardless of success or failure
+			// since we're about to do another query (and reset msg), first
+			// free the old one.
+			msg.dealloc();
 
-				std::string cutpassword = user->password.substr(0, pos);
-				res = ldap_search_ext_s(conn, base.c_str(), searchscope, cutpassword.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msg);
+			std::string cutpassword = req->password.substr(0, pos);
+			res = ldap_search_ext_s(conn, config.base.c_str(), config.searchscope, cutpassword.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msg);
 
-				if (res == LDAP_SUCCESS)
-				{
-					// Trim the user: prefix, leaving just 'pass' for later password check
-					user->password = user->password.substr(pos + 1);
-				}
-			}
-
-			// It may have found based on user:pass check above.
-			if (res != LDAP_SUCCESS)
+			if (res == LDAP_SUCCESS)
 			{
-				if (verbose)
-					ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (LDAP search failed: %s)", user->GetFullRealHost().c_str(), ldap_err2string(res));
-				return false;
+				// Trim the user: prefix, leaving just 'pass' for later password check
+				req->password = req->password.substr(pos + 1);
 			}
 		}
-		if (ldap_count_entries(conn, msg) > 1)
-		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (LDAP search returned more than one result: %s)", user->GetFullRealHost().c_str(), ldap_err2string(res));
-			return false;
-		}
 
-		LDAPMessage *entry;
-		if ((entry = ldap_first_entry(conn, msg)) == NULL)
-		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (LDAP search returned no results: %s)", user->GetFullRealHost().c_str(), ldap_err2string(res));
-			return false;
-		}
-		cred.bv_val = (char*)user->password.data();
-		cred.bv_len = user->password.length();
-		RAIILDAPString DN(ldap_get_dn(conn, entry));
-		if ((res = ldap_sasl_bind_s(conn, DN, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) != LDAP_SUCCESS)
+		// It may have found based on user:pass check above.
+		if (res != LDAP_SUCCESS)
 		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (%s)", user->GetFullRealHost().c_str(), ldap_err2string(res));
-			return false;
+			req->reason = "LDAP search failed: " + std::string(ldap_err2string(res));
+			return;
 		}
+	}
 
-		if (!requiredattributes.empty())
-		{
-			bool authed = false;
+	// From here on the directory has given a definite answer
+	req->cacheable = true;
+	if (ldap_count_entries(conn, msg) > 1)
+	{
+		req->reason = "LDAP search returned more than one result";
+		return;
+	}
 
-			for (std::vector<std::pair<std::string, std::string> >::const_iterator it = requiredattributes.begin(); it != requiredattributes.end(); ++it)
-			{
-				const std::string &attr = it->first;
-				const std::string &val = it->second;
+	LDAPMessage *entry;
+	if ((entry = ldap_first_entry(conn, msg)) == NULL)
+	{
+		req->reason = "LDAP search returned no results";
+		return;
+	}
+	cred.bv_val = (char*)req->password.data();
+	cred.bv_len = req->password.length();
+	RAIILDAPString DN(ldap_get_dn(conn, entry));
+	if ((res = ldap_sasl_bind_s(conn, DN, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) != LDAP_SUCCESS)
+	{
+		// Only a rejected password is worth remembering
+		req->cacheable = (res == LDAP_INVALID_CREDENTIALS);
+		req->reason = ldap_err2string(res);
+		return;
+	}
 
-				struct berval attr_value;
-				attr_value.bv_val = const_cast<char*>(val.c_str());
-				attr_value.bv_len = val.length();
+	if (!config.requiredattributes.empty())
+	{
+		bool authed = false;
 
-				ServerInstance->Logs->Log("m_ldapauth", LOG_DEBUG, "LDAP compare: %s=%s", attr.c_str(), val.c_str());
+		for (std::vector<std::pair<std::string, std::string> >::const_iterator it = config.requiredattributes.begin(); it != config.requiredattributes.end(); ++it)
+		{
+			const std::string &attr = it->first;
+			const std::string &val = it->second;
 
-				authed = (ldap_compare_ext_s(conn, DN, attr.c_str(), &attr_value, NULL, NULL) == LDAP_COMPARE_TRUE);
+			struct berval attr_value;
+			attr_value.bv_val = const_cast<char*>(val.c_str());
+			attr_value.bv_len = val.length();
 
-				if (authed)
-					break;
-			}
+			authed = (ldap_compare_ext_s(conn, DN, attr.c_str(), &attr_value, NULL, NULL) == LDAP_COMPARE_TRUE);
 
-			if (!authed)
-			{
-				if (verbose)
-					ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (Lacks required LDAP attributes)", user->GetFullRealHost().c_str());
-				return false;
-			}
+			if (authed)
+				break;
 		}
 
-		if (!vhost.empty())
+		if (!authed)
 		{
-			irc::commasepstream stream(DN);
-
-			// mashed map of key:value parts of the DN
-			std::map<std::string, std::string> dnParts;
+			req->reason = "Lacks required LDAP attributes";
+			return;
+		}
+	}
 
-			std::string dnPart;
-			while (stream.GetToken(dnPart))
-			{
-				std::string::size_type pos = dnPart.find('=');
-				if (pos == std::string::npos) // malformed
-					continue;
+	req->dn = DN.str;
+	req->authed = true;
+}
 
-				std::string key = dnPart.substr(0, pos);
-				std::string value = dnPart.substr(pos + 1, dnPart.length() - pos + 1); // +1s to skip the = itself
-				dnParts[key] = value;
-			}
+void LDAPAuthWorker::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
+	{
+		if (queue.empty())
+		{
+			this->WaitForQueue();
+			continue;
+		}
 
-			// change host according to config key
-			ldapVhost.set(user, SafeReplace(vhost, dnParts));
+		if (reconfigure)
+		{
+			config = newconfig;
+			reconfigure = false;
+			if (conn)
+				ldap_unbind_ext(conn, NULL, NULL);
+			conn = NULL;
 		}
 
-		ldapAuthed.set(user,1);
-		return true;
+		// The main thread only appends to the queue, the front is ours until popped
+		LDAPAuthRequest* req = queue.front();
+		this->UnlockQueue();
+		Check(req);
+		this->LockQueue();
+		queue.pop_front();
+		results.push_back(req);
+		NotifyParent();
 	}
+	this->UnlockQueue();
+}
 
-	ModResult OnCheckReady(LocalUser* user) CXX11_OVERRIDE
-	{
-		return ldapAuthed.get(user) ? MOD_RES_PASSTHRU : MOD_RES_DENY;
-	}
+void LDAPAuthWorker::OnNotify()
+{
+	std::deque<LDAPAuthRequest*> done;
+	this->LockQueue();
+	done.swap(results);
+	this->UnlockQueue();
 
-	Version GetVersion() CXX11_OVERRIDE
+	for (std::deque<LDAPAuthRequest*>::iterator i = done.begin(); i != done.end(); ++i)
 	{
-		return Version("Allow/Deny connections based upon answer from LDAP server", VF_VENDOR);
+		Parent->OnResult(**i);
+		delete *i;
 	}
-};
+}
 
 MODULE_INIT(ModuleLDAPAuth)
@@ -24,6 +24,8 @@
 #include "users.h"
 #include "channels.h"
 #include "modules.h"
+#include "threadengine.h"
+#include "modules/hash.h"
 
 #include <ldap.h>
 
@@ -34,6 +36,15 @@
 
 /* $LinkerFlags: -lldap */
 
+/*
+ * As in m_ldapauth, the directory is asked by worker threads so a slow LDAP
+ * server does not stall the whole server. OPER is answered once the worker
+ * is done; if LDAP rejects the password the original line is parsed again so
+ * the normal OPER checks run, along with every other module's command hooks.
+ * A user has at most one lookup in progress, further OPERs are refused until
+ * it is answered.
+ */
+
 struct RAIILDAPString
 {
 	char *str;
@@ -59,7 +70,9 @@ struct RAIILDAPString
 	}
 };
 
-class ModuleLDAPAuth : public Module
+/** Settings used by the worker threads, each of them has its own copy
+ */
+struct LDAPOperConfig
 {
 	std::string base;
 	std::string ldapserver;
@@ -67,173 +80,425 @@ class ModuleLDAPAuth : public Module
 	std::string password;
 	std::string attribute;
 	int searchscope;
-	LDAP *conn;
+	int timeout;
+};
+
+/** An oper password check, created by the main thread and answered by a worker
+ */
+struct LDAPOperRequest
+{
+	/** UUID of the user opering up */
+	const std::string uuid;
+	/** Parameters of the OPER command */
+	const std::vector<std::string> parameters;
+	/** The OPER line as sent by the user, parsed again if LDAP rejects the password */
+	const std::string line;
+	/** True if LDAP accepted the password */
+	bool authed;
+	/** Salted hash of the oper name and password, used as the cache key; empty if not cacheable */
+	const std::string key;
+	/** True if the answer came from the directory and may be cached */
+	bool cacheable;
+
+	LDAPOperRequest(const std::string& Uuid, const std::vector<std::string>& Parameters, const std::string& Line, const std::string& Key)
+		: uuid(Uuid), parameters(Parameters), line(Line), authed(false), key(Key), cacheable(false)
+	{
+	}
+};
+
+class ModuleLDAPAuth;
+
+class LDAPOperWorker : public SocketThread
+{
+	ModuleLDAPAuth* const Parent;
+	/** Connection to the directory, worker thread only */
+	LDAP* conn;
+	/** Settings in use, worker thread only */
+	LDAPOperConfig config;
+	/** Settings to use from the next request on, MUST HOLD MUTEX */
+	LDAPOperConfig newconfig;
+	/** True if newconfig is to be used, MUST HOLD MUTEX */
+	bool reconfigure;
+
+	bool Connect();
+	void LookupOper(LDAPOperRequest* req);
+
+ public:
+	/** Requests to answer, the front one is being worked on. MUST HOLD MUTEX */
+	std::deque<LDAPOperRequest*> queue;
+	/** Answered requests, MUST HOLD MUTEX */
+	std::deque<LDAPOperRequest*> results;
+
+	LDAPOperWorker(ModuleLDAPAuth* Creator)
+		: Parent(Creator), conn(NULL), reconfigure(false)
+	{
+	}
+
+	~LDAPOperWorker();
+
+	void SetConfig(const LDAPOperConfig& conf)
+	{
+		this->LockQueue();
+		newconfig = conf;
+		reconfigure = true;
+		this->UnlockQueue();
+	}
+
+	void Submit(LDAPOperRequest* req)
+	{
+		this->LockQueue();
+		queue.push_back(req);
+		this->UnlockQueueWakeup();
+	}
+
+	void Run();
+	void OnNotify();
+};
+
+class ModuleLDAPAuth : public Module
+{
+	/** Cached answers, true if LDAP accepted the password, with their expiry time */
+	typedef std::map<std::string, std::pair<bool, time_t> > LDAPOperCache;
+
+	LDAPOperConfig config;
+	LDAPOperWorker* worker;
+	LDAPOperCache cache;
+	unsigned int cachesize;
+	time_t cachettl;
+	time_t negcachettl;
+	dynamic_reference<HashProvider> sha256;
+	/** Set on users with a lookup in progress */
+	LocalIntExt pending;
+	/** User whose OPER line is being parsed again by OnResult, let through to the core */
+	LocalUser* resuming;
+	/** Random salt of the cache keys */
+	std::string salt;
+
+	/** Get the cache key of an oper name and password
+	 * @return A salted SHA-256 HMAC of both, or an empty string if no hash provider is loaded
+	 */
+	std::string GetKey(const std::string& name, const std::string& password)
+	{
+		if (!sha256)
+			return "";
+		return sha256->hmac(salt, name + " " + password);
+	}
 
-	bool HandleOper(LocalUser* user, const std::string& opername, const std::string& inputpass)
+	/** Find the oper block the user may use, NULL if none */
+	OperInfo* FindOper(LocalUser* user, const std::string& opername)
 	{
 		OperIndex::iterator it = ServerInstance->Config->oper_blocks.find(opername);
 		if (it == ServerInstance->Config->oper_blocks.end())
-			return false;
+			return NULL;
 
 		ConfigTag* tag = it->second->oper_block;
 		if (!tag)
-			return false;
+			return NULL;
 
 		std::string acceptedhosts = tag->getString("host");
 		std::string hostname = user->ident + "@" + user->host;
 		if (!InspIRCd::MatchMask(acceptedhosts, hostname, user->GetIPString()))
-			return false;
+			return NULL;
+
+		return it->second;
+	}
 
-		if (!LookupOper(opername, inputpass))
-			return false;
+	void AddCache(const LDAPOperRequest& req)
+	{
+		time_t ttl = req.authed ? cachettl : negcachettl;
+		if (!req.cacheable || ttl <= 0 || !cachesize || req.key.empty())
+			return;
 
-		user->Oper(it->second);
-		return true;
+		if (cache.size() >= cachesize)
+		{
+			// Make room by dropping expired entries, or any if there are none
+			for (LDAPOperCache::iterator i = cache.begin(); i != cache.end(); )
+			{
+				if (i->second.second <= ServerInstance->Time())
+					cache.erase(i++);
+				else
+					++i;
+			}
+			if (cache.size() >= cachesize)
+				cache.erase(cache.begin());
+		}
+
+		cache[req.key] = std::make_pair(req.authed, ServerInstance->Time() + ttl);
 	}
 
 public:
 	ModuleLDAPAuth()
-		: conn(NULL)
+		: worker(NULL), sha256(this, "hash/sha256"), pending("ldapoper_pending", this), resuming(NULL)
 	{
 	}
 
 	void init() CXX11_OVERRIDE
 	{
+		salt = ServerInstance->GenRandomStr(32, false);
+		ServerInstance->Modules->AddService(pending);
 		Implementation eventlist[] = { I_OnRehash, I_OnPreCommand };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		OnRehash(NULL);
+
+		worker = new LDAPOperWorker(this);
+		worker->SetConfig(config);
+		ServerInstance->Threads->Start(worker);
 	}
 
 	~ModuleLDAPAuth()
 	{
-		if (conn)
-			ldap_unbind_ext(conn, NULL, NULL);
+		if (worker)
+		{
+			// Waits for the request in progress, if any; the rest are dropped
+			worker->join();
+			delete worker;
+		}
 	}
 
 	void OnRehash(User* user) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("ldapoper");
 
-		base 			= tag->getString("baserdn");
-		ldapserver		= tag->getString("server");
+		config.base 		= tag->getString("baserdn");
+		config.ldapserver	= tag->getString("server");
 		std::string scope	= tag->getString("searchscope");
-		username		= tag->getString("binddn");
-		password		= tag->getString("bindauth");
-		attribute		= tag->getString("attribute");
+		config.username		= tag->getString("binddn");
+		config.password		= tag->getString("bindauth");
+		config.attribute	= tag->getString("attribute");
+		config.timeout		= tag->getInt("timeout", 5);
+		cachesize		= tag->getInt("cachesize", 100);
+		cachettl		= tag->getInt("cachettl", 300);
+		negcachettl		= tag->getInt("negcachettl", 60);
 
 		if (scope == "base")
-			searchscope = LDAP_SCOPE_BASE;
+			config.searchscope = LDAP_SCOPE_BASE;
 		else if (scope == "onelevel")
-			searchscope = LDAP_SCOPE_ONELEVEL;
-		else searchscope = LDAP_SCOPE_SUBTREE;
+			config.searchscope = LDAP_SCOPE_ONELEVEL;
+		else config.searchscope = LDAP_SCOPE_SUBTREE;
 
-		Connect();
+		// Answers given under the old settings may no longer be right
+		cache.clear();
+		if (worker)
+			worker->SetConfig(config);
 	}
 
-	bool Connect()
+	ModResult OnPreCommand(std::string& command, std::vector<std::string>& parameters, LocalUser* user, bool validated, const std::string& original_line) CXX11_OVERRIDE
 	{
-		if (conn != NULL)
-			ldap_unbind_ext(conn, NULL, NULL);
-		int res, v = LDAP_VERSION3;
-		res = ldap_initialize(&conn, ldapserver.c_str());
-		if (res != LDAP_SUCCESS)
+		if (validated && command == "OPER" && parameters.size() >= 2)
 		{
-			conn = NULL;
-			return false;
-		}
+			if (user == resuming)
+				return MOD_RES_PASSTHRU;
 
-		res = ldap_set_option(conn, LDAP_OPT_PROTOCOL_VERSION, (void *)&v);
-		if (res != LDAP_SUCCESS)
-		{
-			ldap_unbind_ext(conn, NULL, NULL);
-			conn = NULL;
-			return false;
+			if (pending.get(user))
+			{
+				user->WriteNotice("*** Your previous OPER attempt is still being checked, please wait");
+				return MOD_RES_DENY;
+			}
+
+			OperInfo* oper = FindOper(user, parameters[0]);
+			if (!oper)
+				return MOD_RES_PASSTHRU;
+
+			LDAPOperRequest* req = new LDAPOperRequest(user->uuid, parameters, original_line, GetKey(parameters[0], parameters[1]));
+			LDAPOperCache::iterator it = (req->key.empty() ? cache.end() : cache.find(req->key));
+			if (it != cache.end())
+			{
+				bool authed = it->second.first;
+				if (it->second.second > ServerInstance->Time())
+				{
+					delete req;
+					if (!authed)
+						return MOD_RES_PASSTHRU;
+					user->Oper(oper);
+					return MOD_RES_DENY;
+				}
+				cache.erase(it);
+			}
+
+			// The command is finished by OnResult once the worker has answered
+			pending.set(user, 1);
+			worker->Submit(req);
+			return MOD_RES_DENY;
 		}
-		return true;
+		return MOD_RES_PASSTHRU;
 	}
 
-	ModResult OnPreCommand(std::string& command, std::vector<std::string>& parameters, LocalUser* user, bool validated, const std::string& original_line) CXX11_OVERRIDE
+	/** Called on the main thread when the worker has answered a request */
+	void OnResult(const LDAPOperRequest& req)
 	{
-		if (validated && command == "OPER" && parameters.size() >= 2)
+		AddCache(req);
+
+		LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(req.uuid));
+		if (!user || user->quitting)
+			return;
+
+		pending.set(user, 0);
+
+		// The oper block may have gone away with a rehash while we were waiting
+		OperInfo* oper = req.authed ? FindOper(user, req.parameters[0]) : NULL;
+		if (oper)
 		{
-			if (HandleOper(user, parameters[0], parameters[1]))
-				return MOD_RES_DENY;
+			user->Oper(oper);
+			return;
 		}
-		return MOD_RES_PASSTHRU;
+
+		// Parse the line again, as if the user had just sent it, with this module stepping aside
+		std::string line = req.line;
+		resuming = user;
+		ServerInstance->Parser->ProcessBuffer(line, user);
+		resuming = NULL;
 	}
 
-	bool LookupOper(const std::string& opername, const std::string& opassword)
+	Version GetVersion() CXX11_OVERRIDE
 	{
-		if (conn == NULL)
-			if (!Connect())
-				return false;
+		return Version("Adds the ability to authenticate opers via LDAP", VF_VENDOR);
+	}
 
-		int res;
-		char* authpass = strdup(password.c_str());
-		// bind anonymously if no bind DN and authentication are given in the config
-		struct berval cred;
-		cred.bv_val = authpass;
-		cred.bv_len = password.length();
+};
 
-		if ((res = ldap_sasl_bind_s(conn, username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) != LDAP_SUCCESS)
-		{
-			if (res == LDAP_SERVER_DOWN)
-			{
-				// Attempt to reconnect if the connection dropped
-				ServerInstance->SNO->WriteToSnoMask('a', "LDAP server has gone away - reconnecting...");
-				Connect();
-				res = ldap_sasl_bind_s(conn, username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-			}
+LDAPOperWorker::~LDAPOperWorker()
+{
+	if (conn)
+		ldap_unbind_ext(conn, NULL, NULL);
+	for (std::deque<LDAPOperRequest*>::iterator i = queue.begin(); i != queue.end(); ++i)
+		delete *i;
+	for (std::deque<LDAPOperRequest*>::iterator i = results.begin(); i != results.end(); ++i)
+		delete *i;
+}
+
+bool LDAPOperWorker::Connect()
+{
+	if (conn != NULL)
+		ldap_unbind_ext(conn, NULL, NULL);
+	int res, v = LDAP_VERSION3;
+	res = ldap_initialize(&conn, config.ldapserver.c_str());
+	if (res != LDAP_SUCCESS)
+	{
+		conn = NULL;
+		return false;
+	}
 
-			if (res != LDAP_SUCCESS)
-			{
-				free(authpass);
-				ldap_unbind_ext(conn, NULL, NULL);
-				conn = NULL;
-				return false;
-			}
-		}
-		free(authpass);
+	res = ldap_set_option(conn, LDAP_OPT_PROTOCOL_VERSION, (void *)&v);
+	if (res != LDAP_SUCCESS)
+	{
+		ldap_unbind_ext(conn, NULL, NULL);
+		conn = NULL;
+		return false;
+	}
 
-		LDAPMessage *msg, *entry;
-		std::string what = attribute + "=" + opername;
-		if ((res = ldap_search_ext_s(conn, base.c_str(), searchscope, what.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msg)) != LDAP_SUCCESS)
-		{
-			return false;
-		}
-		if (ldap_count_entries(conn, msg) > 1)
+	// Don't let an unresponsive server hold this worker forever
+	struct timeval tv;
+	tv.tv_sec = config.timeout;
+	tv.tv_usec = 0;
+	ldap_set_option(conn, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+	ldap_set_option(conn, LDAP_OPT_TIMEOUT, &tv);
+	return true;
+}
+
+void LDAPOperWorker::LookupOper(LDAPOperRequest* req)
+{
+	if (conn == NULL)
+		if (!Connect())
+			return;
+
+	int res;
+	// bind anonymously if no bind DN and authentication are given in the config
+	struct berval cred;
+	cred.bv_val = const_cast<char*>(config.password.c_str());
+	cred.bv_len = config.password.length();
+
+	if ((res = ldap_sasl_bind_s(conn, config.username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) != LDAP_SUCCESS)
+	{
+		if (res == LDAP_SERVER_DOWN)
 		{
-			ldap_msgfree(msg);
-			return false;
+			// Attempt to reconnect if the connection dropped
+			if (Connect())
+				res = ldap_sasl_bind_s(conn, config.username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
 		}
-		if ((entry = ldap_first_entry(conn, msg)) == NULL)
+
+		if (res != LDAP_SUCCESS)
 		{
-			ldap_msgfree(msg);
-			return false;
+			if (conn)
+				ldap_unbind_ext(conn, NULL, NULL);
+			conn = NULL;
+			return;
 		}
-		authpass = strdup(opassword.c_str());
-		cred.bv_val = authpass;
-		cred.bv_len = opassword.length();
-		RAIILDAPString DN(ldap_get_dn(conn, entry));
-		if ((res = ldap_sasl_bind_s(conn, DN, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) == LDAP_SUCCESS)
+	}
+
+	LDAPMessage *msg, *entry;
+	std::string what = config.attribute + "=" + req->parameters[0];
+	if ((res = ldap_search_ext_s(conn, config.base.c_str(), config.searchscope, what.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msg)) != LDAP_SUCCESS)
+	{
+		return;
+	}
+
+	// From here on the directory has given a definite answer
+	req->cacheable = true;
+	if (ldap_count_entries(conn, msg) > 1)
+	{
+		ldap_msgfree(msg);
+		return;
+	}
+	if ((entry = ldap_first_entry(conn, msg)) == NULL)
+	{
+		ldap_msgfree(msg);
+		return;
+	}
+	cred.bv_val = const_cast<char*>(req->parameters[1].c_str());
+	cred.bv_len = req->parameters[1].length();
+	RAIILDAPString DN(ldap_get_dn(conn, entry));
+	res = ldap_sasl_bind_s(conn, DN, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+	ldap_msgfree(msg);
+
+	// Only a rejected password is worth remembering
+	req->authed = (res == LDAP_SUCCESS);
+	req->cacheable = (req->authed || res == LDAP_INVALID_CREDENTIALS);
+}
+
+void LDAPOperWorker::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
+	{
+		if (queue.empty())
 		{
-			free(authpass);
-			ldap_msgfree(msg);
-			return true;
+			this->WaitForQueue();
+			continue;
 		}
-		else
+
+		if (reconfigure)
 		{
-			free(authpass);
-			ldap_msgfree(msg);
-			return false;
+			config = newconfig;
+			reconfigure = false;
+			if (conn)
+				ldap_unbind_ext(conn, NULL, NULL);
+			conn = NULL;
 		}
+
+		// The main thread only appends to the queue, the front is ours until popped
+		LDAPOperRequest* req = queue.front();
+		this->UnlockQueue();
+		LookupOper(req);
+		this->LockQueue();
+		queue.pop_front();
+		results.push_back(req);
+		NotifyParent();
 	}
+	this->UnlockQueue();
+}
 
-	Version GetVersion() CXX11_OVERRIDE
+void LDAPOperWorker::OnNotify()
+{
+	std::deque<LDAPOperRequest*> done;
+	this->LockQueue();
+	done.swap(results);
+	this->UnlockQueue();
+
+	for (std::deque<LDAPOperRequest*>::iterator i = done.begin(); i != done.end(); ++i)
 	{
-		return Version("Adds the ability to authenticate opers via LDAP", VF_VENDOR);
+		Parent->OnResult(**i);
+		delete *i;
 	}
-
-};
+}
 
 MODULE_INIT(ModuleLDAPAuth)
@@ -44,21 +44,23 @@
  * that instead, you should thread your program. This is what i've done here to allow for
  * asyncronous SQL requests via mysql. The way this works is as follows:
  *
- * The module spawns a thread via class Thread, and performs its mysql queries in this thread,
- * using a queue with priorities. There is a mutex on either end which prevents two threads
- * adjusting the queue at the same time, and crashing the ircd. Every 50 milliseconds, the
- * worker thread wakes up, and checks if there is a request at the head of its queue.
- * If there is, it processes this request, blocking the worker thread but leaving the ircd
- * thread to go about its business as usual. During this period, the ircd thread is able
- * to insert futher pending requests into the queue.
+ * Each <database> gets a pool of worker threads (class Thread), each holding its own mysql
+ * connection and its own query queue. A new request goes to the worker with the shortest
+ * queue, so one slow query only holds up the requests queued behind it on that connection.
+ * There is a mutex on either end of each queue which prevents two threads adjusting it at
+ * the same time, and crashing the ircd. A worker sleeps until a request is put on its queue.
+ * It then processes the request at the head of the queue, blocking the worker thread but
+ * leaving the ircd thread to go about its business as usual. During this period, the ircd
+ * thread is able to insert futher pending requests into the queue.
  *
  * Once the processing of a request is complete, it is removed from the incoming queue to
- * an outgoing queue, and initialized as a 'response'. The worker thread then signals the
- * ircd thread (via a loopback socket) of the fact a result is available, by sending the
- * connection ID through the connection.
+ * an outgoing queue, and initialized as a 'response'. If the outgoing queue was empty, the
+ * worker thread then signals the ircd thread (via a loopback socket) that results are
+ * available; responses completed before the ircd thread gets round to reading them are
+ * picked up by the same signal.
  *
- * The ircd thread then mutexes the queue once more, reads the outbound response off the head
- * of the queue, and sends it on its way to the original calling module.
+ * The ircd thread then mutexes the queue once more, reads all the outbound responses off
+ * the queue, and sends them on their way to the original calling modules.
  *
  * XXX: You might be asking "why doesnt he just send the response from within the worker thread?"
  * The answer to this is simple. The majority of InspIRCd, and in fact most ircd's are not
@@ -80,15 +82,17 @@ struct QQueueItem
 {
 	SQLQuery* q;
 	std::string query;
-	SQLConnection* c;
-	QQueueItem(SQLQuery* Q, const std::string& S, SQLConnection* C) : q(Q), query(S), c(C) {}
+	/** When the query was submitted, see SQLStats::Now() */
+	unsigned long started;
+	QQueueItem(SQLQuery* Q, const std::string& S, unsigned long T) : q(Q), query(S), started(T) {}
 };
 
 struct RQueueItem
 {
 	SQLQuery* q;
 	MySQLresult* r;
-	RQueueItem(SQLQuery* Q, MySQLresult* R) : q(Q), r(R) {}
+	unsigned long started;
+	RQueueItem(SQLQuery* Q, MySQLresult* R, unsigned long T) : q(Q), r(R), started(T) {}
 };
 
 typedef std::map<std::string, SQLConnection*> ConnMap;
@@ -100,25 +104,33 @@ typedef std::deque<RQueueItem> ResultQueue;
 class ModuleSQL : public Module
 {
  public:
-	DispatcherThread* Dispatcher;
-	QueryQueue qq;       // MUST HOLD MUTEX
-	ResultQueue rq;      // MUST HOLD MUTEX
 	ConnMap connections; // main thread only
 
-	ModuleSQL();
 	void init() CXX11_OVERRIDE;
 	~ModuleSQL();
 	void OnRehash(User* user) CXX11_OVERRIDE;
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE;
 	Version GetVersion() CXX11_OVERRIDE;
 };
 
+/** One pooled connection to a database, and the thread which runs its queries
+ */
 class DispatcherThread : public SocketThread
 {
  private:
-	ModuleSQL* const Parent;
+	SQLConnection* const DB;
+	MYSQL* connection;   // worker thread only
+
+	bool Connect();
+	MySQLresult* DoBlockingQuery(const std::string& query);
+
  public:
-	DispatcherThread(ModuleSQL* CreatorModule) : Parent(CreatorModule) { }
+	QueryQueue qq;       // MUST HOLD MUTEX; the head is the active query while busy is set
+	ResultQueue rq;      // MUST HOLD MUTEX
+	bool busy;           // MUST HOLD MUTEX
+
+	DispatcherThread(SQLConnection* db) : DB(db), connection(NULL), busy(false) { }
 	~DispatcherThread() { }
 	void Run();
 	void OnNotify();
@@ -222,96 +234,71 @@ class MySQLresult : public SQLResult
 	}
 };
 
-/** Represents a connection to a mysql database
+/** Represents a mysql database, served by a pool of connections
  */
 class SQLConnection : public SQLProvider
 {
  public:
 	reference<ConfigTag> config;
-	MYSQL *connection;
-	Mutex lock;
+	std::vector<DispatcherThread*> pool;
+	SQLStats stats;
 
-	// This constructor creates an SQLConnection object with the given credentials, but does not connect yet.
 	SQLConnection(Module* p, ConfigTag* tag) : SQLProvider(p, "SQL/" + tag->getString("id")),
-		config(tag), connection(NULL)
+		config(tag)
 	{
+		unsigned int poolsize = tag->getInt("poolsize", 1);
+		if (poolsize < 1 || poolsize > 64)
+			poolsize = 1;
+		for (unsigned int i = 0; i < poolsize; i++)
+		{
+			DispatcherThread* worker = new DispatcherThread(this);
+			pool.push_back(worker);
+			ServerInstance->Threads->Start(worker);
+		}
 	}
 
+	/** Stop the workers, failing any queries they had not finished */
 	~SQLConnection()
 	{
-		Close();
-	}
-
-	// This method connects to the database using the credentials supplied to the constructor, and returns
-	// true upon success.
-	bool Connect()
-	{
-		unsigned int timeout = 1;
-		connection = mysql_init(connection);
-		mysql_options(connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
-		std::string host = config->getString("host");
-		std::string user = config->getString("user");
-		std::string pass = config->getString("pass");
-		std::string dbname = config->getString("name");
-		int port = config->getInt("port");
-		bool rv = mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, 0);
-		if (!rv)
-			return rv;
-		std::string initquery;
-		if (config->readString("initialquery", initquery))
+		SQLerror err(SQL_BAD_DBID);
+		for (std::vector<DispatcherThread*>::iterator i = pool.begin(); i != pool.end(); ++i)
 		{
-			mysql_query(connection,initquery.c_str());
+			DispatcherThread* worker = *i;
+			// waits for any query in progress to complete
+			worker->join();
+			worker->OnNotify();
+			for (QueryQueue::iterator j = worker->qq.begin(); j != worker->qq.end(); ++j)
+			{
+				if (!j->q)
+					continue;
+				j->q->OnError(err);
+				delete j->q;
+			}
+			delete worker;
 		}
-		return true;
-	}
-
-	ModuleSQL* Parent()
-	{
-		return (ModuleSQL*)(Module*)creator;
 	}
 
-	MySQLresult* DoBlockingQuery(const std::string& query)
+	void submit(SQLQuery* q, const std::string& qs)
 	{
-
-		/* Parse the command string and dispatch it to mysql */
-		if (CheckConnection() && !mysql_real_query(connection, query.data(), query.length()))
-		{
-			/* Successfull query */
-			MYSQL_RES* res = mysql_use_result(connection);
-			unsigned long rows = mysql_affected_rows(connection);
-			return new MySQLresult(res, rows);
-		}
-		else
+		// Hand the query to the worker with the least outstanding work
+		DispatcherThread* best = NULL;
+		size_t bestsize = 0;
+		for (std::vector<DispatcherThread*>::iterator i = pool.begin(); i != pool.end(); ++i)
 		{
-			/* XXX: See /usr/include/mysql/mysqld_error.h for a list of
-			 * possible error numbers and error messages */
-			SQLerror e(SQL_QREPLY_FAIL, ConvToStr(mysql_errno(connection)) + ": " + mysql_error(connection));
-			return new MySQLresult(e);
+			DispatcherThread* worker = *i;
+			worker->LockQueue();
+			size_t size = worker->qq.size();
+			worker->UnlockQueue();
+			if (!best || size < bestsize)
+			{
+				best = worker;
+				bestsize = size;
+			}
 		}
-	}
-
-	bool CheckConnection()
-	{
-		if (!connection || mysql_ping(connection) != 0)
-			return Connect();
-		return true;
-	}
-
-	std::string GetError()
-	{
-		return mysql_error(connection);
-	}
 
-	void Close()
-	{
-		mysql_close(connection);
-	}
-
-	void submit(SQLQuery* q, const std::string& qs)
-	{
-		Parent()->Dispatcher->LockQueue();
-		Parent()->qq.push_back(QQueueItem(q, qs, this));
-		Parent()->Dispatcher->UnlockQueueWakeup();
+		best->LockQueue();
+		best->qq.push_back(QQueueItem(q, qs, SQLStats::Now()));
+		best->UnlockQueueWakeup();
 	}
 
 	void submit(SQLQuery* call, const std::string& q, const ParamL& p)
@@ -372,17 +359,11 @@ class SQLConnection : public SQLProvider
 	}
 };
 
-ModuleSQL::ModuleSQL()
-{
-	Dispatcher = NULL;
-}
-
 void ModuleSQL::init()
 {
-	Dispatcher = new DispatcherThread(this);
-	ServerInstance->Threads->Start(Dispatcher);
+	mysql_library_init(0, NULL, NULL);
 
-	Implementation eventlist[] = { I_OnRehash, I_OnUnloadModule };
+	Implementation eventlist[] = { I_OnRehash, I_OnUnloadModule, I_OnStats };
 	ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 
 	OnRehash(NULL);
@@ -390,12 +371,6 @@ void ModuleSQL::init()
 
 ModuleSQL::~ModuleSQL()
 {
-	if (Dispatcher)
-	{
-		Dispatcher->join();
-		Dispatcher->OnNotify();
-		delete Dispatcher;
-	}
 	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
 		delete i->second;
@@ -426,57 +401,67 @@ void ModuleSQL::OnRehash(User* user)
 	}
 
 	// now clean up the deleted databases
-	Dispatcher->LockQueue();
-	SQLerror err(SQL_BAD_DBID);
 	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
 		ServerInstance->Modules->DelService(*i->second);
-		// it might be running a query on this database. Wait for that to complete
-		i->second->lock.Lock();
-		i->second->lock.Unlock();
-		// now remove all active queries to this DB
-		for (size_t j = qq.size(); j > 0; j--)
-		{
-			size_t k = j - 1;
-			if (qq[k].c == i->second)
-			{
-				qq[k].q->OnError(err);
-				delete qq[k].q;
-				qq.erase(qq.begin() + k);
-			}
-		}
-		// finally, nuke the connection
 		delete i->second;
 	}
-	Dispatcher->UnlockQueue();
 	connections.swap(conns);
 }
 
 void ModuleSQL::OnUnloadModule(Module* mod)
 {
 	SQLerror err(SQL_BAD_DBID);
-	Dispatcher->LockQueue();
-	unsigned int i = qq.size();
-	while (i > 0)
+	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
-		i--;
-		if (qq[i].q->creator == mod)
+		for (std::vector<DispatcherThread*>::iterator w = i->second->pool.begin(); w != i->second->pool.end(); ++w)
 		{
-			if (i == 0)
+			DispatcherThread* worker = *w;
+			worker->LockQueue();
+			QueryQueue& qq = worker->qq;
+			for (size_t j = qq.size(); j > 0; j--)
 			{
-				// need to wait until the query is done
-				// (the result will be discarded)
-				qq[i].c->lock.Lock();
-				qq[i].c->lock.Unlock();
+				size_t k = j - 1;
+				if (!qq[k].q || qq[k].q->creator != mod)
+					continue;
+				qq[k].q->OnError(err);
+				delete qq[k].q;
+				if (k == 0 && worker->busy)
+				{
+					// still running, the worker discards the result
+					qq[k].q = NULL;
+				}
+				else
+					qq.erase(qq.begin() + k);
 			}
-			qq[i].q->OnError(err);
-			delete qq[i].q;
-			qq.erase(qq.begin() + i);
+			worker->UnlockQueue();
+			// clean up any result queue entries
+			worker->OnNotify();
 		}
 	}
-	Dispatcher->UnlockQueue();
-	// clean up any result queue entries
-	Dispatcher->OnNotify();
+}
+
+ModResult ModuleSQL::OnStats(char symbol, User* user, string_list& results)
+{
+	if (symbol != 'Q')
+		return MOD_RES_PASSTHRU;
+
+	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+	{
+		SQLConnection* conn = i->second;
+		size_t queued = 0;
+		size_t active = 0;
+		for (std::vector<DispatcherThread*>::iterator w = conn->pool.begin(); w != conn->pool.end(); ++w)
+		{
+			(*w)->LockQueue();
+			queued += (*w)->qq.size();
+			if ((*w)->busy)
+				active++;
+			(*w)->UnlockQueue();
+		}
+		conn->stats.Report(i->first, conn->pool.size(), queued, active, user, results);
+	}
+	return MOD_RES_PASSTHRU;
 }
 
 Version ModuleSQL::GetVersion()
@@ -484,31 +469,87 @@ Version ModuleSQL::GetVersion()
 	return Version("MySQL support", VF_VENDOR);
 }
 
+bool DispatcherThread::Connect()
+{
+	unsigned int timeout = 1;
+	connection = mysql_init(connection);
+	mysql_options(connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
+	// Bounds how long a single query may take. The client library tries a read up to
+	// three times before it gives up, so a third of the configured timeout is used.
+	unsigned int querytimeout = DB->config->getInt("timeout", 0);
+	if (querytimeout)
+	{
+		querytimeout = (querytimeout + 2) / 3;
+		mysql_options(connection,MYSQL_OPT_READ_TIMEOUT,(char*)&querytimeout);
+		mysql_options(connection,MYSQL_OPT_WRITE_TIMEOUT,(char*)&querytimeout);
+	}
+	std::string host = DB->config->getString("host");
+	std::string user = DB->config->getString("user");
+	std::string pass = DB->config->getString("pass");
+	std::string dbname = DB->config->getString("name");
+	int port = DB->config->getInt("port");
+	bool rv = mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, 0);
+	if (!rv)
+		return rv;
+	std::string initquery;
+	if (DB->config->readString("initialquery", initquery))
+	{
+		mysql_query(connection,initquery.c_str());
+	}
+	return true;
+}
+
+MySQLresult* DispatcherThread::DoBlockingQuery(const std::string& query)
+{
+	/* Reconnect if the connection was lost */
+	bool connected = (connection && mysql_ping(connection) == 0) || Connect();
+
+	/* Parse the command string and dispatch it to mysql */
+	if (connected && !mysql_real_query(connection, query.data(), query.length()))
+	{
+		/* Successfull query */
+		MYSQL_RES* res = mysql_use_result(connection);
+		unsigned long rows = mysql_affected_rows(connection);
+		return new MySQLresult(res, rows);
+	}
+	else
+	{
+		/* XXX: See /usr/include/mysql/mysqld_error.h for a list of
+		 * possible error numbers and error messages */
+		SQLerror e(SQL_QREPLY_FAIL, ConvToStr(mysql_errno(connection)) + ": " + mysql_error(connection));
+		return new MySQLresult(e);
+	}
+}
+
 void DispatcherThread::Run()
 {
 	this->LockQueue();
 	while (!this->GetExitFlag())
 	{
-		if (!Parent->qq.empty())
+		if (!qq.empty())
 		{
-			QQueueItem i = Parent->qq.front();
-			i.c->lock.Lock();
+			std::string query = qq.front().query;
+			busy = true;
 			this->UnlockQueue();
-			MySQLresult* res = i.c->DoBlockingQuery(i.query);
-			i.c->lock.Unlock();
+			MySQLresult* res = DoBlockingQuery(query);
 
 			/*
-			 * At this point, the main thread could be working on:
-			 *  Rehash - delete i.c out from under us. We don't care about that.
-			 *  UnloadModule - delete i.q and the qq item. Need to avoid reporting results.
+			 * At this point, the main thread could have run OnUnloadModule, which
+			 * deletes the query and clears q in the queue item; the item itself
+			 * stays at the head of the queue for us to remove.
 			 */
 
 			this->LockQueue();
-			if (!Parent->qq.empty() && Parent->qq.front().q == i.q)
+			busy = false;
+			QQueueItem i = qq.front();
+			qq.pop_front();
+			if (i.q)
 			{
-				Parent->qq.pop_front();
-				Parent->rq.push_back(RQueueItem(i.q, res));
-				NotifyParent();
+				// Results finished before the main thread reads them share one notification
+				bool wakeup = rq.empty();
+				rq.push_back(RQueueItem(i.q, res, i.started));
+				if (wakeup)
+					NotifyParent();
 			}
 			else
 			{
@@ -525,15 +566,20 @@ void DispatcherThread::Run()
 		}
 	}
 	this->UnlockQueue();
+
+	if (connection)
+		mysql_close(connection);
+	mysql_thread_end();
 }
 
 void DispatcherThread::OnNotify()
 {
 	// this could unlock during the dispatch, but OnResult isn't expected to take that long
 	this->LockQueue();
-	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
+	for(ResultQueue::iterator i = rq.begin(); i != rq.end(); i++)
 	{
 		MySQLresult* res = i->r;
+		DB->stats.Done(i->started, res->err.id != SQL_NO_ERROR);
 		if (res->err.id == SQL_NO_ERROR)
 			i->q->OnResult(*res);
 		else
@@ -541,7 +587,7 @@ void DispatcherThread::OnNotify()
 		delete i->q;
 		delete i->r;
 	}
-	Parent->rq.clear();
+	rq.clear();
 	this->UnlockQueue();
 }
 
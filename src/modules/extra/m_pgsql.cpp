@@ -38,11 +38,17 @@
  * and delete of resources.
  */
 
+/* Each <database> is an SQLDatabase, which owns a pool of SQLConn connections and hands
+ * every new query to the connected one with the least outstanding work. libpq is used in
+ * nonblocking mode from the socket engine, so there is no need for threads here.
+ */
+
 /* Forward declare, so we can have the typedef neatly at the top */
 class SQLConn;
+class SQLDatabase;
 class ModulePgSQL;
 
-typedef std::map<std::string, SQLConn*> ConnMap;
+typedef std::map<std::string, SQLDatabase*> ConnMap;
 
 /* CREAD,	Connecting and wants read event
  * CWRITE,	Connecting and wants write event
@@ -64,11 +70,26 @@ class ReconnectTimer : public Timer
 	bool Tick(time_t TIME);
 };
 
+/** Fails queries which have been running for longer than their database's timeout
+ */
+class QueryTimeoutTimer : public Timer
+{
+ private:
+	ModulePgSQL* mod;
+ public:
+	QueryTimeoutTimer(ModulePgSQL* m) : Timer(1, ServerInstance->Time(), true), mod(m)
+	{
+	}
+	bool Tick(time_t TIME);
+};
+
 struct QueueItem
 {
 	SQLQuery* c;
 	std::string q;
-	QueueItem(SQLQuery* C, const std::string& Q) : c(C), q(Q) {}
+	/** When the query was submitted, see SQLStats::Now() */
+	unsigned long started;
+	QueueItem(SQLQuery* C, const std::string& Q) : c(C), q(Q), started(SQLStats::Now()) {}
 };
 
 /** PgSQLresult is a subclass of the mostly-pure-virtual class SQLresult.
@@ -137,34 +158,27 @@ class PgSQLresult : public SQLResult
 
 /** SQLConn represents one SQL session.
  */
-class SQLConn : public SQLProvider, public EventHandler
+/** One connection in the pool of a database
+ */
+class SQLConn : public EventHandler
 {
  public:
+	SQLDatabase* const db;	/* The database this connection belongs to */
 	reference<ConfigTag> conf;	/* The <database> entry */
 	std::deque<QueueItem> queue;
 	PGconn* 		sql;		/* PgSQL database connection handle */
 	SQLstatus		status;		/* PgSQL database connection status */
 	QueueItem		qinprog;	/* If there is currently a query in progress */
+	time_t			qsent;		/* When qinprog was sent to the server */
 
-	SQLConn(Module* Creator, ConfigTag* tag)
-	: SQLProvider(Creator, "SQL/" + tag->getString("id")), conf(tag), sql(NULL), status(CWRITE), qinprog(NULL, "")
+	SQLConn(SQLDatabase* DB, ConfigTag* tag)
+	: db(DB), conf(tag), sql(NULL), status(CWRITE), qinprog(NULL, ""), qsent(0)
 	{
-		if (!DoConnect())
-		{
-			ServerInstance->Logs->Log("m_pgsql", LOG_DEFAULT, "WARNING: Could not connect to database " + tag->getString("id"));
-			DelayReconnect();
-		}
-	}
-
-	CullResult cull()
-	{
-		this->SQLProvider::cull();
-		ServerInstance->Modules->DelService(*this);
-		return this->EventHandler::cull();
 	}
 
 	~SQLConn()
 	{
+		Close();
 		SQLerror err(SQL_BAD_DBID);
 		if (qinprog.c)
 		{
@@ -316,11 +330,13 @@ restart:
 					case PGRES_FATAL_ERROR:
 					{
 						SQLerror err(SQL_QREPLY_FAIL, PQresultErrorMessage(result));
+						Finished(qinprog, true);
 						qinprog.c->OnError(err);
 						break;
 					}
 					default:
 						/* Other values are not errors */
+						Finished(qinprog, false);
 						qinprog.c->OnResult(reply);
 				}
 
@@ -368,12 +384,40 @@ restart:
 	}
 
 	void DelayReconnect();
+	void Finished(const QueueItem& req, bool failed);
+
+	/** Work not yet finished on this connection, including the query in progress */
+	size_t GetLoad()
+	{
+		return queue.size() + (qinprog.c ? 1 : 0);
+	}
+
+	bool IsConnected()
+	{
+		return (status == WREAD || status == WWRITE);
+	}
+
+	/** Fail the query in progress if it has run for longer than timeout seconds */
+	void CheckTimeout(time_t timeout)
+	{
+		if (!qinprog.c || qsent + timeout >= ServerInstance->Time())
+			return;
+
+		SQLerror err(SQL_QREPLY_FAIL, "Query timed out");
+		Finished(qinprog, true);
+		qinprog.c->OnError(err);
+		delete qinprog.c;
+		qinprog = QueueItem(NULL, "");
+		// The server may still answer the abandoned query, so start afresh
+		DelayReconnect();
+	}
 
 	void DoEvent()
 	{
 		if((status == CREAD) || (status == CWRITE))
 		{
-			DoPoll();
+			if (!DoPoll())
+				DelayReconnect();
 		}
 		else if((status == RREAD) || (status == RWRITE))
 		{
@@ -386,15 +430,20 @@ restart:
 	}
 
 	void submit(SQLQuery *req, const std::string& q)
+	{
+		Enqueue(QueueItem(req,q));
+	}
+
+	void Enqueue(const QueueItem& req)
 	{
 		if (qinprog.q.empty())
 		{
-			DoQuery(QueueItem(req,q));
+			DoQuery(req);
 		}
 		else
 		{
 			// wait your turn.
-			queue.push_back(QueueItem(req,q));
+			queue.push_back(req);
 		}
 	}
 
@@ -468,6 +517,7 @@ restart:
 		{
 			// whoops, not connected...
 			SQLerror err(SQL_BAD_CONN);
+			Finished(req, true);
 			req.c->OnError(err);
 			delete req.c;
 			return;
@@ -476,10 +526,12 @@ restart:
 		if(PQsendQuery(sql, req.q.c_str()))
 		{
 			qinprog = req;
+			qsent = ServerInstance->Time();
 		}
 		else
 		{
 			SQLerror err(SQL_QSEND_FAIL, PQerrorMessage(sql));
+			Finished(req, true);
 			req.c->OnError(err);
 			delete req.c;
 		}
@@ -487,7 +539,8 @@ restart:
 
 	void Close()
 	{
-		ServerInstance->SE->DelFd(this);
+		if (ServerInstance->SE->HasFd(this->fd) && ServerInstance->SE->GetRef(this->fd) == this)
+			ServerInstance->SE->DelFd(this);
 
 		if(sql)
 		{
@@ -497,14 +550,111 @@ restart:
 	}
 };
 
+/** A <database>, served by a pool of connections
+ */
+class SQLDatabase : public SQLProvider
+{
+ public:
+	reference<ConfigTag> conf;	/* The <database> entry */
+	std::vector<SQLConn*> pool;
+	SQLStats stats;
+
+	SQLDatabase(Module* Creator, ConfigTag* tag)
+		: SQLProvider(Creator, "SQL/" + tag->getString("id")), conf(tag)
+	{
+	}
+
+	~SQLDatabase()
+	{
+		for (std::vector<SQLConn*>::iterator i = pool.begin(); i != pool.end(); ++i)
+		{
+			(*i)->cull();
+			delete *i;
+		}
+	}
+
+	/** Open connections until the pool is full
+	 * @return False if a connection could not be made
+	 */
+	bool Fill()
+	{
+		unsigned int poolsize = conf->getInt("poolsize", 1);
+		if (poolsize < 1 || poolsize > 64)
+			poolsize = 1;
+		while (pool.size() < poolsize)
+		{
+			SQLConn* conn = new SQLConn(this, conf);
+			if (!conn->DoConnect())
+			{
+				ServerInstance->Logs->Log("m_pgsql", LOG_DEFAULT, "WARNING: Could not connect to database " + conf->getString("id"));
+				conn->cull();
+				delete conn;
+				return false;
+			}
+			pool.push_back(conn);
+		}
+		return true;
+	}
+
+	/** Get the connected connection with the least outstanding work, or NULL if none are connected */
+	SQLConn* Pick()
+	{
+		SQLConn* best = NULL;
+		for (std::vector<SQLConn*>::iterator i = pool.begin(); i != pool.end(); ++i)
+		{
+			SQLConn* conn = *i;
+			if (conn->IsConnected() && (!best || conn->GetLoad() < best->GetLoad()))
+				best = conn;
+		}
+		return best;
+	}
+
+	/** Fail a query because no connection is available */
+	void NoConnection(SQLQuery* req)
+	{
+		SQLerror err(SQL_BAD_CONN);
+		stats.Done(SQLStats::Now(), true);
+		req->OnError(err);
+		delete req;
+	}
+
+	void submit(SQLQuery* req, const std::string& q)
+	{
+		SQLConn* conn = Pick();
+		if (conn)
+			conn->submit(req, q);
+		else
+			NoConnection(req);
+	}
+
+	void submit(SQLQuery* req, const std::string& q, const ParamL& p)
+	{
+		SQLConn* conn = Pick();
+		if (conn)
+			conn->submit(req, q, p);
+		else
+			NoConnection(req);
+	}
+
+	void submit(SQLQuery* req, const std::string& q, const ParamM& p)
+	{
+		SQLConn* conn = Pick();
+		if (conn)
+			conn->submit(req, q, p);
+		else
+			NoConnection(req);
+	}
+};
+
 class ModulePgSQL : public Module
 {
  public:
 	ConnMap connections;
 	ReconnectTimer* retimer;
+	QueryTimeoutTimer timeouttimer;
 
 	ModulePgSQL()
-		: retimer(NULL)
+		: retimer(NULL), timeouttimer(this)
 	{
 	}
 
@@ -512,8 +662,9 @@ class ModulePgSQL : public Module
 	{
 		ReadConf();
 
-		Implementation eventlist[] = { I_OnUnloadModule, I_OnRehash };
+		Implementation eventlist[] = { I_OnUnloadModule, I_OnRehash, I_OnStats };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+		ServerInstance->Timers->AddTimer(&timeouttimer);
 	}
 
 	~ModulePgSQL()
@@ -522,6 +673,16 @@ class ModulePgSQL : public Module
 		ClearAllConnections();
 	}
 
+	/** Start the reconnect timer if it is not already running */
+	void DelayReconnect()
+	{
+		if (!retimer)
+		{
+			retimer = new ReconnectTimer(this);
+			ServerInstance->Timers->AddTimer(retimer);
+		}
+	}
+
 	void OnRehash(User* user) CXX11_OVERRIDE
 	{
 		ReadConf();
@@ -539,12 +700,17 @@ class ModulePgSQL : public Module
 			ConnMap::iterator curr = connections.find(id);
 			if (curr == connections.end())
 			{
-				SQLConn* conn = new SQLConn(this, i->second);
-				conns.insert(std::make_pair(id, conn));
-				ServerInstance->Modules->AddService(*conn);
+				SQLDatabase* db = new SQLDatabase(this, i->second);
+				if (!db->Fill())
+					DelayReconnect();
+				conns.insert(std::make_pair(id, db));
+				ServerInstance->Modules->AddService(*db);
 			}
 			else
 			{
+				// Replace any connections which were lost
+				if (!curr->second->Fill())
+					DelayReconnect();
 				conns.insert(*curr);
 				connections.erase(curr);
 			}
@@ -557,7 +723,7 @@ class ModulePgSQL : public Module
 	{
 		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 		{
-			i->second->cull();
+			ServerInstance->Modules->DelService(*i->second);
 			delete i->second;
 		}
 		connections.clear();
@@ -568,27 +734,65 @@ class ModulePgSQL : public Module
 		SQLerror err(SQL_BAD_DBID);
 		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 		{
-			SQLConn* conn = i->second;
-			if (conn->qinprog.c && conn->qinprog.c->creator == mod)
-			{
-				conn->qinprog.c->OnError(err);
-				delete conn->qinprog.c;
-				conn->qinprog.c = NULL;
-			}
-			std::deque<QueueItem>::iterator j = conn->queue.begin();
-			while (j != conn->queue.end())
+			for (std::vector<SQLConn*>::iterator c = i->second->pool.begin(); c != i->second->pool.end(); ++c)
 			{
-				SQLQuery* q = j->c;
-				if (q->creator == mod)
+				SQLConn* conn = *c;
+				if (conn->qinprog.c && conn->qinprog.c->creator == mod)
 				{
-					q->OnError(err);
-					delete q;
-					j = conn->queue.erase(j);
+					conn->qinprog.c->OnError(err);
+					delete conn->qinprog.c;
+					conn->qinprog.c = NULL;
 				}
-				else
-					j++;
+				std::deque<QueueItem>::iterator j = conn->queue.begin();
+				while (j != conn->queue.end())
+				{
+					SQLQuery* q = j->c;
+					if (q->creator == mod)
+					{
+						q->OnError(err);
+						delete q;
+						j = conn->queue.erase(j);
+					}
+					else
+						j++;
+				}
+			}
+		}
+	}
+
+	void CheckTimeouts()
+	{
+		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+		{
+			time_t timeout = i->second->conf->getInt("timeout", 0);
+			if (timeout <= 0)
+				continue;
+			// CheckTimeout() may remove the connection from the pool
+			std::vector<SQLConn*> pool(i->second->pool);
+			for (std::vector<SQLConn*>::iterator c = pool.begin(); c != pool.end(); ++c)
+				(*c)->CheckTimeout(timeout);
+		}
+	}
+
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'Q')
+			return MOD_RES_PASSTHRU;
+
+		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+		{
+			SQLDatabase* db = i->second;
+			size_t queued = 0;
+			size_t active = 0;
+			for (std::vector<SQLConn*>::iterator c = db->pool.begin(); c != db->pool.end(); ++c)
+			{
+				queued += (*c)->GetLoad();
+				if ((*c)->qinprog.c)
+					active++;
 			}
+			db->stats.Report(i->first, db->pool.size(), queued, active, user, results);
 		}
+		return MOD_RES_PASSTHRU;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -604,20 +808,44 @@ bool ReconnectTimer::Tick(time_t time)
 	return false;
 }
 
+bool QueryTimeoutTimer::Tick(time_t time)
+{
+	mod->CheckTimeouts();
+	return true;
+}
+
 void SQLConn::DelayReconnect()
 {
-	ModulePgSQL* mod = (ModulePgSQL*)(Module*)creator;
-	ConnMap::iterator it = mod->connections.find(conf->getString("id"));
-	if (it != mod->connections.end())
+	ModulePgSQL* mod = (ModulePgSQL*)(Module*)db->creator;
+	std::vector<SQLConn*>::iterator it = std::find(db->pool.begin(), db->pool.end(), this);
+	if (it != db->pool.end())
 	{
-		mod->connections.erase(it);
+		db->pool.erase(it);
 		ServerInstance->GlobalCulls.AddItem((EventHandler*)this);
-		if (!mod->retimer)
+		mod->DelayReconnect();
+
+		// Queries which were not sent yet can still go to the rest of the pool
+		std::deque<QueueItem> pending;
+		pending.swap(queue);
+		for (std::deque<QueueItem>::iterator i = pending.begin(); i != pending.end(); ++i)
 		{
-			mod->retimer = new ReconnectTimer(mod);
-			ServerInstance->Timers->AddTimer(mod->retimer);
+			SQLConn* conn = db->Pick();
+			if (conn)
+			{
+				conn->Enqueue(*i);
+				continue;
+			}
+			SQLerror err(SQL_BAD_CONN);
+			Finished(*i, true);
+			i->c->OnError(err);
+			delete i->c;
 		}
 	}
 }
 
+void SQLConn::Finished(const QueueItem& req, bool failed)
+{
+	db->stats.Done(req.started, failed);
+}
+
 MODULE_INIT(ModulePgSQL)
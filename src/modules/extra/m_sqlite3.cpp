@@ -32,18 +32,82 @@
 /* $LinkerFlags: pkgconflibs("sqlite3","/libsqlite3.so","-lsqlite3") */
 /* $NoPedantic */
 
+/* Queries are run on a single dispatcher thread, in the same way as m_mysql: the
+ * main thread appends to qq and wakes the dispatcher, which runs the query with the
+ * database locked and hands the result back through rq and NotifyParent().
+ *
+ * Query formats whose parameters each make up a whole string literal ('$nick' or '?')
+ * are turned into SQL with real ? placeholders. That text is the same for every
+ * submission of the format, so the compiled statement is kept and rebound rather
+ * than prepared again. Formats using parameters any other way are escaped into the
+ * query text as they always were.
+ */
+
 class SQLConn;
+class SQLite3Result;
+class DispatcherThread;
+
+struct QQueueItem
+{
+	SQLQuery* q;
+	std::string query;
+	/** Values for the ? placeholders in query */
+	ParamL values;
+	/** True if the prepared statement may be kept for the next query with the same text */
+	bool cacheable;
+	SQLConn* c;
+	QQueueItem(SQLQuery* Q, const std::string& S, const ParamL& V, bool Cacheable, SQLConn* C)
+		: q(Q), query(S), values(V), cacheable(Cacheable), c(C) {}
+};
+
+struct RQueueItem
+{
+	SQLQuery* q;
+	SQLite3Result* r;
+	RQueueItem(SQLQuery* Q, SQLite3Result* R) : q(Q), r(R) {}
+};
+
 typedef std::map<std::string, SQLConn*> ConnMap;
+typedef std::deque<QQueueItem> QueryQueue;
+typedef std::deque<RQueueItem> ResultQueue;
+
+class ModuleSQLite3 : public Module
+{
+ public:
+	DispatcherThread* Dispatcher;
+	QueryQueue qq;       // MUST HOLD MUTEX
+	ResultQueue rq;      // MUST HOLD MUTEX
+	ConnMap conns;       // main thread only
+
+	ModuleSQLite3();
+	void init() CXX11_OVERRIDE;
+	~ModuleSQLite3();
+	void OnRehash(User* user) CXX11_OVERRIDE;
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	Version GetVersion() CXX11_OVERRIDE;
+};
+
+class DispatcherThread : public SocketThread
+{
+ private:
+	ModuleSQLite3* const Parent;
+ public:
+	DispatcherThread(ModuleSQLite3* CreatorModule) : Parent(CreatorModule) { }
+	~DispatcherThread() { }
+	void Run();
+	void OnNotify();
+};
 
 class SQLite3Result : public SQLResult
 {
  public:
+	SQLerror err;
 	int currentrow;
 	int rows;
 	std::vector<std::string> columns;
 	std::vector<SQLEntries> fieldlists;
 
-	SQLite3Result() : currentrow(0), rows(0)
+	SQLite3Result() : err(SQL_NO_ERROR), currentrow(0), rows(0)
 	{
 	}
 
@@ -73,84 +137,213 @@ class SQLite3Result : public SQLResult
 	}
 };
 
+/** Convert a query format into SQL text using ? placeholders.
+ * Only parameters which are a complete string literal on their own can be bound,
+ * as binding never happens inside a literal or in place of a keyword or name.
+ * @param q The query format
+ * @param pl Positional parameters, used when pm is NULL
+ * @param pm Named parameters
+ * @param sql Receives the SQL text
+ * @param values Receives the placeholder values, in order
+ * @return False if some parameter cannot be bound; sql and values are then unusable
+ */
+static bool BuildStatement(const std::string& q, const ParamL* pl, const ParamM* pm, std::string& sql, ParamL& values)
+{
+	bool inquote = false;
+	unsigned int param = 0;
+	for(std::string::size_type i = 0; i < q.length(); i++)
+	{
+		if (q[i] != (pm ? '$' : '?'))
+		{
+			if (q[i] == '\'')
+				inquote = !inquote;
+			sql.push_back(q[i]);
+			continue;
+		}
+
+		std::string value;
+		if (pm)
+		{
+			std::string field;
+			while (i + 1 < q.length() && isalnum(q[i + 1]))
+				field.push_back(q[++i]);
+			ParamM::const_iterator it = pm->find(field);
+			if (it != pm->end())
+				value = it->second;
+		}
+		else if (param < pl->size())
+			value = (*pl)[param++];
+
+		// The literal must open right before the parameter (and not be a '' escape) and close right after it
+		std::string::size_type len = sql.length();
+		if ((!inquote) || (len == 0) || (sql[len - 1] != '\'') || (len > 1 && sql[len - 2] == '\''))
+			return false;
+		if ((i + 1 >= q.length()) || (q[i + 1] != '\''))
+			return false;
+
+		sql[len - 1] = '?';
+		values.push_back(value);
+		inquote = false;
+		i++;
+	}
+	return true;
+}
+
 class SQLConn : public SQLProvider
 {
+	typedef std::map<std::string, sqlite3_stmt*> StatementMap;
+
 	sqlite3* conn;
 	reference<ConfigTag> config;
+	/** Prepared statements keyed by their SQL text, only used by the dispatcher thread */
+	StatementMap statements;
+	unsigned int maxstatements;
 
  public:
+	/** Held by the dispatcher thread while it runs a query on this database */
+	Mutex lock;
+
 	SQLConn(Module* Parent, ConfigTag* tag) : SQLProvider(Parent, "SQL/" + tag->getString("id")), config(tag)
 	{
+		maxstatements = tag->getInt("statementcache", 32);
 		std::string host = tag->getString("hostname");
 		if (sqlite3_open_v2(host.c_str(), &conn, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
 		{
 			ServerInstance->Logs->Log("m_sqlite3", LOG_DEFAULT, "WARNING: Could not open DB with id: " + tag->getString("id"));
+			sqlite3_close(conn);
 			conn = NULL;
+			return;
 		}
+		// Queries run off the main thread, so it is fine to wait for other writers
+		sqlite3_busy_timeout(conn, tag->getInt("timeout", 5000));
 	}
 
 	~SQLConn()
 	{
-		sqlite3_interrupt(conn);
+		for(StatementMap::iterator i = statements.begin(); i != statements.end(); ++i)
+			sqlite3_finalize(i->second);
 		sqlite3_close(conn);
 	}
 
-	void Query(SQLQuery* query, const std::string& q)
+	std::string GetHost()
 	{
-		SQLite3Result res;
-		sqlite3_stmt *stmt;
-		int err = sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL);
-		if (err != SQLITE_OK)
+		return config->getString("hostname");
+	}
+
+	ModuleSQLite3* Parent()
+	{
+		return (ModuleSQLite3*)(Module*)creator;
+	}
+
+	/** Run a query; called by the dispatcher thread with lock held */
+	SQLite3Result* DoBlockingQuery(const QQueueItem& item)
+	{
+		SQLite3Result* res = new SQLite3Result;
+		if (!conn)
 		{
-			SQLerror error(SQL_QSEND_FAIL, sqlite3_errmsg(conn));
-			query->OnError(error);
-			return;
+			res->err = SQLerror(SQL_BAD_CONN, "Database is not open");
+			return res;
 		}
+
+		sqlite3_stmt* stmt = NULL;
+		bool cached = false;
+		if (item.cacheable)
+		{
+			StatementMap::iterator i = statements.find(item.query);
+			if (i != statements.end())
+			{
+				stmt = i->second;
+				cached = true;
+			}
+		}
+
+		if (!stmt)
+		{
+			if (sqlite3_prepare_v2(conn, item.query.c_str(), item.query.length(), &stmt, NULL) != SQLITE_OK)
+			{
+				res->err = SQLerror(SQL_QSEND_FAIL, sqlite3_errmsg(conn));
+				return res;
+			}
+			if (item.cacheable && maxstatements)
+			{
+				if (statements.size() >= maxstatements)
+				{
+					sqlite3_finalize(statements.begin()->second);
+					statements.erase(statements.begin());
+				}
+				statements.insert(std::make_pair(item.query, stmt));
+				cached = true;
+			}
+		}
+
+		for(unsigned int i = 0; i < item.values.size(); i++)
+			sqlite3_bind_text(stmt, i + 1, item.values[i].data(), item.values[i].length(), SQLITE_STATIC);
+
 		int cols = sqlite3_column_count(stmt);
-		res.columns.resize(cols);
+		res->columns.resize(cols);
 		for(int i=0; i < cols; i++)
 		{
-			res.columns[i] = sqlite3_column_name(stmt, i);
+			res->columns[i] = sqlite3_column_name(stmt, i);
 		}
 		while (1)
 		{
-			err = sqlite3_step(stmt);
+			int err = sqlite3_step(stmt);
 			if (err == SQLITE_ROW)
 			{
 				// Add the row
-				res.fieldlists.resize(res.rows + 1);
-				res.fieldlists[res.rows].resize(cols);
+				res->fieldlists.resize(res->rows + 1);
+				res->fieldlists[res->rows].resize(cols);
 				for(int i=0; i < cols; i++)
 				{
 					const char* txt = (const char*)sqlite3_column_text(stmt, i);
 					if (txt)
-						res.fieldlists[res.rows][i] = SQLEntry(txt);
+						res->fieldlists[res->rows][i] = SQLEntry(txt);
 				}
-				res.rows++;
+				res->rows++;
 			}
 			else if (err == SQLITE_DONE)
 			{
-				query->OnResult(res);
 				break;
 			}
 			else
 			{
-				SQLerror error(SQL_QREPLY_FAIL, sqlite3_errmsg(conn));
-				query->OnError(error);
+				res->err = SQLerror(SQL_QREPLY_FAIL, sqlite3_errmsg(conn));
 				break;
 			}
 		}
-		sqlite3_finalize(stmt);
+
+		if (cached)
+		{
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+		}
+		else
+			sqlite3_finalize(stmt);
+		return res;
+	}
+
+	void Queue(SQLQuery* query, const std::string& q, const ParamL& values, bool cacheable)
+	{
+		Parent()->Dispatcher->LockQueue();
+		Parent()->qq.push_back(QQueueItem(query, q, values, cacheable, this));
+		Parent()->Dispatcher->UnlockQueueWakeup();
 	}
 
 	void submit(SQLQuery* query, const std::string& q)
 	{
-		Query(query, q);
-		delete query;
+		Queue(query, q, ParamL(), false);
 	}
 
 	void submit(SQLQuery* query, const std::string& q, const ParamL& p)
 	{
+		std::string sql;
+		ParamL values;
+		if (BuildStatement(q, &p, NULL, sql, values))
+		{
+			Queue(query, sql, values, true);
+			return;
+		}
+
 		std::string res;
 		unsigned int param = 0;
 		for(std::string::size_type i = 0; i < q.length(); i++)
@@ -172,6 +365,14 @@ class SQLConn : public SQLProvider
 
 	void submit(SQLQuery* query, const std::string& q, const ParamM& p)
 	{
+		std::string sql;
+		ParamL values;
+		if (BuildStatement(q, NULL, &p, sql, values))
+		{
+			Queue(query, sql, values, true);
+			return;
+		}
+
 		std::string res;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
@@ -198,58 +399,167 @@ class SQLConn : public SQLProvider
 	}
 };
 
-class ModuleSQLite3 : public Module
+ModuleSQLite3::ModuleSQLite3()
 {
-	ConnMap conns;
+	Dispatcher = NULL;
+}
 
- public:
-	void init() CXX11_OVERRIDE
-	{
-		ReadConf();
+void ModuleSQLite3::init()
+{
+	Dispatcher = new DispatcherThread(this);
+	ServerInstance->Threads->Start(Dispatcher);
+
+	Implementation eventlist[] = { I_OnRehash, I_OnUnloadModule };
+	ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+
+	OnRehash(NULL);
+}
 
-		Implementation eventlist[] = { I_OnRehash };
-		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+ModuleSQLite3::~ModuleSQLite3()
+{
+	if (Dispatcher)
+	{
+		Dispatcher->join();
+		Dispatcher->OnNotify();
+		delete Dispatcher;
+	}
+	for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
+	{
+		delete i->second;
 	}
+}
 
-	~ModuleSQLite3()
+void ModuleSQLite3::OnRehash(User* user)
+{
+	ConnMap newconns;
+	ConfigTagList tags = ServerInstance->Config->ConfTags("database");
+	for(ConfigIter i = tags.first; i != tags.second; i++)
 	{
-		ClearConns();
+		if (i->second->getString("module", "sqlite") != "sqlite")
+			continue;
+		std::string id = i->second->getString("id");
+		ConnMap::iterator curr = conns.find(id);
+		if (curr == conns.end() || curr->second->GetHost() != i->second->getString("hostname"))
+		{
+			SQLConn* conn = new SQLConn(this, i->second);
+			newconns.insert(std::make_pair(id, conn));
+			ServerInstance->Modules->AddService(*conn);
+		}
+		else
+		{
+			newconns.insert(*curr);
+			conns.erase(curr);
+		}
 	}
 
-	void ClearConns()
+	// now clean up the deleted databases
+	Dispatcher->LockQueue();
+	SQLerror err(SQL_BAD_DBID);
+	for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
 	{
-		for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
+		ServerInstance->Modules->DelService(*i->second);
+		// it might be running a query on this database. Wait for that to complete
+		i->second->lock.Lock();
+		i->second->lock.Unlock();
+		// now remove all active queries to this DB
+		for (size_t j = qq.size(); j > 0; j--)
 		{
-			SQLConn* conn = i->second;
-			ServerInstance->Modules->DelService(*conn);
-			delete conn;
+			size_t k = j - 1;
+			if (qq[k].c == i->second)
+			{
+				qq[k].q->OnError(err);
+				delete qq[k].q;
+				qq.erase(qq.begin() + k);
+			}
 		}
-		conns.clear();
+		// finally, nuke the connection
+		delete i->second;
 	}
+	Dispatcher->UnlockQueue();
+	conns.swap(newconns);
+}
 
-	void ReadConf()
+void ModuleSQLite3::OnUnloadModule(Module* mod)
+{
+	SQLerror err(SQL_BAD_DBID);
+	Dispatcher->LockQueue();
+	unsigned int i = qq.size();
+	while (i > 0)
 	{
-		ClearConns();
-		ConfigTagList tags = ServerInstance->Config->ConfTags("database");
-		for(ConfigIter i = tags.first; i != tags.second; i++)
+		i--;
+		if (qq[i].q->creator == mod)
 		{
-			if (i->second->getString("module", "sqlite") != "sqlite")
-				continue;
-			SQLConn* conn = new SQLConn(this, i->second);
-			conns.insert(std::make_pair(i->second->getString("id"), conn));
-			ServerInstance->Modules->AddService(*conn);
+			if (i == 0)
+			{
+				// need to wait until the query is done
+				// (the result will be discarded)
+				qq[i].c->lock.Lock();
+				qq[i].c->lock.Unlock();
+			}
+			qq[i].q->OnError(err);
+			delete qq[i].q;
+			qq.erase(qq.begin() + i);
 		}
 	}
+	Dispatcher->UnlockQueue();
+	// clean up any result queue entries
+	Dispatcher->OnNotify();
+}
 
-	void OnRehash(User* user) CXX11_OVERRIDE
+Version ModuleSQLite3::GetVersion()
+{
+	return Version("sqlite3 provider", VF_VENDOR);
+}
+
+void DispatcherThread::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
 	{
-		ReadConf();
+		if (!Parent->qq.empty())
+		{
+			QQueueItem i = Parent->qq.front();
+			i.c->lock.Lock();
+			this->UnlockQueue();
+			SQLite3Result* res = i.c->DoBlockingQuery(i);
+			i.c->lock.Unlock();
+
+			this->LockQueue();
+			if (!Parent->qq.empty() && Parent->qq.front().q == i.q)
+			{
+				Parent->qq.pop_front();
+				Parent->rq.push_back(RQueueItem(i.q, res));
+				NotifyParent();
+			}
+			else
+			{
+				// OnUnloadModule ate the query
+				delete res;
+			}
+		}
+		else
+		{
+			this->WaitForQueue();
+		}
 	}
+	this->UnlockQueue();
+}
 
-	Version GetVersion() CXX11_OVERRIDE
+void DispatcherThread::OnNotify()
+{
+	this->LockQueue();
+	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
 	{
-		return Version("sqlite3 provider", VF_VENDOR);
+		SQLite3Result* res = i->r;
+		if (res->err.id == SQL_NO_ERROR)
+			i->q->OnResult(*res);
+		else
+			i->q->OnError(res->err);
+		delete i->q;
+		delete i->r;
 	}
-};
+	Parent->rq.clear();
+	this->UnlockQueue();
+}
 
 MODULE_INIT(ModuleSQLite3)
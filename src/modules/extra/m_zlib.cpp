@@ -0,0 +1,206 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "modules/compress.h"
+#include <zlib.h>
+
+/* $ModDep: modules/compress.h */
+/* $LinkerFlags: -lz */
+
+class ZlibStream : public CompressionStream
+{
+ protected:
+	z_stream zs;
+
+	/** Run the stream until all input is consumed and no more output is pending,
+	 * or until limit bytes were produced
+	 */
+	int Run(int flush, std::string& out, size_t limit = std::string::npos)
+	{
+		char buf[16384];
+		int ret;
+		do
+		{
+			zs.next_out = reinterpret_cast<Bytef*>(buf);
+			zs.avail_out = std::min(sizeof(buf), limit);
+			size_t room = zs.avail_out;
+			ret = Step(flush);
+			size_t have = room - zs.avail_out;
+			out.append(buf, have);
+			bytes_out += have;
+			limit -= have;
+			if (ret != Z_OK)
+				break;
+		} while (limit && (zs.avail_out == 0 || zs.avail_in != 0));
+		return ret;
+	}
+
+	/** Start feeding data through the stream */
+	void SetInput(const char* data, size_t len)
+	{
+		zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		zs.avail_in = len;
+	}
+
+	/** Get how much of the input passed to SetInput() was consumed and count it */
+	size_t Consumed(size_t len)
+	{
+		len -= zs.avail_in;
+		bytes_in += len;
+		zs.next_in = NULL;
+		zs.avail_in = 0;
+		return len;
+	}
+
+	virtual int Step(int flush) = 0;
+
+ public:
+	ZlibStream()
+	{
+		memset(&zs, 0, sizeof(zs));
+	}
+};
+
+class Deflater : public ZlibStream
+{
+	/** True if data was added since the last flush */
+	bool dirty;
+
+	int Step(int flush) CXX11_OVERRIDE
+	{
+		return deflate(&zs, flush);
+	}
+
+ public:
+	Deflater(int level) : dirty(false)
+	{
+		if (deflateInit(&zs, level) != Z_OK)
+			throw ModuleException("deflateInit failed");
+	}
+
+	~Deflater()
+	{
+		deflateEnd(&zs);
+	}
+
+	bool Process(const char* data, size_t& len, std::string& out, size_t limit) CXX11_OVERRIDE
+	{
+		clock_t start = clock();
+		SetInput(data, len);
+		dirty = true;
+		/* Z_BUF_ERROR just means nothing was ready to be emitted yet */
+		int ret = Run(Z_NO_FLUSH, out, limit);
+		len = Consumed(len);
+		cpu += clock() - start;
+		return (ret == Z_OK || ret == Z_BUF_ERROR);
+	}
+
+	void Flush(std::string& out) CXX11_OVERRIDE
+	{
+		if (!dirty)
+			return;
+		dirty = false;
+		clock_t start = clock();
+		zs.next_in = NULL;
+		zs.avail_in = 0;
+		Run(Z_SYNC_FLUSH, out);
+		cpu += clock() - start;
+	}
+};
+
+class Inflater : public ZlibStream
+{
+	int Step(int flush) CXX11_OVERRIDE
+	{
+		return inflate(&zs, flush);
+	}
+
+ public:
+	Inflater()
+	{
+		if (inflateInit(&zs) != Z_OK)
+			throw ModuleException("inflateInit failed");
+	}
+
+	~Inflater()
+	{
+		inflateEnd(&zs);
+	}
+
+	bool Process(const char* data, size_t& len, std::string& out, size_t limit) CXX11_OVERRIDE
+	{
+		clock_t start = clock();
+		SetInput(data, len);
+		int ret = Run(Z_SYNC_FLUSH, out, limit);
+		/* Input is only left over if the output limit was hit */
+		bool ok = (zs.avail_in == 0 || zs.avail_out == 0);
+		len = Consumed(len);
+		cpu += clock() - start;
+		/* The peer never finishes the stream, so Z_STREAM_END is as bad as corrupt data */
+		return (ret == Z_OK || ret == Z_BUF_ERROR) && ok;
+	}
+};
+
+class ZlibProvider : public CompressionProvider
+{
+ public:
+	int level;
+
+	ZlibProvider(Module* parent) : CompressionProvider(parent, "zlib"), level(Z_DEFAULT_COMPRESSION) {}
+
+	CompressionStream* CreateCompressor() CXX11_OVERRIDE
+	{
+		return new Deflater(level);
+	}
+
+	CompressionStream* CreateDecompressor() CXX11_OVERRIDE
+	{
+		return new Inflater;
+	}
+};
+
+class ModuleZlib : public Module
+{
+	ZlibProvider zlib;
+ public:
+	ModuleZlib() : zlib(this)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
+	{
+		OnRehash(NULL);
+		ServerInstance->Modules->AddService(zlib);
+		ServerInstance->Modules->Attach(I_OnRehash, this);
+	}
+
+	void OnRehash(User* user) CXX11_OVERRIDE
+	{
+		zlib.level = ServerInstance->Config->ConfValue("zlib")->getInt("level", 6);
+		if (zlib.level < 1 || zlib.level > 9)
+			zlib.level = Z_DEFAULT_COMPRESSION;
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides zlib (deflate) compression streams", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleZlib)
@@ -26,7 +26,7 @@
 #include "modules/dns.h"
 
 /* Class holding data for a single entry */
-class DNSBLConfEntry
+class DNSBLConfEntry : public refcountbase
 {
 	public:
 		enum EnumBanaction { I_UNKNOWN, I_KILL, I_ZLINE, I_KLINE, I_GLINE, I_MARK };
@@ -41,54 +41,199 @@ class DNSBLConfEntry
 		DNSBLConfEntry(): type(A_BITMASK),duration(86400),bitmask(0),stats_hits(0), stats_misses(0) {}
 };
 
+/** An IPv4 address (host byte order, as returned by ntohl()) and the blacklist domain it was looked up in */
+typedef std::pair<unsigned long, std::string> DNSBLKey;
 
-/** Resolver for CGI:IRC hostnames encoded in ident/GECOS
+/** What a blacklist said about an address. Only the raw answer is kept so that
+ * a rehash changing the type, bitmask or records of a blacklist still applies.
+ */
+struct DNSBLVerdict
+{
+	/* True if the blacklist returned an A record for the address */
+	bool listed;
+	/* Last octet of the returned address */
+	unsigned char result;
+	/* Position in ModuleDNSBL::expiries */
+	std::multimap<time_t, DNSBLKey>::iterator expiry;
+
+	DNSBLVerdict() : listed(false), result(0) { }
+};
+
+class ModuleDNSBL;
+
+/** Looks up one address in one blacklist on behalf of every user connecting from it
  */
 class DNSBLResolver : public DNS::Request
 {
-	std::string theiruid;
-	LocalStringExt& nameExt;
-	LocalIntExt& countExt;
-	DNSBLConfEntry *ConfEntry;
+	ModuleDNSBL* mod;
+	DNSBLKey key;
 
  public:
+	DNSBLResolver(DNS::Manager *mgr, ModuleDNSBL *me, const std::string &hostname, const DNSBLKey& k);
+	void OnLookupComplete(const DNS::Query *r) CXX11_OVERRIDE;
+	void OnError(const DNS::Query *q) CXX11_OVERRIDE;
+};
+
+class ModuleDNSBL : public Module
+{
+	typedef std::map<DNSBLKey, DNSBLVerdict> VerdictCache;
+	/* A user waiting on a lookup, with the <dnsbl> block to apply to the answer */
+	typedef std::pair<std::string, reference<DNSBLConfEntry> > Waiter;
+	typedef std::map<DNSBLKey, std::vector<Waiter> > PendingMap;
+
+	std::vector<reference<DNSBLConfEntry> > DNSBLConfEntries;
+	dynamic_reference<DNS::Manager> DNS;
+	LocalStringExt nameExt;
+	LocalIntExt countExt;
+
+	/* Verdicts we already have, and when each of them runs out */
+	VerdictCache cache;
+	std::multimap<time_t, DNSBLKey> expiries;
+	/* Lookups in progress, with the users waiting on each. Blocks with the same
+	 * domain share the lookup, so a user may be waiting on it more than once.
+	 */
+	PendingMap pending;
+	/* Most verdicts to keep, and the longest time to keep one for */
+	unsigned long cachesize;
+	time_t maxttl;
+	/* Cache statistics */
+	unsigned long cache_hits, cache_misses, cache_shared;
+
+	/*
+	 *	Convert a string to EnumBanaction
+	 */
+	DNSBLConfEntry::EnumBanaction str2banaction(const std::string &action)
+	{
+		if(action.compare("KILL")==0)
+			return DNSBLConfEntry::I_KILL;
+		if(action.compare("KLINE")==0)
+			return DNSBLConfEntry::I_KLINE;
+		if(action.compare("ZLINE")==0)
+			return DNSBLConfEntry::I_ZLINE;
+		if(action.compare("GLINE")==0)
+			return DNSBLConfEntry::I_GLINE;
+		if(action.compare("MARK")==0)
+			return DNSBLConfEntry::I_MARK;
+
+		return DNSBLConfEntry::I_UNKNOWN;
+	}
+ public:
+	ModuleDNSBL()
+		: DNS(this, "DNS"), nameExt("dnsbl_match", this), countExt("dnsbl_pending", this)
+		, cachesize(0), maxttl(0), cache_hits(0), cache_misses(0), cache_shared(0)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
+	{
+		ReadConf();
+		ServerInstance->Modules->AddService(nameExt);
+		ServerInstance->Modules->AddService(countExt);
+		Implementation eventlist[] = { I_OnRehash, I_OnSetUserIP, I_OnStats, I_OnSetConnectClass, I_OnCheckReady };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+	}
+
+	~ModuleDNSBL()
+	{
+		ClearEntries();
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides handling of DNS blacklists", VF_VENDOR);
+	}
 
-	DNSBLResolver(DNS::Manager *mgr, Module *me, LocalStringExt& match, LocalIntExt& ctr, const std::string &hostname, LocalUser* u, DNSBLConfEntry *conf)
-		: DNS::Request(mgr, me, hostname, DNS::QUERY_A, true), theiruid(u->uuid), nameExt(match), countExt(ctr), ConfEntry(conf)
+	/** Clear entries and free the mem it was using
+	 */
+	void ClearEntries()
 	{
+		DNSBLConfEntries.clear();
 	}
 
-	/* Note: This may be called multiple times for multiple A record results */
-	void OnLookupComplete(const DNS::Query *r) CXX11_OVERRIDE
+	void RemoveVerdict(VerdictCache::iterator it)
 	{
-		/* Check the user still exists */
-		LocalUser* them = (LocalUser*)ServerInstance->FindUUID(theiruid);
-		if (!them)
+		expiries.erase(it->second.expiry);
+		cache.erase(it);
+	}
+
+	/** Drop expired verdicts, then the ones closest to expiring until at most limit are left
+	 */
+	void TrimCache(unsigned long limit)
+	{
+		while (!expiries.empty() && (expiries.begin()->first <= ServerInstance->Time() || cache.size() > limit))
+			RemoveVerdict(cache.find(expiries.begin()->second));
+	}
+
+	/** Find a verdict that has not expired yet
+	 */
+	const DNSBLVerdict* FindVerdict(const DNSBLKey& key)
+	{
+		VerdictCache::iterator it = cache.find(key);
+		if (it == cache.end())
+			return NULL;
+
+		if (it->second.expiry->first <= ServerInstance->Time())
+		{
+			RemoveVerdict(it);
+			return NULL;
+		}
+		return &it->second;
+	}
+
+	void AddVerdict(const DNSBLKey& key, const DNSBLVerdict& verdict, time_t ttl)
+	{
+		if (ttl > maxttl)
+			ttl = maxttl;
+		if ((ttl <= 0) || (!cachesize))
 			return;
 
-		const DNS::ResourceRecord &ans_record = r->answers[0];
+		VerdictCache::iterator it = cache.find(key);
+		if (it != cache.end())
+			RemoveVerdict(it);
+		TrimCache(cachesize - 1);
+
+		DNSBLVerdict& entry = cache[key];
+		entry = verdict;
+		entry.expiry = expiries.insert(std::make_pair(ServerInstance->Time() + ttl, key));
+	}
 
-		int i = countExt.get(them);
-		if (i)
-			countExt.set(them, i - 1);
+	/** One of the lookups a user was waiting for has finished
+	 */
+	void LookupDone(LocalUser* user)
+	{
+		int i = countExt.get(user);
+		if (!i)
+			return;
+
+		countExt.set(user, i - 1);
+		if ((i == 1) && (!user->quitting))
+			user->checktimer.ScheduleCheck(ServerInstance->Time());
+	}
+
+	/** Act on what a blacklist said about a user
+	 */
+	void ApplyVerdict(LocalUser* them, DNSBLConfEntry* ConfEntry, const DNSBLVerdict& verdict)
+	{
+		if (!verdict.listed)
+		{
+			ConfEntry->stats_misses++;
+			return;
+		}
 
 		// Now we calculate the bitmask: 256*(256*(256*a+b)+c)+d
 
 		unsigned int bitmask = 0, record = 0;
 		bool match = false;
-		in_addr resultip;
-
-		inet_aton(ans_record.rdata.c_str(), &resultip);
 
 		switch (ConfEntry->type)
 		{
 			case DNSBLConfEntry::A_BITMASK:
-				bitmask = resultip.s_addr >> 24; /* Last octet (network byte order) */
+				bitmask = verdict.result;
 				bitmask &= ConfEntry->bitmask;
 				match = (bitmask != 0);
 			break;
 			case DNSBLConfEntry::A_RECORD:
-				record = resultip.s_addr >> 24; /* Last octet */
+				record = verdict.result;
 				match = (ConfEntry->records[record] == 1);
 			break;
 		}
@@ -186,75 +331,34 @@ class DNSBLResolver : public DNS::Request
 			ConfEntry->stats_misses++;
 	}
 
-	void OnError(const DNS::Query *q) CXX11_OVERRIDE
-	{
-		LocalUser* them = (LocalUser*)ServerInstance->FindUUID(theiruid);
-		if (!them)
-			return;
-
-		int i = countExt.get(them);
-		if (i)
-			countExt.set(them, i - 1);
-
-		if (q->error == DNS::ERROR_NO_RECORDS || q->error == DNS::ERROR_DOMAIN_NOT_FOUND)
-			ConfEntry->stats_misses++;
-	}
-};
-
-class ModuleDNSBL : public Module
-{
-	std::vector<DNSBLConfEntry *> DNSBLConfEntries;
-	dynamic_reference<DNS::Manager> DNS;
-	LocalStringExt nameExt;
-	LocalIntExt countExt;
-
-	/*
-	 *	Convert a string to EnumBanaction
+	/** Hand the result of a lookup to every user waiting on it, each for
+	 * the <dnsbl> block it is waiting for
+	 * @param verdict What the blacklist said, or NULL if it could not be asked
+	 * @param ttl How long the verdict may be cached for
 	 */
-	DNSBLConfEntry::EnumBanaction str2banaction(const std::string &action)
+	void OnVerdict(const DNSBLKey& key, const DNSBLVerdict* verdict, time_t ttl)
 	{
-		if(action.compare("KILL")==0)
-			return DNSBLConfEntry::I_KILL;
-		if(action.compare("KLINE")==0)
-			return DNSBLConfEntry::I_KLINE;
-		if(action.compare("ZLINE")==0)
-			return DNSBLConfEntry::I_ZLINE;
-		if(action.compare("GLINE")==0)
-			return DNSBLConfEntry::I_GLINE;
-		if(action.compare("MARK")==0)
-			return DNSBLConfEntry::I_MARK;
+		if (verdict)
+			AddVerdict(key, *verdict, ttl);
 
-		return DNSBLConfEntry::I_UNKNOWN;
-	}
- public:
-	ModuleDNSBL() : DNS(this, "DNS"), nameExt("dnsbl_match", this), countExt("dnsbl_pending", this) { }
-
-	void init() CXX11_OVERRIDE
-	{
-		ReadConf();
-		ServerInstance->Modules->AddService(nameExt);
-		ServerInstance->Modules->AddService(countExt);
-		Implementation eventlist[] = { I_OnRehash, I_OnSetUserIP, I_OnStats, I_OnSetConnectClass, I_OnCheckReady };
-		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
-	}
+		PendingMap::iterator it = pending.find(key);
+		if (it == pending.end())
+			return;
 
-	~ModuleDNSBL()
-	{
-		ClearEntries();
-	}
+		std::vector<Waiter> waiting;
+		waiting.swap(it->second);
+		pending.erase(it);
 
-	Version GetVersion() CXX11_OVERRIDE
-	{
-		return Version("Provides handling of DNS blacklists", VF_VENDOR);
-	}
+		for (std::vector<Waiter>::const_iterator i = waiting.begin(); i != waiting.end(); ++i)
+		{
+			LocalUser* them = IS_LOCAL(ServerInstance->FindUUID(i->first));
+			if ((!them) || (them->quitting))
+				continue;
 
-	/** Clear entries and free the mem it was using
-	 */
-	void ClearEntries()
-	{
-		for (std::vector<DNSBLConfEntry *>::iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); i++)
-			delete *i;
-		DNSBLConfEntries.clear();
+			if (verdict)
+				ApplyVerdict(them, i->second, *verdict);
+			LookupDone(them);
+		}
 	}
 
 	/** Fill our conf vector with data
@@ -263,6 +367,13 @@ class ModuleDNSBL : public Module
 	{
 		ClearEntries();
 
+		ConfigTag* cachetag = ServerInstance->Config->ConfValue("dnsblcache");
+		cachesize = cachetag->getInt("size", 10000);
+		maxttl = InspIRCd::Duration(cachetag->getString("maxttl", "1h"));
+		if (maxttl <= 0)
+			cachesize = 0;
+		TrimCache(cachesize);
+
 		ConfigTagList dnsbls = ServerInstance->Config->ConfTags("dnsbl");
 		for(ConfigIter i = dnsbls.first; i != dnsbls.second; ++i)
 		{
@@ -358,32 +469,52 @@ class ModuleDNSBL : public Module
 		else
 			ServerInstance->Logs->Log("m_dnsbl", LOG_DEBUG, "User has no connect class in OnSetUserIP");
 
-		unsigned char a, b, c, d;
-		d = (unsigned char) (user->client_sa.in4.sin_addr.s_addr >> 24) & 0xFF;
-		c = (unsigned char) (user->client_sa.in4.sin_addr.s_addr >> 16) & 0xFF;
-		b = (unsigned char) (user->client_sa.in4.sin_addr.s_addr >> 8) & 0xFF;
-		a = (unsigned char) user->client_sa.in4.sin_addr.s_addr & 0xFF;
-
-		const std::string reversedip = ConvToStr(d) + "." + ConvToStr(c) + "." + ConvToStr(b) + "." + ConvToStr(a);
+		const unsigned long ip = ntohl(user->client_sa.in4.sin_addr.s_addr);
+		const std::string reversedip = ConvToStr(ip & 0xFF) + "." + ConvToStr((ip >> 8) & 0xFF) + "." + ConvToStr((ip >> 16) & 0xFF) + "." + ConvToStr(ip >> 24);
 
 		countExt.set(user, DNSBLConfEntries.size());
 
 		// For each DNSBL, we will run through this lookup
 		for (unsigned i = 0; i < DNSBLConfEntries.size(); ++i)
 		{
-			// Fill hostname with a dnsbl style host (d.c.b.a.domain.tld)
-			std::string hostname = reversedip + "." + DNSBLConfEntries[i]->domain;
+			DNSBLConfEntry* ConfEntry = DNSBLConfEntries[i];
+			const DNSBLKey key(ip, ConfEntry->domain);
 
-			/* now we'd need to fire off lookups for `hostname'. */
-			DNSBLResolver *r = new DNSBLResolver(*this->DNS, this, nameExt, countExt, hostname, user, DNSBLConfEntries[i]);
-			try
+			const DNSBLVerdict* verdict = FindVerdict(key);
+			if (verdict)
 			{
-				this->DNS->Process(r);
+				cache_hits++;
+				ApplyVerdict(user, ConfEntry, *verdict);
+				LookupDone(user);
 			}
-			catch (DNS::Exception &ex)
+			else
 			{
-				delete r;
-				ServerInstance->Logs->Log("m_dnsbl", LOG_DEBUG, std::string(ex.GetReason()));
+				// If this address is already being looked up in this domain, wait for that answer
+				std::vector<Waiter>& waiting = pending[key];
+				waiting.push_back(Waiter(user->uuid, ConfEntry));
+				if (waiting.size() > 1)
+				{
+					cache_shared++;
+					continue;
+				}
+
+				cache_misses++;
+
+				// Fill hostname with a dnsbl style host (d.c.b.a.domain.tld)
+				std::string hostname = reversedip + "." + ConfEntry->domain;
+
+				/* now we'd need to fire off lookups for `hostname'. */
+				DNSBLResolver *r = new DNSBLResolver(*this->DNS, this, hostname, key);
+				try
+				{
+					this->DNS->Process(r);
+				}
+				catch (DNS::Exception &ex)
+				{
+					delete r;
+					ServerInstance->Logs->Log("m_dnsbl", LOG_DEBUG, std::string(ex.GetReason()));
+					OnVerdict(key, NULL, 0);
+				}
 			}
 
 			if (user->quitting)
@@ -417,7 +548,7 @@ class ModuleDNSBL : public Module
 
 		unsigned long total_hits = 0, total_misses = 0;
 
-		for (std::vector<DNSBLConfEntry*>::iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); i++)
+		for (std::vector<reference<DNSBLConfEntry> >::iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); i++)
 		{
 			total_hits += (*i)->stats_hits;
 			total_misses += (*i)->stats_misses;
@@ -428,9 +559,51 @@ class ModuleDNSBL : public Module
 
 		results.push_back(ServerInstance->Config->ServerName + " 304 " + user->nick + " :DNSBLSTATS Total hits: " + ConvToStr(total_hits));
 		results.push_back(ServerInstance->Config->ServerName + " 304 " + user->nick + " :DNSBLSTATS Total misses: " + ConvToStr(total_misses));
+		results.push_back(ServerInstance->Config->ServerName + " 304 " + user->nick + " :DNSBLSTATS Cache: " + ConvToStr(cache.size()) + "/" + ConvToStr(cachesize) +
+				" verdicts, " + ConvToStr(cache_hits) + " hits, " + ConvToStr(cache_shared) + " shared lookups, " + ConvToStr(cache_misses) + " lookups");
 
 		return MOD_RES_PASSTHRU;
 	}
 };
 
+DNSBLResolver::DNSBLResolver(DNS::Manager *mgr, ModuleDNSBL *me, const std::string &hostname, const DNSBLKey& k)
+	: DNS::Request(mgr, me, hostname, DNS::QUERY_A, true), mod(me), key(k)
+{
+}
+
+void DNSBLResolver::OnLookupComplete(const DNS::Query *r)
+{
+	const DNS::ResourceRecord &ans_record = r->answers[0];
+
+	in_addr resultip;
+	inet_aton(ans_record.rdata.c_str(), &resultip);
+
+	DNSBLVerdict verdict;
+	verdict.listed = true;
+	verdict.result = ntohl(resultip.s_addr) & 0xFF; /* Last octet */
+
+	// A cached answer has already used up part of its TTL
+	mod->OnVerdict(key, &verdict, ans_record.created + ans_record.ttl - ServerInstance->Time());
+}
+
+void DNSBLResolver::OnError(const DNS::Query *q)
+{
+	if (q->error != DNS::ERROR_NO_RECORDS && q->error != DNS::ERROR_DOMAIN_NOT_FOUND)
+	{
+		mod->OnVerdict(key, NULL, 0);
+		return;
+	}
+
+	// Not listed; the SOA record, if any, says how long that holds
+	time_t ttl = 0;
+	for (std::vector<DNS::ResourceRecord>::const_iterator i = q->authorities.begin(); i != q->authorities.end(); ++i)
+	{
+		if (i->type == DNS::QUERY_SOA)
+			ttl = i->created + i->ttl - ServerInstance->Time();
+	}
+
+	DNSBLVerdict verdict;
+	mod->OnVerdict(key, &verdict, ttl);
+}
+
 MODULE_INIT(ModuleDNSBL)
@@ -29,9 +29,23 @@
 /* $ModDep: modules/httpd.h */
 
 class ModuleHttpServer;
+class HttpServerSocket;
 
 static ModuleHttpServer* HttpModule;
 static bool claimed;
+static std::set<HttpServerSocket*> sockets;
+
+/** Seconds a connection may sit idle before it is closed
+ */
+static unsigned int IdleTimeout;
+
+/** Ask a streamed document for more once less than this much is waiting to be sent
+ */
+static const size_t STREAM_LOWAT = 65536;
+
+/** Most bytes a connection may have waiting to be sent, it is closed if a response takes it over this
+ */
+static unsigned long MaxSendQ;
 
 /** HTTP socket states
  */
@@ -42,6 +56,21 @@ enum HttpState
 	HTTP_SERVE_SEND_DATA = 2 /* Sending response */
 };
 
+/** Closes a connection that has not done anything for a while
+ */
+class HttpIdleTimer : public Timer
+{
+	HttpServerSocket* sock;
+
+ public:
+	HttpIdleTimer(HttpServerSocket* s)
+		: Timer(IdleTimeout, ServerInstance->Time()), sock(s)
+	{
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE;
+};
+
 /** A socket used for HTTP transport
  */
 class HttpServerSocket : public BufferedSocket
@@ -57,22 +86,75 @@ class HttpServerSocket : public BufferedSocket
 	std::string uri;
 	std::string http_version;
 
+	/** True if the connection stays open after the current response
+	 */
+	bool keepalive;
+
+	/** True if the connection is to be closed once everything has been sent
+	 */
+	bool closing;
+
+	/** Body of the response being sent and the module that generated it, if it is streamed
+	 */
+	HTTPDocumentStream* stream;
+	Module* streamowner;
+	/** True if the stream is sent with chunked transfer encoding
+	 */
+	bool chunked;
+
+	HttpIdleTimer idle;
+
  public:
 	HttpServerSocket(int newfd, const std::string& IP, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
-		: BufferedSocket(newfd), ip(IP), postsize(0)
+		: BufferedSocket(newfd), ip(IP), postsize(0), keepalive(false), closing(false)
+		, stream(NULL), streamowner(NULL), chunked(false), idle(this)
 	{
 		InternalState = HTTP_SERVE_WAIT_REQUEST;
+		sockets.insert(this);
+		ServerInstance->Timers->AddTimer(&idle);
 
 		FOREACH_MOD(I_OnHookIO, OnHookIO(this, via));
 		if (GetIOHook())
 			GetIOHook()->OnStreamSocketAccept(this, client, server);
 	}
 
+	~HttpServerSocket()
+	{
+		delete stream;
+	}
+
+	CullResult cull() CXX11_OVERRIDE
+	{
+		sockets.erase(this);
+		return BufferedSocket::cull();
+	}
+
 	void OnError(BufferedSocketError) CXX11_OVERRIDE
 	{
 		ServerInstance->GlobalCulls.AddItem(this);
 	}
 
+	/** Close the connection without sending anything more
+	 */
+	void Shutdown(const std::string& reason)
+	{
+		if (!getError().empty())
+			return;
+		SetError(reason);
+		ServerInstance->GlobalCulls.AddItem(this);
+	}
+
+	/** Abort a streamed response because the module generating it is going away
+	 */
+	void DropStream(Module* mod)
+	{
+		if ((!stream) || (streamowner != mod))
+			return;
+		delete stream;
+		stream = NULL;
+		Shutdown("Module unloaded");
+	}
+
 	std::string Response(int response)
 	{
 		switch (response)
@@ -170,11 +252,17 @@ class HttpServerSocket : public BufferedSocket
 		std::string data = "<html><head></head><body>Server error "+ConvToStr(response)+": "+Response(response)+"<br>"+
 		                   "<small>Powered by <a href='http://www.inspircd.org'>InspIRCd</a></small></body></html>";
 
+		/* After a malformed request whatever the client sent next can not be trusted to be a request */
+		if (InternalState != HTTP_SERVE_SEND_DATA)
+			keepalive = false;
+		if (http_version.empty())
+			http_version = "HTTP/1.0";
 		SendHeaders(data.length(), response, empty);
 		WriteData(data);
+		ResponseDone();
 	}
 
-	void SendHeaders(unsigned long size, int response, HTTPHeaders &rheaders)
+	void SendHeaders(unsigned long size, int response, HTTPHeaders &rheaders, bool streamed = false)
 	{
 
 		WriteData(http_version + " "+ConvToStr(response)+" "+Response(response)+"\r\n");
@@ -186,17 +274,18 @@ class HttpServerSocket : public BufferedSocket
 		rheaders.CreateHeader("Date", date);
 
 		rheaders.CreateHeader("Server", BRANCH);
-		rheaders.SetHeader("Content-Length", ConvToStr(size));
 
-		if (size)
+		if (!streamed)
+			rheaders.SetHeader("Content-Length", ConvToStr(size));
+		else if (chunked)
+			rheaders.SetHeader("Transfer-Encoding", "chunked");
+
+		if (size || streamed)
 			rheaders.CreateHeader("Content-Type", "text/html");
 		else
 			rheaders.RemoveHeader("Content-Type");
 
-		/* Supporting Connection: keep-alive causes a whole world of hurt syncronizing timeouts,
-		 * so remove it, its not essential for what we need.
-		 */
-		rheaders.SetHeader("Connection", "Close");
+		rheaders.SetHeader("Connection", keepalive ? "Keep-Alive" : "Close");
 
 		WriteData(rheaders.GetFormattedHeaders());
 		WriteData("\r\n");
@@ -204,105 +293,136 @@ class HttpServerSocket : public BufferedSocket
 
 	void OnDataReady()
 	{
+		idle.SetInterval(IdleTimeout);
+
 		if (InternalState == HTTP_SERVE_RECV_POSTDATA)
 		{
-			postdata.append(recvq);
+			/* Anything after the post data is the next pipelined request */
+			size_t want = postsize - postdata.length();
+			if (recvq.length() > want)
+			{
+				postdata.append(recvq.data(), want);
+				reqbuffer.append(recvq.data() + want, recvq.length() - want);
+			}
+			else
+				postdata.append(recvq.data(), recvq.length());
+			recvq.clear();
 			if (postdata.length() >= postsize)
 				ServeData();
 		}
 		else
 		{
-			reqbuffer.append(recvq);
-
-			if (reqbuffer.length() >= 8192)
-			{
-				ServerInstance->Logs->Log("m_httpd", LOG_DEBUG, "m_httpd dropped connection due to an oversized request buffer");
-				reqbuffer.clear();
-				SetError("Buffer");
-			}
+			reqbuffer.append(recvq.data(), recvq.length());
+			recvq.clear();
+		}
 
-			if (InternalState == HTTP_SERVE_WAIT_REQUEST)
-				CheckRequestBuffer();
+		if (reqbuffer.length() >= 8192)
+		{
+			ServerInstance->Logs->Log("m_httpd", LOG_DEBUG, "m_httpd dropped connection due to an oversized request buffer");
+			reqbuffer.clear();
+			SetError("Buffer");
 		}
+
+		CheckRequestBuffer();
 	}
 
+	/** Serve every complete request in the buffer, stopping while a response
+	 * is still being streamed so that pipelined responses stay in order, and
+	 * while the client is slow to read what has already been queued for it
+	 */
 	void CheckRequestBuffer()
 	{
-		std::string::size_type reqend = reqbuffer.find("\r\n\r\n");
-		if (reqend == std::string::npos)
-			return;
-
-		// We have the headers; parse them all
-		std::string::size_type hbegin = 0, hend;
-		while ((hend = reqbuffer.find("\r\n", hbegin)) != std::string::npos)
+		while ((InternalState == HTTP_SERVE_WAIT_REQUEST) && (getSendQSize() <= STREAM_LOWAT) && (getError().empty()))
 		{
-			if (hbegin == hend)
-				break;
+			std::string::size_type reqend = reqbuffer.find("\r\n\r\n");
+			if (reqend == std::string::npos)
+				return;
 
-			if (request_type.empty())
+			// We have the headers; parse them all
+			std::string::size_type hbegin = 0, hend;
+			while ((hend = reqbuffer.find("\r\n", hbegin)) != std::string::npos)
 			{
-				std::istringstream cheader(std::string(reqbuffer, hbegin, hend - hbegin));
-				cheader >> request_type;
-				cheader >> uri;
-				cheader >> http_version;
+				if (hbegin == hend)
+					break;
 
-				if (request_type.empty() || uri.empty() || http_version.empty())
+				if (request_type.empty())
+				{
+					std::istringstream cheader(std::string(reqbuffer, hbegin, hend - hbegin));
+					cheader >> request_type;
+					cheader >> uri;
+					cheader >> http_version;
+
+					if (request_type.empty() || uri.empty() || http_version.empty())
+					{
+						SendHTTPError(400);
+						return;
+					}
+
+					hbegin = hend + 2;
+					continue;
+				}
+
+				std::string cheader = reqbuffer.substr(hbegin, hend - hbegin);
+
+				std::string::size_type fieldsep = cheader.find(':');
+				if ((fieldsep == std::string::npos) || (fieldsep == 0) || (fieldsep == cheader.length() - 1))
 				{
 					SendHTTPError(400);
 					return;
 				}
 
+				headers.SetHeader(cheader.substr(0, fieldsep), cheader.substr(fieldsep + 2));
+
 				hbegin = hend + 2;
-				continue;
 			}
 
-			std::string cheader = reqbuffer.substr(hbegin, hend - hbegin);
+			reqbuffer.erase(0, reqend + 4);
 
-			std::string::size_type fieldsep = cheader.find(':');
-			if ((fieldsep == std::string::npos) || (fieldsep == 0) || (fieldsep == cheader.length() - 1))
+			std::transform(request_type.begin(), request_type.end(), request_type.begin(), ::toupper);
+			std::transform(http_version.begin(), http_version.end(), http_version.begin(), ::toupper);
+
+			if ((http_version != "HTTP/1.1") && (http_version != "HTTP/1.0"))
 			{
-				SendHTTPError(400);
+				SendHTTPError(505);
 				return;
 			}
 
-			headers.SetHeader(cheader.substr(0, fieldsep), cheader.substr(fieldsep + 2));
-
-			hbegin = hend + 2;
-		}
+			/* HTTP/1.1 connections persist unless the client says otherwise, HTTP/1.0 ones only if it asks */
+			std::string connection = headers.GetHeader("Connection");
+			std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+			if (http_version == "HTTP/1.1")
+				keepalive = (connection != "close");
+			else
+				keepalive = (connection == "keep-alive");
 
-		reqbuffer.erase(0, reqend + 4);
+			if (headers.IsSet("Content-Length") && (postsize = ConvToInt(headers.GetHeader("Content-Length"))) > 0)
+			{
+				InternalState = HTTP_SERVE_RECV_POSTDATA;
 
-		std::transform(request_type.begin(), request_type.end(), request_type.begin(), ::toupper);
-		std::transform(http_version.begin(), http_version.end(), http_version.begin(), ::toupper);
+				if (reqbuffer.length() >= postsize)
+				{
+					postdata = reqbuffer.substr(0, postsize);
+					reqbuffer.erase(0, postsize);
+				}
+				else if (!reqbuffer.empty())
+				{
+					postdata = reqbuffer;
+					reqbuffer.clear();
+				}
 
-		if ((http_version != "HTTP/1.1") && (http_version != "HTTP/1.0"))
-		{
-			SendHTTPError(505);
-			return;
-		}
+				if (postdata.length() < postsize)
+					return;
+			}
 
-		if (headers.IsSet("Content-Length") && (postsize = ConvToInt(headers.GetHeader("Content-Length"))) > 0)
-		{
-			InternalState = HTTP_SERVE_RECV_POSTDATA;
+			ServeData();
 
-			if (reqbuffer.length() >= postsize)
+			if (getSendQSize() > MaxSendQ)
 			{
-				postdata = reqbuffer.substr(0, postsize);
-				reqbuffer.erase(0, postsize);
-			}
-			else if (!reqbuffer.empty())
-			{
-				postdata = reqbuffer;
-				reqbuffer.clear();
+				ServerInstance->Logs->Log("m_httpd", LOG_DEBUG, "m_httpd dropped connection due to an oversized send queue");
+				SetError("SendQ exceeded");
+				return;
 			}
-
-			if (postdata.length() >= postsize)
-				ServeData();
-
-			return;
 		}
-
-		ServeData();
 	}
 
 	void ServeData()
@@ -323,13 +443,107 @@ class HttpServerSocket : public BufferedSocket
 		}
 	}
 
+	/** The response has been queued in full, get ready for the next request or close
+	 */
+	void ResponseDone()
+	{
+		idle.SetInterval(IdleTimeout);
+
+		if (!keepalive)
+		{
+			InternalState = HTTP_SERVE_SEND_DATA;
+			closing = true;
+			return;
+		}
+
+		InternalState = HTTP_SERVE_WAIT_REQUEST;
+		headers.Clear();
+		postdata.clear();
+		postsize = 0;
+		request_type.clear();
+		uri.clear();
+		http_version.clear();
+	}
+
 	void Page(std::stringstream* n, int response, HTTPHeaders *hheaders)
 	{
 		SendHeaders(n->str().length(), response, *hheaders);
 		WriteData(n->str());
+		ResponseDone();
+	}
+
+	void Page(HTTPDocumentStream* body, Module* owner, int response, HTTPHeaders *hheaders)
+	{
+		/* Without chunked encoding the only way to mark the end of the document is to close */
+		chunked = (http_version == "HTTP/1.1");
+		if (!chunked)
+			keepalive = false;
+
+		stream = body;
+		streamowner = owner;
+		SendHeaders(0, response, *hheaders, true);
+		PumpStream();
+	}
+
+	/** Top up the send queue from the streamed document
+	 */
+	void PumpStream()
+	{
+		while ((stream) && (getSendQSize() < STREAM_LOWAT) && (getError().empty()))
+		{
+			std::string data;
+			bool more = stream->Generate(data);
+
+			if (!data.empty())
+			{
+				if (chunked)
+				{
+					char size[24];
+					snprintf(size, sizeof(size), "%lx\r\n", (unsigned long)data.length());
+					data.insert(0, size);
+					data.append("\r\n");
+				}
+				WriteData(data);
+			}
+
+			if (!more)
+			{
+				delete stream;
+				stream = NULL;
+				if (chunked)
+					WriteData("0\r\n\r\n");
+				ResponseDone();
+			}
+		}
+	}
+
+	void DoWrite() CXX11_OVERRIDE
+	{
+		BufferedSocket::DoWrite();
+		if (!getError().empty())
+			return;
+
+		if (stream)
+		{
+			idle.SetInterval(IdleTimeout);
+			PumpStream();
+		}
+
+		/* Requests that arrived while earlier responses were being sent */
+		CheckRequestBuffer();
+
+		if ((closing) && (!getSendQSize()))
+			Shutdown("Response sent");
 	}
 };
 
+bool HttpIdleTimer::Tick(time_t)
+{
+	sock->Shutdown("Idle timeout");
+	// The timer is part of the socket, returning false would make the TimerManager delete it
+	return true;
+}
+
 class HTTPdAPIImpl : public HTTPdAPIBase
 {
  public:
@@ -341,13 +555,15 @@ class HTTPdAPIImpl : public HTTPdAPIBase
 	void SendResponse(HTTPDocumentResponse& resp) CXX11_OVERRIDE
 	{
 		claimed = true;
-		resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
+		if (resp.stream)
+			resp.src.sock->Page(resp.stream, resp.module, resp.responsecode, &resp.headers);
+		else
+			resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
 	}
 };
 
 class ModuleHttpServer : public Module
 {
-	std::vector<HttpServerSocket *> httpsocks;
 	HTTPdAPIImpl APIImpl;
 
  public:
@@ -360,7 +576,24 @@ class ModuleHttpServer : public Module
 	{
 		HttpModule = this;
 		ServerInstance->Modules->AddService(APIImpl);
-		ServerInstance->Modules->Attach(I_OnAcceptConnection, this);
+		Implementation eventlist[] = { I_OnAcceptConnection, I_OnUnloadModule, I_OnRehash };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+		OnRehash(NULL);
+	}
+
+	void OnRehash(User* user) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("httpd");
+		long timeout = tag->getInt("timeout", 10);
+		IdleTimeout = (timeout < 1) ? 1 : timeout;
+		long maxsendq = tag->getInt("maxsendq", 1048576);
+		MaxSendQ = (maxsendq < (long)STREAM_LOWAT) ? STREAM_LOWAT : maxsendq;
+	}
+
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		for (std::set<HttpServerSocket*>::const_iterator i = sockets.begin(); i != sockets.end(); ++i)
+			(*i)->DropStream(mod);
 	}
 
 	ModResult OnAcceptConnection(int nfd, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
@@ -376,10 +609,11 @@ class ModuleHttpServer : public Module
 
 	~ModuleHttpServer()
 	{
-		for (size_t i = 0; i < httpsocks.size(); i++)
+		while (!sockets.empty())
 		{
-			httpsocks[i]->cull();
-			delete httpsocks[i];
+			HttpServerSocket* sock = *sockets.begin();
+			sock->cull();
+			delete sock;
 		}
 	}
 
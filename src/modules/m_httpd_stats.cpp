@@ -26,218 +26,343 @@
 #include "xline.h"
 #include "protocol.h"
 
-class ModuleHttpStats : public Module
+static std::map<char, char const*> const &init_entities()
 {
-	static std::map<char, char const*> const &entities;
-	HTTPdAPI API;
+	static std::map<char, char const*> entities;
+	entities['<'] = "lt";
+	entities['>'] = "gt";
+	entities['&'] = "amp";
+	entities['"'] = "quot";
+	return entities;
+}
 
- public:
-	ModuleHttpStats()
-		: API(this)
+static std::map<char, char const*> const &entities = init_entities();
+
+static std::string Sanitize(const std::string &str)
+{
+	std::string ret;
+	ret.reserve(str.length() * 2);
+
+	for (std::string::const_iterator x = str.begin(); x != str.end(); ++x)
 	{
+		std::map<char, char const*>::const_iterator it = entities.find(*x);
+
+		if (it != entities.end())
+		{
+			ret += '&';
+			ret += it->second;
+			ret += ';';
+		}
+		else if (*x == 0x9 ||  *x == 0xA || *x == 0xD || *x >= 0x20)
+		{
+			// The XML specification defines the following characters as valid inside an XML document:
+			// Char ::= #x9 | #xA | #xD | [#x20-#xD7FF] | [#xE000-#xFFFD] | [#x10000-#x10FFFF]
+			ret += *x;
+		}
+		else
+		{
+			// If we reached this point then the string contains characters which can
+			// not be represented in XML, even using a numeric escape. Therefore, we
+			// Base64 encode the entire string and wrap it in a CDATA.
+			ret.clear();
+			ret += "<![CDATA[";
+			ret += BinToBase64(str);
+			ret += "]]>";
+			break;
+		}
 	}
+	return ret;
+}
 
-	void init() CXX11_OVERRIDE
+static void DumpMeta(std::stringstream& data, Extensible* ext)
+{
+	data << "<metadata>";
+	for(Extensible::ExtensibleStore::const_iterator i = ext->GetExtList().begin(); i != ext->GetExtList().end(); i++)
 	{
-		Implementation eventlist[] = { I_OnEvent };
-		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_USER, ext, i->second);
+		if (!value.empty())
+			data << "<meta name=\"" << item->name << "\">" << Sanitize(value) << "</meta>";
+		else if (!item->name.empty())
+			data << "<meta name=\"" << item->name << "\"/>";
 	}
+	data << "</metadata>";
+}
 
-	std::string Sanitize(const std::string &str)
+/** Generates the /stats document as m_httpd sends it. Channels and users are
+ * dumped a batch at a time; only their names are remembered in between, so
+ * anything that goes away while the document is being sent is left out.
+ */
+class StatsStream : public HTTPDocumentStream
+{
+	enum Section { SECTION_HEADER, SECTION_CHANNELS, SECTION_USERS, SECTION_FOOTER };
+
+	/** Stop adding to a piece of the document once it reaches this size
+	 */
+	static const size_t BATCH_SIZE = 16384;
+
+	Section section;
+	/** Space separated channel names or UUIDs still to be dumped
+	 */
+	std::string pending;
+	std::string::size_type pos;
+
+	/** Take the next name from pending
+	 * @return False if there are none left
+	 */
+	bool NextName(std::string& name)
 	{
-		std::string ret;
-		ret.reserve(str.length() * 2);
+		if (pos >= pending.length())
+			return false;
+
+		std::string::size_type end = pending.find(' ', pos);
+		if (end == std::string::npos)
+			end = pending.length();
+		name.assign(pending, pos, end - pos);
+		pos = end + 1;
+		return true;
+	}
 
-		for (std::string::const_iterator x = str.begin(); x != str.end(); ++x)
+	void DumpHeader(std::stringstream& data)
+	{
+		data << "<inspircdstats><server><name>" << ServerInstance->Config->ServerName << "</name><gecos>"
+			<< Sanitize(ServerInstance->Config->ServerDesc) << "</gecos><version>"
+			<< Sanitize(ServerInstance->GetVersionString()) << "</version></server>";
+
+		data << "<general>";
+		data << "<usercount>" << ServerInstance->Users->clientlist->size() << "</usercount>";
+		data << "<channelcount>" << ServerInstance->chanlist->size() << "</channelcount>";
+		data << "<opercount>" << ServerInstance->Users->all_opers.size() << "</opercount>";
+		data << "<socketcount>" << (ServerInstance->SE->GetUsedFds()) << "</socketcount><socketmax>" << ServerInstance->SE->GetMaxFds() << "</socketmax><socketengine>" << ServerInstance->SE->GetName() << "</socketengine>";
+
+		time_t current_time = 0;
+		current_time = ServerInstance->Time();
+		time_t server_uptime = current_time - ServerInstance->startup_time;
+		struct tm* stime;
+		stime = gmtime(&server_uptime);
+		data << "<uptime><days>" << stime->tm_yday << "</days><hours>" << stime->tm_hour << "</hours><mins>" << stime->tm_min << "</mins><secs>" << stime->tm_sec << "</secs><boot_time_t>" << ServerInstance->startup_time << "</boot_time_t></uptime>";
+
+		data << "<isupport>";
+		const std::vector<std::string>& isupport = ServerInstance->ISupport.GetLines();
+		for (std::vector<std::string>::const_iterator it = isupport.begin(); it != isupport.end(); it++)
+		{
+			data << Sanitize(*it) << std::endl;
+		}
+		data << "</isupport></general><xlines>";
+		std::vector<std::string> xltypes = ServerInstance->XLines->GetAllTypes();
+		for (std::vector<std::string>::iterator it = xltypes.begin(); it != xltypes.end(); ++it)
 		{
-			std::map<char, char const*>::const_iterator it = entities.find(*x);
+			XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
 
-			if (it != entities.end())
-			{
-				ret += '&';
-				ret += it->second;
-				ret += ';';
-			}
-			else if (*x == 0x9 ||  *x == 0xA || *x == 0xD || *x >= 0x20)
-			{
-				// The XML specification defines the following characters as valid inside an XML document:
-				// Char ::= #x9 | #xA | #xD | [#x20-#xD7FF] | [#xE000-#xFFFD] | [#x10000-#x10FFFF]
-				ret += *x;
-			}
-			else
+			if (!lookup)
+				continue;
+			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
 			{
-				// If we reached this point then the string contains characters which can
-				// not be represented in XML, even using a numeric escape. Therefore, we
-				// Base64 encode the entire string and wrap it in a CDATA.
-				ret.clear();
-				ret += "<![CDATA[";
-				ret += BinToBase64(str);
-				ret += "]]>";
-				break;
+				data << "<xline type=\"" << it->c_str() << "\"><mask>"
+					<< Sanitize(i->second->Displayable()) << "</mask><settime>"
+					<< i->second->set_time << "</settime><duration>" << i->second->duration
+					<< "</duration><reason>" << Sanitize(i->second->reason)
+					<< "</reason></xline>";
 			}
 		}
-		return ret;
+
+		data << "</xlines><modulelist>";
+		std::vector<std::string> module_names = ServerInstance->Modules->GetAllModuleNames(0);
+
+		for (std::vector<std::string>::iterator i = module_names.begin(); i != module_names.end(); ++i)
+		{
+			Module* m = ServerInstance->Modules->Find(i->c_str());
+			Version v = m->GetVersion();
+			data << "<module><name>" << *i << "</name><description>" << Sanitize(v.description) << "</description></module>";
+		}
+		data << "</modulelist><channellist>";
 	}
 
-	void DumpMeta(std::stringstream& data, Extensible* ext)
+	void DumpChannel(std::stringstream& data, Channel* c)
 	{
-		data << "<metadata>";
-		for(Extensible::ExtensibleStore::const_iterator i = ext->GetExtList().begin(); i != ext->GetExtList().end(); i++)
+		data << "<channel>";
+		data << "<usercount>" << c->GetUsers()->size() << "</usercount><channelname>" << Sanitize(c->name) << "</channelname>";
+		data << "<channeltopic>";
+		data << "<topictext>" << Sanitize(c->topic) << "</topictext>";
+		data << "<setby>" << Sanitize(c->setby) << "</setby>";
+		data << "<settime>" << c->topicset << "</settime>";
+		data << "</channeltopic>";
+		data << "<channelmodes>" << Sanitize(c->ChanModes(true)) << "</channelmodes>";
+		const UserMembList* ulist = c->GetUsers();
+
+		for (UserMembCIter x = ulist->begin(); x != ulist->end(); ++x)
 		{
-			ExtensionItem* item = i->first;
-			std::string value = item->serialize(FORMAT_USER, ext, i->second);
-			if (!value.empty())
-				data << "<meta name=\"" << item->name << "\">" << Sanitize(value) << "</meta>";
-			else if (!item->name.empty())
-				data << "<meta name=\"" << item->name << "\"/>";
+			Membership* memb = x->second;
+			data << "<channelmember><uid>" << memb->user->uuid << "</uid><privs>"
+				<< Sanitize(c->GetAllPrefixChars(x->first)) << "</privs><modes>"
+				<< memb->modes << "</modes>";
+			DumpMeta(data, memb);
+			data << "</channelmember>";
 		}
-		data << "</metadata>";
+
+		DumpMeta(data, c);
+
+		data << "</channel>";
 	}
 
-	void OnEvent(Event& event) CXX11_OVERRIDE
+	void DumpUser(std::stringstream& data, User* u)
 	{
-		std::stringstream data("");
+		data << "<user>";
+		data << "<nickname>" << u->nick << "</nickname><uuid>" << u->uuid << "</uuid><realhost>"
+			<< u->host << "</realhost><displayhost>" << u->dhost << "</displayhost><gecos>"
+			<< Sanitize(u->fullname) << "</gecos><server>" << u->server << "</server>";
+		if (u->IsAway())
+			data << "<away>" << Sanitize(u->awaymsg) << "</away><awaytime>" << u->awaytime << "</awaytime>";
+		if (u->IsOper())
+			data << "<opertype>" << Sanitize(u->oper->name) << "</opertype>";
+		data << "<modes>" << u->FormatModes() << "</modes><ident>" << Sanitize(u->ident) << "</ident>";
+		LocalUser* lu = IS_LOCAL(u);
+		if (lu)
+			data << "<port>" << lu->GetServerPort() << "</port><servaddr>"
+				<< irc::sockets::satouser(lu->server_sa) << "</servaddr>";
+		data << "<ipaddress>" << u->GetIPString() << "</ipaddress>";
+
+		DumpMeta(data, u);
+
+		data << "</user>";
+	}
 
-		if (event.id == "httpd_url")
+	void DumpFooter(std::stringstream& data)
+	{
+		data << "</userlist><serverlist>";
+
+		ProtoServerList sl;
+		ServerInstance->PI->GetServerList(sl);
+
+		for (ProtoServerList::iterator b = sl.begin(); b != sl.end(); ++b)
 		{
-			ServerInstance->Logs->Log("m_http_stats", LOG_DEBUG, "Handling httpd event");
-			HTTPRequest* http = (HTTPRequest*)&event;
+			data << "<server>";
+			data << "<servername>" << b->servername << "</servername>";
+			data << "<parentname>" << b->parentname << "</parentname>";
+			data << "<gecos>" << b->gecos << "</gecos>";
+			data << "<usercount>" << b->usercount << "</usercount>";
+// This is currently not implemented, so, commented out.
+//			data << "<opercount>" << b->opercount << "</opercount>";
+			data << "<lagmillisecs>" << b->latencyms << "</lagmillisecs>";
+			data << "</server>";
+		}
 
-			if ((http->GetURI() == "/stats") || (http->GetURI() == "/stats/"))
-			{
-				data << "<inspircdstats><server><name>" << ServerInstance->Config->ServerName << "</name><gecos>"
-					<< Sanitize(ServerInstance->Config->ServerDesc) << "</gecos><version>"
-					<< Sanitize(ServerInstance->GetVersionString()) << "</version></server>";
-
-				data << "<general>";
-				data << "<usercount>" << ServerInstance->Users->clientlist->size() << "</usercount>";
-				data << "<channelcount>" << ServerInstance->chanlist->size() << "</channelcount>";
-				data << "<opercount>" << ServerInstance->Users->all_opers.size() << "</opercount>";
-				data << "<socketcount>" << (ServerInstance->SE->GetUsedFds()) << "</socketcount><socketmax>" << ServerInstance->SE->GetMaxFds() << "</socketmax><socketengine>" << ServerInstance->SE->GetName() << "</socketengine>";
-
-				time_t current_time = 0;
-				current_time = ServerInstance->Time();
-				time_t server_uptime = current_time - ServerInstance->startup_time;
-				struct tm* stime;
-				stime = gmtime(&server_uptime);
-				data << "<uptime><days>" << stime->tm_yday << "</days><hours>" << stime->tm_hour << "</hours><mins>" << stime->tm_min << "</mins><secs>" << stime->tm_sec << "</secs><boot_time_t>" << ServerInstance->startup_time << "</boot_time_t></uptime>";
-
-				data << "<isupport>";
-				const std::vector<std::string>& isupport = ServerInstance->ISupport.GetLines();
-				for (std::vector<std::string>::const_iterator it = isupport.begin(); it != isupport.end(); it++)
-				{
-					data << Sanitize(*it) << std::endl;
-				}
-				data << "</isupport></general><xlines>";
-				std::vector<std::string> xltypes = ServerInstance->XLines->GetAllTypes();
-				for (std::vector<std::string>::iterator it = xltypes.begin(); it != xltypes.end(); ++it)
-				{
-					XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
-
-					if (!lookup)
-						continue;
-					for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-					{
-						data << "<xline type=\"" << it->c_str() << "\"><mask>"
-							<< Sanitize(i->second->Displayable()) << "</mask><settime>"
-							<< i->second->set_time << "</settime><duration>" << i->second->duration
-							<< "</duration><reason>" << Sanitize(i->second->reason)
-							<< "</reason></xline>";
-					}
-				}
+		data << "</serverlist></inspircdstats>";
+	}
 
-				data << "</xlines><modulelist>";
-				std::vector<std::string> module_names = ServerInstance->Modules->GetAllModuleNames(0);
+ public:
+	StatsStream() : section(SECTION_HEADER), pos(0)
+	{
+	}
 
-				for (std::vector<std::string>::iterator i = module_names.begin(); i != module_names.end(); ++i)
-				{
-					Module* m = ServerInstance->Modules->Find(i->c_str());
-					Version v = m->GetVersion();
-					data << "<module><name>" << *i << "</name><description>" << Sanitize(v.description) << "</description></module>";
-				}
-				data << "</modulelist><channellist>";
+	bool Generate(std::string& out) CXX11_OVERRIDE
+	{
+		std::stringstream data;
+		std::string name;
+
+		switch (section)
+		{
+			case SECTION_HEADER:
+				DumpHeader(data);
 
+				pending.reserve(ServerInstance->chanlist->size() * 16);
 				for (chan_hash::const_iterator a = ServerInstance->chanlist->begin(); a != ServerInstance->chanlist->end(); ++a)
+					pending.append(a->first).push_back(' ');
+				section = SECTION_CHANNELS;
+			break;
+
+			case SECTION_CHANNELS:
+				while ((data.tellp() < static_cast<std::streampos>(BATCH_SIZE)) && (NextName(name)))
 				{
-					Channel* c = a->second;
-
-					data << "<channel>";
-					data << "<usercount>" << c->GetUsers()->size() << "</usercount><channelname>" << Sanitize(c->name) << "</channelname>";
-					data << "<channeltopic>";
-					data << "<topictext>" << Sanitize(c->topic) << "</topictext>";
-					data << "<setby>" << Sanitize(c->setby) << "</setby>";
-					data << "<settime>" << c->topicset << "</settime>";
-					data << "</channeltopic>";
-					data << "<channelmodes>" << Sanitize(c->ChanModes(true)) << "</channelmodes>";
-					const UserMembList* ulist = c->GetUsers();
-
-					for (UserMembCIter x = ulist->begin(); x != ulist->end(); ++x)
-					{
-						Membership* memb = x->second;
-						data << "<channelmember><uid>" << memb->user->uuid << "</uid><privs>"
-							<< Sanitize(c->GetAllPrefixChars(x->first)) << "</privs><modes>"
-							<< memb->modes << "</modes>";
-						DumpMeta(data, memb);
-						data << "</channelmember>";
-					}
-
-					DumpMeta(data, c);
-
-					data << "</channel>";
+					Channel* c = ServerInstance->FindChan(name);
+					if (c)
+						DumpChannel(data, c);
 				}
 
+				if (pos < pending.length())
+					break;
+
 				data << "</channellist><userlist>";
 
-				for (user_hash::const_iterator a = ServerInstance->Users->clientlist->begin(); a != ServerInstance->Users->clientlist->end(); ++a)
+				pending.clear();
+				pos = 0;
+				pending.reserve(ServerInstance->Users->uuidlist->size() * (UIDGenerator::UUID_LENGTH + 1));
+				for (user_hash::const_iterator a = ServerInstance->Users->uuidlist->begin(); a != ServerInstance->Users->uuidlist->end(); ++a)
 				{
-					User* u = a->second;
-
-					data << "<user>";
-					data << "<nickname>" << u->nick << "</nickname><uuid>" << u->uuid << "</uuid><realhost>"
-						<< u->host << "</realhost><displayhost>" << u->dhost << "</displayhost><gecos>"
-						<< Sanitize(u->fullname) << "</gecos><server>" << u->server << "</server>";
-					if (u->IsAway())
-						data << "<away>" << Sanitize(u->awaymsg) << "</away><awaytime>" << u->awaytime << "</awaytime>";
-					if (u->IsOper())
-						data << "<opertype>" << Sanitize(u->oper->name) << "</opertype>";
-					data << "<modes>" << u->FormatModes() << "</modes><ident>" << Sanitize(u->ident) << "</ident>";
-					LocalUser* lu = IS_LOCAL(u);
-					if (lu)
-						data << "<port>" << lu->GetServerPort() << "</port><servaddr>"
-							<< irc::sockets::satouser(lu->server_sa) << "</servaddr>";
-					data << "<ipaddress>" << u->GetIPString() << "</ipaddress>";
-
-					DumpMeta(data, u);
-
-					data << "</user>";
+					// Servers have UUIDs too but are not users
+					if (!IS_SERVER(a->second))
+						pending.append(a->first).push_back(' ');
 				}
+				section = SECTION_USERS;
+			break;
 
-				data << "</userlist><serverlist>";
-
-				ProtoServerList sl;
-				ServerInstance->PI->GetServerList(sl);
-
-				for (ProtoServerList::iterator b = sl.begin(); b != sl.end(); ++b)
+			case SECTION_USERS:
+				while ((data.tellp() < static_cast<std::streampos>(BATCH_SIZE)) && (NextName(name)))
 				{
-					data << "<server>";
-					data << "<servername>" << b->servername << "</servername>";
-					data << "<parentname>" << b->parentname << "</parentname>";
-					data << "<gecos>" << b->gecos << "</gecos>";
-					data << "<usercount>" << b->usercount << "</usercount>";
-// This is currently not implemented, so, commented out.
-//					data << "<opercount>" << b->opercount << "</opercount>";
-					data << "<lagmillisecs>" << b->latencyms << "</lagmillisecs>";
-					data << "</server>";
+					User* u = ServerInstance->FindUUID(name);
+					if (u)
+						DumpUser(data, u);
 				}
 
-				data << "</serverlist></inspircdstats>";
+				if (pos < pending.length())
+					break;
 
-				/* Send the document back to m_httpd */
-				HTTPDocumentResponse response(this, *http, &data, 200);
+				std::string().swap(pending);
+				section = SECTION_FOOTER;
+			break;
+
+			case SECTION_FOOTER:
+				DumpFooter(data);
+				out = data.str();
+				return false;
+		}
+
+		out = data.str();
+		return true;
+	}
+};
+
+class ModuleHttpStats : public Module
+{
+	HTTPdAPI API;
+
+ public:
+	ModuleHttpStats()
+		: API(this)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
+	{
+		Implementation eventlist[] = { I_OnEvent };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+	}
+
+	void OnEvent(Event& event) CXX11_OVERRIDE
+	{
+		if (event.id == "httpd_url")
+		{
+			ServerInstance->Logs->Log("m_http_stats", LOG_DEBUG, "Handling httpd event");
+			HTTPRequest* http = (HTTPRequest*)&event;
+
+			if ((http->GetURI() == "/stats") || (http->GetURI() == "/stats/"))
+			{
+				/* The document is generated as m_httpd sends it */
+				HTTPDocumentResponse response(this, *http, new StatsStream, 200);
 				response.headers.SetHeader("X-Powered-By", "m_httpd_stats.so");
 				response.headers.SetHeader("Content-Type", "text/xml");
 				API->SendResponse(response);
 			}
+			else if (http->GetURI() == "/metrics")
+			{
+				std::string metrics;
+				ServerInstance->Metrics->Render(metrics);
+				std::stringstream data(metrics);
+				HTTPDocumentResponse response(this, *http, &data, 200);
+				response.headers.SetHeader("X-Powered-By", "m_httpd_stats.so");
+				response.headers.SetHeader("Content-Type", "application/openmetrics-text; version=1.0.0; charset=utf-8");
+				API->SendResponse(response);
+			}
 		}
 	}
 
@@ -247,16 +372,4 @@ class ModuleHttpStats : public Module
 	}
 };
 
-static std::map<char, char const*> const &init_entities()
-{
-	static std::map<char, char const*> entities;
-	entities['<'] = "lt";
-	entities['>'] = "gt";
-	entities['&'] = "amp";
-	entities['"'] = "quot";
-	return entities;
-}
-
-std::map<char, char const*> const &ModuleHttpStats::entities = init_entities ();
-
 MODULE_INIT(ModuleHttpStats)
@@ -265,6 +265,9 @@ class ModuleServicesAccount : public Module
 		// check if its our metadata key, and its associated with a user
 		if (dest && (extname == "accountname"))
 		{
+			// The R: and U: extbans match on the account
+			dest->identgeneration++;
+
 			std::string *account = accountname.get(dest);
 			if (account && !account->empty())
 			{
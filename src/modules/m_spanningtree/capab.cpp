@@ -20,6 +20,7 @@
 
 
 #include "inspircd.h"
+#include "modules/compress.h"
 
 #include "treeserver.h"
 #include "utils.h"
@@ -132,6 +133,10 @@ void TreeSocket::SendCapabilities(int phase)
 		extra = " CHALLENGE=" + this->GetOurChallenge();
 	}
 
+	/* Can we decompress what the other side sends? */
+	if (ServerInstance->Modules->FindDataService<CompressionProvider>("compress/zlib"))
+		extra.append(" COMPRESS=zlib");
+
 	// 2.0 needs this key
 	if (proto_version == 1202)
 		extra.append(" PROTOCOL="+ConvToStr(ProtocolVersion));
@@ -158,8 +158,16 @@ void TreeSocket::WriteLine(std::string line)
 	}
 
 	ServerInstance->Logs->Log("m_spanningtree", LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
-	this->WriteData(line);
-	this->WriteData(newline);
+	Utils->Creator->Traffic.Out(line.length() + 1);
+	if (traffic)
+		traffic->Out(line.length() + 1);
+	if (deflater)
+	{
+		line.append(newline);
+		WriteRaw(line);
+	}
+	else
+		this->WriteData(new SendBuffer(line, newline));
 }
 
 namespace
@@ -194,7 +202,7 @@ bool TreeSocket::PreProcessOldProtocolMessage(User*& who, std::string& cmd, std:
 		{
 			// If it's a PING with 1 parameter, reply with a PONG now, if it's a PONG with 1 parameter (weird), do nothing
 			if (cmd[1] == 'I')
-				this->WriteData(":" + ServerInstance->Config->GetSID() + " PONG " + params[0] + newline);
+				this->WriteRaw(":" + ServerInstance->Config->GetSID() + " PONG " + params[0] + newline);
 
 			// Don't process this message further
 			return false;
@@ -0,0 +1,160 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "modules/compress.h"
+
+#include "link.h"
+#include "treesocket.h"
+
+/* $ModDep: m_spanningtree/link.h m_spanningtree/treesocket.h */
+
+/** Link compression works per direction: once a server knows the other side can
+ * decompress (COMPRESS=zlib in CAPAB CAPABILITIES) and its own link block says
+ * compress="yes", it sends a plaintext CAPAB COMPRESS line and deflates everything
+ * after it. The compressor is flushed once per write, so a whole mainloop
+ * iteration worth of lines shares one flush. Any SSL hook sits below this and
+ * encrypts the compressed data.
+ */
+static const std::string CompressMethod = "zlib";
+
+void TreeSocket::StartCompression(Link* link)
+{
+	std::map<std::string, std::string>::const_iterator i = capab->CapKeys.find("COMPRESS");
+	if (i == capab->CapKeys.end())
+		return;
+
+	bool supported = false;
+	irc::commasepstream methods(i->second);
+	std::string method;
+	while (methods.GetToken(method))
+	{
+		if (method == CompressMethod)
+			supported = true;
+	}
+
+	CompressionProvider* prov = ServerInstance->Modules->FindDataService<CompressionProvider>("compress/" + CompressMethod);
+	if (!supported || !prov)
+		return;
+
+	// We offered it in our CAPAB as well, so the other side may start compressing
+	compressok = true;
+	if (!link->Compress || deflater)
+		return;
+
+	// The marker itself goes out uncompressed, everything after it is deflated
+	WriteLine("CAPAB COMPRESS " + CompressMethod);
+	deflater = prov->CreateCompressor();
+	compressor = prov->creator;
+}
+
+bool TreeSocket::StartDecompression(const std::string& command, const parameterlist& params)
+{
+	if ((command != "CAPAB") || (params.size() != 2) || (params[0] != "COMPRESS"))
+		return false;
+
+	// Inflating is only worth the risk once the other side has proven who it is
+	if ((LinkState != WAIT_AUTH_2) && (LinkState != CONNECTED))
+	{
+		SendError("Compression started before authentication");
+		return true;
+	}
+
+	CompressionProvider* prov = NULL;
+	if ((compressok) && (params[1] == CompressMethod) && (!inflater))
+		prov = ServerInstance->Modules->FindDataService<CompressionProvider>("compress/" + CompressMethod);
+
+	if (!prov)
+	{
+		SendError("Unable to decompress data compressed with " + params[1]);
+		return true;
+	}
+
+	inflater = prov->CreateDecompressor();
+	compressor = prov->creator;
+	return true;
+}
+
+bool TreeSocket::Inflate()
+{
+	// Before the link is up no more than a line may be buffered, afterwards <performance:burstsendq> applies
+	const size_t max = (LinkState == CONNECTED) ? Utils->BurstSendQ : 4096;
+	if (recvq.empty() || !getError().empty())
+		return false;
+	if (plainq.length() >= max)
+	{
+		SendError("RecvQ overrun (line too long)");
+		return false;
+	}
+
+	// Produce no more than a single read of uncompressed data would have
+	size_t limit = std::min<size_t>(max - plainq.length(), ServerInstance->Config->NetBufferSize);
+	size_t len = recvq.length();
+	size_t before = plainq.length();
+	if (!inflater->Process(recvq.data(), len, plainq.GetAppendBuffer(), limit))
+	{
+		SendError("Compressed data stream is corrupt");
+		return false;
+	}
+	recvq.consume(len);
+	return ((len) || (plainq.length() != before));
+}
+
+void TreeSocket::StopCompression()
+{
+	delete deflater;
+	deflater = NULL;
+	delete inflater;
+	inflater = NULL;
+	compressor = NULL;
+}
+
+void TreeSocket::WriteRaw(const std::string& data)
+{
+	if (!deflater)
+	{
+		WriteData(data);
+		return;
+	}
+
+	std::string out;
+	size_t len = data.length();
+	if (!deflater->Process(data.data(), len, out))
+	{
+		SetError("Compression failed");
+		return;
+	}
+
+	// Usually the compressor keeps small lines to itself until DoWrite() flushes it
+	if (!out.empty())
+		WriteData(out);
+	else
+		ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
+void TreeSocket::DoWrite()
+{
+	if ((deflater) && (getError().empty()))
+	{
+		std::string out;
+		deflater->Flush(out);
+		if (!out.empty())
+			WriteData(out);
+	}
+	BufferedSocket::DoWrite();
+}
@@ -134,7 +134,7 @@ CmdResult CommandFJoin::Handle(const std::vector<std::string>& params, User *src
 	}
 
 	irc::modestacker modestack(true);
-	TreeSocket* src_socket = Utils->FindServer(srcuser->server)->GetRoute()->GetSocket();
+	TreeSocket* src_socket = Utils->FindServer(srcuser)->GetRoute()->GetSocket();
 
 	/* Now, process every 'modes,uuid' pair */
 	irc::tokenstream users(*params.rbegin());
@@ -168,7 +168,7 @@ bool CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeSocket* src_
 
 	/* Check that the user's 'direction' is correct */
 	SpanningTreeUtilities* Utils = ((ModuleSpanningTree*)(Module*)creator)->Utils;
-	TreeServer* route_back_again = Utils->BestRouteTo(who->server);
+	TreeServer* route_back_again = Utils->BestRouteTo(who);
 	if ((!route_back_again) || (route_back_again->GetSocket() != src_socket))
 	{
 		return true;
@@ -44,7 +44,7 @@ bool TreeSocket::Whois(const std::string &prefix, parameterlist &params)
 	if (!localtarget)
 	{
 		// Forward to target's server
-		Utils->DoOneToOne(prefix, "IDLE", params, target->server);
+		Utils->DoOneToOne(prefix, "IDLE", params, target);
 		return true;
 	}
 
@@ -66,7 +66,7 @@ bool TreeSocket::Whois(const std::string &prefix, parameterlist &params)
 		reply.push_back(prefix);
 		reply.push_back(ConvToStr(target->signon));
 		reply.push_back(ConvToStr(idle));
-		Utils->DoOneToOne(params[0], "IDLE", reply, issuer->server);
+		Utils->DoOneToOne(params[0], "IDLE", reply, issuer);
 	}
 
 	return true;
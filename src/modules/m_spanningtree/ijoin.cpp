@@ -35,7 +35,7 @@ CmdResult CommandIJoin::HandleRemote(const std::vector<std::string>& params, Rem
 		parameterlist p;
 		p.push_back(params[0]);
 		SpanningTreeUtilities* Utils = ((ModuleSpanningTree*)(Module*)creator)->Utils;
-		Utils->DoOneToOne(ServerInstance->Config->GetSID(), "RESYNC", p, user->server);
+		Utils->DoOneToOne(ServerInstance->Config->GetSID(), "RESYNC", p, user);
 
 		return CMD_FAILURE;
 	}
@@ -36,6 +36,7 @@ class Link : public refcountbase
 	int Timeout;
 	std::string Bind;
 	bool Hidden;
+	bool Compress;
 	Link(ConfigTag* Tag) : tag(Tag) {}
 };
 
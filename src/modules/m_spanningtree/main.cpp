@@ -37,6 +37,7 @@
 
 ModuleSpanningTree::ModuleSpanningTree()
 	: commands(NULL), DNS(this, "DNS"), Utils(NULL)
+	, Traffic("inspircd_socket", "sockets", Metric::Label("class", "server"))
 {
 }
 
@@ -68,6 +69,9 @@ void ModuleSpanningTree::init()
 	ServerInstance->Modules->AddService(commands->fhost);
 	ServerInstance->Modules->AddService(commands->fident);
 	ServerInstance->Modules->AddService(commands->fname);
+	ServerInstance->Modules->AddService(Utils->userserver);
+	ServerInstance->Modules->AddService(Utils->chanroutes);
+	Traffic.Register();
 
 	Implementation eventlist[] =
 	{
@@ -76,7 +80,7 @@ void ModuleSpanningTree::init()
 		I_OnChangeHost, I_OnChangeName, I_OnChangeIdent, I_OnUserPart, I_OnUnloadModule,
 		I_OnUserQuit, I_OnUserPostNick, I_OnUserKick, I_OnRehash, I_OnPreRehash,
 		I_OnOper, I_OnAddLine, I_OnDelLine, I_OnLoadModule, I_OnStats,
-		I_OnSetAway, I_OnPostCommand, I_OnUserConnect, I_OnAcceptConnection
+		I_OnSetAway, I_OnPostCommand, I_OnUserConnect, I_OnAcceptConnection, I_OnRunTestSuite
 	};
 	ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 
@@ -467,7 +471,7 @@ void ModuleSpanningTree::LocalMessage(User* user, void* dest, int target_type, c
 			parameterlist params;
 			params.push_back(d->uuid);
 			params.push_back(":"+text);
-			Utils->DoOneToOne(user->uuid, message_type, params, d->server);
+			Utils->DoOneToOne(user->uuid, message_type, params, d);
 		}
 	}
 	else if (target_type == TYPE_CHANNEL)
@@ -535,6 +539,8 @@ void ModuleSpanningTree::OnUserConnect(LocalUser* user)
 
 void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by_local, CUList& excepts)
 {
+	Utils->ChangeChannelRoute(memb, 1);
+
 	// Only do this for local users
 	if (IS_LOCAL(memb->user))
 	{
@@ -591,6 +597,8 @@ void ModuleSpanningTree::OnChangeIdent(User* user, const std::string &ident)
 
 void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage, CUList& excepts)
 {
+	Utils->ChangeChannelRoute(memb, -1);
+
 	if (IS_LOCAL(memb->user))
 	{
 		parameterlist params;
@@ -617,12 +625,26 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 		Utils->DoOneToMany(user->uuid,"QUIT",params);
 	}
 
+	// The user leaves all channels after this
+	if (!IS_LOCAL(user))
+	{
+		for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+		{
+			Membership* memb = (*i)->GetUser(user);
+			if (memb)
+				Utils->ChangeChannelRoute(memb, -1);
+		}
+	}
+
 	// Regardless, We need to modify the user Counts..
-	TreeServer* SourceServer = Utils->FindServer(user->server);
+	TreeServer* SourceServer = Utils->FindServer(user);
 	if (SourceServer)
 	{
 		SourceServer->UserCount--;
 	}
+
+	// The server may go away before the user is gone, e.g. in a netsplit
+	Utils->userserver.unset(user);
 }
 
 void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
@@ -651,6 +673,8 @@ void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 
 void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts)
 {
+	Utils->ChangeChannelRoute(memb, -1);
+
 	parameterlist params;
 	params.push_back(memb->chan->name);
 	params.push_back(memb->user->uuid);
@@ -665,6 +689,11 @@ void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::s
 	}
 }
 
+void ModuleSpanningTree::OnRunTestSuite()
+{
+	Utils->BenchmarkChannelRoutes();
+}
+
 void ModuleSpanningTree::OnPreRehash(User* user, const std::string &parameter)
 {
 	if (loopCall)
@@ -729,6 +758,22 @@ void ModuleSpanningTree::OnUnloadModule(Module* mod)
 			sock->SendError("SSL module unloaded");
 			sock->Close();
 		}
+		else if (sock && sock->GetCompressor() == mod)
+		{
+			sock->SendError("Compression module unloaded");
+			sock->Close();
+		}
+	}
+
+	// Links still being set up may have started compressing, too
+	for (std::map<TreeSocket*, std::pair<std::string, int> >::iterator i = Utils->timeoutlist.begin(); i != Utils->timeoutlist.end(); ++i)
+	{
+		TreeSocket* sock = i->first;
+		if (sock->GetCompressor() == mod)
+		{
+			sock->SendError("Compression module unloaded");
+			sock->Close();
+		}
 	}
 }
 
@@ -27,6 +27,154 @@
 #include "treeserver.h"
 #include "main.h"
 
+/** Slices of a burst are sent this many milliseconds apart, the main loop runs in between */
+static const unsigned long BURST_INTERVAL = 1;
+
+/** While the sendq of the link is too large the burst checks whether it can continue this often */
+static const unsigned long BURST_PAUSED_INTERVAL = 10;
+
+BurstState::BurstState(SpanningTreeUtilities* Util, TreeSocket* s)
+	: Timer(0, ServerInstance->Time(), true), Utils(Util), sock(s), phase(BURST_USERS), pos(0), xlinetype(0)
+{
+	/* Users are sent first, take the snapshot of them right away */
+	for (user_hash::const_iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); ++i)
+	{
+		if (i->second->registered == REG_ALL)
+			items.push_back(i->second->uuid);
+	}
+	SetIntervalMS(BURST_INTERVAL);
+}
+
+void BurstState::NextPhase()
+{
+	items.clear();
+	pos = 0;
+
+	switch (phase)
+	{
+		case BURST_USERS:
+			phase = BURST_CHANNELS;
+			items.reserve(ServerInstance->chanlist->size());
+			for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+				items.push_back(i->second->name);
+		break;
+		case BURST_CHANNELS:
+			phase = BURST_XLINES;
+			xlinetypes = ServerInstance->XLines->GetAllTypes();
+			xlinetype = 0;
+			lastxline.clear();
+		break;
+		default:
+			phase = BURST_DONE;
+	}
+}
+
+bool BurstState::SendNextXLine()
+{
+	for (; xlinetype < xlinetypes.size(); xlinetype++, lastxline.clear())
+	{
+		/* Expired lines are removed in XLineManager::GetAll() */
+		const std::string& type = xlinetypes[xlinetype];
+		XLineLookup* lookup = ServerInstance->XLines->GetAll(type);
+		if (!lookup)
+			continue;
+
+		/* Lookups are ordered by mask, so continue right after the last line sent
+		 * even if lines were added or removed since then
+		 */
+		LookupIter i = (lastxline.empty() ? lookup->begin() : lookup->upper_bound(lastxline));
+		if (i == lookup->end())
+			continue;
+
+		/* Is it burstable? this is better than an explicit check for type 'K'.
+		 * We skip the type as NONE of the items in this group are worth iterating.
+		 */
+		if (!i->second->IsBurstable())
+			continue;
+
+		sock->SendXLine(type, i->second);
+		lastxline = i->first;
+		return true;
+	}
+	return false;
+}
+
+bool BurstState::Continue()
+{
+	for (unsigned int sent = 0; (sent < Utils->BurstSlice) && (sock->getSendQSize() < Utils->BurstSendQ); )
+	{
+		switch (phase)
+		{
+			case BURST_USERS:
+				if (pos == items.size())
+				{
+					NextPhase();
+					continue;
+				}
+				else
+				{
+					/* Users who have quit since the burst started are skipped,
+					 * the ones which connected since then were sent as they registered
+					 */
+					User* user = ServerInstance->FindUUID(items[pos++]);
+					if (user)
+					{
+						sock->SendUser(user);
+						sent++;
+					}
+				}
+			break;
+			case BURST_CHANNELS:
+				if (pos == items.size())
+				{
+					NextPhase();
+					continue;
+				}
+				else
+				{
+					/* If the channel was recreated since the burst started, the new one is sent */
+					Channel* chan = ServerInstance->FindChan(items[pos++]);
+					if (chan)
+					{
+						sock->SyncChannel(chan);
+						sent++;
+					}
+				}
+			break;
+			case BURST_XLINES:
+				if (!SendNextXLine())
+				{
+					NextPhase();
+					continue;
+				}
+				sent++;
+			break;
+			case BURST_DONE:
+				return false;
+		}
+	}
+	return true;
+}
+
+bool BurstState::Tick(time_t)
+{
+	if ((!sock->getError().empty()) || (sock->GetLinkState() != CONNECTED))
+		return true;
+
+	if (Continue())
+	{
+		/* Check again soon if the slice stopped because the sendq is full */
+		unsigned long interval = ((sock->getSendQSize() < Utils->BurstSendQ) ? BURST_INTERVAL : BURST_PAUSED_INTERVAL);
+		if (interval != GetIntervalMS())
+			SetIntervalMS(interval);
+		return true;
+	}
+
+	/* This deletes us when we return */
+	sock->EndBurst();
+	return false;
+}
+
 /** This function is called when we want to send a netburst to a local
  * server. There is a set order we must do this, because for example
  * users require their servers to exist, and channels require their
@@ -45,16 +193,16 @@ void TreeSocket::DoBurst(TreeServer* s)
 	this->WriteLine(":" + ServerInstance->Config->GetSID() + " VERSION :"+ServerInstance->GetVersionString());
 	/* Send server tree */
 	this->SendServers(Utils->TreeRoot, s);
-	/* Send users and their oper status */
-	this->SendUsers();
-
-	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
-		SyncChannel(i->second);
+	/* Users, channels and X-lines follow a slice at a time, see BurstState */
+	burst = new BurstState(Utils, this);
+}
 
-	this->SendXLines();
+void TreeSocket::EndBurst()
+{
+	burst = NULL;
 	FOREACH_MOD(I_OnSyncNetwork,OnSyncNetwork(Utils->Creator,(void*)this));
 	this->WriteLine(":" + ServerInstance->Config->GetSID() + " ENDBURST");
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+ s->GetName()+"\2.");
+	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+ MyRoot->GetName()+"\2.");
 }
 
 /** Recursively send the server tree.
@@ -112,38 +260,17 @@ void TreeSocket::SendFJoins(Channel* c)
 	static_cast<ListModeBase*>(*ban)->DoSyncChannel(c, Utils->Creator, this);
 }
 
-/** Send all XLines we know about */
-void TreeSocket::SendXLines()
+/** Send an XLine */
+void TreeSocket::SendXLine(const std::string& type, XLine* line)
 {
-	std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
-
-	for (std::vector<std::string>::const_iterator it = types.begin(); it != types.end(); ++it)
-	{
-		/* Expired lines are removed in XLineManager::GetAll() */
-		XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
-
-		/* lookup cannot be NULL in this case but a check won't hurt */
-		if (lookup)
-		{
-			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-			{
-				/* Is it burstable? this is better than an explicit check for type 'K'.
-				 * We break the loop as NONE of the items in this group are worth iterating.
-				 */
-				if (!i->second->IsBurstable())
-					break;
-
-				this->WriteLine(InspIRCd::Format(":%s ADDLINE %s %s %s %lu %lu :%s",
-					ServerInstance->Config->GetSID().c_str(),
-					it->c_str(),
-					i->second->Displayable().c_str(),
-					i->second->source.c_str(),
-					(unsigned long)i->second->set_time,
-					(unsigned long)i->second->duration,
-					i->second->reason.c_str()));
-			}
-		}
-	}
+	this->WriteLine(InspIRCd::Format(":%s ADDLINE %s %s %s %lu %lu :%s",
+		ServerInstance->Config->GetSID().c_str(),
+		type.c_str(),
+		line->Displayable().c_str(),
+		line->source.c_str(),
+		(unsigned long)line->set_time,
+		(unsigned long)line->duration,
+		line->reason.c_str()));
 }
 
 /** Send channel topic, modes and metadata */
@@ -171,50 +298,43 @@ void TreeSocket::SyncChannel(Channel* chan)
 	FOREACH_MOD(I_OnSyncChannel,OnSyncChannel(chan, Utils->Creator, this));
 }
 
-/** send all users and their oper state/modes */
-void TreeSocket::SendUsers()
+/** send a user and their oper state/modes */
+void TreeSocket::SendUser(User* user)
 {
-	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); u++)
+	TreeServer* theirserver = Utils->FindServer(user);
+	if (theirserver)
 	{
-		if (u->second->registered == REG_ALL)
-		{
-			TreeServer* theirserver = Utils->FindServer(u->second->server);
-			if (theirserver)
-			{
-				this->WriteLine(InspIRCd::Format(":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
-					theirserver->GetID().c_str(),     // Prefix: SID
-					u->second->uuid.c_str(),          // 0: UUID
-					(unsigned long)u->second->age,    // 1: TS
-					u->second->nick.c_str(),          // 2: Nick
-					u->second->host.c_str(),          // 3: Real host
-					u->second->dhost.c_str(),         // 4: Display host
-					u->second->ident.c_str(),         // 5: Ident
-					u->second->GetIPString().c_str(), // 6: IP address
-					(unsigned long)u->second->signon, // 7: Signon time
-					u->second->FormatModes(true),     // 8...n: User modes and params
-					u->second->fullname.c_str()));    // size-1: GECOS
-
-				if (u->second->IsOper())
-				{
-					this->WriteLine(InspIRCd::Format(":%s OPERTYPE :%s", u->second->uuid.c_str(), u->second->oper->name.c_str()));
-				}
-				if (u->second->IsAway())
-				{
-					this->WriteLine(InspIRCd::Format(":%s AWAY %ld :%s", u->second->uuid.c_str(), (long)u->second->awaytime,
-						u->second->awaymsg.c_str()));
-				}
-			}
+		this->WriteLine(InspIRCd::Format(":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
+			theirserver->GetID().c_str(),     // Prefix: SID
+			user->uuid.c_str(),               // 0: UUID
+			(unsigned long)user->age,         // 1: TS
+			user->nick.c_str(),               // 2: Nick
+			user->host.c_str(),               // 3: Real host
+			user->dhost.c_str(),              // 4: Display host
+			user->ident.c_str(),              // 5: Ident
+			user->GetIPString().c_str(),      // 6: IP address
+			(unsigned long)user->signon,      // 7: Signon time
+			user->FormatModes(true),          // 8...n: User modes and params
+			user->fullname.c_str()));         // size-1: GECOS
 
-			for(Extensible::ExtensibleStore::const_iterator i = u->second->GetExtList().begin(); i != u->second->GetExtList().end(); i++)
-			{
-				ExtensionItem* item = i->first;
-				std::string value = item->serialize(FORMAT_NETWORK, u->second, i->second);
-				if (!value.empty())
-					Utils->Creator->ProtoSendMetaData(this, u->second, item->name, value);
-			}
-
-			FOREACH_MOD(I_OnSyncUser,OnSyncUser(u->second,Utils->Creator,this));
+		if (user->IsOper())
+		{
+			this->WriteLine(InspIRCd::Format(":%s OPERTYPE :%s", user->uuid.c_str(), user->oper->name.c_str()));
+		}
+		if (user->IsAway())
+		{
+			this->WriteLine(InspIRCd::Format(":%s AWAY %ld :%s", user->uuid.c_str(), (long)user->awaytime,
+				user->awaymsg.c_str()));
 		}
 	}
-}
 
+	for(Extensible::ExtensibleStore::const_iterator i = user->GetExtList().begin(); i != user->GetExtList().end(); i++)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, user, i->second);
+		if (!value.empty())
+			Utils->Creator->ProtoSendMetaData(this, user, item->name, value);
+	}
+
+	FOREACH_MOD(I_OnSyncUser,OnSyncUser(user,Utils->Creator,this));
+}
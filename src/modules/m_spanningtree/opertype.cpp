@@ -48,7 +48,7 @@ CmdResult CommandOpertype::Handle(const std::vector<std::string>& params, User *
 		 * If quiet bursts are enabled, and server is bursting or silent uline (i.e. services),
 		 * then do nothing. -- w00t
 		 */
-		TreeServer* remoteserver = Utils->FindServer(u->server);
+		TreeServer* remoteserver = Utils->FindServer(u);
 		if (remoteserver->bursting || ServerInstance->SilentULine(u->server))
 			return CMD_SUCCESS;
 	}
@@ -19,10 +19,22 @@
 
 
 #include "inspircd.h"
+#include "modules/compress.h"
 
 #include "main.h"
 #include "utils.h"
 #include "link.h"
+#include "treeserver.h"
+#include "treesocket.h"
+
+static std::string CompressionStats(const std::string& server, const char* dir, CompressionStream* cs, bool outgoing)
+{
+	unsigned long plain = outgoing ? cs->bytes_in : cs->bytes_out;
+	unsigned long wire = outgoing ? cs->bytes_out : cs->bytes_in;
+	unsigned long ratio = plain ? (unsigned long)(wire * 100.0 / plain) : 100;
+	unsigned long cpu = (unsigned long)(cs->cpu * 1000.0 / CLOCKS_PER_SEC);
+	return server + " " + dir + " " + ConvToStr(plain) + " " + ConvToStr(wire) + " " + ConvToStr(ratio) + "% " + ConvToStr(cpu);
+}
 
 ModResult ModuleSpanningTree::OnStats(char statschar, User* user, string_list &results)
 {
@@ -37,6 +49,24 @@ ModResult ModuleSpanningTree::OnStats(char statschar, User* user, string_list &r
 		}
 		return MOD_RES_DENY;
 	}
+	else if (statschar == 'x')
+	{
+		/* stats x (show link compression stats) */
+		const std::string prefix = std::string(ServerInstance->Config->ServerName) + " 211 " + user->nick + " ";
+		results.push_back(prefix + ":server direction plain_bytes compressed_bytes ratio cpu_ms");
+		for (unsigned int i = 0; i < Utils->TreeRoot->ChildCount(); i++)
+		{
+			TreeServer* server = Utils->TreeRoot->GetChild(i);
+			TreeSocket* sock = server->GetSocket();
+			if (!sock)
+				continue;
+			if (sock->GetDeflater())
+				results.push_back(prefix + CompressionStats(server->GetName(), "out", sock->GetDeflater(), true));
+			if (sock->GetInflater())
+				results.push_back(prefix + CompressionStats(server->GetName(), "in", sock->GetInflater(), false));
+		}
+		return MOD_RES_DENY;
+	}
 	return MOD_RES_PASSTHRU;
 }
 
@@ -32,7 +32,7 @@ ModResult ModuleSpanningTree::HandleRemoteWhois(const std::vector<std::string>&
 		{
 			parameterlist params;
 			params.push_back(remote->uuid);
-			Utils->DoOneToOne(user->uuid,"IDLE",params,remote->server);
+			Utils->DoOneToOne(user->uuid,"IDLE",params,remote);
 			return MOD_RES_DENY;
 		}
 		else if (!remote)
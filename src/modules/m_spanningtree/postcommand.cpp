@@ -121,11 +121,11 @@ void SpanningTreeUtilities::RouteCommand(TreeServer* origin, Command* thiscmd, c
 			User* d = ServerInstance->FindNick(dest);
 			if (!d)
 				return;
-			TreeServer* tsd = BestRouteTo(d->server);
+			TreeServer* tsd = BestRouteTo(d);
 			if (tsd == origin)
 				// huh? no routing stuff around in a circle, please.
 				return;
-			DoOneToOne(user->uuid, sent_cmd, params, d->server);
+			DoOneToOne(user->uuid, sent_cmd, params, d);
 		}
 	}
 	else if (routing.type == ROUTE_TYPE_BROADCAST || routing.type == ROUTE_TYPE_OPT_BCAST)
@@ -124,7 +124,7 @@ void SpanningTreeProtocolInterface::PushToClient(User* target, const std::string
 	parameterlist p;
 	p.push_back(target->uuid);
 	p.push_back(":" + rawline);
-	Utils->DoOneToOne(ServerInstance->Config->GetSID(), "PUSH", p, target->server);
+	Utils->DoOneToOne(ServerInstance->Config->GetSID(), "PUSH", p, target);
 }
 
 void SpanningTreeProtocolInterface::SendChannelPrivmsg(Channel* target, char status, const std::string &text)
@@ -144,7 +144,7 @@ void SpanningTreeProtocolInterface::SendUserPrivmsg(User* target, const std::str
 	parameterlist p;
 	p.push_back(target->uuid);
 	p.push_back(":" + text);
-	Utils->DoOneToOne(ServerInstance->Config->GetSID(), "PRIVMSG", p, target->server);
+	Utils->DoOneToOne(ServerInstance->Config->GetSID(), "PRIVMSG", p, target);
 }
 
 void SpanningTreeProtocolInterface::SendUserNotice(User* target, const std::string &text)
@@ -152,5 +152,5 @@ void SpanningTreeProtocolInterface::SendUserNotice(User* target, const std::stri
 	parameterlist p;
 	p.push_back(target->uuid);
 	p.push_back(":" + text);
-	Utils->DoOneToOne(ServerInstance->Config->GetSID(), "NOTICE", p, target->server);
+	Utils->DoOneToOne(ServerInstance->Config->GetSID(), "NOTICE", p, target);
 }
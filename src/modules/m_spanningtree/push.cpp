@@ -39,7 +39,7 @@ bool TreeSocket::Push(const std::string &prefix, parameterlist &params)
 	{
 		// continue the raw onwards
 		params[1] = ":" + params[1];
-		Utils->DoOneToOne(prefix,"PUSH",params,u->server);
+		Utils->DoOneToOne(prefix,"PUSH",params,u);
 	}
 	return true;
 }
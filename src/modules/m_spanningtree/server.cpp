@@ -147,9 +147,11 @@ bool TreeSocket::Outbound_Reply_Server(parameterlist &params)
 		 *   -- w
 		 */
 		this->LinkState = CONNECTED;
+		this->StartCompression(x);
 
 		Utils->timeoutlist.erase(this);
 		linkID = sname;
+		StartTrafficMetrics();
 
 		MyRoot = new TreeServer(Utils, sname, description, sid, Utils->TreeRoot, this, x->Hidden);
 		Utils->TreeRoot->AddChild(MyRoot);
@@ -250,6 +252,7 @@ bool TreeSocket::Inbound_Server(parameterlist &params)
 		// Send our details: Our server name and description and hopcount of 0,
 		// along with the sendpass from this block.
 		this->WriteLine("SERVER "+ServerInstance->Config->ServerName+" "+this->MakePass(x->SendPass, this->GetTheirChallenge())+" 0 "+ServerInstance->Config->GetSID()+" :"+ServerInstance->Config->ServerDesc);
+		this->StartCompression(x);
 
 		// move to the next state, we are now waiting for THEM.
 		this->LinkState = WAIT_AUTH_2;
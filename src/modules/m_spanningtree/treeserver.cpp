@@ -124,6 +124,9 @@ TreeServer::TreeServer(SpanningTreeUtilities* Util, std::string Name, std::strin
 
 	this->AddHashEntry();
 
+	/* Commands from this server are routed without looking it up by name */
+	Utils->userserver.set(ServerUser, this);
+
 	SetID(id);
 }
 
@@ -83,6 +83,71 @@ struct CapabData
 	bool hidden;
 };
 
+class TreeSocket;
+class CompressionStream;
+
+/** A netburst which is being sent to a server. Everything after the server
+ * tree is sent a slice at a time, one slice per main loop iteration, so
+ * linking to a large network does not stall the server until the entire
+ * burst is in the sendq. No slice is sent while the sendq of the link is
+ * larger than <performance:burstsendq>.
+ *
+ * Users and channels are remembered by UUID and name when the burst starts
+ * and looked up again when their turn comes, so they are sent as they are
+ * at that moment. Changes to users and channels which have not been sent
+ * yet are routed to the server as usual and dropped there, changes to those
+ * which have been sent are applied on top of the burst in order.
+ */
+class BurstState : public Timer
+{
+ public:
+	/** The parts of the burst, in the order they are sent */
+	enum Phase { BURST_USERS, BURST_CHANNELS, BURST_XLINES, BURST_DONE };
+
+ private:
+	SpanningTreeUtilities* const Utils;
+
+	/** The socket the burst is sent on */
+	TreeSocket* const sock;
+
+	/** The part of the burst being sent */
+	Phase phase;
+
+	/** UUIDs of users or names of channels still to be sent, depending on phase */
+	std::vector<std::string> items;
+
+	/** Index of the next item in items to send */
+	size_t pos;
+
+	/** X-line types in the order they are sent, and the index of the current type */
+	std::vector<std::string> xlinetypes;
+	size_t xlinetype;
+
+	/** Mask of the last X-line sent of the current type, the next one is sent after it */
+	irc::string lastxline;
+
+	/** Advance to the next phase and take a snapshot of the items to send in it */
+	void NextPhase();
+
+	/** Send the next X-line
+	 * @return False if there are no more X-lines to send
+	 */
+	bool SendNextXLine();
+
+ public:
+	BurstState(SpanningTreeUtilities* Util, TreeSocket* s);
+
+	/** Send a slice of the burst
+	 * @return True if there is more to send
+	 */
+	bool Continue();
+
+	bool Tick(time_t);
+
+	/** Get the part of the burst being sent */
+	Phase GetPhase() const { return phase; }
+};
+
 /** Every SERVER connection inbound or outbound is represented by an object of
  * type TreeSocket. During setup, the object can be found in Utils->timeoutlist;
  * after setup, MyRoot will have been created as a child of Utils->TreeRoot
@@ -98,6 +163,13 @@ class TreeSocket : public BufferedSocket
 	bool LastPingWasGood;			/* Responded to last ping we sent? */
 	int proto_version;			/* Remote protocol version */
 	bool ConnectionFailureShown; /* Set to true if a connection failure message was shown */
+	BurstState* burst;			/* Netburst being sent, NULL if none */
+	CompressionStream* deflater;		/* Compresses what we send, NULL if not compressing */
+	CompressionStream* inflater;		/* Decompresses what we receive, NULL if not compressed */
+	RecvQueue plainq;			/* Decompressed data not yet split into lines */
+	Module* compressor;			/* Module providing the compression streams */
+	bool compressok;			/* Both sides offered our compression method, so the peer may compress */
+	TrafficMetrics* traffic;		/* Traffic of this link, NULL until it is connected */
 
 	/** Checks if the given servername and sid are both free
 	 */
@@ -147,6 +219,11 @@ class TreeSocket : public BufferedSocket
 	 */
 	void CleanNegotiationInfo();
 
+	/** Start counting the traffic of this link separately, labelled with
+	 * the server name. Called once the link is connected.
+	 */
+	void StartTrafficMetrics();
+
 	CullResult cull();
 	/** Destructor
 	 */
@@ -212,28 +289,33 @@ class TreeSocket : public BufferedSocket
 	/* Used on nick collision ... XXX ugly function HACK */
 	int DoCollision(User *u, time_t remotets, const std::string &remoteident, const std::string &remoteip, const std::string &remoteuid);
 
+	/** Send a user, its oper status, away message and metadata
+	 */
+	void SendUser(User* user);
+
 	/** Send one or more FJOINs for a channel of users.
 	 * If the length of a single line is more than 480-NICKMAX
 	 * in length, it is split over multiple lines.
 	 */
 	void SendFJoins(Channel* c);
 
-	/** Send G, Q, Z and E lines */
-	void SendXLines();
+	/** Send an X-line of a burstable type */
+	void SendXLine(const std::string& type, XLine* line);
 
 	/** Send all known information about a channel */
 	void SyncChannel(Channel* chan);
 
-	/** send all users and their oper state/modes */
-	void SendUsers();
-
 	/** This function is called when we want to send a netburst to a local
 	 * server. There is a set order we must do this, because for example
 	 * users require their servers to exist, and channels require their
 	 * users to exist. You get the idea.
+	 * Only the server tree is sent right away, the rest is sent by a BurstState.
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** Send the data of modules and ENDBURST, called by BurstState when everything else was sent */
+	void EndBurst();
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -243,6 +325,45 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(std::string line);
 
+	/** Queue raw data, compressing it if the link is compressed
+	 */
+	void WriteRaw(const std::string& data);
+
+	/** Flush the compressor, if any, then write out the sendq
+	 */
+	void DoWrite() CXX11_OVERRIDE;
+
+	/** Called once the other side has authenticated. Remembers whether both
+	 * sides offered compression in CAPAB, and if so starts compressing outgoing
+	 * data if this link block allows it. Must be called before any line that
+	 * may be compressed.
+	 * @param link The link block of the server
+	 */
+	void StartCompression(Link* link);
+
+	/** Handle the CAPAB COMPRESS line that marks the start of compressed data.
+	 * It is only accepted once the other side has authenticated and if both
+	 * sides offered compression.
+	 * @return True if the line was a compression marker and was handled
+	 */
+	bool StartDecompression(const std::string& command, const parameterlist& params);
+
+	/** Decompress some of the recvq into plainq, at most one read buffer worth
+	 * at a time, closing the link if plainq would grow beyond its limit
+	 * @return True if data was decompressed, false if there is nothing to do or on error
+	 */
+	bool Inflate();
+
+	/** Free the compression streams, if any */
+	void StopCompression();
+
+	/** Get the module providing the compression streams, NULL if the link is not compressed */
+	Module* GetCompressor() const { return compressor; }
+
+	/** Get the compression streams, NULL if the direction is not compressed */
+	CompressionStream* GetDeflater() const { return deflater; }
+	CompressionStream* GetInflater() const { return inflater; }
+
 	/** Handle ERROR command */
 	void Error(parameterlist &params);
 
@@ -45,6 +45,12 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, Link* link, Autoconnect* mya
 	capab->ac = myac;
 	capab->capab_phase = 0;
 	MyRoot = NULL;
+	burst = NULL;
+	deflater = NULL;
+	inflater = NULL;
+	compressor = NULL;
+	compressok = false;
+	traffic = NULL;
 	proto_version = 0;
 	ConnectionFailureShown = false;
 	LinkState = CONNECTING;
@@ -73,6 +79,12 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, int newfd, ListenSocket* via
 	capab = new CapabData;
 	capab->capab_phase = 0;
 	MyRoot = NULL;
+	burst = NULL;
+	deflater = NULL;
+	inflater = NULL;
+	compressor = NULL;
+	compressok = false;
+	traffic = NULL;
 	age = ServerInstance->Time();
 	LinkState = WAIT_AUTH_1;
 	proto_version = 0;
@@ -101,6 +113,14 @@ void TreeSocket::CleanNegotiationInfo()
 	capab = NULL;
 }
 
+void TreeSocket::StartTrafficMetrics()
+{
+	if (traffic)
+		return;
+	traffic = new TrafficMetrics("inspircd_link", "each server link", Metric::Label("server", linkID));
+	traffic->Register();
+}
+
 CullResult TreeSocket::cull()
 {
 	Utils->timeoutlist.erase(this);
@@ -113,6 +133,9 @@ TreeSocket::~TreeSocket()
 {
 	if (capab)
 		delete capab;
+	delete burst;
+	StopCompression();
+	delete traffic;
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -227,11 +250,25 @@ void TreeSocket::OnDataReady()
 {
 	Utils->Creator->loopCall = true;
 	std::string line;
-	while (GetNextLine(line))
+	const char* start;
+	size_t len;
+	while (true)
 	{
+		// Once the other side starts compressing, lines come out of plainq instead
+		if (!(inflater ? plainq : recvq).GetNextLine(start, len))
+		{
+			if ((inflater) && (Inflate()))
+				continue;
+			break;
+		}
+		line.assign(start, len);
+		Utils->Creator->Traffic.In(len + 1);
+		if (traffic)
+			traffic->In(len + 1);
+
 		std::string::size_type rline = line.find('\r');
 		if (rline != std::string::npos)
-			line = line.substr(0,rline);
+			line.erase(rline);
 		if (line.find('\0') != std::string::npos)
 		{
 			SendError("Read null character from socket");
@@ -241,7 +278,7 @@ void TreeSocket::OnDataReady()
 		if (!getError().empty())
 			break;
 	}
-	if (LinkState != CONNECTED && recvq.length() > 4096)
+	if (LinkState != CONNECTED && (inflater ? plainq : recvq).length() > 4096)
 		SendError("RecvQ overrun (line too long)");
 	Utils->Creator->loopCall = false;
 }
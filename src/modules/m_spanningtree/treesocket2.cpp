@@ -87,6 +87,9 @@ void TreeSocket::ProcessLine(std::string &line)
 	if (command.empty())
 		return;
 
+	if (StartDecompression(command, params))
+		return;
+
 	switch (this->LinkState)
 	{
 		case WAIT_AUTH_1:
@@ -171,6 +174,7 @@ void TreeSocket::ProcessLine(std::string &line)
 				Utils->timeoutlist.erase(this);
 
 				linkID = capab->name;
+				StartTrafficMetrics();
 
 				MyRoot = new TreeServer(Utils, capab->name, capab->description, capab->sid, Utils->TreeRoot, this, capab->hidden);
 				Utils->TreeRoot->AddChild(MyRoot);
@@ -234,7 +238,6 @@ void TreeSocket::ProcessLine(std::string &line)
 void TreeSocket::ProcessConnectedLine(std::string& prefix, std::string& command, parameterlist& params)
 {
 	User* who = ServerInstance->FindUUID(prefix);
-	std::string direction;
 
 	if (!who)
 	{
@@ -275,7 +278,6 @@ void TreeSocket::ProcessConnectedLine(std::string& prefix, std::string& command,
 	}
 
 	// Make sure prefix is still good
-	direction = who->server;
 	prefix = who->uuid;
 
 	/*
@@ -294,7 +296,7 @@ void TreeSocket::ProcessConnectedLine(std::string& prefix, std::string& command,
 	 * a valid SID or a valid UUID, so that invalid UUID or SID never makes it
 	 * to the higher level functions. -- B
 	 */
-	TreeServer* route_back_again = Utils->BestRouteTo(direction);
+	TreeServer* route_back_again = Utils->BestRouteTo(who);
 	if ((!route_back_again) || (route_back_again->GetSocket() != this))
 	{
 		if (route_back_again)
@@ -511,6 +513,11 @@ void TreeSocket::OnTimeout()
 
 void TreeSocket::Close()
 {
+	// Stop sending the burst, if any
+	delete burst;
+	burst = NULL;
+	StopCompression();
+
 	if (fd != -1)
 		ServerInstance->GlobalCulls.AddItem(this);
 	this->BufferedSocket::Close();
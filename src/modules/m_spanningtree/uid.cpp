@@ -89,6 +89,7 @@ CmdResult CommandUID::Handle(const parameterlist &params, User* serversrc)
 		return CMD_INVALID;
 	}
 	(*(ServerInstance->Users->clientlist))[params[2]] = _new;
+	Utils->userserver.set(_new, remoteserver);
 	_new->nick = params[2];
 	_new->host = params[3];
 	_new->dhost = params[4];
@@ -28,6 +28,8 @@
 #include "treesocket.h"
 #include "resolvers.h"
 
+#include <iostream>
+
 /* Create server sockets off a listener. */
 ModResult ModuleSpanningTree::OnAcceptConnection(int newsock, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
 {
@@ -101,6 +103,28 @@ TreeServer* SpanningTreeUtilities::BestRouteTo(const std::string &ServerName)
 	}
 }
 
+TreeServer* SpanningTreeUtilities::FindServer(User* user)
+{
+	TreeServer* server = userserver.get(user);
+	if (server)
+		return server;
+
+	// Local and server users, and remote users which are quitting
+	return FindServer(user->server);
+}
+
+TreeServer* SpanningTreeUtilities::BestRouteTo(User* user)
+{
+	if (IS_LOCAL(user))
+		return NULL;
+
+	TreeServer* server = userserver.get(user);
+	if (server)
+		return server->GetRoute();
+
+	return BestRouteTo(user->server);
+}
+
 /** Find the first server matching a given glob mask.
  * Theres no find-using-glob method of hash_map [awwww :-(]
  * so instead, we iterate over the list using an iterator
@@ -127,7 +151,7 @@ TreeServer* SpanningTreeUtilities::FindServerID(const std::string &id)
 }
 
 SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C)
-	: RefreshTimer(this), Creator(C)
+	: RefreshTimer(this), Creator(C), userserver(C), chanroutes("spanningtree_routes", C)
 {
 	ServerInstance->Timers->AddTimer(&RefreshTimer);
 	ServerInstance->Logs->Log("m_spanningtree", LOG_DEBUG, "***** Using SID for hash: %s *****", ServerInstance->Config->GetSID().c_str());
@@ -164,16 +188,43 @@ SpanningTreeUtilities::~SpanningTreeUtilities()
 }
 
 /* returns a list of DIRECT servernames for a specific channel */
-void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerList &list, char status, const CUList &exempt_list)
+void ChannelRoutes::Change(TreeServer* route, int diff)
 {
-	unsigned int minrank = 0;
-	if (status)
+	for (RouteList::iterator i = routes.begin(); i != routes.end(); ++i)
 	{
-		ModeHandler* mh = ServerInstance->Modes->FindPrefix(status);
-		if (mh)
-			minrank = mh->GetPrefixRank();
+		if (i->first != route)
+			continue;
+
+		i->second += diff;
+		if (!i->second)
+			routes.erase(i);
+		return;
+	}
+	routes.push_back(std::make_pair(route, diff));
+}
+
+void SpanningTreeUtilities::ChangeChannelRoute(Membership* memb, int diff)
+{
+	if (IS_LOCAL(memb->user))
+		return;
+
+	TreeServer* route = this->BestRouteTo(memb->user);
+	if (!route)
+		return;
+
+	ChannelRoutes* routes = chanroutes.get(memb->chan);
+	if (!routes)
+	{
+		routes = new ChannelRoutes;
+		chanroutes.set(memb->chan, routes);
 	}
+	routes->Change(route, diff);
+	if (routes->GetRoutes().empty())
+		chanroutes.unset(memb->chan);
+}
 
+void SpanningTreeUtilities::WalkChannelMembers(Channel* c, TreeServerList& list, unsigned int minrank, const CUList& exempt_list)
+{
 	const UserMembList *ulist = c->GetUsers();
 
 	for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
@@ -186,12 +237,164 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerLis
 
 		if (exempt_list.find(i->first) == exempt_list.end())
 		{
-			TreeServer* best = this->BestRouteTo(i->first->server);
+			TreeServer* best = this->BestRouteTo(i->first);
 			if (best)
 				list.insert(best);
 		}
 	}
-	return;
+}
+
+void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerList &list, char status, const CUList &exempt_list)
+{
+	unsigned int minrank = 0;
+	if (status)
+	{
+		ModeHandler* mh = ServerInstance->Modes->FindPrefix(status);
+		if (mh)
+			minrank = mh->GetPrefixRank();
+	}
+
+	// Members are not counted by rank
+	if (minrank)
+	{
+		WalkChannelMembers(c, list, minrank, exempt_list);
+		return;
+	}
+
+	ChannelRoutes* counts = chanroutes.get(c);
+	if (!counts)
+		return;
+
+	// Exempt members do not count towards their route. The exempt list is usually
+	// just the local source of the message, so the counts are rarely copied.
+	ChannelRoutes exempted;
+	for (CUList::const_iterator i = exempt_list.begin(); i != exempt_list.end(); ++i)
+	{
+		User* user = *i;
+		if ((IS_LOCAL(user)) || (!c->HasUser(user)))
+			continue;
+
+		TreeServer* route = this->BestRouteTo(user);
+		if (!route)
+			continue;
+
+		if (counts != &exempted)
+		{
+			exempted = *counts;
+			counts = &exempted;
+		}
+		exempted.Change(route, -1);
+	}
+
+	for (ChannelRoutes::RouteList::const_iterator i = counts->GetRoutes().begin(); i != counts->GetRoutes().end(); ++i)
+	{
+		if (i->second > 0)
+			list.insert(i->first);
+	}
+}
+
+void SpanningTreeUtilities::BenchmarkChannelRoutes()
+{
+	std::cout << "\n\nSpanning tree channel route tests\n\n";
+
+	const unsigned int LINKS = 4;
+	const unsigned int MEMBERS = 10000;
+	const unsigned int ROUNDS = 1000;
+
+	if (ServerInstance->FindChan("#routebench"))
+	{
+		std::cout << "ROUTES: #routebench already exists, skipping" << std::endl;
+		return;
+	}
+
+	// Fake servers without a socket, each with a quarter of the members of one channel
+	std::vector<TreeServer*> servers;
+	for (unsigned int i = 0; i < LINKS; i++)
+	{
+		std::string sid = "9Z" + ConvToStr(i);
+		TreeServer* server = new TreeServer(this, "routebench" + ConvToStr(i) + ".test", "Channel route benchmark", sid, TreeRoot, NULL, true);
+		TreeRoot->AddChild(server);
+		servers.push_back(server);
+	}
+
+	Channel* chan = new Channel("#routebench", ServerInstance->Time());
+	for (unsigned int i = 0; i < MEMBERS; i++)
+	{
+		TreeServer* server = servers[i % LINKS];
+		std::string uuid = server->GetID() + ConvToStr(100000 + i);
+		User* user = new RemoteUser(uuid, server->GetName());
+		(*(ServerInstance->Users->clientlist))[uuid] = user;
+		userserver.set(user, server);
+		user->nick = uuid;
+		user->registered = REG_ALL;
+		server->UserCount++;
+		chan->ForceJoin(user, NULL, true);
+	}
+
+	bool passed = true;
+	TreeServerList walked;
+	TreeServerList counted;
+
+	clock_t start = clock();
+	for (unsigned int i = 0; i < ROUNDS; i++)
+	{
+		walked.clear();
+		WalkChannelMembers(chan, walked, 0, CUList());
+	}
+	double walkusecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / ROUNDS;
+
+	start = clock();
+	for (unsigned int i = 0; i < ROUNDS; i++)
+	{
+		counted.clear();
+		GetListOfServersForChannel(chan, counted, 0, CUList());
+	}
+	double countusecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / ROUNDS;
+
+	std::cout << MEMBERS << " members behind " << LINKS << " links: walking the members takes " << walkusecs
+		<< "us, the route counts " << countusecs << "us" << std::endl;
+
+	if (walked != counted || counted.size() != LINKS)
+	{
+		std::cout << "ROUTES: Route counts found " << counted.size() << " routes, walking the members " << walked.size() << std::endl;
+		passed = false;
+	}
+
+	// The only member behind a route is exempt, so the route is not needed
+	servers[0]->QuitUsers("Route benchmark");
+	User* lone = new RemoteUser(servers[0]->GetID() + "AAAAAA", servers[0]->GetName());
+	(*(ServerInstance->Users->clientlist))[lone->uuid] = lone;
+	userserver.set(lone, servers[0]);
+	lone->nick = lone->uuid;
+	lone->registered = REG_ALL;
+	servers[0]->UserCount++;
+	chan->ForceJoin(lone, NULL, true);
+
+	CUList exempt;
+	exempt.insert(lone);
+	counted.clear();
+	GetListOfServersForChannel(chan, counted, 0, exempt);
+	if (counted.size() != LINKS - 1 || counted.count(servers[0]))
+	{
+		std::cout << "ROUTES: Exempt member did not remove its route" << std::endl;
+		passed = false;
+	}
+
+	for (unsigned int i = 0; i < LINKS; i++)
+	{
+		servers[i]->QuitUsers("Route benchmark");
+		TreeRoot->DelChild(servers[i]);
+		servers[i]->cull();
+		delete servers[i];
+	}
+
+	if (chanroutes.get(chan))
+	{
+		std::cout << "ROUTES: Route counts left after all members quit" << std::endl;
+		passed = false;
+	}
+
+	std::cout << (passed ? "\nSUCCESS!\n" : "\nFAILURE\n");
 }
 
 std::string SpanningTreeUtilities::ConstructLine(const std::string& prefix, const std::string& command, const parameterlist& params)
@@ -267,6 +470,18 @@ bool SpanningTreeUtilities::DoOneToOne(const std::string& prefix, const std::str
 	}
 }
 
+bool SpanningTreeUtilities::DoOneToOne(const std::string& prefix, const std::string& command, const parameterlist& params, User* target)
+{
+	TreeServer* Route = this->BestRouteTo(target);
+	if (!Route)
+		return false;
+
+	TreeSocket* Sock = Route->GetSocket();
+	if (Sock)
+		Sock->WriteLine(ConstructLine(prefix, command, params));
+	return true;
+}
+
 void SpanningTreeUtilities::RefreshIPCache()
 {
 	ValidIPs.clear();
@@ -311,7 +526,12 @@ void SpanningTreeUtilities::ReadConfiguration()
 	AnnounceTSChange = options->getBool("announcets");
 	AllowOptCommon = options->getBool("allowmismatch");
 	ChallengeResponse = !security->getBool("disablehmac");
-	quiet_bursts = ServerInstance->Config->ConfValue("performance")->getBool("quietbursts");
+	ConfigTag* performance = ServerInstance->Config->ConfValue("performance");
+	quiet_bursts = performance->getBool("quietbursts");
+	long sendq = performance->getInt("burstsendq", 262144);
+	BurstSendQ = (sendq < 4096) ? 4096 : sendq;
+	long slice = performance->getInt("burstslice", 100);
+	BurstSlice = (slice < 1) ? 1 : slice;
 	PingWarnTime = options->getInt("pingwarning");
 	PingFreq = options->getInt("serverpingfreq");
 
@@ -341,6 +561,7 @@ void SpanningTreeUtilities::ReadConfiguration()
 		L->Hook = tag->getString("ssl");
 		L->Bind = tag->getString("bind");
 		L->Hidden = tag->getBool("hidden");
+		L->Compress = tag->getBool("compress");
 
 		if (L->Name.empty())
 			throw ModuleException("Invalid configuration, found a link tag without a name!" + (!L->IPAddr.empty() ? " IP address: "+L->IPAddr : ""));
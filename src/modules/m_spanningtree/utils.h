@@ -40,6 +40,43 @@ typedef TR1NS::unordered_map<std::string, TreeServer*, irc::insensitive, irc::St
 
 typedef std::set<TreeServer*> TreeServerList;
 
+/** Remembers the server of each remote user, so routing to a user needs no lookup by server name.
+ * The server is forgotten when the user quits, servers are only removed after all their users quit.
+ */
+class TreeServerExt : public LocalExtItem
+{
+ public:
+	TreeServerExt(Module* parent) : LocalExtItem("spanningtree_server", parent) { }
+	TreeServer* get(const Extensible* container) const { return static_cast<TreeServer*>(get_raw(container)); }
+	void set(Extensible* container, TreeServer* server) { set_raw(container, server); }
+	void unset(Extensible* container) { unset_raw(container); }
+	void free(void* item) { }
+};
+
+/** The number of remote members of a channel behind each directly connected server.
+ * It is updated as remote users join and leave, so the servers a channel message
+ * has to be sent to are known without looking at every member of the channel.
+ */
+class ChannelRoutes
+{
+ public:
+	typedef std::vector<std::pair<TreeServer*, int> > RouteList;
+
+ private:
+	/** Routes with at least one member behind them, there are only as many as there are links */
+	RouteList routes;
+
+ public:
+	/** Change the number of members behind a route, a route with no members left is forgotten
+	 * @param route The directly connected server the members are behind
+	 * @param diff The number of members that joined, negative if they left
+	 */
+	void Change(TreeServer* route, int diff);
+
+	/** Get the routes which have members behind them */
+	const RouteList& GetRoutes() const { return routes; }
+};
+
 /** Contains helper functions and variables for this module,
  * and keeps them out of the global namespace
  */
@@ -51,6 +88,11 @@ class SpanningTreeUtilities : public classbase
 
 	CacheRefreshTimer RefreshTimer;
 
+	/** Add the servers which have members of channel c with at least the given rank behind them
+	 * by looking at every member, used when the route counts can not be used
+	 */
+	void WalkChannelMembers(Channel* c, TreeServerList& list, unsigned int minrank, const CUList& exempt_list);
+
  public:
 	/** Creator module
 	 */
@@ -74,6 +116,14 @@ class SpanningTreeUtilities : public classbase
 	 */
 	bool quiet_bursts;
 
+	/** Bursts are paused while the sendq of the link is larger than this
+	 */
+	unsigned long BurstSendQ;
+
+	/** Maximum number of users, channels or X-lines sent in one slice of a burst
+	 */
+	unsigned int BurstSlice;
+
 	/* Number of seconds that a server can go without ping
 	 * before opers are warned of high latency.
 	 */
@@ -130,6 +180,10 @@ class SpanningTreeUtilities : public classbase
 	 */
 	bool DoOneToOne(const std::string& prefix, const std::string& command, const parameterlist& params, const std::string& target);
 
+	/** Send a message from this server to the server a user is on
+	 */
+	bool DoOneToOne(const std::string& prefix, const std::string& command, const parameterlist& params, User* target);
+
 	/** Send a message from this server to all but one other, local or remote
 	 */
 	bool DoOneToAllButSender(const std::string &prefix, const std::string &command, const parameterlist& params, const std::string& omit);
@@ -142,10 +196,28 @@ class SpanningTreeUtilities : public classbase
 	 */
 	void ReadConfiguration();
 
+	/** Servers of remote users
+	 */
+	TreeServerExt userserver;
+
+	/** Route counts of channels with remote members
+	 */
+	SimpleExtItem<ChannelRoutes> chanroutes;
+
 	/** Compile a list of servers which contain members of channel c
 	 */
 	void GetListOfServersForChannel(Channel* c, TreeServerList &list, char status, const CUList &exempt_list);
 
+	/** Update the route counts of a channel when a remote user joins or leaves it
+	 * @param memb The membership of the user
+	 * @param diff 1 if the user joined, -1 if the user left
+	 */
+	void ChangeChannelRoute(Membership* memb, int diff);
+
+	/** Measure finding the servers to send a message for a large channel to, for the test suite
+	 */
+	void BenchmarkChannelRoutes();
+
 	/** Find a server by name
 	 */
 	TreeServer* FindServer(const std::string &ServerName);
@@ -154,10 +226,18 @@ class SpanningTreeUtilities : public classbase
 	 */
 	TreeServer* FindServerID(const std::string &id);
 
+	/** Find the server a user is on
+	 */
+	TreeServer* FindServer(User* user);
+
 	/** Find a route to a server by name
 	 */
 	TreeServer* BestRouteTo(const std::string &ServerName);
 
+	/** Find the route to the server a user is on, NULL for local users
+	 */
+	TreeServer* BestRouteTo(User* user);
+
 	/** Find a server by glob mask
 	 */
 	TreeServer* FindServerMask(const std::string &ServerName);
@@ -38,6 +38,14 @@ class AuthQuery : public SQLQuery
 	{
 	}
 
+	/** Let the user finish registering now rather than on the next periodic check */
+	void Resume(User* user)
+	{
+		LocalUser* localuser = IS_LOCAL(user);
+		if (localuser)
+			localuser->checktimer.ScheduleCheck(ServerInstance->Time());
+	}
+
 	void OnResult(SQLResult& res) CXX11_OVERRIDE
 	{
 		User* user = ServerInstance->FindNick(uid);
@@ -53,6 +61,7 @@ class AuthQuery : public SQLQuery
 				ServerInstance->SNO->WriteGlobalSno('a', "Forbidden connection from %s (SQL query returned no matches)", user->GetFullRealHost().c_str());
 			pendingExt.set(user, AUTH_STATE_FAIL);
 		}
+		Resume(user);
 	}
 
 	void OnError(SQLerror& error) CXX11_OVERRIDE
@@ -63,6 +72,7 @@ class AuthQuery : public SQLQuery
 		pendingExt.set(user, AUTH_STATE_FAIL);
 		if (verbose)
 			ServerInstance->SNO->WriteGlobalSno('a', "Forbidden connection from %s (SQL query failed: %s)", user->GetFullRealHost().c_str(), error.Str());
+		Resume(user);
 	}
 };
 
@@ -33,6 +33,11 @@ class SSLCertExt : public ExtensionItem {
 		ssl_cert* old = static_cast<ssl_cert*>(set_raw(item, value));
 		if (old && old->refcount_dec())
 			delete old;
+
+		// The z: extban matches on the certificate fingerprint
+		User* user = dynamic_cast<User*>(item);
+		if (user)
+			user->identgeneration++;
 	}
 
 	std::string serialize(SerializeFormat format, const Extensible* container, void* item) const
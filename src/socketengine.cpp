@@ -63,7 +63,7 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 
 	// if adding a trial read/write, insert it into the set
 	if (change & FD_TRIAL_NOTE_MASK && !(old_m & FD_TRIAL_NOTE_MASK))
-		trials.insert(eh->GetFd());
+		trials.push_back(eh->GetFd());
 
 	new_m |= change;
 	if (new_m == old_m)
@@ -75,23 +75,63 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 
 void SocketEngine::DispatchTrialWrites()
 {
-	std::vector<int> working_list;
-	working_list.reserve(trials.size());
-	working_list.assign(trials.begin(), trials.end());
-	trials.clear();
-	for(unsigned int i=0; i < working_list.size(); i++)
+	// Take the trials out of the list and clear their bits first, so any
+	// trial that is added while they are dispatched goes into a fresh list
+	trialswork.swap(trials);
+	trialmasks.resize(trialswork.size());
+	for (size_t i = 0; i < trialswork.size(); i++)
 	{
-		int fd = working_list[i];
-		EventHandler* eh = GetRef(fd);
+		EventHandler* eh = GetRef(trialswork[i]);
 		if (!eh)
+		{
+			trialmasks[i] = 0;
 			continue;
-		int mask = eh->event_mask;
+		}
+		trialmasks[i] = eh->event_mask;
 		eh->event_mask &= ~(FD_ADD_TRIAL_READ | FD_ADD_TRIAL_WRITE);
-		if ((mask & (FD_ADD_TRIAL_READ | FD_READ_WILL_BLOCK)) == FD_ADD_TRIAL_READ)
+	}
+
+	// Reads first, they run commands which queue output on other sockets
+	for (size_t i = 0; i < trialswork.size(); i++)
+	{
+		EventHandler* eh = GetRef(trialswork[i]);
+		if (eh && (trialmasks[i] & (FD_ADD_TRIAL_READ | FD_READ_WILL_BLOCK)) == FD_ADD_TRIAL_READ)
 			eh->HandleEvent(EVENT_READ, 0);
-		if ((mask & (FD_ADD_TRIAL_WRITE | FD_WRITE_WILL_BLOCK)) == FD_ADD_TRIAL_WRITE)
+	}
+
+	// Then write out everything, including what the reads queued. The write
+	// sends the whole sendq, so a trial write added by the reads is done too.
+	for (size_t i = 0; i < trialswork.size(); i++)
+	{
+		EventHandler* eh = GetRef(trialswork[i]);
+		if (eh && (trialmasks[i] & (FD_ADD_TRIAL_WRITE | FD_WRITE_WILL_BLOCK)) == FD_ADD_TRIAL_WRITE)
+		{
+			eh->event_mask &= ~FD_ADD_TRIAL_WRITE;
 			eh->HandleEvent(EVENT_WRITE, 0);
+		}
+	}
+	trialswork.clear();
+
+	// Sockets which got output during the reads but were not in the list yet.
+	// Trial reads wait for the next call, others are dropped from the list.
+	size_t kept = 0;
+	for (size_t i = 0; i < trials.size(); i++)
+	{
+		int fd = trials[i];
+		EventHandler* eh = GetRef(fd);
+		if (!eh)
+			continue;
+		int mask = eh->event_mask;
+		if (mask & FD_ADD_TRIAL_WRITE)
+		{
+			eh->event_mask &= ~FD_ADD_TRIAL_WRITE;
+			if (!(mask & FD_WRITE_WILL_BLOCK))
+				eh->HandleEvent(EVENT_WRITE, 0);
+		}
+		if ((GetRef(fd) == eh) && (eh->event_mask & FD_TRIAL_NOTE_MASK))
+			trials[kept++] = fd;
 	}
+	trials.resize(kept);
 }
 
 bool SocketEngine::HasFd(int fd)
@@ -229,7 +229,7 @@ void PollEngine::DelFd(EventHandler* eh)
 
 int PollEngine::DispatchEvents()
 {
-	int i = poll(events, CurrentSetSize, 1000);
+	int i = poll(events, CurrentSetSize, ServerInstance->Timers->GetTimeout());
 	int index;
 	socklen_t codesize = sizeof(int);
 	int errcode;
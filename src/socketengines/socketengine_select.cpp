@@ -130,7 +130,10 @@ void SelectEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 
 int SelectEngine::DispatchEvents()
 {
-	static timeval tval = { 1, 0 };
+	int timeout = ServerInstance->Timers->GetTimeout();
+	timeval tval;
+	tval.tv_sec = timeout / 1000;
+	tval.tv_usec = (timeout % 1000) * 1000;
 
 	fd_set rfdset = ReadSet, wfdset = WriteSet, errfdset = ErrSet;
 
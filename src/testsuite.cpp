@@ -20,9 +20,12 @@
 
 
 #include "inspircd.h"
+#include "listmode.h"
 #include "testsuite.h"
 #include "threadengine.h"
+#include "xline.h"
 #include <iostream>
+#include <sys/ioctl.h>
 
 class TestSuiteThread : public Thread
 {
@@ -62,6 +65,16 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Receive queue tests\n";
+		std::cout << "(A) Timer tests\n";
+		std::cout << "(B) Hash table tests\n";
+		std::cout << "(C) X-line index tests\n";
+		std::cout << "(D) Ban verdict cache tests\n";
+		std::cout << "(E) List mode tests\n";
+		std::cout << "(F) Oper privilege tests\n";
+		std::cout << "(G) Command parser tests\n";
+		std::cout << "(H) Socket engine tests\n";
+		std::cout << "(I) I/O thread tests\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -105,6 +118,36 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoRecvQueueTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'A':
+				std::cout << (DoTimerTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'B':
+				std::cout << (DoHashTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'C':
+				std::cout << (DoXLineTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'D':
+				std::cout << (DoBanCacheTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'E':
+				std::cout << (DoListModeTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'F':
+				std::cout << (DoPrivilegeTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'G':
+				std::cout << (DoParserTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'H':
+				std::cout << (DoSocketEngineTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'I':
+				std::cout << (DoIOThreadTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -389,6 +432,1364 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+bool TestSuite::DoRecvQueueTests()
+{
+	RecvQueue recvq;
+	const char* line;
+	size_t len;
+
+	const std::string first = "PRIVMSG #chan :hello\r\nPING :a";
+	recvq.append(first.data(), first.length());
+	if (!recvq.GetNextLine(line, len) || std::string(line, len) != "PRIVMSG #chan :hello\r")
+	{
+		std::cout << "RECVQUEUE: First line was not split correctly" << std::endl;
+		return false;
+	}
+
+	if (recvq.GetNextLine(line, len))
+	{
+		std::cout << "RECVQUEUE: Returned a line without a delimiter: " << std::string(line, len) << std::endl;
+		return false;
+	}
+
+	// Appending must keep the partial line which is still in the queue
+	const std::string second = "bc\nQUIT\n";
+	recvq.append(second.data(), second.length());
+	if (!recvq.GetNextLine(line, len) || std::string(line, len) != "PING :abc")
+	{
+		std::cout << "RECVQUEUE: Partial line was not joined correctly" << std::endl;
+		return false;
+	}
+
+	if (!recvq.GetNextLine(line, len) || std::string(line, len) != "QUIT" || !recvq.empty())
+	{
+		std::cout << "RECVQUEUE: Last line was not split correctly" << std::endl;
+		return false;
+	}
+
+	// Split a large buffer line by line
+	std::string big;
+	for (unsigned int i = 0; i < 10000; i++)
+		big.append("line ").append(ConvToStr(i)).append("\n");
+	recvq.append(big.data(), big.length());
+	for (unsigned int i = 0; i < 10000; i++)
+	{
+		if (!recvq.GetNextLine(line, len) || std::string(line, len) != "line " + ConvToStr(i))
+		{
+			std::cout << "RECVQUEUE: Line " << i << " of large buffer was not split correctly" << std::endl;
+			return false;
+		}
+		if (i == 5000)
+			recvq.append("extra\n", 6);
+	}
+
+	if (!recvq.GetNextLine(line, len) || std::string(line, len) != "extra" || recvq.length() != 0)
+	{
+		std::cout << "RECVQUEUE: Data appended during splitting was lost" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+/** The tick the timer tests are at, so test timers can record when they ticked */
+static unsigned long testtick;
+
+class TestTimer : public Timer
+{
+ public:
+	std::vector<unsigned long> ticks;
+
+	TestTimer(unsigned int secs_from_now, time_t now, bool repeating = false)
+		: Timer(secs_from_now, now, repeating)
+	{
+	}
+
+	bool Tick(time_t)
+	{
+		ticks.push_back(testtick);
+		return true;
+	}
+};
+
+bool TestSuite::DoTimerTests()
+{
+	// Run the tests on a private timer manager with a simulated clock
+	TimerManager tm;
+	TimerManager* const realtimers = ServerInstance->Timers;
+	ServerInstance->Timers = &tm;
+
+	const unsigned long base = 1000000000;
+	const time_t basetime = base / 1000;
+	tm.wheeltime = base;
+
+	bool passed = true;
+	{
+		TestTimer oneshot(5, basetime);
+		TestTimer repeating(2, basetime, true);
+		TestTimer overdue(0, basetime - 10);
+		TestTimer cancelled(3, basetime);
+		TestTimer daylong(86400, basetime);
+		TestTimer distant(86400 * 60, basetime);
+		TestTimer fast(0, basetime, true);
+		tm.AddTimer(&oneshot);
+		tm.AddTimer(&repeating);
+		tm.AddTimer(&overdue);
+		tm.AddTimer(&cancelled);
+		tm.AddTimer(&daylong);
+		tm.AddTimer(&distant);
+		fast.SetIntervalMS(30);
+		tm.AddTimer(&fast, base);
+		tm.DelTimer(&cancelled);
+
+		if (tm.GetTimerCount() != 6)
+		{
+			std::cout << "TIMER: Expected 6 timers, have " << tm.GetTimerCount() << std::endl;
+			passed = false;
+		}
+
+		// The overdue timer is due now
+		if (tm.GetTimeout(base, 1000) != 0)
+		{
+			std::cout << "TIMER: Timeout with an overdue timer is " << tm.GetTimeout(base, 1000) << std::endl;
+			passed = false;
+		}
+
+		for (testtick = base; testtick < base + 10010; testtick += 7)
+			tm.Run(testtick, testtick / 1000);
+
+		if (overdue.ticks.size() != 1 || overdue.ticks[0] != base)
+		{
+			std::cout << "TIMER: Overdue timer did not tick once immediately" << std::endl;
+			passed = false;
+		}
+
+		if (oneshot.ticks.size() != 1 || oneshot.ticks[0] < base + 5000 || oneshot.ticks[0] >= base + 5007)
+		{
+			std::cout << "TIMER: One-shot timer did not tick once after 5 seconds" << std::endl;
+			passed = false;
+		}
+
+		if (!cancelled.ticks.empty())
+		{
+			std::cout << "TIMER: Cancelled timer ticked" << std::endl;
+			passed = false;
+		}
+
+		if (repeating.ticks.size() != 5)
+		{
+			std::cout << "TIMER: Repeating timer ticked " << repeating.ticks.size() << " times, expected 5" << std::endl;
+			passed = false;
+		}
+		for (unsigned int i = 0; i < repeating.ticks.size(); i++)
+		{
+			unsigned long due = base + (i + 1) * 2000;
+			if (repeating.ticks[i] < due || repeating.ticks[i] >= due + 7)
+			{
+				std::cout << "TIMER: Repeating timer tick " << i << " at " << repeating.ticks[i] - base << "ms" << std::endl;
+				passed = false;
+			}
+		}
+
+		// Rescheduled from the tick it ran at, so every interval is between 30 and 37ms
+		if (fast.ticks.size() < 10010 / 37 || fast.ticks.size() > 10010 / 30)
+		{
+			std::cout << "TIMER: Millisecond timer ticked " << fast.ticks.size() << " times" << std::endl;
+			passed = false;
+		}
+		for (unsigned int i = 1; i < fast.ticks.size(); i++)
+		{
+			unsigned long interval = fast.ticks[i] - fast.ticks[i - 1];
+			if (interval < 30 || interval > 37)
+			{
+				std::cout << "TIMER: Millisecond timer interval " << interval << "ms" << std::endl;
+				passed = false;
+				break;
+			}
+		}
+
+		tm.DelTimer(&fast);
+		tm.DelTimer(&repeating);
+
+		// Only the day long and distant timers are left, they are not due for a while
+		if (tm.GetTimeout(testtick, 1000) != 1000)
+		{
+			std::cout << "TIMER: Timeout without timers due soon is " << tm.GetTimeout(testtick, 1000) << std::endl;
+			passed = false;
+		}
+
+		TestTimer soon(0, basetime);
+		soon.SetIntervalMS(100);
+		tm.AddTimer(&soon, testtick);
+		if (tm.GetTimeout(testtick, 1000) != 100)
+		{
+			std::cout << "TIMER: Timeout with a timer due in 100ms is " << tm.GetTimeout(testtick, 1000) << std::endl;
+			passed = false;
+		}
+		tm.DelTimer(&soon);
+
+		// Jump forward three days in steps of a minute
+		for (unsigned int i = 0; i < 3 * 24 * 60; i++)
+		{
+			testtick += 60000;
+			tm.Run(testtick, testtick / 1000);
+		}
+
+		if (daylong.ticks.size() != 1 || daylong.ticks[0] < base + 86400000 || daylong.ticks[0] >= base + 86460000)
+		{
+			std::cout << "TIMER: Day long timer did not tick once after a day" << std::endl;
+			passed = false;
+		}
+
+		if (!distant.ticks.empty() || tm.GetTimerCount() != 1)
+		{
+			std::cout << "TIMER: Distant timer ticked early" << std::endl;
+			passed = false;
+		}
+
+		// Jump to when the distant timer is due in steps of a day
+		for (unsigned int i = 3; i < 60; i++)
+		{
+			testtick += 86400000;
+			tm.Run(testtick, testtick / 1000);
+		}
+		if (distant.ticks.size() != 1 || tm.GetTimerCount() != 0)
+		{
+			std::cout << "TIMER: Distant timer did not tick after 60 days" << std::endl;
+			passed = false;
+		}
+	}
+
+	ServerInstance->Timers = realtimers;
+	return passed;
+}
+
+/** The hash function which was used for nicks and channel names before the keyed hash */
+struct LegacyHash
+{
+	size_t operator()(const std::string& s) const
+	{
+		size_t t = 0;
+		for (std::string::const_iterator x = s.begin(); x != s.end(); ++x)
+			t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
+		return t;
+	}
+};
+
+template<typename Hash>
+static size_t MaxBucketSize(const std::vector<std::string>& names, double& usecs)
+{
+	typedef TR1NS::unordered_map<std::string, int, Hash, irc::StrHashComp> Table;
+	Table table;
+	for (size_t i = 0; i < names.size(); i++)
+		table[names[i]] = i;
+
+	size_t maxbucket = 0;
+	for (size_t i = 0; i < table.bucket_count(); i++)
+		maxbucket = std::max(maxbucket, table.bucket_size(i));
+
+	clock_t start = clock();
+	size_t found = 0;
+	for (unsigned int round = 0; round < 10; round++)
+		for (size_t i = 0; i < names.size(); i++)
+			found += table.count(names[i]);
+	usecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / found;
+	return maxbucket;
+}
+
+bool TestSuite::DoHashTests()
+{
+	std::cout << "\n\nHash table tests\n\n";
+	bool passed = true;
+
+	irc::insensitive hash;
+	irc::hash ircstringhash;
+	const char* const pairs[][2] = {
+		{ "FooBar", "foobar" },
+		{ "#InspIRCd", "#inspircd" },
+		{ "[]\\", "{}|" },
+		{ "SomeoneWithAVeryLongNickname", "someonewithaverylongnickname" },
+		{ "", "" }
+	};
+
+	for (unsigned int i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++)
+	{
+		std::string a = pairs[i][0];
+		std::string b = pairs[i][1];
+		if (hash(a) != hash(b) || ircstringhash(a.c_str()) != hash(b))
+		{
+			std::cout << "HASH: \"" << a << "\" and \"" << b << "\" have different hashes" << std::endl;
+			passed = false;
+		}
+	}
+
+	if (hash("foobar") == hash("foobaz") || hash("a") == hash("a\x01"))
+	{
+		std::cout << "HASH: Different strings have the same hash" << std::endl;
+		passed = false;
+	}
+
+	/* "ba" and "af" have the same legacy hash, so do all 2^14 names built from
+	 * 14 of them. With the keyed hash they should be spread over the table.
+	 */
+	std::vector<std::string> names;
+	for (unsigned int i = 0; i < (1 << 14); i++)
+	{
+		std::string name;
+		for (unsigned int bit = 0; bit < 14; bit++)
+			name.append((i & (1 << bit)) ? "ba" : "af");
+		names.push_back(name);
+	}
+
+	double legacyusecs, usecs;
+	size_t legacymax = MaxBucketSize<LegacyHash>(names, legacyusecs);
+	size_t keyedmax = MaxBucketSize<irc::insensitive>(names, usecs);
+	std::cout << "Colliding names: " << names.size() << ", largest bucket with the legacy hash: " << legacymax
+		<< " (" << legacyusecs << "us per lookup), with the keyed hash: " << keyedmax << " (" << usecs << "us per lookup)" << std::endl;
+
+	if (legacymax != names.size())
+	{
+		std::cout << "HASH: The colliding names do not collide with the legacy hash" << std::endl;
+		passed = false;
+	}
+	if (keyedmax > 16)
+	{
+		std::cout << "HASH: Largest bucket has " << keyedmax << " names" << std::endl;
+		passed = false;
+	}
+
+	// Ordinary names, to compare the cost of hashing without collisions
+	names.clear();
+	for (unsigned int i = 0; i < 100000; i++)
+		names.push_back("Guest" + ConvToStr(i));
+	MaxBucketSize<LegacyHash>(names, legacyusecs);
+	MaxBucketSize<irc::insensitive>(names, usecs);
+	std::cout << "Ordinary names: " << names.size() << ", legacy hash " << legacyusecs << "us per lookup, keyed hash " << usecs << "us per lookup" << std::endl;
+
+	return passed;
+}
+
+static void SetTestUser(User* user, const char* nick, const char* ident, const char* host, const char* ip)
+{
+	user->nick = nick;
+	user->ident = ident;
+	user->host = host;
+	user->SetClientIP(ip, false);
+}
+
+/** Find a matching line by calling Matches() for every line, like MatchesLine() did before the index */
+static XLine* MatchesLineLinear(const std::string& type, User* user)
+{
+	XLineLookup* list = ServerInstance->XLines->GetAll(type);
+	if (!list)
+		return NULL;
+
+	for (LookupIter i = list->begin(); i != list->end(); ++i)
+	{
+		if (i->second->Matches(user))
+			return i->second;
+	}
+	return NULL;
+}
+
+/** Gives the X-line tests access to the expiry queue */
+class XLineTestManager : public XLineManager
+{
+ public:
+	size_t GetExpiryCount() const { return expiries.size(); }
+};
+
+bool TestSuite::DoXLineTests()
+{
+	std::cout << "\n\nX-line index tests\n\n";
+	bool passed = true;
+
+	XLineManager* realxlines = ServerInstance->XLines;
+	XLineTestManager* xlm = new XLineTestManager;
+	ServerInstance->XLines = xlm;
+	const time_t now = ServerInstance->Time();
+
+	const char* const lines[][2] = {
+		{ "G", "*@10.0.0.0/8" },
+		{ "G", "baduser@*" },
+		{ "G", "*@spam.example.com" },
+		{ "G", "*@*.evil.net" },
+		{ "G", "*@192.168.1.*" },
+		{ "G", "*@*bad?host*" },
+		{ "G", "*@2001:db8::/32" },
+		{ "Z", "172.16.0.0/12" },
+		{ "Z", "203.0.113.7" },
+		{ "Q", "ChanServ" },
+		{ "Q", "Guest*" },
+		{ "E", "*@10.1.2.3" }
+	};
+
+	for (unsigned int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+	{
+		XLine* line = xlm->GetFactory(lines[i][0])->Generate(now, 0, "testsuite", "test", lines[i][1]);
+		if (!xlm->AddLine(line, NULL))
+		{
+			std::cout << "XLINE: Could not add " << lines[i][0] << ":" << lines[i][1] << std::endl;
+			delete line;
+			passed = false;
+		}
+	}
+
+	/* nick, ident, host, ip, type, the mask of the line that should match or NULL */
+	const char* const checks[][6] = {
+		{ "alice", "alice", "foo.com", "10.2.3.4", "G", "*@10.0.0.0/8" },
+		{ "alice", "alice", "10.0.0.5", "11.0.0.1", "G", "*@10.0.0.0/8" },
+		{ "alice", "baduser", "foo.com", "1.1.1.1", "G", "baduser@*" },
+		{ "alice", "alice", "SPAM.Example.COM", "1.1.1.1", "G", "*@spam.example.com" },
+		{ "alice", "alice", "mail.evil.net", "1.1.1.1", "G", "*@*.evil.net" },
+		{ "alice", "alice", "evil.net", "1.1.1.1", "G", NULL },
+		{ "alice", "alice", "foo.com", "192.168.1.50", "G", "*@192.168.1.*" },
+		{ "alice", "alice", "xbadyhostz", "1.1.1.1", "G", "*@*bad?host*" },
+		{ "alice", "alice", "foo.com", "2001:db8:1::1", "G", "*@2001:db8::/32" },
+		{ "alice", "alice", "foo.com", "2001:db9::1", "G", NULL },
+		{ "alice", "alice", "foo.com", "172.20.1.1", "Z", "172.16.0.0/12" },
+		{ "alice", "alice", "foo.com", "172.32.0.1", "Z", NULL },
+		{ "alice", "alice", "foo.com", "203.0.113.7", "Z", "203.0.113.7" },
+		{ "chanserv", "alice", "foo.com", "1.1.1.1", "Q", "ChanServ" },
+		{ "Guest42", "alice", "foo.com", "1.1.1.1", "Q", "Guest*" },
+		{ "Gues", "alice", "foo.com", "1.1.1.1", "Q", NULL },
+		{ "alice", "alice", "foo.com", "10.1.2.3", "E", "*@10.1.2.3" },
+		{ "alice", "alice", "clean.org", "8.8.8.8", "G", NULL },
+		{ "alice", "alice", "clean.org", "8.8.8.8", "Z", NULL },
+		{ "alice", "alice", "clean.org", "8.8.8.8", "E", NULL }
+	};
+
+	User* user = new RemoteUser("0ZZZZZZZZ", ServerInstance->Config->ServerName);
+	for (unsigned int i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+	{
+		SetTestUser(user, checks[i][0], checks[i][1], checks[i][2], checks[i][3]);
+		XLine* line = xlm->MatchesLine(checks[i][4], user);
+		const std::string got = line ? line->Displayable() : "nothing";
+		const std::string expected = checks[i][5] ? checks[i][5] : "nothing";
+		if (got != expected)
+		{
+			std::cout << "XLINE: " << checks[i][0] << "!" << checks[i][1] << "@" << checks[i][2] << " (" << checks[i][3] << ") matched "
+				<< checks[i][4] << ":" << got << " instead of " << expected << std::endl;
+			passed = false;
+		}
+	}
+
+	if (!xlm->MatchesLine("Q", "CHANSERV") || xlm->MatchesLine("Q", "Gues") || !xlm->MatchesLine("Z", "172.31.255.255"))
+	{
+		std::cout << "XLINE: Pattern matching gave the wrong result" << std::endl;
+		passed = false;
+	}
+
+	xlm->DelLine("*@spam.example.com", "G", NULL);
+	SetTestUser(user, "alice", "alice", "spam.example.com", "1.1.1.1");
+	if (xlm->MatchesLine("G", user))
+	{
+		std::cout << "XLINE: Removed line still matches" << std::endl;
+		passed = false;
+	}
+
+	/* Lines are only due when the current time is past their expiry time */
+	XLine* expiring = xlm->GetFactory("G")->Generate(now, 1, "testsuite", "test", "*@expire.test");
+	xlm->AddLine(expiring, NULL);
+	SetTestUser(user, "alice", "alice", "expire.test", "1.1.1.1");
+	if (!xlm->MatchesLine("G", user))
+	{
+		std::cout << "XLINE: Timed line does not match" << std::endl;
+		passed = false;
+	}
+	sleep(2);
+	ServerInstance->UpdateTime();
+	if (xlm->MatchesLine("G", user) || xlm->GetAll("G")->count("*@expire.test"))
+	{
+		std::cout << "XLINE: Timed line did not expire" << std::endl;
+		passed = false;
+	}
+
+	xlm->DelAll("Q");
+	SetTestUser(user, "ChanServ", "alice", "foo.com", "1.1.1.1");
+	if (xlm->MatchesLine("Q", user) || !xlm->GetAll("Q")->empty())
+	{
+		std::cout << "XLINE: Lines left after DelAll()" << std::endl;
+		passed = false;
+	}
+
+	/* Deleting timed lines must not leave their entries in the expiry queue until they are due */
+	for (unsigned int i = 0; i < 1000; i++)
+	{
+		const std::string mask = "*@timed" + ConvToStr(i) + ".test";
+		XLine* line = xlm->GetFactory("G")->Generate(now, 86400, "testsuite", "test", mask);
+		if (xlm->AddLine(line, NULL))
+			xlm->DelLine(mask.c_str(), "G", NULL);
+		else
+			delete line;
+	}
+	if (xlm->GetExpiryCount() > 10)
+	{
+		std::cout << "XLINE: " << xlm->GetExpiryCount() << " expiry entries left after deleting all timed lines" << std::endl;
+		passed = false;
+	}
+
+	/* 50000 lines: single IPs, /24 ranges and domains */
+	unsigned long seed = 1;
+	for (unsigned int i = 0; i < 50000; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		const std::string net = ConvToStr((seed >> 8) & 0xFF) + "." + ConvToStr((seed >> 16) & 0xFF) + ".";
+		std::string type = "G";
+		std::string mask;
+		if (i % 5 == 0)
+			mask = "*@*.domain" + ConvToStr(i) + ".com";
+		else if (i % 5 == 1)
+		{
+			type = "Z";
+			mask = "1." + net + "0/24";
+		}
+		else
+			mask = "*@2." + net + ConvToStr((seed >> 24) & 0x7F);
+		XLine* line = xlm->GetFactory(type)->Generate(now, 0, "testsuite", "test", mask);
+		if (!xlm->AddLine(line, NULL))
+			delete line;
+	}
+
+	/* The users have the IPs and domains of the lines, so some of them match */
+	std::vector<std::pair<std::string, std::string> > users;
+	seed = 1;
+	for (unsigned int i = 0; i < 20000; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		const std::string ip = ConvToStr(1 + i % 3) + "." + ConvToStr((seed >> 8) & 0xFF) + "." + ConvToStr((seed >> 16) & 0xFF) + "." + ConvToStr((seed >> 24) & 0x7F);
+		users.push_back(std::make_pair((i % 2) ? ip : "host.domain" + ConvToStr(i) + ".com", ip));
+	}
+
+	const char* const benchtypes[] = { "G", "Z" };
+	std::vector<bool> expected;
+	clock_t start = clock();
+	for (unsigned int i = 0; i < 100; i++)
+	{
+		SetTestUser(user, "alice", "alice", users[i].first.c_str(), users[i].second.c_str());
+		for (unsigned int t = 0; t < 2; t++)
+			expected.push_back(MatchesLineLinear(benchtypes[t], user) != NULL);
+	}
+	double linearusecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / expected.size();
+
+	unsigned int mismatches = 0;
+	start = clock();
+	for (unsigned int i = 0; i < users.size(); i++)
+	{
+		SetTestUser(user, "alice", "alice", users[i].first.c_str(), users[i].second.c_str());
+		for (unsigned int t = 0; t < 2; t++)
+		{
+			bool found = (xlm->MatchesLine(benchtypes[t], user) != NULL);
+			if (i < 100 && found != expected[i * 2 + t])
+				mismatches++;
+		}
+	}
+	double indexusecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / users.size() / 2;
+
+	std::cout << "Lines: " << xlm->GetAll("G")->size() + xlm->GetAll("Z")->size() << ", " << std::count(expected.begin(), expected.end(), true) << " of " << expected.size() << " checks matched, indexed lookup "
+		<< indexusecs << "us, linear walk " << linearusecs << "us per check" << std::endl;
+
+	if (mismatches)
+	{
+		std::cout << "XLINE: Indexed and linear matching disagreed " << mismatches << " times" << std::endl;
+		passed = false;
+	}
+
+	ServerInstance->Users->uuidlist->erase(user->uuid);
+	delete user;
+	delete xlm;
+	ServerInstance->XLines = realxlines;
+	return passed;
+}
+
+static void SetTestBan(Channel* chan, bool adding, const std::string& mask)
+{
+	std::vector<std::string> modes;
+	modes.push_back(chan->name);
+	modes.push_back(adding ? "+b" : "-b");
+	modes.push_back(mask);
+	ServerInstance->Modes->Process(modes, ServerInstance->FakeClient, ModeParser::MODE_LOCALONLY);
+}
+
+bool TestSuite::DoBanCacheTests()
+{
+	std::cout << "\n\nBan verdict cache tests\n\n";
+	bool passed = true;
+
+	Channel* chan = new Channel("#bancachetest", ServerInstance->Time());
+	User* user = new RemoteUser("0ZZZZZZZY", ServerInstance->Config->ServerName);
+	SetTestUser(user, "alice", "alice", "clean.org", "8.8.8.8");
+	chan->AddUser(user);
+
+	const unsigned int bancount = 500;
+	for (unsigned int i = 0; i < bancount; i++)
+		SetTestBan(chan, true, "*!*@host" + ConvToStr(i) + ".example.com");
+
+	if (chan->IsBanned(user) || chan->IsBanned(user))
+	{
+		std::cout << "BANCACHE: Unbanned user is banned" << std::endl;
+		passed = false;
+	}
+
+	/* Changing the ban list must be noticed */
+	SetTestBan(chan, true, "*!*@clean.org");
+	if (!chan->IsBanned(user))
+	{
+		std::cout << "BANCACHE: New ban not noticed" << std::endl;
+		passed = false;
+	}
+	SetTestBan(chan, false, "*!*@clean.org");
+	if (chan->IsBanned(user))
+	{
+		std::cout << "BANCACHE: Removed ban still matches" << std::endl;
+		passed = false;
+	}
+
+	/* So must changes to the user */
+	SetTestBan(chan, true, "bob!*@*");
+	if (chan->IsBanned(user))
+	{
+		std::cout << "BANCACHE: Ban on another nick matches" << std::endl;
+		passed = false;
+	}
+	user->ChangeNick("bob");
+	if (!chan->IsBanned(user))
+	{
+		std::cout << "BANCACHE: Nick change not noticed" << std::endl;
+		passed = false;
+	}
+	user->ChangeNick("alice");
+
+	/* Extban types are cached separately, and only bans of the given type apply */
+	SetTestBan(chan, true, "m:*!*@clean.org");
+	if (chan->GetExtBanStatus(user, 'm') != MOD_RES_DENY || chan->GetExtBanStatus(user, 'm') != MOD_RES_DENY
+		|| chan->GetExtBanStatus(user, 'T') != MOD_RES_PASSTHRU || chan->IsBanned(user))
+	{
+		std::cout << "BANCACHE: Wrong extban verdicts" << std::endl;
+		passed = false;
+	}
+
+	const unsigned int count = 20000;
+	clock_t start = clock();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		user->identgeneration++;
+		chan->IsBanned(user);
+	}
+	double walkusecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / count;
+
+	start = clock();
+	for (unsigned int i = 0; i < count; i++)
+		chan->IsBanned(user);
+	double cachedusecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / count;
+
+	std::cout << "Bans: " << bancount + 2 << ", cached check " << cachedusecs << "us, walking the list " << walkusecs << "us per check" << std::endl;
+
+	chan->DelUser(user);
+	chan->CheckDestroy();
+	ServerInstance->Users->uuidlist->erase(user->uuid);
+	delete user;
+	return passed;
+}
+
+/** Collects the mode lines a list mode sends when syncing a channel */
+class ListSyncCollector : public Module
+{
+ public:
+	std::vector<std::vector<std::string> > lines;
+
+	void ProtoSendMode(void*, TargetTypeFlags, void*, const std::vector<std::string>& modeline, const std::vector<TranslateType>&)
+	{
+		lines.push_back(modeline);
+	}
+
+	Version GetVersion()
+	{
+		return Version("Testsuite list mode sync collector");
+	}
+};
+
+bool TestSuite::DoListModeTests()
+{
+	std::cout << "\n\nList mode tests\n\n";
+	bool passed = true;
+
+	Channel* chan = new Channel("#listmodetest", ServerInstance->Time());
+	ListModeBase* banlm = static_cast<ListModeBase*>(ServerInstance->Modes->FindMode('b', MODETYPE_CHANNEL));
+
+	const unsigned int count = 2000;
+	clock_t start = clock();
+	for (unsigned int i = 0; i < count; i++)
+		SetTestBan(chan, true, "*!*@Host" + ConvToStr(i) + ".Example.com");
+	double addusecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / count;
+
+	ListModeBase::ModeList* list = banlm->GetList(chan);
+	if (!list || list->size() != count)
+	{
+		std::cout << "LISTMODE: Wrong number of items after adding" << std::endl;
+		chan->CheckDestroy();
+		return false;
+	}
+
+	/* Masks are compared case insensitively */
+	SetTestBan(chan, true, "*!*@host5.example.COM");
+	if (list->size() != count)
+	{
+		std::cout << "LISTMODE: Duplicate mask was added" << std::endl;
+		passed = false;
+	}
+
+	/* Removing keeps the order of the other items */
+	SetTestBan(chan, false, "*!*@HOST7.EXAMPLE.COM");
+	if (list->size() != count - 1 || (*list)[6].mask != "*!*@Host6.Example.com" || (*list)[7].mask != "*!*@Host8.Example.com")
+	{
+		std::cout << "LISTMODE: Wrong list after removing an item" << std::endl;
+		passed = false;
+	}
+	SetTestBan(chan, true, "*!*@host7.example.com");
+	if (list->back().mask != "*!*@host7.example.com")
+	{
+		std::cout << "LISTMODE: Removed mask could not be added again" << std::endl;
+		passed = false;
+	}
+
+	/* The synced lines carry every item once, in order */
+	ListSyncCollector collector;
+	banlm->DoSyncChannel(chan, &collector, NULL);
+	size_t synced = 0;
+	for (size_t i = 0; i < collector.lines.size(); i++)
+	{
+		const std::vector<std::string>& line = collector.lines[i];
+		if (line.size() < 2 || line.size() > ServerInstance->Config->Limits.MaxModes + 1 || line[0] != "+" + std::string(line.size() - 1, 'b'))
+		{
+			std::cout << "LISTMODE: Badly stacked sync line " << irc::stringjoiner(line).GetJoined() << std::endl;
+			passed = false;
+			break;
+		}
+		for (size_t j = 1; j < line.size(); j++, synced++)
+		{
+			if (synced >= list->size() || (*list)[synced].mask != line[j])
+			{
+				std::cout << "LISTMODE: Sync out of order at item " << synced << std::endl;
+				passed = false;
+				break;
+			}
+		}
+	}
+	if (synced != list->size())
+	{
+		std::cout << "LISTMODE: Synced " << synced << " of " << list->size() << " items" << std::endl;
+		passed = false;
+	}
+
+	/* Unbanning from the front is the worst case for keeping the order */
+	start = clock();
+	for (unsigned int i = 0; i < count; i++)
+		SetTestBan(chan, false, "*!*@host" + ConvToStr(i) + ".example.com");
+	double delusecs = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / count;
+
+	if (!list->empty())
+	{
+		std::cout << "LISTMODE: " << list->size() << " items left after removing all" << std::endl;
+		passed = false;
+	}
+
+	std::cout << "Items: " << count << ", " << collector.lines.size() << " sync lines, add " << addusecs << "us, remove " << delusecs << "us per mode change" << std::endl;
+
+	chan->CheckDestroy();
+	return passed;
+}
+
+static OperInfo* CreateTestOperInfo(const std::string& privs)
+{
+	std::vector<KeyVal>* items;
+	ConfigTag* tag = ConfigTag::create("class", "<testsuite>", 0, items);
+	items->push_back(std::make_pair("privs", privs));
+
+	OperInfo* info = new OperInfo;
+	info->class_blocks.push_back(tag);
+	info->init();
+	return info;
+}
+
+/** Check a privilege by name the way HasPrivPermission() did before privileges were numbered */
+static bool HasPrivByName(OperInfo* info, const std::string& privstr)
+{
+	return ((info->AllowedPrivs.find(privstr) != info->AllowedPrivs.end()) || (info->AllowedPrivs.find("*") != info->AllowedPrivs.end()));
+}
+
+bool TestSuite::DoPrivilegeTests()
+{
+	std::cout << "\n\nOper privilege tests\n\n";
+	bool passed = true;
+
+	reference<OperInfo> bot = CreateTestOperInfo("users/flood/no-throttle users/flood/increased-buffers users/flood/no-fakelag");
+	reference<OperInfo> admin = CreateTestOperInfo("*");
+	reference<OperInfo> none = CreateTestOperInfo("");
+
+	const char* const names[] = { "users/flood/no-throttle", "users/flood/increased-buffers", "users/auspex", "testsuite/never-configured" };
+	for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+	{
+		Privilege priv(names[i]);
+		if (priv.GetId() != Privilege(names[i]).GetId() || priv.GetName() != names[i])
+		{
+			std::cout << "PRIV: " << names[i] << " does not resolve consistently" << std::endl;
+			passed = false;
+		}
+
+		if (bot->HasPriv(priv) != HasPrivByName(bot, names[i]) || !admin->HasPriv(priv) || none->HasPriv(priv))
+		{
+			std::cout << "PRIV: Wrong result for " << names[i] << std::endl;
+			passed = false;
+		}
+	}
+
+	if (Privilege("*").GetId() != 0)
+	{
+		std::cout << "PRIV: The wildcard is not privilege 0" << std::endl;
+		passed = false;
+	}
+
+	/* An opered bot sending a line costs a no-throttle check when the command is
+	 * parsed and an increased-buffers check for every line written to it
+	 */
+	const unsigned int count = 1000000;
+	unsigned int granted = 0;
+	clock_t start = clock();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		granted += HasPrivByName(bot, "users/flood/no-throttle");
+		granted += HasPrivByName(bot, "users/flood/increased-buffers");
+	}
+	double namensecs = (double)(clock() - start) * 1000000000 / CLOCKS_PER_SEC / count;
+
+	Privilege nothrottle("users/flood/no-throttle");
+	Privilege increasedbuffers("users/flood/increased-buffers");
+	start = clock();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		granted += bot->HasPriv(nothrottle);
+		granted += bot->HasPriv(increasedbuffers);
+	}
+	double bitnsecs = (double)(clock() - start) * 1000000000 / CLOCKS_PER_SEC / count;
+
+	if (granted != count * 4)
+	{
+		std::cout << "PRIV: Bot was denied a privilege it has" << std::endl;
+		passed = false;
+	}
+
+	std::cout << "Privilege checks per line: by name " << namensecs << "ns, resolved " << bitnsecs << "ns" << std::endl;
+
+	return passed;
+}
+
+/** Owner of the commands registered by the testsuite */
+class TestSuiteModule : public Module
+{
+ public:
+	Version GetVersion()
+	{
+		return Version("Testsuite command owner");
+	}
+};
+
+/** Remembers the parameters it was last called with */
+class CommandParserTest : public Command
+{
+ public:
+	std::vector<std::string> lastparams;
+	unsigned long calls;
+
+	CommandParserTest(Module* parent, const std::string& cmdname, int maxpara) : Command(parent, cmdname, 0, maxpara), calls(0)
+	{
+		works_before_reg = true;
+	}
+
+	CmdResult Handle(const std::vector<std::string>& parameters, User* user)
+	{
+		lastparams = parameters;
+		calls++;
+		return CMD_SUCCESS;
+	}
+};
+
+bool TestSuite::DoParserTests()
+{
+	std::cout << "\n\nCommand parser tests\n\n";
+	bool passed = true;
+
+	TestSuiteModule owner;
+	CommandParserTest testcmd(&owner, "PARSERTEST", 0);
+	CommandParserTest testcmd2(&owner, "PARSERTEST2", 2);
+	ServerInstance->Parser->AddCommand(&testcmd);
+	ServerInstance->Parser->AddCommand(&testcmd2);
+
+	irc::sockets::sockaddrs client, server;
+	irc::sockets::aptosa("127.0.0.1", 0, client);
+	irc::sockets::aptosa("127.0.0.1", 6667, server);
+	LocalUser* user = new LocalUser(-1, &client, &server);
+	user->nick = "parsertest";
+	user->registered = REG_ALL;
+	user->MyClass = ServerInstance->Config->Classes[0];
+
+	/* line, expected parameters joined with '|' */
+	const char* const checks[][2] = {
+		{ "PARSERTEST", "" },
+		{ "parsertest a b c", "a|b|c" },
+		{ ":nick!user@host PARSERTEST a", "a" },
+		{ "PARSERTEST   a    b  ", "a|b" },
+		{ "PARSERTEST a :trailing with  spaces ", "a|trailing with  spaces " },
+		{ "PARSERTEST a :", "a|" },
+		{ "PARSERTEST :", "" },
+		{ "PARSERTEST a:b :c", "a:b|c" },
+		{ "PARSERTEST2 a b c :d e", "a|b c d e" },
+		{ "PARSERTEST 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18", "1|2|3|4|5|6|7|8|9|10|11|12|13|14|15|16|17|18" },
+		{ "PARSERTEST x", "x" }
+	};
+
+	for (unsigned int i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+	{
+		std::string line = checks[i][0];
+		testcmd.lastparams.assign(1, "not called");
+		testcmd2.lastparams.assign(1, "not called");
+		ServerInstance->Parser->ProcessBuffer(line, user);
+
+		const std::vector<std::string>& got = (line.find("PARSERTEST2") != std::string::npos) ? testcmd2.lastparams : testcmd.lastparams;
+		std::string joined;
+		for (std::vector<std::string>::const_iterator j = got.begin(); j != got.end(); ++j)
+			joined.append(j == got.begin() ? "" : "|").append(*j);
+		if (joined != checks[i][1])
+		{
+			std::cout << "PARSER: \"" << checks[i][0] << "\" gave \"" << joined << "\" instead of \"" << checks[i][1] << "\"" << std::endl;
+			passed = false;
+		}
+	}
+
+	/* Throughput of typical client lines, the handler does nothing */
+	const char* const benchlines[] = {
+		"PARSERTEST #channel :Hello there, this is a fairly ordinary line of chat text",
+		"PARSERTEST somebody :short",
+		"parsertest #channel",
+		"PARSERTEST2 #channel +o somebody"
+	};
+	const unsigned int count = 500000;
+	std::string line;
+	const bool rawlog = ServerInstance->Config->RawLog;
+	ServerInstance->Config->RawLog = false;
+	clock_t start = clock();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		line = benchlines[i % 4];
+		ServerInstance->Parser->ProcessBuffer(line, user);
+	}
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	ServerInstance->Config->RawLog = rawlog;
+	std::cout << "Parsed " << count << " lines in " << secs << "s, " << (unsigned long)(count / secs) << " lines per second" << std::endl;
+
+	ServerInstance->Parser->RemoveCommand(&testcmd);
+	ServerInstance->Parser->RemoveCommand(&testcmd2);
+	ServerInstance->Users->uuidlist->erase(user->uuid);
+	delete user;
+	return passed;
+}
+
+/** One end of a socket pair registered with the socket engine, counts the events it gets */
+class EngineTestSocket : public EventHandler
+{
+ public:
+	/** If false, reads leave the data in the socket */
+	bool drain;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long errors;
+	unsigned long lines;
+
+	EngineTestSocket(int newfd, bool drainreads)
+		: drain(drainreads), reads(0), writes(0), errors(0), lines(0)
+	{
+		SetFd(newfd);
+	}
+
+	void HandleEvent(EventType et, int errornum)
+	{
+		if (et == EVENT_WRITE)
+		{
+			writes++;
+			return;
+		}
+		if (et == EVENT_ERROR)
+		{
+			errors++;
+			return;
+		}
+
+		reads++;
+		if (!drain)
+			return;
+
+		// Read until the socket would block, like StreamSocket does
+		char buf[1024];
+		int n;
+		while ((n = ServerInstance->SE->Recv(this, buf, sizeof(buf), 0)) > 0)
+		{
+			for (int i = 0; i < n; i++)
+				if (buf[i] == '\n')
+					lines++;
+		}
+		if (n < 0 && SocketEngine::IgnoreError())
+			ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_READ | FD_READ_WILL_BLOCK);
+	}
+};
+
+/** A StreamSocket which copies the lines it reads to another one */
+class EngineTestStream : public StreamSocket
+{
+ public:
+	StreamSocket* target;
+
+	EngineTestStream(int newfd) : target(NULL)
+	{
+		SetFd(newfd);
+	}
+
+	void OnDataReady()
+	{
+		std::string line;
+		while (GetNextLine(line))
+			if (target)
+				target->WriteData(line + "\n");
+	}
+
+	void OnError(BufferedSocketError e)
+	{
+	}
+};
+
+/** Create a connected pair of sockets and register one of them
+ * @param peer Set to the other, unregistered, end of the pair
+ * @return The registered end or NULL if creating the pair failed
+ */
+static EngineTestSocket* CreateEngineTestPair(int& peer, bool drain, int event_mask)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return NULL;
+	ServerInstance->SE->NonBlocking(fds[0]);
+	ServerInstance->SE->NonBlocking(fds[1]);
+
+	EngineTestSocket* sock = new EngineTestSocket(fds[0], drain);
+	if (!ServerInstance->SE->AddFd(sock, event_mask))
+	{
+		close(fds[0]);
+		close(fds[1]);
+		delete sock;
+		return NULL;
+	}
+	peer = fds[1];
+	return sock;
+}
+
+static void DestroyEngineTestPair(EngineTestSocket* sock, int peer)
+{
+	ServerInstance->SE->DelFd(sock);
+	ServerInstance->SE->Close(sock);
+	close(peer);
+	delete sock;
+}
+
+bool TestSuite::DoSocketEngineTests()
+{
+	std::cout << "\n\nSocket engine tests, using " << ServerInstance->SE->GetName() << "\n\n";
+	bool passed = true;
+	SocketEngine* se = ServerInstance->SE;
+	int peer;
+
+	/* Poll-style reads are given while data is waiting, even if it is never read */
+	EngineTestSocket* level = CreateEngineTestPair(peer, false, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+	if (!level)
+	{
+		std::cout << "SE: unable to create a socket pair: " << strerror(errno) << std::endl;
+		return false;
+	}
+	int levelpeer = peer;
+	/* A single write event is given, then the socket is back to FD_WANT_NO_WRITE */
+	EngineTestSocket* single = CreateEngineTestPair(peer, true, FD_WANT_FAST_READ | FD_WANT_SINGLE_WRITE);
+	int singlepeer = peer;
+	/* Closing the other end gives an error event */
+	EngineTestSocket* hangup = CreateEngineTestPair(peer, true, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE);
+	close(peer);
+
+	if (write(levelpeer, "x\n", 2) != 2)
+		passed = false;
+	for (int i = 0; (i < 50) && ((level->reads < 3) || (!single->writes) || (!hangup->errors)); i++)
+		se->DispatchEvents();
+
+	if (level->reads < 3)
+	{
+		std::cout << "SE: poll-style read was given " << level->reads << " times instead of at least 3" << std::endl;
+		passed = false;
+	}
+	if ((single->writes != 1) || (single->GetEventMask() & FD_WANT_SINGLE_WRITE))
+	{
+		std::cout << "SE: single write gave " << single->writes << " write events and left mask " << single->GetEventMask() << std::endl;
+		passed = false;
+	}
+	if (!hangup->errors)
+	{
+		std::cout << "SE: closing the other end of a socket gave no error event" << std::endl;
+		passed = false;
+	}
+	DestroyEngineTestPair(level, levelpeer);
+	DestroyEngineTestPair(single, singlepeer);
+	se->DelFd(hangup);
+	se->Close(hangup);
+	delete hangup;
+
+	/* Output queued by a trial read is written by the same DispatchTrialWrites()
+	 * call, even to a socket which was in the list for a trial write before
+	 */
+	int fds[2];
+	int targetpeer = -1;
+	int relaypeer = -1;
+	EngineTestStream* target = NULL;
+	EngineTestStream* relay = NULL;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0)
+	{
+		se->NonBlocking(fds[0]);
+		target = new EngineTestStream(fds[0]);
+		se->AddFd(target, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE);
+		targetpeer = fds[1];
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0)
+	{
+		se->NonBlocking(fds[0]);
+		relay = new EngineTestStream(fds[0]);
+		se->AddFd(relay, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE);
+		relaypeer = fds[1];
+	}
+	if (target && relay)
+	{
+		relay->target = target;
+		target->WriteData("first\n");
+		if (write(relaypeer, "second\n", 7) != 7)
+			passed = false;
+		se->ChangeEventMask(relay, FD_ADD_TRIAL_READ);
+		se->DispatchTrialWrites();
+
+		char buf[64];
+		ssize_t n = recv(targetpeer, buf, sizeof(buf), MSG_DONTWAIT);
+		std::string got(buf, n > 0 ? n : 0);
+		if (got != "first\nsecond\n")
+		{
+			std::cout << "SE: one DispatchTrialWrites() wrote \"" << got << "\" instead of both lines" << std::endl;
+			passed = false;
+		}
+	}
+	else
+	{
+		std::cout << "SE: unable to create stream sockets" << std::endl;
+		passed = false;
+	}
+	if (target)
+	{
+		target->Close();
+		close(targetpeer);
+		delete target;
+	}
+	if (relay)
+	{
+		relay->Close();
+		close(relaypeer);
+		delete relay;
+	}
+
+	/* Many idle sockets and some chatty ones. 50000 idle and 5000 chatty ones are
+	 * wanted, both are scaled down by the same factor if the fd limit is lower.
+	 */
+	unsigned int idlecount = 50000;
+	unsigned int chattycount = 5000;
+	unsigned int pairs = (se->GetMaxFds() - se->GetUsedFds() - 256) / 2;
+	if (pairs < idlecount + chattycount)
+	{
+		idlecount = pairs / 11 * 10;
+		chattycount = pairs / 11;
+	}
+
+	std::vector<std::pair<EngineTestSocket*, int> > idle, chatty;
+	clock_t start = clock();
+	for (unsigned int i = 0; i < idlecount + chattycount; i++)
+	{
+		EngineTestSocket* sock = CreateEngineTestPair(peer, true, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE);
+		if (!sock)
+		{
+			std::cout << "SE: unable to create socket pair " << i << ": " << strerror(errno) << std::endl;
+			passed = false;
+			break;
+		}
+		(i < idlecount ? idle : chatty).push_back(std::make_pair(sock, peer));
+	}
+	/* The first dispatch reports the sockets as writable, that is part of adding them */
+	se->DispatchEvents();
+	double addsecs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	std::cout << "Added " << idle.size() << " idle and " << chatty.size() << " chatty sockets in " << addsecs << "s" << std::endl;
+
+	const unsigned int rounds = 200;
+	const char line[] = "PRIVMSG #channel :Hello there, this is a fairly ordinary line of chat text\r\n";
+	unsigned long expected = 0;
+	unsigned long dispatches = 0;
+	unsigned long events = 0;
+	clock_t dispatchtime = 0;
+	for (unsigned int round = 0; (round < rounds) && (passed); round++)
+	{
+		for (size_t i = 0; i < chatty.size(); i++)
+			if (write(chatty[i].second, line, sizeof(line) - 1) == (ssize_t)sizeof(line) - 1)
+				expected++;
+
+		unsigned long got = 0;
+		start = clock();
+		for (int tries = 0; (got < expected) && (tries < 1000); tries++)
+		{
+			se->DispatchTrialWrites();
+			events += se->DispatchEvents();
+			dispatches++;
+			got = 0;
+			for (size_t i = 0; i < chatty.size(); i++)
+				got += chatty[i].first->lines;
+		}
+		dispatchtime += clock() - start;
+		if (got != expected)
+		{
+			std::cout << "SE: chatty sockets received " << got << " lines instead of " << expected << std::endl;
+			passed = false;
+		}
+	}
+
+	double secs = (double)dispatchtime / CLOCKS_PER_SEC;
+	std::cout << "Delivered " << expected << " lines in " << dispatches << " dispatches, " << events << " events in " << secs << "s, "
+		<< (unsigned long)(events / (secs ? secs : 1)) << " events per second, " << (secs * 1000000 / (dispatches ? dispatches : 1)) << "us per dispatch" << std::endl;
+
+	for (size_t i = 0; i < idle.size(); i++)
+	{
+		if (idle[i].first->reads || idle[i].first->errors)
+		{
+			std::cout << "SE: idle socket " << idle[i].first->GetFd() << " got events" << std::endl;
+			passed = false;
+			break;
+		}
+	}
+
+	start = clock();
+	for (size_t i = 0; i < idle.size(); i++)
+		DestroyEngineTestPair(idle[i].first, idle[i].second);
+	for (size_t i = 0; i < chatty.size(); i++)
+		DestroyEngineTestPair(chatty[i].first, chatty[i].second);
+	std::cout << "Removed all sockets in " << ((double)(clock() - start) / CLOCKS_PER_SEC) << "s" << std::endl;
+
+	return passed;
+}
+
+/** A StreamSocket which keeps the lines it reads */
+class IOThreadTestStream : public StreamSocket
+{
+ public:
+	std::vector<std::string> lines;
+
+	IOThreadTestStream(int newfd)
+	{
+		SetFd(newfd);
+	}
+
+	void OnDataReady()
+	{
+		std::string line;
+		while (GetNextLine(line))
+			lines.push_back(line);
+	}
+
+	void OnError(BufferedSocketError e)
+	{
+	}
+};
+
+bool TestSuite::DoIOThreadTests()
+{
+	std::cout << "\n\nI/O thread tests\n\n";
+
+	bool started = false;
+	if (!ServerInstance->IOThreads->GetThreadCount())
+	{
+		ServerInstance->IOThreads->Start(1);
+		started = true;
+	}
+	if (!ServerInstance->IOThreads->GetThreadCount())
+	{
+		std::cout << "I/O threads are not supported on this system" << std::endl;
+		return true;
+	}
+
+	bool passed = true;
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+	{
+		std::cout << "IOT: unable to create a socket pair: " << strerror(errno) << std::endl;
+		return false;
+	}
+	ServerInstance->SE->NonBlocking(fds[0]);
+	IOThreadTestStream* sock = new IOThreadTestStream(fds[0]);
+	ServerInstance->SE->AddFd(sock, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE);
+
+	if (!ServerInstance->IOThreads->Attach(sock))
+	{
+		std::cout << "IOT: unable to attach a socket" << std::endl;
+		passed = false;
+	}
+	else
+	{
+		/* Wait for the thread to read everything, the main thread does not
+		 * dispatch events in the meantime so the lines stay queued
+		 */
+		const char data[] = "one\ntwo\nthr";
+		if (write(fds[1], data, sizeof(data) - 1) != sizeof(data) - 1)
+			passed = false;
+		int pending = 1;
+		for (int i = 0; (i < 200) && (pending); i++)
+		{
+			usleep(10000);
+			if (ioctl(fds[0], FIONREAD, &pending) < 0)
+				pending = 0;
+		}
+		usleep(10000);
+
+		/* Detaching gives back the queued lines and the partial one */
+		sock->DetachIOThread();
+		sock->OnDataReady();
+		if ((sock->lines.size() != 2) || (sock->lines[0] != "one") || (sock->lines[1] != "two"))
+		{
+			std::cout << "IOT: detaching gave back " << sock->lines.size() << " complete lines instead of one, two" << std::endl;
+			passed = false;
+		}
+
+		/* The main thread reads the rest, and nothing is delivered twice */
+		if (write(fds[1], "ee\n", 3) != 3)
+			passed = false;
+		for (int i = 0; (i < 50) && (sock->lines.size() < 3); i++)
+			ServerInstance->SE->DispatchEvents();
+		if ((sock->lines.size() != 3) || (sock->lines[2] != "three"))
+		{
+			std::cout << "IOT: the main thread did not complete the partial line after detaching" << std::endl;
+			passed = false;
+		}
+	}
+
+	sock->Close();
+	close(fds[1]);
+	delete sock;
+	if (started)
+		ServerInstance->IOThreads->Stop();
+	return passed;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
@@ -80,6 +80,8 @@ class ThreadSignalSocket : public EventHandler
 
 	~ThreadSignalSocket()
 	{
+		ServerInstance->SE->DelFd(this);
+		ServerInstance->SE->Close(this);
 	}
 
 	void Notify()
@@ -97,7 +99,8 @@ class ThreadSignalSocket : public EventHandler
 		}
 		else
 		{
-			ServerInstance->GlobalCulls.AddItem(this);
+			// The SocketThread owns and deletes this, just stop listening
+			ServerInstance->SE->ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
 		}
 	}
 };
@@ -126,6 +129,8 @@ class ThreadSignalSocket : public EventHandler
 
 	~ThreadSignalSocket()
 	{
+		ServerInstance->SE->DelFd(this);
+		ServerInstance->SE->Close(this);
 		close(send_fd);
 	}
 
@@ -145,7 +150,8 @@ class ThreadSignalSocket : public EventHandler
 		}
 		else
 		{
-			ServerInstance->GlobalCulls.AddItem(this);
+			// The SocketThread owns and deletes this, just stop listening
+			ServerInstance->SE->ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
 		}
 	}
 };
@@ -166,4 +172,5 @@ void SocketThread::NotifyParent()
 
 SocketThread::~SocketThread()
 {
+	delete signal.sock;
 }
@@ -23,54 +23,293 @@
 #include "inspircd.h"
 #include "timer.h"
 
+/** The largest delay that can be stored in the timing wheel. Timers that are
+ * due later are stored with this delay and rescheduled when they come up.
+ */
+static const unsigned long MAX_DELAY = ((ULONG_MAX >> 1) < 0xFFFFFFFFUL) ? (ULONG_MAX >> 1) : 0xFFFFFFFFUL;
+
+/** Get a timestamp in microseconds, used to measure the time spent in TickTimers()
+ */
+static unsigned long GetMicroseconds()
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (unsigned long)(count.QuadPart * 1000000 / freq.QuadPart);
+#elif defined HAS_CLOCK_GETTIME
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 void Timer::SetInterval(time_t newinterval)
 {
 	ServerInstance->Timers->DelTimer(this);
 	secs = newinterval;
+	msecs = 0;
 	SetTrigger(ServerInstance->Time() + newinterval);
 	ServerInstance->Timers->AddTimer(this);
 }
 
+void Timer::SetIntervalMS(unsigned long newinterval)
+{
+	ServerInstance->Timers->DelTimer(this);
+	msecs = newinterval ? newinterval : 1;
+	secs = msecs / 1000;
+	SetTrigger(ServerInstance->Time() + secs);
+	ServerInstance->Timers->AddTimer(this);
+}
+
 Timer::~Timer()
 {
 	ServerInstance->Timers->DelTimer(this);
 }
 
-void TimerManager::TickTimers(time_t TIME)
+TimerManager::TimerManager()
+	: wheeltime(GetTick()), count(0), currentsecond(0)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
-	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
-			break;
+	memset(root, 0, sizeof(root));
+	memset(levels, 0, sizeof(levels));
+	memset(wheelcount, 0, sizeof(wheelcount));
+}
+
+unsigned long TimerManager::GetTick()
+{
+	return (unsigned long)ServerInstance->Time() * 1000 + ServerInstance->Time_ns() / 1000000;
+}
 
-		Timers.erase(i++);
+void TimerManager::Link(Timer* t)
+{
+	Timer** slot;
+	unsigned long delay = t->expires - wheeltime;
+	if ((long)delay < 0)
+	{
+		// Already due, run it on the next tick
+		slot = &root[wheeltime & (ROOT_SIZE - 1)];
+		t->wheel = 0;
+	}
+	else
+	{
+		if (delay > MAX_DELAY)
+		{
+			delay = MAX_DELAY;
+			t->expires = wheeltime + delay;
+		}
 
-		if (!t->Tick(TIME))
-			delete t;
-		else if (t->GetRepeat())
+		if (delay < ROOT_SIZE)
 		{
-			t->SetTrigger(TIME + t->GetInterval());
-			AddTimer(t);
+			slot = &root[t->expires & (ROOT_SIZE - 1)];
+			t->wheel = 0;
+		}
+		else
+		{
+			unsigned int level = 0;
+			unsigned int shift = ROOT_BITS + LEVEL_BITS;
+			while ((level < LEVELS - 1) && (delay >= (1UL << shift)))
+			{
+				level++;
+				shift += LEVEL_BITS;
+			}
+			slot = &levels[level][(t->expires >> (shift - LEVEL_BITS)) & (LEVEL_SIZE - 1)];
+			t->wheel = level + 1;
 		}
 	}
+
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+	*slot = t;
+	t->pprev = slot;
+	wheelcount[t->wheel]++;
 }
 
-void TimerManager::DelTimer(Timer* t)
+void TimerManager::Unlink(Timer* t)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	wheelcount[t->wheel]--;
+}
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+unsigned int TimerManager::Cascade(unsigned int level)
+{
+	unsigned int index = (wheeltime >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+	Timer* list = levels[level][index];
+	levels[level][index] = NULL;
+	while (list)
 	{
-		if (i->second == t)
+		Timer* t = list;
+		list = t->next;
+		wheelcount[level + 1]--;
+		Link(t);
+	}
+	return index;
+}
+
+void TimerManager::Run(unsigned long now, time_t TIME)
+{
+	while ((long)(now - wheeltime) >= 0)
+	{
+		if (!count)
 		{
-			Timers.erase(i);
+			wheeltime = now + 1;
 			break;
 		}
+
+		// When the root wheel completes a turn move the timers of the next slot
+		// of the outer wheels inwards, the same way for each outer wheel
+		unsigned int index = wheeltime & (ROOT_SIZE - 1);
+		if (!index)
+		{
+			for (unsigned int level = 0; level < LEVELS; level++)
+			{
+				if (Cascade(level))
+					break;
+			}
+		}
+
+		if (!wheelcount[0])
+		{
+			// Nothing can become due before the next time a non-empty outer wheel moves timers inwards
+			unsigned long period = ROOT_SIZE;
+			for (unsigned int level = 0; (level < LEVELS - 1) && (!wheelcount[level + 1]); level++)
+				period <<= LEVEL_BITS;
+
+			unsigned long next = (wheeltime | (period - 1)) + 1;
+			wheeltime = ((long)(next - now) > 0) ? now + 1 : next;
+			continue;
+		}
+
+		Timer* work = root[index];
+		root[index] = NULL;
+		if (work)
+			work->pprev = &work;
+		wheeltime++;
+
+		while (work)
+		{
+			Timer* t = work;
+			Unlink(t);
+			count--;
+
+			// Timers beyond MAX_DELAY and timers whose trigger was moved later come up early
+			if ((!t->msecs) && (TIME < t->GetTrigger()))
+			{
+				AddTimer(t, now);
+				continue;
+			}
+
+			current.timers++;
+			if (!t->Tick(TIME))
+				delete t;
+			else if (t->GetRepeat())
+			{
+				t->SetTrigger(TIME + t->GetInterval());
+				AddTimer(t, now);
+			}
+		}
 	}
 }
 
+void TimerManager::TickTimers(time_t TIME)
+{
+	if (TIME != currentsecond)
+	{
+		lastsecond = current;
+		if (current.usecs > peak.usecs)
+			peak = current;
+		current = TickCost();
+		currentsecond = TIME;
+	}
+
+	unsigned long start = GetMicroseconds();
+	Run(GetTick(), TIME);
+	current.usecs += GetMicroseconds() - start;
+}
+
+void TimerManager::DelTimer(Timer* t)
+{
+	if (!t->pprev)
+		return;
+
+	Unlink(t);
+	count--;
+}
+
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	AddTimer(t, GetTick());
+}
+
+void TimerManager::AddTimer(Timer* t, unsigned long now)
+{
+	if (t->pprev)
+		Unlink(t);
+	else
+		count++;
+
+	if (t->msecs)
+		t->expires = now + t->msecs;
+	else
+		t->expires = (unsigned long)t->GetTrigger() * 1000;
+	Link(t);
+}
+
+int TimerManager::GetTimeout()
+{
+	// Wake up at the start of the next second at the latest, that is when the
+	// main loop does its once-per-second work and when one-second timers are due
+	return GetTimeout(GetTick(), 1000 - ServerInstance->Time_ns() / 1000000);
+}
+
+int TimerManager::GetTimeout(unsigned long now, int max) const
+{
+	if (!count)
+		return max;
+
+	long best = max;
+	for (unsigned int i = 0; (wheelcount[0]) && (i < ROOT_SIZE); i++)
+	{
+		unsigned long tick = wheeltime + i;
+		long wait = (long)(tick - now);
+		if (wait >= best)
+			break;
+		if (root[tick & (ROOT_SIZE - 1)])
+		{
+			best = wait;
+			break;
+		}
+	}
+
+	// Timers in the outer wheels are due no earlier than when they are moved inwards
+	for (unsigned int level = 0; level < LEVELS; level++)
+	{
+		if (!wheelcount[level + 1])
+			continue;
+
+		unsigned int shift = ROOT_BITS + level * LEVEL_BITS;
+		unsigned long period = 1UL << shift;
+		unsigned long tick = (wheeltime + period - 1) & ~(period - 1);
+		for (unsigned int i = 0; i < LEVEL_SIZE; i++, tick += period)
+		{
+			long wait = (long)(tick - now);
+			if (wait >= best)
+				break;
+			if (levels[level][(tick >> shift) & (LEVEL_SIZE - 1)])
+			{
+				best = wait;
+				break;
+			}
+		}
+	}
+
+	return (best > 0 ? best : 0);
 }
@@ -94,6 +94,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 
 	New->localuseriter = this->local_users.insert(local_users.end(), New);
 	local_count++;
+	ServerInstance->Timers->AddTimer(&New->checktimer);
 
 	if ((this->local_users.size() > ServerInstance->Config->SoftLimit) || (this->local_users.size() >= (unsigned int)ServerInstance->SE->GetMaxFds()))
 	{
@@ -158,6 +159,10 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 		ServerInstance->Logs->Log("USERS", LOG_DEBUG, "Internal error on new connection");
 		this->QuitUser(New, "Internal error handling connection");
 	}
+	else
+	{
+		ServerInstance->IOThreads->Attach(eh);
+	}
 
 	if (ServerInstance->Config->RawLog)
 		New->WriteNotice("*** Raw I/O logging is enabled on this server. All messages, passwords, and commands are being recorded.");
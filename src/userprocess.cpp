@@ -26,70 +26,99 @@
 #include "socketengine.h"
 #include "command_parse.h"
 
+UserCheckTimer::UserCheckTimer(LocalUser* me)
+	: Timer(1, ServerInstance->Time()), user(me)
+{
+}
+
+bool UserCheckTimer::Tick(time_t)
+{
+	ServerInstance->Users->DoBackgroundUserStuff(user);
+	return true;
+}
+
+void UserCheckTimer::ScheduleCheck(time_t when)
+{
+	// While the checks are running GetTrigger() is in the past, the next check is scheduled afterwards
+	if (user->quitting || GetTrigger() <= when)
+		return;
+
+	SetTrigger(when);
+	ServerInstance->Timers->AddTimer(this);
+}
+
 /**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the user structs, e.g.
+ * This function is called from the UserCheckTimer of a user when a check falls due.
+ * It is intended to do background checking on the user struct, e.g.
  * stuff like ping checks, registration timeouts, etc.
  */
-void UserManager::DoBackgroundUserStuff()
+void UserManager::DoBackgroundUserStuff(LocalUser* curr)
 {
-	/*
-	 * loop over all local users..
-	 */
-	for (LocalUserList::iterator i = local_users.begin(); i != local_users.end(); ++i)
-	{
-		LocalUser* curr = *i;
+	if (curr->quitting)
+		return;
 
+	if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
+	{
+		unsigned int rate = curr->MyClass->GetCommandRate();
+		if (curr->CommandFloodPenalty > rate)
+			curr->CommandFloodPenalty -= rate;
+		else
+			curr->CommandFloodPenalty = 0;
+		curr->eh.OnDataReady();
 		if (curr->quitting)
-			continue;
-
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
-
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (ServerInstance->Time() > curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						const std::string message = "Ping timeout: " + ConvToStr(time) + (time == 1 ? " seconds" : " second");
-						this->QuitUser(curr, message);
-						continue;
-					}
+			return;
+	}
 
-					curr->Write("PING :" + ServerInstance->Config->ServerName);
-					curr->lastping = 0;
-					curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr))
+	switch (curr->registered)
+	{
+		case REG_ALL:
+			if (ServerInstance->Time() > curr->nping)
+			{
+				// This user didn't answer the last ping, remove them
+				if (!curr->lastping)
 				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
+					time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
+					const std::string message = "Ping timeout: " + ConvToStr(time) + (time == 1 ? " seconds" : " second");
+					this->QuitUser(curr, message);
+					return;
 				}
-				break;
-		}
 
-		if (curr->registered != REG_ALL && (ServerInstance->Time() > (curr->age + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->QuitUser(curr, "Registration timeout");
-			continue;
-		}
+				curr->Write("PING :" + ServerInstance->Config->ServerName);
+				curr->lastping = 0;
+				curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
+			}
+			break;
+		case REG_NICKUSER:
+			if (AllModulesReportReady(curr))
+			{
+				/* User has sent NICK/USER, modules are okay, DNS finished. */
+				curr->FullConnect();
+				if (curr->quitting)
+					return;
+			}
+			break;
 	}
+
+	if (curr->registered != REG_ALL && (ServerInstance->Time() > (curr->age + curr->MyClass->GetRegTimeout())))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		this->QuitUser(curr, "Registration timeout");
+		return;
+	}
+
+	/* Unregistered users are waiting for modules, flood penalty decays every second,
+	 * otherwise nothing happens until the next ping is due. nping is moved forward
+	 * whenever the user sends a command, which is noticed when the check runs.
+	 */
+	time_t next;
+	if (curr->registered != REG_ALL || curr->CommandFloodPenalty || curr->eh.getSendQSize())
+		next = ServerInstance->Time() + 1;
+	else
+		next = curr->nping + 1;
+
+	curr->checktimer.SetTrigger(next);
+	ServerInstance->Timers->AddTimer(&curr->checktimer);
 }
@@ -31,6 +31,9 @@
 
 already_sent_t LocalUser::already_sent_id = 0;
 
+static Privilege privincreasedbuffers("users/flood/increased-buffers");
+static Privilege privnofakelag("users/flood/no-fakelag");
+
 std::string User::ProcessNoticeMasks(const char *sm)
 {
 	bool adding = true, oldadding = false;
@@ -180,6 +183,7 @@ User::User(const std::string &uid, const std::string& sid, int type)
 	signon = 0;
 	registered = 0;
 	quietquit = quitting = false;
+	identgeneration = 0;
 	client_sa.sa.sa_family = AF_UNSPEC;
 
 	ServerInstance->Logs->Log("USERS", LOG_DEBUG, "New UUID for user: %s", uuid.c_str());
@@ -192,7 +196,7 @@ User::User(const std::string &uid, const std::string& sid, int type)
 }
 
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
-	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->Config->ServerName, USERTYPE_LOCAL), eh(this),
+	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->Config->ServerName, USERTYPE_LOCAL), eh(this), checktimer(this),
 	localuseriter(ServerInstance->Users->local_users.end()),
 	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
 	already_sent(0)
@@ -324,7 +328,17 @@ bool User::HasPrivPermission(const std::string &privstr, bool noisy)
 	return true;
 }
 
+bool User::HasPrivPermission(const Privilege& priv, bool noisy)
+{
+	return true;
+}
+
 bool LocalUser::HasPrivPermission(const std::string &privstr, bool noisy)
+{
+	return HasPrivPermission(Privilege(privstr), noisy);
+}
+
+bool LocalUser::HasPrivPermission(const Privilege& priv, bool noisy)
 {
 	if (!this->IsOper())
 	{
@@ -333,27 +347,55 @@ bool LocalUser::HasPrivPermission(const std::string &privstr, bool noisy)
 		return false;
 	}
 
-	if (oper->AllowedPrivs.find(privstr) != oper->AllowedPrivs.end())
-	{
-		return true;
-	}
-	else if (oper->AllowedPrivs.find("*") != oper->AllowedPrivs.end())
-	{
+	if (oper->HasPriv(priv))
 		return true;
-	}
 
 	if (noisy)
-		this->WriteNotice("Oper type " + oper->name + " does not have access to priv " + privstr);
+		this->WriteNotice("Oper type " + oper->name + " does not have access to priv " + priv.GetName());
 
 	return false;
 }
 
+/** Names of the privileges by number, and the numbers by name */
+struct PrivRegistry
+{
+	std::vector<std::string> names;
+	TR1NS::unordered_map<std::string, unsigned int> ids;
+
+	PrivRegistry()
+	{
+		names.push_back("*");
+		ids["*"] = 0;
+	}
+};
+
+// Privileges are resolved by static objects in other files, make sure the registry exists before them
+static PrivRegistry& GetPrivRegistry()
+{
+	static PrivRegistry registry;
+	return registry;
+}
+
+unsigned int Privilege::Resolve(const std::string& name)
+{
+	PrivRegistry& registry = GetPrivRegistry();
+	std::pair<TR1NS::unordered_map<std::string, unsigned int>::iterator, bool> ret = registry.ids.insert(std::make_pair(name, registry.names.size()));
+	if (ret.second)
+		registry.names.push_back(name);
+	return ret.first->second;
+}
+
+const std::string& Privilege::GetName() const
+{
+	return GetPrivRegistry().names[id];
+}
+
 void UserIOHandler::OnDataReady()
 {
 	if (user->quitting)
 		return;
 
-	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
+	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission(privincreasedbuffers))
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
 		ServerInstance->SNO->WriteToSnoMask('a', "User %s RecvQ of %lu exceeds connect class maximum of %lu",
@@ -361,20 +403,27 @@ void UserIOHandler::OnDataReady()
 		return;
 	}
 	unsigned long sendqmax = ULONG_MAX;
-	if (!user->HasPrivPermission("users/flood/increased-buffers"))
+	if (!user->HasPrivPermission(privincreasedbuffers))
 		sendqmax = user->MyClass->GetSendqSoftMax();
 	unsigned long penaltymax = ULONG_MAX;
-	if (!user->HasPrivPermission("users/flood/no-fakelag"))
+	if (!user->HasPrivPermission(privnofakelag))
 		penaltymax = user->MyClass->GetPenaltyThreshold() * 1000;
 
+	std::string line;
+	line.reserve(ServerInstance->Config->Limits.MaxLine);
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		std::string line;
-		line.reserve(ServerInstance->Config->Limits.MaxLine);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		// Take the next line out of the recvq, this points into the recvq
+		// itself so that the rest of the queue is never copied
+		const char* start;
+		size_t length;
+		if (!recvq.GetNextLine(start, length))
+			break;
+
+		line.clear();
+		for (size_t qpos = 0; qpos < length; qpos++)
 		{
-			char c = recvq[qpos++];
+			char c = start[qpos];
 			switch (c)
 			{
 			case '\0':
@@ -382,21 +431,15 @@ void UserIOHandler::OnDataReady()
 				break;
 			case '\r':
 				continue;
-			case '\n':
-				goto eol_found;
 			}
 			if (line.length() < ServerInstance->Config->Limits.MaxLine - 2)
 				line.push_back(c);
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
 
 		// TODO should this be moved to when it was inserted in recvq?
-		ServerInstance->stats->statsRecv += qpos;
-		user->bytes_in += qpos;
+		ServerInstance->stats->statsRecv += length + 1;
+		ServerInstance->Metrics->Clients.In(length + 1);
+		user->bytes_in += length + 1;
 		user->cmds_in++;
 
 		ServerInstance->Parser->ProcessBuffer(line, user);
@@ -404,15 +447,22 @@ eol_found:
 			return;
 	}
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
+	{
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+		return;
+	}
+
+	// The penalty decays and held back commands are resumed by the check timer
+	if (user->CommandFloodPenalty || getSendQSize())
+		user->checktimer.ScheduleCheck(ServerInstance->Time() + 1);
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+void UserIOHandler::AddWriteBuf(const reference<SendBuffer>& data)
 {
 	if (user->quitting_sendq)
 		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
-		!user->HasPrivPermission("users/flood/increased-buffers"))
+	if (!user->quitting && getSendQSize() + data->length() > user->MyClass->GetSendqHardMax() &&
+		!user->HasPrivPermission(privincreasedbuffers))
 	{
 		user->quitting_sendq = true;
 		ServerInstance->GlobalCulls.AddSQItem(user);
@@ -476,6 +526,7 @@ void User::Oper(OperInfo* info)
 
 	this->modes[UM_OPERATOR] = 1;
 	this->oper = info;
+	identgeneration++;
 	this->WriteServ("MODE %s :+o", this->nick.c_str());
 	FOREACH_MOD(I_OnOper, OnOper(this, info->name));
 
@@ -512,6 +563,7 @@ void OperInfo::init()
 {
 	AllowedOperCommands.clear();
 	AllowedPrivs.clear();
+	PrivBits.clear();
 	AllowedUserModes.reset();
 	AllowedChanModes.reset();
 	AllowedUserModes['o' - 'A'] = true; // Call me paranoid if you want.
@@ -531,6 +583,11 @@ void OperInfo::init()
 		while (PrivList.GetToken(mypriv))
 		{
 			AllowedPrivs.insert(mypriv);
+
+			unsigned int id = Privilege::Resolve(mypriv);
+			if (id >= PrivBits.size())
+				PrivBits.resize(id + 1);
+			PrivBits[id] = true;
 		}
 
 		std::string modes = tag->getString("usermodes");
@@ -572,6 +629,7 @@ void User::UnOper()
 	 * to call UnOper. -- w00t
 	 */
 	oper = NULL;
+	identgeneration++;
 
 
 	/* Remove all oper only modes from the user when the deoper - Bug #466*/
@@ -633,6 +691,7 @@ void LocalUser::CheckClass(bool clone_count)
 	}
 
 	this->nping = ServerInstance->Time() + a->GetPingTime() + ServerInstance->Config->dns_timeout;
+	checktimer.ScheduleCheck(nping + 1);
 }
 
 bool LocalUser::CheckLines(bool doZline)
@@ -731,6 +790,7 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	identgeneration++;
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force)
@@ -892,6 +952,7 @@ bool User::SetClientIP(const char* sip, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
+	identgeneration++;
 	return irc::sockets::aptosa(sip, 0, client_sa);
 }
 
@@ -899,6 +960,7 @@ void User::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
+	identgeneration++;
 	memcpy(&client_sa, &sa, sizeof(irc::sockets::sockaddrs));
 }
 
@@ -935,26 +997,38 @@ void User::Write(const char *text, ...)
 {
 }
 
+reference<SendBuffer> LocalUser::PrepareLine(const std::string& text)
+{
+	if (text.length() > ServerInstance->Config->Limits.MaxLine - 2)
+	{
+		// this should happen rarely or never. Crop the string at 512.
+		return new SendBuffer(text.substr(0, ServerInstance->Config->Limits.MaxLine - 2), wide_newline);
+	}
+
+	return new SendBuffer(text, wide_newline);
+}
+
 void LocalUser::Write(const std::string& text)
 {
 	if (!ServerInstance->SE->BoundsCheckFd(&eh))
 		return;
 
-	if (text.length() > ServerInstance->Config->Limits.MaxLine - 2)
-	{
-		// this should happen rarely or never. Crop the string at 512 and try again.
-		std::string try_again = text.substr(0, ServerInstance->Config->Limits.MaxLine - 2);
-		Write(try_again);
+	Write(PrepareLine(text));
+}
+
+void LocalUser::Write(const reference<SendBuffer>& line)
+{
+	if (!ServerInstance->SE->BoundsCheckFd(&eh))
 		return;
-	}
 
-	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(),
+		(int)line->length() - 2, line->str().c_str());
 
-	eh.AddWriteBuf(text);
-	eh.AddWriteBuf(wide_newline);
+	eh.AddWriteBuf(line);
 
-	ServerInstance->stats->statsSent += text.length() + 2;
-	this->bytes_out += text.length() + 2;
+	ServerInstance->stats->statsSent += line->length();
+	ServerInstance->Metrics->Clients.Out(line->length());
+	this->bytes_out += line->length();
 	this->cmds_out++;
 }
 
@@ -1068,6 +1142,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 
 	LocalUser::already_sent_id++;
 
+	const reference<SendBuffer> out = LocalUser::PrepareLine(line);
 	UserChanList include_c(chans);
 	std::map<User*,bool> exceptions;
 
@@ -1082,7 +1157,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 		{
 			u->already_sent = LocalUser::already_sent_id;
 			if (i->second)
-				u->Write(line);
+				u->Write(out);
 		}
 	}
 	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
@@ -1095,7 +1170,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 			if (u && !u->quitting && u->already_sent != LocalUser::already_sent_id)
 			{
 				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				u->Write(out);
 			}
 		}
 	}
@@ -1108,8 +1183,8 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 
 	already_sent_t uniq_id = ++LocalUser::already_sent_id;
 
-	const std::string normalMessage = ":" + this->GetFullHost() + " QUIT :" + normal_text;
-	const std::string operMessage = ":" + this->GetFullHost() + " QUIT :" + oper_text;
+	const reference<SendBuffer> normalMessage = LocalUser::PrepareLine(":" + this->GetFullHost() + " QUIT :" + normal_text);
+	const reference<SendBuffer> operMessage = (oper_text == normal_text ? normalMessage : LocalUser::PrepareLine(":" + this->GetFullHost() + " QUIT :" + oper_text));
 
 	UserChanList include_c(chans);
 	std::map<User*,bool> exceptions;
@@ -1222,6 +1297,7 @@ bool User::ChangeName(const char* gecos)
 		FOREACH_MOD(I_OnChangeName,OnChangeName(this,gecos));
 	}
 	this->fullname.assign(gecos, 0, ServerInstance->Config->Limits.MaxGecos);
+	identgeneration++;
 
 	return true;
 }
@@ -1234,6 +1310,7 @@ void User::DoHostCycle(const std::string &quitline)
 	already_sent_t silent_id = ++LocalUser::already_sent_id;
 	already_sent_t seen_id = ++LocalUser::already_sent_id;
 
+	const reference<SendBuffer> quitbuf = LocalUser::PrepareLine(quitline);
 	UserChanList include_c(chans);
 	std::map<User*,bool> exceptions;
 
@@ -1247,7 +1324,7 @@ void User::DoHostCycle(const std::string &quitline)
 			if (i->second)
 			{
 				u->already_sent = seen_id;
-				u->Write(quitline);
+				u->Write(quitbuf);
 			}
 			else
 			{
@@ -1259,16 +1336,17 @@ void User::DoHostCycle(const std::string &quitline)
 	{
 		Channel* c = *v;
 		Membership* memb = c->GetUser(this);
-		const std::string joinline = ":" + GetFullHost() + " JOIN " + c->name;
-		std::string modeline;
+		const reference<SendBuffer> joinline = LocalUser::PrepareLine(":" + GetFullHost() + " JOIN " + c->name);
+		reference<SendBuffer> modeline;
 
 		if (!memb->modes.empty())
 		{
-			modeline = ":" + (ServerInstance->Config->CycleHostsFromUser ? GetFullHost() : ServerInstance->Config->ServerName)
+			std::string modetext = ":" + (ServerInstance->Config->CycleHostsFromUser ? GetFullHost() : ServerInstance->Config->ServerName)
 				+ " MODE " + c->name + " +" + memb->modes;
 
 			for (size_t i = 0; i < memb->modes.length(); i++)
-				modeline.append(" ").append(nick);
+				modetext.append(" ").append(nick);
+			modeline = LocalUser::PrepareLine(modetext);
 		}
 
 		const UserMembList *ulist = c->GetUsers();
@@ -1282,7 +1360,7 @@ void User::DoHostCycle(const std::string &quitline)
 
 			if (u->already_sent != seen_id)
 			{
-				u->Write(quitline);
+				u->Write(quitbuf);
 				u->already_sent = seen_id;
 			}
 			u->Write(joinline);
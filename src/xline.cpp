@@ -134,7 +134,334 @@ class ZLineFactory : public XLineFactory
  *  added since the previous application are applied. This keeps S2S ADDLINE during burst nice and fast,
  *  while at the same time not slowing things the fuck down when we try adding a ban with lots of preexisting
  *  bans. :)
+ *
+ * Later additions:
+ *  Matching a user no longer walks every line of a type. Each type has an XLineIndex which files lines
+ *  under their host, IP or nick mask, so a user is only checked against the lines that may match (and
+ *  any wildcard masks which can't be indexed). Expiry is back on a schedule: lines with a duration are
+ *  kept in a heap ordered by expiry time, which is drained once a second and before lines are matched.
+ */
+
+/** Index of the lines of one type. Lines are filed under the mask returned by
+ * XLine::GetIndexMask(): masks without wildcards go into a hash table, masks with
+ * a single leading or trailing '*' into tables of suffixes and prefixes and CIDR
+ * masks into a table which is probed once for every mask length in use. Only the
+ * lines with other wildcard masks and the lines that can't be indexed at all are
+ * candidates for every user.
  */
+class XLineIndex
+{
+	typedef std::vector<XLine*> LineList;
+	typedef TR1NS::unordered_map<std::string, LineList> StringTable;
+	typedef std::map<irc::sockets::cidr_mask, LineList> CIDRTable;
+
+	/** The lines of one XLine::IndexType
+	 */
+	struct Table
+	{
+		/** True if the masks are compared using national_case_insensitive_map, which may
+		 * change at any time, false if they are compared using ascii_case_insensitive_map
+		 */
+		bool national;
+		/** The case map the keys of the string tables were folded with */
+		unsigned char foldmap[256];
+		/** Number of lines of this type, including the ones with a mask which can't be indexed */
+		size_t count;
+		/** Masks without wildcards */
+		StringTable exact;
+		/** Masks ending with a '*', without the '*' */
+		StringTable prefixes;
+		/** Masks starting with a '*', without the '*' */
+		StringTable suffixes;
+		/** CIDR masks */
+		CIDRTable cidrs;
+		/** Number of CIDR masks of each length */
+		size_t lengths4[33];
+		size_t lengths6[129];
+	};
+
+	Table tables[XLine::INDEX_NICK + 1];
+
+	/** Lines which are candidates for every user */
+	std::set<XLine*> unindexed;
+
+	static std::string Fold(const Table& t, const std::string& str)
+	{
+		std::string ret(str);
+		for (std::string::iterator i = ret.begin(); i != ret.end(); ++i)
+			*i = t.foldmap[(unsigned char)*i];
+		return ret;
+	}
+
+	/** Find the string table a mask belongs in
+	 * @param mask The mask
+	 * @param key Set to the key of the mask in the returned table, not yet folded
+	 * @return The table or NULL if the mask has wildcards which the tables can't handle
+	 */
+	static StringTable* GetStringTable(Table& t, const std::string& mask, std::string& key)
+	{
+		std::string::size_type wild = mask.find_first_of("*?");
+		if (wild == std::string::npos)
+		{
+			key = mask;
+			return &t.exact;
+		}
+
+		if ((mask.find('?') != std::string::npos) || (mask.find('*', wild + 1) != std::string::npos))
+			return NULL;
+
+		if (wild == mask.length() - 1)
+		{
+			key.assign(mask, 0, wild);
+			return &t.prefixes;
+		}
+		if (wild == 0)
+		{
+			key.assign(mask, 1, std::string::npos);
+			return &t.suffixes;
+		}
+		return NULL;
+	}
+
+	/** Parse a CIDR mask the same way irc::sockets::MatchCIDR() does
+	 * @return True if the mask is a valid CIDR mask. Invalid ones must not be indexed
+	 * as MatchCIDR() considers them to match every string which is not an IP.
+	 */
+	static bool ParseCIDR(const std::string& mask, irc::sockets::cidr_mask& cidr)
+	{
+		cidr = irc::sockets::cidr_mask(mask);
+		if (cidr.type == AF_INET)
+			return (cidr.length <= 32);
+		if (cidr.type == AF_INET6)
+			return (cidr.length <= 128);
+		return false;
+	}
+
+	/** Get the index mask of a line
+	 * @return The type of the mask, INDEX_NONE if the line must not be indexed
+	 */
+	static XLine::IndexType GetIndexMask(XLine* line, std::string& mask)
+	{
+		XLine::IndexType type = line->GetIndexMask(mask);
+
+		// MatchCIDR() matches the part of the mask before an '@' with the part of the string before an '@'
+		if ((type != XLine::INDEX_NICK) && (mask.find('@') != std::string::npos))
+			return XLine::INDEX_NONE;
+		return type;
+	}
+
+	template<typename Map>
+	static bool Erase(Map& map, const typename Map::key_type& key, XLine* line)
+	{
+		typename Map::iterator i = map.find(key);
+		if (i == map.end())
+			return false;
+
+		LineList::iterator j = std::find(i->second.begin(), i->second.end(), line);
+		if (j == i->second.end())
+			return false;
+
+		i->second.erase(j);
+		if (i->second.empty())
+			map.erase(i);
+		return true;
+	}
+
+	template<typename Map>
+	static void Append(Map& map, const typename Map::key_type& key, LineList& out)
+	{
+		typename Map::const_iterator i = map.find(key);
+		if (i != map.end())
+			out.insert(out.end(), i->second.begin(), i->second.end());
+	}
+
+	/** Refold the keys of the string tables if the national case map has changed
+	 * since they were folded, e.g. because m_nationalchars was loaded or rehashed
+	 */
+	void Refresh(Table& t)
+	{
+		if ((!t.national) || (!memcmp(t.foldmap, national_case_insensitive_map, sizeof(t.foldmap))))
+			return;
+
+		std::set<XLine*> lines;
+		StringTable* stringtables[] = { &t.exact, &t.prefixes, &t.suffixes };
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			for (StringTable::const_iterator j = stringtables[i]->begin(); j != stringtables[i]->end(); ++j)
+				lines.insert(j->second.begin(), j->second.end());
+			stringtables[i]->clear();
+		}
+
+		memcpy(t.foldmap, national_case_insensitive_map, sizeof(t.foldmap));
+		for (std::set<XLine*>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+		{
+			std::string mask, key;
+			(*i)->GetIndexMask(mask);
+			(*GetStringTable(t, mask, key))[Fold(t, key)].push_back(*i);
+		}
+	}
+
+	void FindString(Table& t, const std::string& str, LineList& out)
+	{
+		if (!t.count)
+			return;
+
+		Refresh(t);
+		const std::string key = Fold(t, str);
+		Append(t.exact, key, out);
+
+		if (!t.prefixes.empty())
+		{
+			for (std::string::size_type i = 0; i <= key.length(); i++)
+				Append(t.prefixes, key.substr(0, i), out);
+		}
+
+		if (!t.suffixes.empty())
+		{
+			for (std::string::size_type i = 0; i <= key.length(); i++)
+				Append(t.suffixes, key.substr(i), out);
+		}
+	}
+
+	static void FindCIDR(const Table& t, const std::string& address, LineList& out)
+	{
+		if (t.cidrs.empty())
+			return;
+
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(address, 0, sa))
+			return;
+
+		const size_t* lengths = (sa.sa.sa_family == AF_INET6) ? t.lengths6 : t.lengths4;
+		const int maxlength = (sa.sa.sa_family == AF_INET6) ? 128 : 32;
+		for (int length = 0; length <= maxlength; length++)
+		{
+			if (lengths[length])
+				Append(t.cidrs, irc::sockets::cidr_mask(sa, length), out);
+		}
+	}
+
+ public:
+	XLineIndex()
+	{
+		for (unsigned int i = 0; i <= XLine::INDEX_NICK; i++)
+		{
+			Table& t = tables[i];
+			t.national = (i != XLine::INDEX_HOST);
+			memcpy(t.foldmap, (t.national ? national_case_insensitive_map : ascii_case_insensitive_map), sizeof(t.foldmap));
+			t.count = 0;
+			memset(t.lengths4, 0, sizeof(t.lengths4));
+			memset(t.lengths6, 0, sizeof(t.lengths6));
+		}
+	}
+
+	/** Add a line to the index
+	 */
+	void Add(XLine* line)
+	{
+		std::string mask;
+		XLine::IndexType type = GetIndexMask(line, mask);
+		if (type == XLine::INDEX_NONE)
+		{
+			unindexed.insert(line);
+			return;
+		}
+
+		Table& t = tables[type];
+		t.count++;
+		if ((type != XLine::INDEX_NICK) && (mask.find('/') != std::string::npos))
+		{
+			irc::sockets::cidr_mask cidr;
+			if (!ParseCIDR(mask, cidr))
+			{
+				unindexed.insert(line);
+				return;
+			}
+			t.cidrs[cidr].push_back(line);
+			(cidr.type == AF_INET6 ? t.lengths6 : t.lengths4)[cidr.length]++;
+		}
+
+		// MatchCIDR() falls back to a wildcard match, so CIDR masks go in a string table too
+		std::string key;
+		StringTable* table = GetStringTable(t, mask, key);
+		if (table)
+			(*table)[Fold(t, key)].push_back(line);
+		else
+			unindexed.insert(line);
+	}
+
+	/** Remove a line from the index
+	 */
+	void Remove(XLine* line)
+	{
+		unindexed.erase(line);
+
+		std::string mask;
+		XLine::IndexType type = GetIndexMask(line, mask);
+		if (type == XLine::INDEX_NONE)
+			return;
+
+		Table& t = tables[type];
+		t.count--;
+		if ((type != XLine::INDEX_NICK) && (mask.find('/') != std::string::npos))
+		{
+			irc::sockets::cidr_mask cidr;
+			if (!ParseCIDR(mask, cidr))
+				return;
+			if (Erase(t.cidrs, cidr, line))
+				(cidr.type == AF_INET6 ? t.lengths6 : t.lengths4)[cidr.length]--;
+		}
+
+		std::string key;
+		StringTable* table = GetStringTable(t, mask, key);
+		if (table)
+			Erase(*table, Fold(t, key), line);
+	}
+
+	/** Get the lines which may match a user
+	 * @param user The user
+	 * @param out The lines are appended to this, a line may be appended more than once
+	 */
+	void Find(User* user, LineList& out)
+	{
+		const std::string& ip = user->GetIPString();
+
+		Table& hosts = tables[XLine::INDEX_HOST];
+		FindString(hosts, user->host, out);
+		FindCIDR(hosts, user->host, out);
+		if (user->host != ip)
+		{
+			FindString(hosts, ip, out);
+			FindCIDR(hosts, ip, out);
+		}
+
+		FindString(tables[XLine::INDEX_IP], ip, out);
+		FindCIDR(tables[XLine::INDEX_IP], ip, out);
+		FindString(tables[XLine::INDEX_NICK], user->nick, out);
+
+		out.insert(out.end(), unindexed.begin(), unindexed.end());
+	}
+
+	/** Get the lines which may match a pattern, see XLineManager::MatchesLine()
+	 * @param pattern The pattern
+	 * @param out The lines are appended to this, a line may be appended more than once
+	 * @return False if there are lines whose Matches(const std::string&) can't be
+	 * predicted by the index; this is the case for host masks, as G, K and E-lines
+	 * are matched against ident\@host strings
+	 */
+	bool Find(const std::string& pattern, LineList& out)
+	{
+		if (tables[XLine::INDEX_HOST].count)
+			return false;
+
+		FindString(tables[XLine::INDEX_IP], pattern, out);
+		FindCIDR(tables[XLine::INDEX_IP], pattern, out);
+		FindString(tables[XLine::INDEX_NICK], pattern, out);
+
+		out.insert(out.end(), unindexed.begin(), unindexed.end());
+		return true;
+	}
+};
 
 bool XLine::Matches(User *u)
 {
@@ -151,55 +478,67 @@ void XLineManager::CheckELines()
 	if (n == lookup_lines.end())
 		return;
 
-	XLineLookup& ELines = n->second;
-
-	if (ELines.empty())
+	if (n->second.empty())
 		return;
 
 	for (LocalUserList::const_iterator u2 = ServerInstance->Users->local_users.begin(); u2 != ServerInstance->Users->local_users.end(); u2++)
 	{
 		LocalUser* u = *u2;
 
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
-
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
-		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
-			u->exempt = e->Matches(u);
-
-			i = safei;
-		}
+		/* ELine::Matches() never matches users who are exempt already */
+		u->exempt = false;
+		u->exempt = (MatchesLine("E", u) != NULL);
 	}
 }
 
 
 XLineLookup* XLineManager::GetAll(const std::string &type)
 {
+	/* Expire any dead ones, before sending */
+	ExpireLines();
+
 	ContainerIter n = lookup_lines.find(type);
 
 	if (n == lookup_lines.end())
 		return NULL;
 
-	LookupIter safei;
-	const time_t current = ServerInstance->Time();
+	return &(n->second);
+}
 
-	/* Expire any dead ones, before sending */
-	for (LookupIter x = n->second.begin(); x != n->second.end(); )
+void XLineManager::ExpireLines()
+{
+	/* Expiring a line can end up here again, e.g. ELine::Unset() matches the remaining elines */
+	if (expiring)
+		return;
+
+	expiring = true;
+	const time_t current = ServerInstance->Time();
+	while (!expiries.empty() && current > expiries.front().expiry)
 	{
-		safei = x;
-		safei++;
-		if (x->second->duration && current > x->second->expiry)
+		XLineExpiry entry = expiries.front();
+		std::pop_heap(expiries.begin(), expiries.end(), std::greater<XLineExpiry>());
+		expiries.pop_back();
+
+		ContainerIter x = lookup_lines.find(entry.type);
+		if (x == lookup_lines.end())
+			continue;
+
+		LookupIter i = x->second.find(entry.mask.c_str());
+		if ((i == x->second.end()) || (!i->second->duration))
+			continue;
+
+		if (current > i->second->expiry)
 		{
-			ExpireLine(n, x);
+			ExpireLine(x, i);
+		}
+		else if (i->second->expiry != entry.expiry)
+		{
+			/* The line was replaced by one with a later expiry, or its creation time was changed */
+			expiries.push_back(XLineExpiry(i->second->expiry, entry.type, entry.mask));
+			std::push_heap(expiries.begin(), expiries.end(), std::greater<XLineExpiry>());
 		}
-		x = safei;
 	}
-
-	return &(n->second);
+	expiring = false;
 }
 
 void XLineManager::DelAll(const std::string &type)
@@ -282,6 +621,18 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable().c_str()] = line;
+
+	XLineIndex*& index = line_index[line->type];
+	if (!index)
+		index = new XLineIndex;
+	index->Add(line);
+
+	if (line->duration)
+	{
+		expiries.push_back(XLineExpiry(line->expiry, line->type, line->Displayable()));
+		std::push_heap(expiries.begin(), expiries.end(), std::greater<XLineExpiry>());
+	}
+
 	line->OnAdd();
 
 	FOREACH_MOD(I_OnAddLine,OnAddLine(user, line));
@@ -310,14 +661,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 
 	FOREACH_MOD(I_OnDelLine,OnDelLine(user, y->second));
 
-	y->second->Unset();
-
-	std::vector<XLine*>::iterator pptr = std::find(pending_lines.begin(), pending_lines.end(), y->second);
-	if (pptr != pending_lines.end())
-		pending_lines.erase(pptr);
-
-	delete y->second;
-	x->second.erase(y);
+	RemoveLine(x, y);
 
 	return true;
 }
@@ -339,97 +683,176 @@ void ELine::Unset()
 
 XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 {
-	ContainerIter x = lookup_lines.find(type);
+	ExpireLines();
 
-	if (x == lookup_lines.end())
+	std::map<std::string, XLineIndex*>::iterator x = line_index.find(type);
+
+	if (x == line_index.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
+	std::vector<XLine*> candidates;
+	x->second->Find(user, candidates);
 
-	LookupIter safei;
+	const time_t current = ServerInstance->Time();
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 	{
-		safei = i;
-		safei++;
+		XLine* line = *i;
 
-		if (i->second->duration && current > i->second->expiry)
-		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
+		/* Lines can only be due here while ExpireLines() is busy expiring others */
+		if (line->duration && current > line->expiry)
 			continue;
-		}
 
-		if (i->second->Matches(user))
+		if (line->Matches(user))
 		{
-			return i->second;
+			CountMatch(line);
+			return line;
 		}
-
-		i = safei;
 	}
 	return NULL;
 }
 
 XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
 {
-	ContainerIter x = lookup_lines.find(type);
+	ExpireLines();
 
-	if (x == lookup_lines.end())
+	std::map<std::string, XLineIndex*>::iterator x = line_index.find(type);
+
+	if (x == line_index.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
+	std::vector<XLine*> candidates;
+	if (!x->second->Find(pattern, candidates))
+	{
+		XLineLookup& list = lookup_lines[type];
+		for (LookupIter i = list.begin(); i != list.end(); ++i)
+			candidates.push_back(i->second);
+	}
 
-	 LookupIter safei;
+	const time_t current = ServerInstance->Time();
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 	{
-		safei = i;
-		safei++;
+		XLine* line = *i;
 
-		if (i->second->Matches(pattern))
+		if (line->duration && current > line->expiry)
+			continue;
+
+		if (line->Matches(pattern))
 		{
-			if (i->second->duration && current > i->second->expiry)
-			{
-				/* Expire the line, return nothing */
-				ExpireLine(x, i);
-				/* See above */
-				i = safei;
-				continue;
-			}
-			else
-				return i->second;
+			CountMatch(line);
+			return line;
 		}
-
-		i = safei;
 	}
 	return NULL;
 }
 
+void XLineManager::CountMatch(XLine* line)
+{
+	XLineFactory* xlf = GetFactory(line->type);
+	if (xlf)
+		xlf->matches.Inc();
+}
+
 // removes lines that have expired
 void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 {
 	FOREACH_MOD(I_OnExpireLine, OnExpireLine(item->second));
 
 	item->second->DisplayExpiry();
-	item->second->Unset();
+
+	RemoveLine(container, item);
+}
+
+void XLineManager::RemoveLine(ContainerIter container, LookupIter item)
+{
+	XLine* line = item->second;
+
+	/* Take the line out of the index first, so Unset() (e.g. ELine::Unset()) no longer finds it */
+	std::map<std::string, XLineIndex*>::iterator x = line_index.find(line->type);
+	if (x != line_index.end())
+		x->second->Remove(line);
+
+	line->Unset();
 
 	/* TODO: Can we skip this loop by having a 'pending' field in the XLine class, which is set when a line
 	 * is pending, cleared when it is no longer pending, so we skip over this loop if its not pending?
 	 * -- Brain
 	 */
-	std::vector<XLine*>::iterator pptr = std::find(pending_lines.begin(), pending_lines.end(), item->second);
+	std::vector<XLine*>::iterator pptr = std::find(pending_lines.begin(), pending_lines.end(), line);
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
-	delete item->second;
+	/* ExpireLines() has already popped the entry of the lines it expires, any other removal leaves one behind */
+	const bool stale = ((line->duration) && (!expiring));
+	delete line;
 	container->second.erase(item);
+
+	if ((stale) && (++staleexpiries > expiries.size() / 2))
+		CompactExpiries();
+}
+
+void XLineManager::CompactExpiries()
+{
+	std::vector<XLineExpiry> keep;
+	keep.reserve(expiries.size() - std::min(staleexpiries, expiries.size()));
+	for (std::vector<XLineExpiry>::const_iterator i = expiries.begin(); i != expiries.end(); ++i)
+	{
+		ContainerIter x = lookup_lines.find(i->type);
+		if (x == lookup_lines.end())
+			continue;
+		LookupIter l = x->second.find(i->mask.c_str());
+		if ((l != x->second.end()) && (l->second->duration))
+			keep.push_back(*i);
+	}
+	expiries.swap(keep);
+	std::make_heap(expiries.begin(), expiries.end(), std::greater<XLineExpiry>());
+	staleexpiries = 0;
 }
 
 
 // applies lines, removing clients and changing nicks etc as applicable
+namespace
+{
+	/** Orders lines by their position in the pending list */
+	class PendingOrder
+	{
+		std::map<XLine*, size_t> position;
+
+	 public:
+		void Add(XLine* line)
+		{
+			position.insert(std::make_pair(line, position.size()));
+		}
+
+		bool operator()(XLine* a, XLine* b) const
+		{
+			return position.find(a)->second < position.find(b)->second;
+		}
+	};
+}
+
 void XLineManager::ApplyLines()
 {
+	if (pending_lines.empty())
+		return;
+
+	/* Index the pending lines when there are many of them (e.g. at the end of a netburst)
+	 * so every user is only checked against the ones that may match.
+	 */
+	XLineIndex* pending = NULL;
+	PendingOrder order;
+	if (pending_lines.size() > 8)
+	{
+		pending = new XLineIndex;
+		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		{
+			pending->Add(*i);
+			order.Add(*i);
+		}
+	}
+
+	std::vector<XLine*> candidates;
 	LocalUserList::reverse_iterator u2 = ServerInstance->Users->local_users.rbegin();
 	while (u2 != ServerInstance->Users->local_users.rend())
 	{
@@ -439,47 +862,52 @@ void XLineManager::ApplyLines()
 		if (u->exempt)
 			continue;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		candidates.clear();
+		if (pending)
+		{
+			pending->Find(u, candidates);
+			// Apply them in pending order like the unindexed loop, the first line to match decides the kill reason
+			std::sort(candidates.begin(), candidates.end(), order);
+			candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+		}
+
+		const std::vector<XLine*>& lines = (pending ? candidates : pending_lines);
+		for (std::vector<XLine *>::const_iterator i = lines.begin(); i != lines.end(); i++)
 		{
 			XLine *x = *i;
 			if (x->Matches(u))
+			{
+				CountMatch(x);
 				x->Apply(u);
+			}
 		}
 	}
 
+	delete pending;
 	pending_lines.clear();
 }
 
 void XLineManager::InvokeStats(const std::string &type, int numeric, User* user, string_list &results)
 {
-	ContainerIter n = lookup_lines.find(type);
+	ExpireLines();
 
-	time_t current = ServerInstance->Time();
-
-	LookupIter safei;
+	ContainerIter n = lookup_lines.find(type);
 
 	if (n != lookup_lines.end())
 	{
 		XLineLookup& list = n->second;
-		for (LookupIter i = list.begin(); i != list.end(); )
+		for (LookupIter i = list.begin(); i != list.end(); ++i)
 		{
-			safei = i;
-			safei++;
-
-			if (i->second->duration && current > i->second->expiry)
-			{
-				ExpireLine(n, i);
-			}
-			else
-				results.push_back(ServerInstance->Config->ServerName+" "+ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
-					ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
-			i = safei;
+			results.push_back(ServerInstance->Config->ServerName+" "+ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
+				ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
 		}
 	}
 }
 
 
 XLineManager::XLineManager()
+	: expiring(false)
+	, staleexpiries(0)
 {
 	GLineFactory* GFact;
 	ELineFactory* EFact;
@@ -518,6 +946,9 @@ XLineManager::~XLineManager()
 			delete j->second;
 		}
 	}
+
+	for (std::map<std::string, XLineIndex*>::iterator i = line_index.begin(); i != line_index.end(); ++i)
+		delete i->second;
 }
 
 void XLine::Apply(User* u)
@@ -720,6 +1151,36 @@ const std::string& QLine::Displayable()
 	return nick;
 }
 
+XLine::IndexType ELine::GetIndexMask(std::string& mask)
+{
+	mask = hostmask;
+	return INDEX_HOST;
+}
+
+XLine::IndexType KLine::GetIndexMask(std::string& mask)
+{
+	mask = hostmask;
+	return INDEX_HOST;
+}
+
+XLine::IndexType GLine::GetIndexMask(std::string& mask)
+{
+	mask = hostmask;
+	return INDEX_HOST;
+}
+
+XLine::IndexType ZLine::GetIndexMask(std::string& mask)
+{
+	mask = ipaddr;
+	return INDEX_IP;
+}
+
+XLine::IndexType QLine::GetIndexMask(std::string& mask)
+{
+	mask = nick;
+	return INDEX_NICK;
+}
+
 bool KLine::IsBurstable()
 {
 	return false;
@@ -733,6 +1194,7 @@ bool XLineManager::RegisterFactory(XLineFactory* xlf)
 		return false;
 
 	line_factory[xlf->GetType()] = xlf;
+	ServerInstance->Metrics->Add(&xlf->matches);
 
 	return true;
 }
@@ -745,6 +1207,7 @@ bool XLineManager::UnregisterFactory(XLineFactory* xlf)
 		return false;
 
 	line_factory.erase(n);
+	ServerInstance->Metrics->Del(&xlf->matches);
 
 	return true;
 }